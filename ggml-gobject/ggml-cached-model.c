@@ -22,6 +22,7 @@
 
 #include <stdint.h>
 #include <gio/gio.h>
+#include <gio/gfiledescriptorbased.h>
 #include <libsoup/soup.h>
 #include <ggml-gobject/ggml-cached-model.h>
 #include <ggml-gobject/internal/ggml-async-queue-source.h>
@@ -52,10 +53,14 @@ enum {
   PROP_N
 };
 
+static void ggml_cached_model_istream_file_descriptor_based_iface_init (GFileDescriptorBasedIface *iface);
+
 G_DEFINE_TYPE_WITH_CODE (GGMLCachedModelIstream,
                          ggml_cached_model_istream,
                          G_TYPE_FILE_INPUT_STREAM,
-                         G_ADD_PRIVATE (GGMLCachedModelIstream))
+                         G_ADD_PRIVATE (GGMLCachedModelIstream)
+                         G_IMPLEMENT_INTERFACE (G_TYPE_FILE_DESCRIPTOR_BASED,
+                                                ggml_cached_model_istream_file_descriptor_based_iface_init))
 
 static gboolean
 ggml_download_progress_async_queue_monitor_callback (gpointer message,
@@ -442,6 +447,30 @@ ggml_cached_model_istream_can_seek (GFileInputStream *file_istream)
   return FALSE;
 }
 
+static int
+ggml_cached_model_istream_get_fd (GFileDescriptorBased *fd_based)
+{
+  GGMLCachedModelIstream *cached_model = GGML_CACHED_MODEL_ISTREAM (fd_based);
+  GGMLCachedModelIstreamPrivate *priv = ggml_cached_model_istream_get_instance_private (cached_model);
+
+  /* We only have a file descriptor once the local file has been opened,
+   * which happens on the first read. Consumers like the model loader use
+   * this to map the file directly instead of reading it. */
+  if (priv->current_stream == NULL ||
+      !G_IS_FILE_DESCRIPTOR_BASED (priv->current_stream))
+    {
+      return -1;
+    }
+
+  return g_file_descriptor_based_get_fd (G_FILE_DESCRIPTOR_BASED (priv->current_stream));
+}
+
+static void
+ggml_cached_model_istream_file_descriptor_based_iface_init (GFileDescriptorBasedIface *iface)
+{
+  iface->get_fd = ggml_cached_model_istream_get_fd;
+}
+
 static GFileInfo *
 ggml_cached_model_istream_query_info (GFileInputStream  *stream,
                                       const char        *attributes,
@@ -0,0 +1,263 @@
+/*
+ * ggml-gobject/ggml-compute-context.c
+ *
+ * Library code for ggml-compute-context
+ *
+ * Copyright (C) 2023 Sam Spilsbury.
+ *
+ * ggml-gobject is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation; either version 2.1 of the License, or
+ * (at your option) any later version.
+ *
+ * ggml-gobject is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License along
+ * with ggml-gobject; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+#include <gio/gio.h>
+#include <ggml-gobject/ggml-compute-context.h>
+
+struct _GGMLComputeContext {
+  GMutex mutex;
+  GCond cond;
+  size_t n_threads;
+  size_t n_threads_per_request;
+  size_t n_available_threads;
+  gatomicrefcount ref_count;
+};
+
+/**
+ * ggml_compute_context_new:
+ * @n_threads: The total number of threads that computations sharing this
+ *             context may use at once, or 0 for the number of processors.
+ * @n_threads_per_request: The number of threads that a single computation
+ *                         uses if it does not ask for a specific number,
+ *                         or 0 for @n_threads.
+ *
+ * Creates a new #GGMLComputeContext, which hands out a budget of threads
+ * to graph computations. Computations that share a context never use more
+ * than @n_threads threads between them, so that running several of them
+ * at once, for example from several completion cursors, does not oversubscribe
+ * the machine. A computation that can't get any threads waits until another
+ * one finishes.
+ *
+ * Returns: (transfer full): A new #GGMLComputeContext
+ */
+GGMLComputeContext *
+ggml_compute_context_new (size_t n_threads,
+                          size_t n_threads_per_request)
+{
+  GGMLComputeContext *compute_context = g_new0 (GGMLComputeContext, 1);
+
+  g_mutex_init (&compute_context->mutex);
+  g_cond_init (&compute_context->cond);
+  compute_context->n_threads = n_threads > 0 ? n_threads : g_get_num_processors ();
+  compute_context->n_threads_per_request = (
+    n_threads_per_request > 0 ? MIN (n_threads_per_request, compute_context->n_threads) :
+                                compute_context->n_threads
+  );
+  compute_context->n_available_threads = compute_context->n_threads;
+  g_atomic_ref_count_init (&compute_context->ref_count);
+
+  return compute_context;
+}
+
+/**
+ * ggml_compute_context_get_default:
+ *
+ * Gets the process-wide #GGMLComputeContext, which is used by models that
+ * were not given a context of their own. It has as many threads as there
+ * are processors, and a single computation may use all of them.
+ *
+ * Returns: (transfer none): The default #GGMLComputeContext
+ */
+GGMLComputeContext *
+ggml_compute_context_get_default (void)
+{
+  static GGMLComputeContext *default_compute_context = NULL;
+
+  if (g_once_init_enter (&default_compute_context))
+    {
+      g_once_init_leave (&default_compute_context, ggml_compute_context_new (0, 0));
+    }
+
+  return default_compute_context;
+}
+
+/**
+ * ggml_compute_context_ref:
+ * @compute_context: A #GGMLComputeContext
+ *
+ * Increases the reference count on @compute_context
+ *
+ * Returns: (transfer full): The @compute_context
+ */
+GGMLComputeContext *
+ggml_compute_context_ref (GGMLComputeContext *compute_context)
+{
+  g_atomic_ref_count_inc (&compute_context->ref_count);
+  return compute_context;
+}
+
+/**
+ * ggml_compute_context_unref:
+ * @compute_context: A #GGMLComputeContext
+ *
+ * Decreases the reference count on @compute_context. If the reference
+ * count goes to zero, then the @compute_context will be freed.
+ */
+void
+ggml_compute_context_unref (GGMLComputeContext *compute_context)
+{
+  if (g_atomic_ref_count_dec (&compute_context->ref_count))
+    {
+      g_mutex_clear (&compute_context->mutex);
+      g_cond_clear (&compute_context->cond);
+      g_clear_pointer (&compute_context, g_free);
+    }
+}
+
+/**
+ * ggml_compute_context_get_n_threads:
+ * @compute_context: A #GGMLComputeContext
+ *
+ * Returns: The total number of threads in the budget of @compute_context
+ */
+size_t
+ggml_compute_context_get_n_threads (GGMLComputeContext *compute_context)
+{
+  return compute_context->n_threads;
+}
+
+/**
+ * ggml_compute_context_get_n_threads_per_request:
+ * @compute_context: A #GGMLComputeContext
+ *
+ * Returns: The number of threads a computation gets if it does not ask
+ *          for a specific number.
+ */
+size_t
+ggml_compute_context_get_n_threads_per_request (GGMLComputeContext *compute_context)
+{
+  return compute_context->n_threads_per_request;
+}
+
+/**
+ * ggml_compute_context_get_n_available_threads:
+ * @compute_context: A #GGMLComputeContext
+ *
+ * Returns: The number of threads in the budget of @compute_context
+ *          that are not being used by any computation right now.
+ */
+size_t
+ggml_compute_context_get_n_available_threads (GGMLComputeContext *compute_context)
+{
+  g_autoptr(GMutexLocker) locker = g_mutex_locker_new (&compute_context->mutex);
+
+  return compute_context->n_available_threads;
+}
+
+static void
+ggml_compute_context_on_cancelled (GCancellable *cancellable,
+                                   gpointer      user_data)
+{
+  GGMLComputeContext *compute_context = user_data;
+
+  g_mutex_lock (&compute_context->mutex);
+  g_cond_broadcast (&compute_context->cond);
+  g_mutex_unlock (&compute_context->mutex);
+}
+
+/**
+ * ggml_compute_context_acquire_threads:
+ * @compute_context: A #GGMLComputeContext
+ * @n_requested: The number of threads wanted, or 0 for the default
+ *               number of threads per request
+ * @cancellable: (nullable): A #GCancellable
+ * @error: A #GError
+ *
+ * Takes up to @n_requested threads out of the budget of @compute_context,
+ * waiting until at least one is available or @cancellable is cancelled.
+ * Fewer threads than requested may be handed out if other computations
+ * are using the rest of the budget. The threads must be given back with
+ * ggml_compute_context_release_threads.
+ *
+ * Returns: The number of threads that the computation may use, at least one,
+ *          or 0 with @error set if @cancellable was cancelled.
+ */
+size_t
+ggml_compute_context_acquire_threads (GGMLComputeContext  *compute_context,
+                                      size_t               n_requested,
+                                      GCancellable        *cancellable,
+                                      GError             **error)
+{
+  /* Connect before taking the lock, since the handler runs
+   * straight away if @cancellable is already cancelled */
+  gulong cancelled_handler_id = (
+    cancellable != NULL ?
+    g_cancellable_connect (cancellable,
+                           G_CALLBACK (ggml_compute_context_on_cancelled),
+                           compute_context,
+                           NULL) :
+    0
+  );
+  size_t n_wanted = MIN (n_requested > 0 ? n_requested : compute_context->n_threads_per_request,
+                         compute_context->n_threads);
+  size_t n_granted = 0;
+
+  g_mutex_lock (&compute_context->mutex);
+
+  while (compute_context->n_available_threads == 0 &&
+         !g_cancellable_is_cancelled (cancellable))
+    {
+      g_cond_wait (&compute_context->cond, &compute_context->mutex);
+    }
+
+  if (!g_cancellable_is_cancelled (cancellable))
+    {
+      n_granted = MIN (n_wanted, compute_context->n_available_threads);
+      compute_context->n_available_threads -= n_granted;
+    }
+
+  g_mutex_unlock (&compute_context->mutex);
+  g_cancellable_disconnect (cancellable, cancelled_handler_id);
+
+  if (n_granted == 0)
+    {
+      g_cancellable_set_error_if_cancelled (cancellable, error);
+    }
+
+  return n_granted;
+}
+
+/**
+ * ggml_compute_context_release_threads:
+ * @compute_context: A #GGMLComputeContext
+ * @n_threads: The number of threads that were returned from
+ *             ggml_compute_context_acquire_threads
+ *
+ * Gives threads back to the budget of @compute_context, waking
+ * up any computations that were waiting for them.
+ */
+void
+ggml_compute_context_release_threads (GGMLComputeContext *compute_context,
+                                      size_t              n_threads)
+{
+  g_autoptr(GMutexLocker) locker = g_mutex_locker_new (&compute_context->mutex);
+
+  compute_context->n_available_threads += n_threads;
+  g_assert (compute_context->n_available_threads <= compute_context->n_threads);
+
+  g_cond_broadcast (&compute_context->cond);
+}
+
+G_DEFINE_BOXED_TYPE (GGMLComputeContext,
+                     ggml_compute_context,
+                     ggml_compute_context_ref,
+                     ggml_compute_context_unref);
@@ -0,0 +1,55 @@
+/*
+ * ggml-gobject/ggml-compute-context.h
+ *
+ * Header file for ggml-compute-context
+ *
+ * Copyright (C) 2023 Sam Spilsbury.
+ *
+ * ggml-gobject is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation; either version 2.1 of the License, or
+ * (at your option) any later version.
+ *
+ * ggml-gobject is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with ggml-gobject; if not, write to the Free Software Foundation,
+ * Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+#pragma once
+
+#include <glib-object.h>
+#include <gio/gio.h>
+
+G_BEGIN_DECLS
+
+typedef struct _GGMLComputeContext GGMLComputeContext;
+
+#define GGML_TYPE_COMPUTE_CONTEXT (ggml_compute_context_get_type ())
+GType ggml_compute_context_get_type (void);
+
+GGMLComputeContext * ggml_compute_context_new (size_t n_threads,
+                                               size_t n_threads_per_request);
+GGMLComputeContext * ggml_compute_context_get_default (void);
+GGMLComputeContext * ggml_compute_context_ref (GGMLComputeContext *compute_context);
+void ggml_compute_context_unref (GGMLComputeContext *compute_context);
+
+size_t ggml_compute_context_get_n_threads (GGMLComputeContext *compute_context);
+size_t ggml_compute_context_get_n_threads_per_request (GGMLComputeContext *compute_context);
+
+size_t ggml_compute_context_get_n_available_threads (GGMLComputeContext *compute_context);
+
+size_t ggml_compute_context_acquire_threads (GGMLComputeContext  *compute_context,
+                                             size_t               n_requested,
+                                             GCancellable        *cancellable,
+                                             GError             **error);
+void ggml_compute_context_release_threads (GGMLComputeContext *compute_context,
+                                           size_t              n_threads);
+
+G_DEFINE_AUTOPTR_CLEANUP_FUNC (GGMLComputeContext, ggml_compute_context_unref)
+
+G_END_DECLS
@@ -109,23 +109,41 @@ ggml_compute_graph_get_computation_size (GGMLComputeGraph *graph,
  */
 GGMLComputePlan *
 ggml_compute_graph_plan (GGMLComputeGraph *compute_graph, int n_threads)
+{
+  return ggml_compute_graph_plan_with_execution_memory (compute_graph, n_threads, NULL);
+}
+
+/**
+ * ggml_compute_graph_plan_with_execution_memory:
+ * @compute_graph: A #GGMLComputeGraph
+ * @n_threads: Number of threads to use, or -1 for default
+ * @execution_memory: (nullable): A #GGMLExecutionMemory
+ *
+ * Like ggml_compute_graph_plan, but the scratch memory that the plan needs
+ * comes from the work buffer of @execution_memory, which only gets
+ * allocated again when a plan needs more than any plan before it. If
+ * @execution_memory is %NULL, the plan gets its own scratch memory.
+ *
+ * Returns: (transfer full): A new #GGMLComputePlan
+ */
+GGMLComputePlan *
+ggml_compute_graph_plan_with_execution_memory (GGMLComputeGraph    *compute_graph,
+                                               int                  n_threads,
+                                               GGMLExecutionMemory *execution_memory)
 {
   GGMLComputePlan *compute_plan = g_new0 (GGMLComputePlan, 1);
   compute_plan->cplan = ggml_graph_plan (&compute_graph->cgraph, n_threads);
   compute_plan->ref_count = 1;
 
-  size_t buffer_size = compute_plan->cplan.work_size * sizeof (int8_t) + ggml_tensor_overhead ();
-  g_autoptr(GGMLContext) context = ggml_context_new (buffer_size);
-
-  /* We have to do some manual bookkeeping of the work size here.
-   * Do this first before allocating the graph, otherwise we'll end up
-   * getting allocated as part of some garbage-collected tensor */
-  g_autoptr(GGMLTensor) work_tensor = ggml_context_new_tensor_1d (context,
-                                                                  GGML_DATA_TYPE_I8,
-                                                                  compute_plan->cplan.work_size);
+  size_t work_size = compute_plan->cplan.work_size * sizeof (int8_t);
 
-  compute_plan->cplan_work_tensor = g_steal_pointer (&work_tensor);
-  compute_plan->cplan.work_data = compute_plan->cplan_work_tensor->tensor->data;
+  /* The plan keeps a reference to the buffer, so it stays alive
+   * even if the execution memory grows its work buffer later */
+  compute_plan->cplan_work_buffer = (
+    execution_memory != NULL ? ggml_execution_memory_get_work_buffer (execution_memory, work_size) :
+                               g_bytes_new_take (g_malloc (work_size), work_size)
+  );
+  compute_plan->cplan.work_data = (uint8_t *) g_bytes_get_data (compute_plan->cplan_work_buffer, NULL);
 
   return compute_plan;
 }
@@ -144,6 +162,27 @@ ggml_compute_graph_build_forward_expand (GGMLComputeGraph *compute_graph, GGMLTe
   ggml_build_forward_expand (&compute_graph->cgraph, tensor->tensor);
 }
 
+/**
+ * ggml_compute_graph_allocate:
+ * @compute_graph: A #GGMLComputeGraph
+ * @context: A #GGMLContext created with ggml_alloc_context_new
+ *
+ * Allocates memory for all the nodes in @compute_graph from @context
+ * upfront and then detaches the allocator from @context, so that
+ * the nodes keep their memory. The graph can then be computed as many
+ * times as needed without being rebuilt, as long as any input tensors
+ * are written again before each computation.
+ */
+void
+ggml_compute_graph_allocate (GGMLComputeGraph *compute_graph,
+                             GGMLContext      *context)
+{
+  g_assert (context->alloc != NULL && !ggml_allocr_is_measure (context->alloc));
+
+  ggml_allocr_alloc_graph (context->alloc, &compute_graph->cgraph);
+  g_clear_pointer (&context->alloc, ggml_allocr_free);
+}
+
 /**
  * ggml_compute_graph_compute:
  * @compute_graph: A #GGMLComputeGraph
@@ -171,8 +210,12 @@ ggml_compute_graph_compute (GGMLComputeGraph  *compute_graph,
   compute_plan->cplan.abort_callback = (_Bool (*)(void*))g_cancellable_is_cancelled;
   compute_plan->cplan.abort_callback_data = cancellable;
 
-  /* Allocate memory for computation */
-  ggml_allocr_alloc_graph (context->alloc, &compute_graph->cgraph);
+  /* Allocate memory for computation, unless that was already
+   * done upfront with ggml_compute_graph_allocate */
+  if (context->alloc != NULL)
+    {
+      ggml_allocr_alloc_graph (context->alloc, &compute_graph->cgraph);
+    }
 
   int exit_status = ggml_graph_compute (&compute_graph->cgraph, &compute_plan->cplan);
 
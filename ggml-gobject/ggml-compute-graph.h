@@ -26,6 +26,7 @@
 #include <gio/gio.h>
 #include <ggml-gobject/ggml-compute-plan.h>
 #include <ggml-gobject/ggml-context.h>
+#include <ggml-gobject/ggml-execution-memory.h>
 #include <ggml-gobject/ggml-tensor.h>
 
 G_BEGIN_DECLS
@@ -42,6 +43,11 @@ void ggml_compute_graph_build_forward_expand (GGMLComputeGraph *compute_graph, G
 size_t ggml_compute_graph_get_computation_size (GGMLComputeGraph *graph,
                                                 GGMLTensor       *result_tensor);
 GGMLComputePlan * ggml_compute_graph_plan (GGMLComputeGraph *compute_graph, int n_threads);
+GGMLComputePlan * ggml_compute_graph_plan_with_execution_memory (GGMLComputeGraph    *compute_graph,
+                                                                 int                  n_threads,
+                                                                 GGMLExecutionMemory *execution_memory);
+void ggml_compute_graph_allocate (GGMLComputeGraph *compute_graph,
+                                  GGMLContext      *context);
 gboolean ggml_compute_graph_compute (GGMLComputeGraph  *compute_graph,
                                      GGMLComputePlan   *compute_plan,
                                      GGMLContext       *context,
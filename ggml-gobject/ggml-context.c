@@ -133,6 +133,43 @@ ggml_alloc_context_new (GBytes *mem_buffer)
   return context;
 }
 
+/**
+ * ggml_context_new_for_external_data: (skip)
+ * @external_data: (transfer none): A #GBytes that tensors in this context will point into
+ * @n_tensors: The number of tensors that will be created in this context
+ *
+ * Creates a new context which only holds tensor metadata. The tensor
+ * data itself is not allocated, instead the caller is expected to point
+ * each tensor into @external_data, for instance a memory-mapped model
+ * file. The context keeps a reference to @external_data so that it
+ * stays alive for as long as any of its tensors do.
+ *
+ * Returns: (transfer full): A new #GGMLContext
+ */
+GGMLContext *
+ggml_context_new_for_external_data (GBytes *external_data,
+                                    size_t  n_tensors)
+{
+  GGMLContext *context = g_new0 (GGMLContext, 1);
+  size_t metadata_size = ggml_tensor_overhead () * MAX (n_tensors, 1);
+
+  context->mem_buffer = g_bytes_new_take (g_malloc (metadata_size), metadata_size);
+  context->external_data = g_bytes_ref (external_data);
+  gpointer mem_buffer_ptr = (gpointer) g_bytes_get_data (context->mem_buffer, NULL);
+
+  struct ggml_init_params params = {
+    .mem_size = metadata_size,
+    .mem_buffer = mem_buffer_ptr,
+    .no_alloc = TRUE,
+  };
+
+  context->ctx = ggml_init (params);
+  context->ref_count = 1;
+
+  g_assert (context->ctx != NULL);
+  return context;
+}
+
 /**
  * ggml_context_new:
  * @memory_size: The size of the memory pool for this context
@@ -183,6 +220,7 @@ ggml_context_unref (GGMLContext *context)
       g_clear_pointer (&context->alloc, ggml_allocr_free);
       g_clear_pointer (&context->ctx, ggml_free);
       g_clear_pointer (&context->mem_buffer, g_bytes_unref);
+      g_clear_pointer (&context->external_data, g_bytes_unref);
       g_clear_pointer (&context, g_free);
     }
 }
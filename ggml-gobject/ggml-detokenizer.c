@@ -0,0 +1,314 @@
+/*
+ * ggml-gobject/ggml-detokenizer.c
+ *
+ * Library code for ggml-detokenizer
+ *
+ * Copyright (C) 2023 Sam Spilsbury.
+ *
+ * ggml-gobject is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation; either version 2.1 of the License, or
+ * (at your option) any later version.
+ *
+ * ggml-gobject is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License along
+ * with ggml-gobject; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+#include <string.h>
+
+#include <ggml-gobject/ggml-detokenizer.h>
+
+/* The bytes of the decoded tokens go into @buffer. Byte-level tokens
+ * can end part of the way through a UTF-8 sequence, so only the bytes
+ * up to @n_complete_bytes can be handed out. The rest stay at the end of
+ * @buffer until the tokens that complete them come in. */
+struct _GGMLDetokenizer {
+  GGMLTokenDictionary *token_dictionary;
+  GString *buffer;
+  size_t n_complete_bytes;
+  size_t ref_count;
+};
+
+/**
+ * ggml_detokenizer_new:
+ * @token_dictionary: (transfer none): A #GGMLTokenDictionary
+ *
+ * Creates a new #GGMLDetokenizer, which decodes tokens from @token_dictionary
+ * as they come in and only ever hands out complete UTF-8 sequences.
+ *
+ * Returns: (transfer full): A new #GGMLDetokenizer
+ */
+GGMLDetokenizer *
+ggml_detokenizer_new (GGMLTokenDictionary *token_dictionary)
+{
+  GGMLDetokenizer *detokenizer = g_new0 (GGMLDetokenizer, 1);
+
+  detokenizer->token_dictionary = ggml_token_dictionary_ref (token_dictionary);
+  detokenizer->buffer = g_string_new (NULL);
+  detokenizer->n_complete_bytes = 0;
+  detokenizer->ref_count = 1;
+
+  return detokenizer;
+}
+
+/**
+ * ggml_detokenizer_copy:
+ * @detokenizer: A #GGMLDetokenizer
+ *
+ * Returns: (transfer full): A new #GGMLDetokenizer with the same bytes
+ *          waiting to be handed out as @detokenizer
+ */
+GGMLDetokenizer *
+ggml_detokenizer_copy (GGMLDetokenizer *detokenizer)
+{
+  GGMLDetokenizer *copy = ggml_detokenizer_new (detokenizer->token_dictionary);
+
+  g_string_append_len (copy->buffer, detokenizer->buffer->str, detokenizer->buffer->len);
+  copy->n_complete_bytes = detokenizer->n_complete_bytes;
+
+  return copy;
+}
+
+/**
+ * ggml_detokenizer_ref: (skip)
+ * @detokenizer: A #GGMLDetokenizer
+ *
+ * Returns: (transfer full): A #GGMLDetokenizer
+ */
+GGMLDetokenizer *
+ggml_detokenizer_ref (GGMLDetokenizer *detokenizer)
+{
+  ++detokenizer->ref_count;
+  return detokenizer;
+}
+
+/**
+ * ggml_detokenizer_unref: (skip)
+ * @detokenizer: A #GGMLDetokenizer
+ *
+ * Decrements the reference count on @detokenizer and frees the
+ * underlying buffer if the reference count goes to zero.
+ */
+void
+ggml_detokenizer_unref (GGMLDetokenizer *detokenizer)
+{
+  if (--detokenizer->ref_count == 0)
+    {
+      g_clear_pointer (&detokenizer->token_dictionary, ggml_token_dictionary_unref);
+      g_string_free (g_steal_pointer (&detokenizer->buffer), TRUE);
+      g_clear_pointer (&detokenizer, g_free);
+    }
+}
+
+/* Finds where the last UTF-8 sequence in @buffer starts, if the
+ * sequence does not have all of its bytes yet. Bytes that could never
+ * be part of a valid sequence are handed out as they are. */
+static size_t
+ggml_detokenizer_find_complete_bytes (GString *buffer)
+{
+  const guchar *bytes = (const guchar *) buffer->str;
+
+  for (size_t i = 1; i <= 3 && i <= buffer->len; ++i)
+    {
+      guchar c = bytes[buffer->len - i];
+      size_t sequence_len;
+
+      /* Continuation byte, keep looking for the start of the sequence */
+      if ((c & 0xc0) == 0x80)
+        {
+          continue;
+        }
+
+      if ((c & 0xe0) == 0xc0)
+        {
+          sequence_len = 2;
+        }
+      else if ((c & 0xf0) == 0xe0)
+        {
+          sequence_len = 3;
+        }
+      else if ((c & 0xf8) == 0xf0)
+        {
+          sequence_len = 4;
+        }
+      else
+        {
+          sequence_len = 1;
+        }
+
+      return sequence_len > i ? buffer->len - i : buffer->len;
+    }
+
+  return buffer->len;
+}
+
+/**
+ * ggml_detokenizer_push_token:
+ * @detokenizer: A #GGMLDetokenizer
+ * @token: A token to decode
+ *
+ * Appends the bytes of @token to @detokenizer. It is an error to pass a
+ * token which is outside the range of tokens in the token dictionary.
+ */
+void
+ggml_detokenizer_push_token (GGMLDetokenizer *detokenizer,
+                             int32_t          token)
+{
+  g_string_append (detokenizer->buffer,
+                   ggml_token_dictionary_get_word (detokenizer->token_dictionary, token));
+  detokenizer->n_complete_bytes = ggml_detokenizer_find_complete_bytes (detokenizer->buffer);
+}
+
+/**
+ * ggml_detokenizer_push_tokens:
+ * @detokenizer: A #GGMLDetokenizer
+ * @tokens: (array length=n_tokens): The tokens to decode
+ * @n_tokens: The number of tokens in @tokens
+ *
+ * Appends the bytes of each of @tokens to @detokenizer, see
+ * ggml_detokenizer_push_token().
+ */
+void
+ggml_detokenizer_push_tokens (GGMLDetokenizer *detokenizer,
+                              const int32_t   *tokens,
+                              size_t           n_tokens)
+{
+  for (size_t i = 0; i < n_tokens; ++i)
+    {
+      g_string_append (detokenizer->buffer,
+                       ggml_token_dictionary_get_word (detokenizer->token_dictionary, tokens[i]));
+    }
+
+  detokenizer->n_complete_bytes = ggml_detokenizer_find_complete_bytes (detokenizer->buffer);
+}
+
+/**
+ * ggml_detokenizer_peek:
+ * @detokenizer: A #GGMLDetokenizer
+ * @out_length: (out): The number of bytes that can be handed out
+ *
+ * Returns the decoded text that has not been consumed yet, up to the end of
+ * the last complete UTF-8 sequence. The text is not nul-terminated and is only
+ * valid until the next call on @detokenizer.
+ *
+ * Returns: (transfer none) (array length=out_length) (element-type guint8): The decoded text
+ */
+const char *
+ggml_detokenizer_peek (GGMLDetokenizer *detokenizer,
+                       size_t          *out_length)
+{
+  *out_length = detokenizer->n_complete_bytes;
+  return detokenizer->buffer->str;
+}
+
+/**
+ * ggml_detokenizer_consume:
+ * @detokenizer: A #GGMLDetokenizer
+ * @length: The number of bytes to remove
+ *
+ * Removes the first @length bytes of the text returned by
+ * ggml_detokenizer_peek(). The buffer is kept around for the next tokens.
+ */
+void
+ggml_detokenizer_consume (GGMLDetokenizer *detokenizer,
+                          size_t           length)
+{
+  g_assert (length <= detokenizer->n_complete_bytes);
+
+  g_string_erase (detokenizer->buffer, 0, length);
+  detokenizer->n_complete_bytes -= length;
+}
+
+/**
+ * ggml_detokenizer_take:
+ * @detokenizer: A #GGMLDetokenizer
+ *
+ * Takes all the complete UTF-8 text out of @detokenizer, leaving only the
+ * bytes of an incomplete sequence at the end, if there are any.
+ *
+ * Returns: (transfer full): The decoded text
+ */
+char *
+ggml_detokenizer_take (GGMLDetokenizer *detokenizer)
+{
+  size_t length;
+  const char *text = ggml_detokenizer_peek (detokenizer, &length);
+  char *taken = g_strndup (text, length);
+
+  ggml_detokenizer_consume (detokenizer, length);
+
+  return taken;
+}
+
+/**
+ * ggml_detokenizer_get_n_pending_bytes:
+ * @detokenizer: A #GGMLDetokenizer
+ *
+ * Returns: The number of bytes held back because they do not make up a
+ *          complete UTF-8 sequence yet
+ */
+size_t
+ggml_detokenizer_get_n_pending_bytes (GGMLDetokenizer *detokenizer)
+{
+  return detokenizer->buffer->len - detokenizer->n_complete_bytes;
+}
+
+/**
+ * ggml_detokenizer_get_pending_bytes:
+ * @detokenizer: A #GGMLDetokenizer
+ * @out_length: (out): The number of bytes held back
+ *
+ * Gets the bytes held back because they do not make up a complete UTF-8
+ * sequence yet, for instance to save them. They are only valid until the
+ * next call on @detokenizer.
+ *
+ * Returns: (transfer none) (array length=out_length) (element-type guint8): The
+ *          bytes held back
+ */
+const char *
+ggml_detokenizer_get_pending_bytes (GGMLDetokenizer *detokenizer,
+                                    size_t          *out_length)
+{
+  *out_length = detokenizer->buffer->len - detokenizer->n_complete_bytes;
+  return detokenizer->buffer->str + detokenizer->n_complete_bytes;
+}
+
+/**
+ * ggml_detokenizer_push_bytes:
+ * @detokenizer: A #GGMLDetokenizer
+ * @bytes: (array length=length) (element-type guint8): Decoded bytes
+ * @length: The number of bytes in @bytes
+ *
+ * Appends bytes that were already decoded to @detokenizer, for instance
+ * the bytes from ggml_detokenizer_get_pending_bytes() of a saved detokenizer.
+ */
+void
+ggml_detokenizer_push_bytes (GGMLDetokenizer *detokenizer,
+                             const char      *bytes,
+                             size_t           length)
+{
+  g_string_append_len (detokenizer->buffer, bytes, length);
+  detokenizer->n_complete_bytes = ggml_detokenizer_find_complete_bytes (detokenizer->buffer);
+}
+
+/**
+ * ggml_detokenizer_reset:
+ * @detokenizer: A #GGMLDetokenizer
+ *
+ * Drops all the bytes in @detokenizer, including the bytes that
+ * were held back.
+ */
+void
+ggml_detokenizer_reset (GGMLDetokenizer *detokenizer)
+{
+  g_string_truncate (detokenizer->buffer, 0);
+  detokenizer->n_complete_bytes = 0;
+}
+
+G_DEFINE_BOXED_TYPE (GGMLDetokenizer, ggml_detokenizer, ggml_detokenizer_ref, ggml_detokenizer_unref)
@@ -0,0 +1,60 @@
+/*
+ * ggml-gobject/ggml-detokenizer.h
+ *
+ * Header file for ggml-detokenizer
+ *
+ * Copyright (C) 2023 Sam Spilsbury.
+ *
+ * ggml-gobject is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation; either version 2.1 of the License, or
+ * (at your option) any later version.
+ *
+ * ggml-gobject is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with ggml-gobject; if not, write to the Free Software Foundation,
+ * Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+#pragma once
+
+#include <glib-object.h>
+#include <ggml-gobject/ggml-token-dictionary.h>
+
+G_BEGIN_DECLS
+
+typedef struct _GGMLDetokenizer GGMLDetokenizer;
+
+#define GGML_TYPE_DETOKENIZER (ggml_detokenizer_get_type ())
+GType ggml_detokenizer_get_type (void);
+
+GGMLDetokenizer * ggml_detokenizer_new (GGMLTokenDictionary *token_dictionary);
+GGMLDetokenizer * ggml_detokenizer_copy (GGMLDetokenizer *detokenizer);
+GGMLDetokenizer * ggml_detokenizer_ref (GGMLDetokenizer *detokenizer);
+void ggml_detokenizer_unref (GGMLDetokenizer *detokenizer);
+
+void ggml_detokenizer_push_token (GGMLDetokenizer *detokenizer,
+                                  int32_t          token);
+void ggml_detokenizer_push_tokens (GGMLDetokenizer *detokenizer,
+                                   const int32_t   *tokens,
+                                   size_t           n_tokens);
+const char * ggml_detokenizer_peek (GGMLDetokenizer *detokenizer,
+                                    size_t          *out_length);
+void ggml_detokenizer_consume (GGMLDetokenizer *detokenizer,
+                               size_t           length);
+char * ggml_detokenizer_take (GGMLDetokenizer *detokenizer);
+size_t ggml_detokenizer_get_n_pending_bytes (GGMLDetokenizer *detokenizer);
+const char * ggml_detokenizer_get_pending_bytes (GGMLDetokenizer *detokenizer,
+                                                 size_t          *out_length);
+void ggml_detokenizer_push_bytes (GGMLDetokenizer *detokenizer,
+                                  const char      *bytes,
+                                  size_t           length);
+void ggml_detokenizer_reset (GGMLDetokenizer *detokenizer);
+
+G_DEFINE_AUTOPTR_CLEANUP_FUNC (GGMLDetokenizer, ggml_detokenizer_unref)
+
+G_END_DECLS
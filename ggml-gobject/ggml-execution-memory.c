@@ -24,17 +24,46 @@
 #include <ggml-gobject/ggml-model.h>
 
 struct _GGMLExecutionMemory {
-  GBytes      *execution_buffer;
-  GHashTable  *key_value_memory;
-  size_t       ref_count;
+  GBytes         *execution_buffer;
+  size_t          execution_memory_size;
+  GBytes         *work_buffer;
+  GHashTable     *key_value_memory;
+  GGMLKeyValuePagePool *key_value_page_pool;
+  GArray         *key_value_page_table;
+  gpointer        cached_graph;
+  GDestroyNotify  cached_graph_destroy;
+  size_t          ref_count;
 };
 
+static void
+ggml_execution_memory_clear_key_value_memory (GHashTable *key_value_memory)
+{
+  GHashTableIter iter;
+  gpointer value;
+
+  g_hash_table_iter_init (&iter, key_value_memory);
+  while (g_hash_table_iter_next (&iter, NULL, &value))
+    {
+      size_t n_bytes = 0;
+      char *data = ggml_tensor_get_data (value, &n_bytes);
+
+      if (data != NULL)
+        {
+          memset (data, 0, n_bytes);
+        }
+    }
+}
+
 /**
  * ggml_execution_memory_new:
  * @execution_memory_size: Size in bytes of the execution memory
  * @key_value_memory: (transfer none) (nullable) (element-type utf8 GGMLTensor): A #GHashTable
  *                    of string keys and #GGMLTensor values containing the key-value memory
- *                    for this execution memory.
+ *                    for this execution memory. It is zeroed on construction.
+ *
+ * Creates a new #GGMLExecutionMemory with a single buffer that is re-used
+ * by every context created with ggml_execution_memory_create_context, see
+ * there for how long the tensors from each pass stay valid.
  *
  * Returns: (transfer full): A new #GGMLExecutionMemory
  */
@@ -46,13 +75,51 @@ ggml_execution_memory_new (size_t      execution_memory_size,
   size_t mem_size = execution_memory_size + compute_graph_tensor_overhead;
   GGMLExecutionMemory *memory = g_new0 (GGMLExecutionMemory, 1);
 
+  /* This is allocated once and then re-used for every pass */
   memory->execution_buffer = g_bytes_new_take (g_malloc (mem_size), mem_size);
+  memory->execution_memory_size = execution_memory_size;
   memory->key_value_memory = key_value_memory != NULL ? g_hash_table_ref (key_value_memory) : NULL;
   memory->ref_count = 1;
 
+  /* Forward passes may attend over a few positions past the
+   * ones that have been written so far and mask them out, which
+   * only works out if those positions hold finite values */
+  if (memory->key_value_memory != NULL)
+    {
+      ggml_execution_memory_clear_key_value_memory (memory->key_value_memory);
+    }
+
   return g_steal_pointer (&memory);
 }
 
+/**
+ * ggml_execution_memory_new_paged:
+ * @execution_memory_size: Size in bytes of the execution memory
+ * @key_value_page_pool: (transfer none): A #GGMLKeyValuePagePool
+ *
+ * Creates a new #GGMLExecutionMemory like ggml_execution_memory_new, but
+ * with its key-value memory in @key_value_page_pool, which may be shared with
+ * other execution memories. The key-value memory of this execution memory
+ * is made up of the pages in its page table, which grows as the forward
+ * function reserves positions with ggml_execution_memory_reserve_key_value_positions.
+ * The pages go back to @key_value_page_pool once this execution memory is freed.
+ *
+ * Returns: (transfer full): A new #GGMLExecutionMemory
+ */
+GGMLExecutionMemory *
+ggml_execution_memory_new_paged (size_t                execution_memory_size,
+                                 GGMLKeyValuePagePool *key_value_page_pool)
+{
+  GGMLExecutionMemory *memory = ggml_execution_memory_new (execution_memory_size, NULL);
+
+  /* Not cleared, since the pool memory is shared and starts out zeroed */
+  memory->key_value_memory = g_hash_table_ref (ggml_key_value_page_pool_get_memory (key_value_page_pool));
+  memory->key_value_page_pool = ggml_key_value_page_pool_ref (key_value_page_pool);
+  memory->key_value_page_table = g_array_new (FALSE, FALSE, sizeof (int32_t));
+
+  return memory;
+}
+
 /**
  * ggml_execution_memory_recorder_new:
  * @memory_desc: (transfer none) (nullable): A #GGMLModelDescNode describing how the key-value
@@ -72,7 +139,6 @@ ggml_execution_memory_recorder_new (GGMLModelDescNode *memory_desc)
       g_autoptr(GHashTable) flattened_memory_desc = ggml_model_desc_node_flatten (memory_desc);
       g_autoptr(GGMLContext) recorder_context = ggml_recorder_context_new ();
 
-      memory->execution_buffer = NULL;
       memory->key_value_memory = ggml_new_weight_set_from_flattened_desc (recorder_context,
                                                                           flattened_memory_desc);
     }
@@ -94,7 +160,22 @@ ggml_execution_memory_unref (GGMLExecutionMemory *memory)
 {
   if (--memory->ref_count == 0)
     {
+      ggml_execution_memory_set_cached_graph (memory, NULL, NULL);
+
       g_clear_pointer (&memory->execution_buffer, g_bytes_unref);
+      g_clear_pointer (&memory->work_buffer, g_bytes_unref);
+
+      if (memory->key_value_page_table != NULL)
+        {
+          for (size_t i = 0; i < memory->key_value_page_table->len; ++i)
+            {
+              ggml_key_value_page_pool_unref_page (memory->key_value_page_pool,
+                                                   g_array_index (memory->key_value_page_table, int32_t, i));
+            }
+        }
+
+      g_clear_pointer (&memory->key_value_page_table, g_array_unref);
+      g_clear_pointer (&memory->key_value_page_pool, ggml_key_value_page_pool_unref);
       g_clear_pointer (&memory->key_value_memory, g_hash_table_unref);
       g_clear_pointer (&memory, g_free);
     }
@@ -114,10 +195,545 @@ ggml_execution_memory_get_key_value_memory (GGMLExecutionMemory *execution_memor
   return execution_memory->key_value_memory;
 }
 
+/**
+ * ggml_execution_memory_get_key_value_page_pool:
+ * @execution_memory: A #GGMLExecutionMemory
+ *
+ * Returns: (transfer none) (nullable): The #GGMLKeyValuePagePool that the key-value
+ *          memory of @execution_memory lives in, or %NULL if the key-value memory
+ *          is not paged.
+ */
+GGMLKeyValuePagePool *
+ggml_execution_memory_get_key_value_page_pool (GGMLExecutionMemory *execution_memory)
+{
+  return execution_memory->key_value_page_pool;
+}
+
+/**
+ * ggml_execution_memory_get_key_value_page_table:
+ * @execution_memory: A #GGMLExecutionMemory
+ * @out_n_pages: (out): The number of pages in the page table
+ *
+ * Gets the pages of the key-value page pool that make up the key-value
+ * memory of @execution_memory. Position p is in page p / page_size of the
+ * page table, at p % page_size positions into that page. The page table is
+ * only valid until the next call to ggml_execution_memory_reserve_key_value_positions.
+ *
+ * Returns: (transfer none) (array length=out_n_pages) (nullable): The page table, or
+ *          %NULL if the key-value memory is not paged.
+ */
+const int32_t *
+ggml_execution_memory_get_key_value_page_table (GGMLExecutionMemory *execution_memory,
+                                                size_t              *out_n_pages)
+{
+  if (execution_memory->key_value_page_table == NULL)
+    {
+      *out_n_pages = 0;
+      return NULL;
+    }
+
+  *out_n_pages = execution_memory->key_value_page_table->len;
+  return (const int32_t *) execution_memory->key_value_page_table->data;
+}
+
+/**
+ * ggml_execution_memory_reserve_key_value_positions:
+ * @execution_memory: A #GGMLExecutionMemory
+ * @n_past: The number of positions already in the key-value memory
+ * @n_tokens: The number of positions that are about to be written
+ * @error: A #GError
+ *
+ * Makes sure that the page table of @execution_memory covers the first
+ * @n_past + @n_tokens positions, taking new pages from the key-value page
+ * pool if needed. Pages that the positions from @n_past onwards are in get
+ * copied first if they are shared with another execution memory, so that
+ * writing to them does not change what the other one sees. Forward functions
+ * call this before writing to a paged key-value memory. It does nothing if the
+ * key-value memory is not paged.
+ *
+ * Returns: %TRUE on success, %FALSE with @error set if the key-value page pool
+ *          ran out of pages.
+ */
+gboolean
+ggml_execution_memory_reserve_key_value_positions (GGMLExecutionMemory  *execution_memory,
+                                                   size_t                n_past,
+                                                   size_t                n_tokens,
+                                                   GError              **error)
+{
+  GGMLKeyValuePagePool *page_pool = execution_memory->key_value_page_pool;
+  GArray *page_table = execution_memory->key_value_page_table;
+
+  if (page_pool == NULL)
+    {
+      return TRUE;
+    }
+
+  const size_t page_size = ggml_key_value_page_pool_get_page_size (page_pool);
+  const size_t n_pages = (n_past + n_tokens + page_size - 1) / page_size;
+
+  while (page_table->len < n_pages)
+    {
+      int32_t page;
+
+      if (!ggml_key_value_page_pool_allocate_page (page_pool, &page, error))
+        {
+          return FALSE;
+        }
+
+      g_array_append_val (page_table, page);
+    }
+
+  for (size_t i = n_past / page_size; i < n_pages; ++i)
+    {
+      int32_t *page = &g_array_index (page_table, int32_t, i);
+      int32_t page_copy;
+
+      if (!ggml_key_value_page_pool_page_is_shared (page_pool, *page))
+        {
+          continue;
+        }
+
+      if (!ggml_key_value_page_pool_allocate_page (page_pool, &page_copy, error))
+        {
+          return FALSE;
+        }
+
+      ggml_key_value_page_pool_copy_page (page_pool, *page, page_copy);
+      ggml_key_value_page_pool_unref_page (page_pool, *page);
+      *page = page_copy;
+    }
+
+  return TRUE;
+}
+
+/* Saving and restoring copies positions [0, n_positions) out of each
+ * group of each memory tensor, in the order of the keys. Groups are the
+ * layers for memory with one row per position, and the channels of
+ * each layer for memory with one row of positions per channel. */
+static GList *
+ggml_execution_memory_sorted_key_value_keys (GGMLExecutionMemory *execution_memory)
+{
+  return g_list_sort (g_hash_table_get_keys (execution_memory->key_value_memory),
+                      (GCompareFunc) g_strcmp0);
+}
+
+static void
+ggml_execution_memory_key_value_tensor_layout (GGMLTensor *tensor,
+                                               size_t     *out_n_groups,
+                                               size_t     *out_n_memory_positions,
+                                               size_t     *out_position_n_bytes)
+{
+  size_t n_dims;
+  int64_t *shape = ggml_tensor_get_shape (tensor, &n_dims);
+
+  *out_n_groups = n_dims == 2 ? shape[1] : shape[2];
+  *out_n_memory_positions = n_dims == 2 ? shape[0] : shape[1];
+  *out_position_n_bytes = ggml_tensor_n_bytes (tensor) / (*out_n_groups * *out_n_memory_positions);
+}
+
+/**
+ * ggml_execution_memory_get_key_value_positions_n_bytes:
+ * @execution_memory: A #GGMLExecutionMemory
+ * @n_positions: The number of positions
+ *
+ * Returns: The size of the #GBytes that ggml_execution_memory_save_key_value_positions
+ *          would return for @n_positions positions, without copying anything.
+ */
+size_t
+ggml_execution_memory_get_key_value_positions_n_bytes (GGMLExecutionMemory *execution_memory,
+                                                       size_t               n_positions)
+{
+  GHashTableIter iter;
+  gpointer value;
+  size_t n_bytes = 0;
+
+  g_hash_table_iter_init (&iter, execution_memory->key_value_memory);
+  while (g_hash_table_iter_next (&iter, NULL, &value))
+    {
+      size_t n_groups, n_memory_positions, position_n_bytes;
+
+      ggml_execution_memory_key_value_tensor_layout (value, &n_groups, &n_memory_positions, &position_n_bytes);
+      n_bytes += n_groups * n_positions * position_n_bytes;
+    }
+
+  return n_bytes;
+}
+
+static void
+ggml_execution_memory_copy_key_value_positions (GGMLExecutionMemory *execution_memory,
+                                                char                *saved,
+                                                size_t               n_saved_positions,
+                                                size_t               n_positions,
+                                                gboolean             save)
+{
+  g_autoptr(GList) keys = ggml_execution_memory_sorted_key_value_keys (execution_memory);
+  GArray *page_table = execution_memory->key_value_page_table;
+  size_t page_size = (execution_memory->key_value_page_pool != NULL ?
+                      ggml_key_value_page_pool_get_page_size (execution_memory->key_value_page_pool) :
+                      G_MAXSIZE);
+  size_t saved_offset = 0;
+
+  for (GList *link = keys; link != NULL; link = link->next)
+    {
+      GGMLTensor *tensor = g_hash_table_lookup (execution_memory->key_value_memory, link->data);
+      char *data = ggml_tensor_get_data (tensor, NULL);
+      size_t n_groups, n_memory_positions, position_n_bytes;
+
+      ggml_execution_memory_key_value_tensor_layout (tensor, &n_groups, &n_memory_positions, &position_n_bytes);
+
+      for (size_t group = 0; group < n_groups; ++group)
+        {
+          char *group_data = data + group * n_memory_positions * position_n_bytes;
+
+          /* Pages are not next to each other, so copy one page at a time */
+          for (size_t position = 0; position < n_positions;)
+            {
+              size_t length = MIN (page_size - position % page_size, n_positions - position);
+              size_t row = (page_table != NULL ?
+                            g_array_index (page_table, int32_t, position / page_size) * page_size + position % page_size :
+                            position);
+              char *memory_ptr = group_data + row * position_n_bytes;
+              char *saved_ptr = saved + saved_offset + position * position_n_bytes;
+
+              if (save)
+                {
+                  memcpy (saved_ptr, memory_ptr, length * position_n_bytes);
+                }
+              else
+                {
+                  memcpy (memory_ptr, saved_ptr, length * position_n_bytes);
+                }
+
+              position += length;
+            }
+
+          saved_offset += n_saved_positions * position_n_bytes;
+        }
+    }
+}
+
+static gboolean
+ggml_execution_memory_check_key_value_positions (GGMLExecutionMemory  *execution_memory,
+                                                 size_t                n_positions,
+                                                 GError              **error)
+{
+  size_t n_available_positions = G_MAXSIZE;
+
+  if (execution_memory->key_value_memory == NULL || ggml_execution_memory_is_recorder (execution_memory))
+    {
+      g_set_error (error,
+                   G_IO_ERROR,
+                   G_IO_ERROR_NOT_SUPPORTED,
+                   "Execution memory has no key-value memory to save or restore");
+      return FALSE;
+    }
+
+  if (execution_memory->key_value_page_pool != NULL)
+    {
+      n_available_positions = (execution_memory->key_value_page_table->len *
+                               ggml_key_value_page_pool_get_page_size (execution_memory->key_value_page_pool));
+    }
+  else
+    {
+      GHashTableIter iter;
+      gpointer value;
+
+      g_hash_table_iter_init (&iter, execution_memory->key_value_memory);
+      while (g_hash_table_iter_next (&iter, NULL, &value))
+        {
+          size_t n_groups, n_memory_positions, position_n_bytes;
+
+          ggml_execution_memory_key_value_tensor_layout (value, &n_groups, &n_memory_positions, &position_n_bytes);
+          n_available_positions = MIN (n_available_positions, n_memory_positions);
+        }
+    }
+
+  if (n_positions > n_available_positions)
+    {
+      g_set_error (error,
+                   G_IO_ERROR,
+                   G_IO_ERROR_INVALID_ARGUMENT,
+                   "Cannot access %zu positions of the key-value memory, only %zu are available",
+                   n_positions,
+                   n_available_positions);
+      return FALSE;
+    }
+
+  return TRUE;
+}
+
+/**
+ * ggml_execution_memory_save_key_value_positions:
+ * @execution_memory: A #GGMLExecutionMemory
+ * @n_positions: The number of positions to save, starting from the first one
+ * @error: A #GError
+ *
+ * Copies the keys and values for the first @n_positions positions out of
+ * the key-value memory, for instance to start other sequences with the
+ * same prefix from there. The layout of the copy only depends on the
+ * memory description, so it can be restored into any execution memory
+ * for the same model with ggml_execution_memory_restore_key_value_positions,
+ * whether it is paged or not.
+ *
+ * Returns: (transfer full): A #GBytes with the saved positions or %NULL
+ *          with @error set on failure.
+ */
+GBytes *
+ggml_execution_memory_save_key_value_positions (GGMLExecutionMemory  *execution_memory,
+                                                size_t                n_positions,
+                                                GError              **error)
+{
+  if (!ggml_execution_memory_check_key_value_positions (execution_memory, n_positions, error))
+    {
+      return NULL;
+    }
+
+  size_t n_bytes = ggml_execution_memory_get_key_value_positions_n_bytes (execution_memory, n_positions);
+  char *saved = g_malloc (n_bytes);
+
+  ggml_execution_memory_copy_key_value_positions (execution_memory, saved, n_positions, n_positions, TRUE);
+
+  return g_bytes_new_take (saved, n_bytes);
+}
+
+/**
+ * ggml_execution_memory_restore_key_value_positions:
+ * @execution_memory: A #GGMLExecutionMemory
+ * @saved: (transfer none): A #GBytes from ggml_execution_memory_save_key_value_positions
+ * @n_saved_positions: The number of positions that were saved in @saved
+ * @n_positions: The number of positions to restore, which may be less than @n_saved_positions
+ * @error: A #GError
+ *
+ * Copies the keys and values of the first @n_positions positions in @saved
+ * back into the key-value memory. If the memory is paged, then the pages for
+ * those positions are reserved first.
+ *
+ * Returns: %TRUE on success or %FALSE with @error set on failure.
+ */
+gboolean
+ggml_execution_memory_restore_key_value_positions (GGMLExecutionMemory  *execution_memory,
+                                                   GBytes               *saved,
+                                                   size_t                n_saved_positions,
+                                                   size_t                n_positions,
+                                                   GError              **error)
+{
+  g_return_val_if_fail (n_positions <= n_saved_positions, FALSE);
+
+  if (g_bytes_get_size (saved) != ggml_execution_memory_get_key_value_positions_n_bytes (execution_memory, n_saved_positions))
+    {
+      g_set_error (error,
+                   G_IO_ERROR,
+                   G_IO_ERROR_INVALID_DATA,
+                   "Saved key-value positions do not match the layout of the key-value memory");
+      return FALSE;
+    }
+
+  if (!ggml_execution_memory_reserve_key_value_positions (execution_memory, 0, n_positions, error))
+    {
+      return FALSE;
+    }
+
+  if (!ggml_execution_memory_check_key_value_positions (execution_memory, n_positions, error))
+    {
+      return FALSE;
+    }
+
+  ggml_execution_memory_copy_key_value_positions (execution_memory,
+                                                  (char *) g_bytes_get_data (saved, NULL),
+                                                  n_saved_positions,
+                                                  n_positions,
+                                                  FALSE);
+
+  return TRUE;
+}
+
+static GHashTable *
+ggml_execution_memory_flatten_key_value_memory_desc (GHashTable *key_value_memory)
+{
+  g_autoptr(GHashTable) flattened_memory_desc = g_hash_table_new_full (g_str_hash,
+                                                                       g_str_equal,
+                                                                       g_free,
+                                                                       (GDestroyNotify) ggml_model_desc_leaf_unref);
+  GHashTableIter iter;
+  gpointer key, value;
+
+  g_hash_table_iter_init (&iter, key_value_memory);
+  while (g_hash_table_iter_next (&iter, &key, &value))
+    {
+      size_t n_dims;
+      int64_t *shape = ggml_tensor_get_shape (value, &n_dims);
+
+      g_hash_table_insert (flattened_memory_desc,
+                           g_strdup (key),
+                           ggml_model_desc_leaf_new (shape, n_dims, ggml_tensor_get_data_type (value)));
+    }
+
+  return g_steal_pointer (&flattened_memory_desc);
+}
+
+/**
+ * ggml_execution_memory_fork:
+ * @execution_memory: A #GGMLExecutionMemory
+ * @n_positions: The number of positions of the key-value memory to carry over
+ * @error: A #GError
+ *
+ * Creates a new #GGMLExecutionMemory with the same buffers as @execution_memory,
+ * whose key-value memory starts out with the first @n_positions positions of
+ * @execution_memory, so that both can continue the same sequence in different
+ * ways. If the key-value memory is paged, the pages for those positions are
+ * shared between the two and a page only gets copied once one of them
+ * writes to it in ggml_execution_memory_reserve_key_value_positions. Otherwise
+ * the new execution memory gets its own key-value memory and the positions are
+ * copied into it straight away.
+ *
+ * Returns: (transfer full): A new #GGMLExecutionMemory or %NULL with @error set
+ *          on failure.
+ */
+GGMLExecutionMemory *
+ggml_execution_memory_fork (GGMLExecutionMemory  *execution_memory,
+                            size_t                n_positions,
+                            GError              **error)
+{
+  if (!ggml_execution_memory_check_key_value_positions (execution_memory, n_positions, error))
+    {
+      return NULL;
+    }
+
+  if (execution_memory->key_value_page_pool != NULL)
+    {
+      GGMLKeyValuePagePool *page_pool = execution_memory->key_value_page_pool;
+      const size_t page_size = ggml_key_value_page_pool_get_page_size (page_pool);
+      const size_t n_pages = (n_positions + page_size - 1) / page_size;
+      g_autoptr(GGMLExecutionMemory) fork = ggml_execution_memory_new_paged (execution_memory->execution_memory_size,
+                                                                              page_pool);
+
+      for (size_t i = 0; i < n_pages; ++i)
+        {
+          int32_t page = g_array_index (execution_memory->key_value_page_table, int32_t, i);
+
+          ggml_key_value_page_pool_ref_page (page_pool, page);
+          g_array_append_val (fork->key_value_page_table, page);
+        }
+
+      return g_steal_pointer (&fork);
+    }
+
+  g_autoptr(GHashTable) flattened_memory_desc = ggml_execution_memory_flatten_key_value_memory_desc (execution_memory->key_value_memory);
+  g_autoptr(GHashTable) key_value_memory = ggml_new_weight_set_from_flattened_desc (NULL, flattened_memory_desc);
+  g_autoptr(GGMLExecutionMemory) fork = ggml_execution_memory_new (execution_memory->execution_memory_size,
+                                                                    key_value_memory);
+  g_autoptr(GBytes) saved = ggml_execution_memory_save_key_value_positions (execution_memory, n_positions, error);
+
+  if (saved == NULL)
+    {
+      return NULL;
+    }
+
+  if (!ggml_execution_memory_restore_key_value_positions (fork, saved, n_positions, n_positions, error))
+    {
+      return NULL;
+    }
+
+  return g_steal_pointer (&fork);
+}
+
+/**
+ * ggml_execution_memory_is_recorder:
+ * @execution_memory: A #GGMLExecutionMemory
+ *
+ * Returns: %TRUE if @execution_memory was created with
+ *          ggml_execution_memory_recorder_new and so only records
+ *          allocations, %FALSE otherwise.
+ */
+gboolean
+ggml_execution_memory_is_recorder (GGMLExecutionMemory *execution_memory)
+{
+  return execution_memory->execution_buffer == NULL;
+}
+
+/**
+ * ggml_execution_memory_get_cached_graph: (skip)
+ * @execution_memory: A #GGMLExecutionMemory
+ *
+ * Returns: (transfer none) (nullable): The compute graph state previously stored with
+ *          ggml_execution_memory_set_cached_graph, or %NULL if there is none.
+ */
+gpointer
+ggml_execution_memory_get_cached_graph (GGMLExecutionMemory *execution_memory)
+{
+  return execution_memory->cached_graph;
+}
+
+/**
+ * ggml_execution_memory_set_cached_graph: (skip)
+ * @execution_memory: A #GGMLExecutionMemory
+ * @cached_graph: (transfer full) (nullable): Some forward-function specific compute graph state
+ * @cached_graph_destroy: (nullable): A #GDestroyNotify for @cached_graph
+ *
+ * Stores a compute graph that was built in a context from this @execution_memory,
+ * so that a forward function can re-run it on the next pass instead of building
+ * a new graph, replacing any previously stored graph. The forward function is
+ * responsible for deciding whether the stored graph fits the next pass.
+ */
+void
+ggml_execution_memory_set_cached_graph (GGMLExecutionMemory *execution_memory,
+                                        gpointer             cached_graph,
+                                        GDestroyNotify       cached_graph_destroy)
+{
+  if (execution_memory->cached_graph_destroy != NULL)
+    {
+      g_clear_pointer (&execution_memory->cached_graph, execution_memory->cached_graph_destroy);
+    }
+
+  execution_memory->cached_graph = cached_graph;
+  execution_memory->cached_graph_destroy = cached_graph_destroy;
+}
+
+/**
+ * ggml_execution_memory_get_work_buffer:
+ * @execution_memory: A #GGMLExecutionMemory
+ * @min_size: The number of bytes needed
+ *
+ * Gets the scratch buffer for computing compute plans. It only grows,
+ * so after the first few passes it is usually big enough and no longer
+ * needs to be allocated again.
+ *
+ * Returns: (transfer full): A #GBytes of at least @min_size bytes
+ */
+GBytes *
+ggml_execution_memory_get_work_buffer (GGMLExecutionMemory *execution_memory,
+                                       size_t               min_size)
+{
+  size_t work_buffer_size = 0;
+
+  if (execution_memory->work_buffer != NULL)
+    {
+      g_bytes_get_data (execution_memory->work_buffer, &work_buffer_size);
+    }
+
+  if (execution_memory->work_buffer == NULL || work_buffer_size < min_size)
+    {
+      g_clear_pointer (&execution_memory->work_buffer, g_bytes_unref);
+      execution_memory->work_buffer = g_bytes_new_take (g_malloc (min_size), min_size);
+    }
+
+  return g_bytes_ref (execution_memory->work_buffer);
+}
+
 /**
  * ggml_execution_memory_create_context:
  * @execution_memory: A #GGMLExecutionMemory
  *
+ * Every context created from @execution_memory is laid out over the same
+ * buffer, which is only allocated once. Both the data and the metadata of
+ * the tensors in a context, for instance their shapes, live in that buffer,
+ * so creating a new context invalidates every tensor and graph from the
+ * context before, even though that context still holds a reference on the
+ * buffer and can be unreferenced safely. Read out anything that is needed
+ * from a pass, such as its logits, before creating the context for the next
+ * one. Graphs kept with ggml_execution_memory_set_cached_graph() are only
+ * valid for as long as no other context has been created.
+ *
  * Returns: (transfer full): A new #GGMLContext created from this #GGMLExecutionMemory's
  *          internal buffer. It has enough space as was given on construction and can only
  *          be used for a single execution pass at a time.
@@ -131,13 +747,8 @@ ggml_execution_memory_create_context (GGMLExecutionMemory *execution_memory)
       return ggml_recorder_context_new ();
     }
 
-  size_t mem_size;
-  g_bytes_get_data (execution_memory->execution_buffer, &mem_size);
-
-  g_clear_pointer (&execution_memory->execution_buffer, g_bytes_unref);
-
-  execution_memory->execution_buffer = g_bytes_new_take (g_malloc (mem_size), mem_size);
-
+  /* The allocator itself is tiny, so we start over with a fresh
+   * one on the same buffer, which is the same as resetting it */
   return ggml_alloc_context_new (execution_memory->execution_buffer);
 }
 
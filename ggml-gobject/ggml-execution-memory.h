@@ -24,6 +24,7 @@
 
 #include <glib-object.h>
 #include <ggml-gobject/ggml-context.h>
+#include <ggml-gobject/ggml-key-value-page-pool.h>
 #include <ggml-gobject/ggml-model-desc.h>
 
 G_BEGIN_DECLS
@@ -35,13 +36,43 @@ typedef struct _GGMLExecutionMemory GGMLExecutionMemory;
 
 GGMLExecutionMemory * ggml_execution_memory_new (size_t      execution_memory_size,
                                                  GHashTable *key_value_memory);
+GGMLExecutionMemory * ggml_execution_memory_new_paged (size_t                execution_memory_size,
+                                                       GGMLKeyValuePagePool *key_value_page_pool);
 GGMLExecutionMemory * ggml_execution_memory_recorder_new (GGMLModelDescNode *memory_desc);
 
 GGMLExecutionMemory * ggml_execution_memory_ref (GGMLExecutionMemory *memory);
 void ggml_execution_memory_unref (GGMLExecutionMemory *memory);
 
 GHashTable * ggml_execution_memory_get_key_value_memory (GGMLExecutionMemory *execution_memory);
+GGMLKeyValuePagePool * ggml_execution_memory_get_key_value_page_pool (GGMLExecutionMemory *execution_memory);
+const int32_t * ggml_execution_memory_get_key_value_page_table (GGMLExecutionMemory *execution_memory,
+                                                                size_t              *out_n_pages);
+gboolean ggml_execution_memory_reserve_key_value_positions (GGMLExecutionMemory  *execution_memory,
+                                                            size_t                n_past,
+                                                            size_t                n_tokens,
+                                                            GError              **error);
+size_t ggml_execution_memory_get_key_value_positions_n_bytes (GGMLExecutionMemory *execution_memory,
+                                                              size_t               n_positions);
+GBytes * ggml_execution_memory_save_key_value_positions (GGMLExecutionMemory  *execution_memory,
+                                                         size_t                n_positions,
+                                                         GError              **error);
+gboolean ggml_execution_memory_restore_key_value_positions (GGMLExecutionMemory  *execution_memory,
+                                                            GBytes               *saved,
+                                                            size_t                n_saved_positions,
+                                                            size_t                n_positions,
+                                                            GError              **error);
+GGMLExecutionMemory * ggml_execution_memory_fork (GGMLExecutionMemory  *execution_memory,
+                                                  size_t                n_positions,
+                                                  GError              **error);
 GGMLContext * ggml_execution_memory_create_context (GGMLExecutionMemory *execution_memory);
+GBytes * ggml_execution_memory_get_work_buffer (GGMLExecutionMemory *execution_memory,
+                                                size_t               min_size);
+gboolean ggml_execution_memory_is_recorder (GGMLExecutionMemory *execution_memory);
+
+gpointer ggml_execution_memory_get_cached_graph (GGMLExecutionMemory *execution_memory);
+void ggml_execution_memory_set_cached_graph (GGMLExecutionMemory *execution_memory,
+                                             gpointer             cached_graph,
+                                             GDestroyNotify       cached_graph_destroy);
 
 G_DEFINE_AUTOPTR_CLEANUP_FUNC (GGMLExecutionMemory, ggml_execution_memory_unref)
 
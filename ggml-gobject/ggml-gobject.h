@@ -23,16 +23,20 @@
 #pragma once
 
 #include <ggml-gobject/ggml-cached-model.h>
+#include <ggml-gobject/ggml-compute-context.h>
 #include <ggml-gobject/ggml-compute-graph.h>
 #include <ggml-gobject/ggml-context.h>
+#include <ggml-gobject/ggml-detokenizer.h>
 #include <ggml-gobject/ggml-gpt.h>
 #include <ggml-gobject/ggml-hyperparameters.h>
+#include <ggml-gobject/ggml-key-value-page-pool.h>
 #include <ggml-gobject/ggml-language-model.h>
 #include <ggml-gobject/ggml-language-model-sampler.h>
 #include <ggml-gobject/ggml-top-k-top-p-language-model-sampler.h>
 #include <ggml-gobject/ggml-model-desc.h>
 #include <ggml-gobject/ggml-model.h>
 #include <ggml-gobject/ggml-ops.h>
+#include <ggml-gobject/ggml-prefix-cache.h>
 #include <ggml-gobject/ggml-quantize.h>
 #include <ggml-gobject/ggml-tensor.h>
 #include <ggml-gobject/ggml-token-dictionary.h>
@@ -22,27 +22,243 @@
 
 #include <ggml-gobject/ggml-quantize.h>
 #include <ggml-gobject/ggml-gpt.h>
+#include <ggml-gobject/internal/ggml-tensor-internal.h>
+#include <ggml-gobject/internal/ggml-token-dictionary-internal.h>
 #include <math.h>
 
-#define GPT_SPLIT_REGEX "('s|'t|'re|'ve|'m|'ll|'d| ?[[:alpha:]]+| ?[[:digit:]]+| ?[^\\s[:alpha:][:digit:]]+|\\s+(?!\\S)|\\s+)"
+typedef enum {
+  GGML_GPT_CHAR_CLASS_ALPHA,
+  GGML_GPT_CHAR_CLASS_DIGIT,
+  GGML_GPT_CHAR_CLASS_SPACE,
+  GGML_GPT_CHAR_CLASS_OTHER
+} GGMLGPTCharClass;
+
+/* Classifies the character at @offset the same way as GRegex does
+ * in UTF-8 mode, where [[:alpha:]] is any letter, [[:digit:]] is a
+ * decimal digit and \s is any separator, or \t, \n, \v, \f or \r.
+ * Bytes that are not valid UTF-8 are one character each. */
+static inline GGMLGPTCharClass
+ggml_gpt_classify_char (const char *string,
+                        size_t      length,
+                        size_t      offset,
+                        size_t     *out_char_len)
+{
+  guchar c = (guchar) string[offset];
+  gunichar uc;
+
+  if (c < 0x80)
+    {
+      *out_char_len = 1;
+
+      if (g_ascii_isalpha (c))
+        {
+          return GGML_GPT_CHAR_CLASS_ALPHA;
+        }
+      else if (g_ascii_isdigit (c))
+        {
+          return GGML_GPT_CHAR_CLASS_DIGIT;
+        }
+      else if (g_ascii_isspace (c))
+        {
+          return GGML_GPT_CHAR_CLASS_SPACE;
+        }
+
+      return GGML_GPT_CHAR_CLASS_OTHER;
+    }
+
+  uc = g_utf8_get_char_validated (&string[offset], length - offset);
+
+  if (uc == (gunichar) -1 || uc == (gunichar) -2)
+    {
+      *out_char_len = 1;
+      return GGML_GPT_CHAR_CLASS_OTHER;
+    }
+
+  *out_char_len = g_utf8_skip[c];
+
+  if (g_unichar_isalpha (uc))
+    {
+      return GGML_GPT_CHAR_CLASS_ALPHA;
+    }
+  else if (g_unichar_isdigit (uc))
+    {
+      return GGML_GPT_CHAR_CLASS_DIGIT;
+    }
+  else if (g_unichar_isspace (uc))
+    {
+      return GGML_GPT_CHAR_CLASS_SPACE;
+    }
+
+  return GGML_GPT_CHAR_CLASS_OTHER;
+}
+
+static inline size_t
+ggml_gpt_match_contraction (const char *string,
+                            size_t      length,
+                            size_t      offset)
+{
+  const char *contractions[] = { "s", "t", "re", "ve", "m", "ll", "d", NULL };
+
+  if (string[offset] != '\'')
+    {
+      return 0;
+    }
+
+  for (const char **contraction = contractions; *contraction != NULL; ++contraction)
+    {
+      size_t contraction_len = strlen (*contraction);
+
+      if (offset + 1 + contraction_len <= length &&
+          strncmp (&string[offset + 1], *contraction, contraction_len) == 0)
+        {
+          return contraction_len + 1;
+        }
+    }
+
+  return 0;
+}
+
+/**
+ * ggml_gpt_pre_tokenize_next_word:
+ * @string: (array length=length): A UTF-8 string
+ * @length: The length of @string in bytes
+ * @offset: The offset of the next word in @string
+ *
+ * Finds the length of the word starting at @offset in @string, splitting
+ * words the same way as the GPT-2 regex
+ * `'s|'t|'re|'ve|'m|'ll|'d| ?[[:alpha:]]+| ?[[:digit:]]+| ?[^\s[:alpha:][:digit:]]+|\s+(?!\S)|\s+`.
+ *
+ * The words cover the whole string, so the next word starts where
+ * this one ends. Nothing is copied or allocated.
+ *
+ * Returns: The length of the word in bytes, or zero if @offset is at
+ *          the end of @string.
+ */
+size_t
+ggml_gpt_pre_tokenize_next_word (const char *string,
+                                 size_t      length,
+                                 size_t      offset)
+{
+  size_t char_len;
+  size_t end;
+  size_t contraction_len;
+  GGMLGPTCharClass char_class;
+
+  if (offset >= length)
+    {
+      return 0;
+    }
+
+  contraction_len = ggml_gpt_match_contraction (string, length, offset);
+
+  if (contraction_len > 0)
+    {
+      return contraction_len;
+    }
+
+  char_class = ggml_gpt_classify_char (string, length, offset, &char_len);
+  end = offset + char_len;
+
+  /* A single space may lead a run of letters, digits or other characters */
+  if (string[offset] == ' ' && end < length)
+    {
+      size_t next_char_len;
+      GGMLGPTCharClass next_char_class = ggml_gpt_classify_char (string, length, end, &next_char_len);
+
+      if (next_char_class != GGML_GPT_CHAR_CLASS_SPACE)
+        {
+          char_class = next_char_class;
+          end += next_char_len;
+        }
+    }
+
+  while (end < length)
+    {
+      GGMLGPTCharClass next_char_class = ggml_gpt_classify_char (string, length, end, &char_len);
+
+      if (next_char_class != char_class)
+        {
+          break;
+        }
+
+      end += char_len;
+    }
+
+  /* A run of spaces followed by anything else leaves its last space
+   * to lead the next word, unless it is the only space in the run */
+  if (char_class == GGML_GPT_CHAR_CLASS_SPACE && end < length)
+    {
+      size_t last_char_offset = g_utf8_find_prev_char (&string[offset], &string[end]) - string;
 
-GPtrArray *
-ggml_iterate_words_in_regex (GRegex *regex, const char *string)
+      if (last_char_offset > offset)
+        {
+          end = last_char_offset;
+        }
+    }
+
+  return end - offset;
+}
+
+/* Splits @string into words first, then finds the corresponding tokens in
+ * the dictionary, taking the longest word in the dictionary each time and
+ * skipping bytes that start no word at all. A word always splits into the
+ * same tokens, so they are kept in the word cache of the dictionary. There
+ * are never more tokens than bytes, so @out_tokens must have space for
+ * @length tokens. */
+static size_t
+ggml_gpt_tokenize_into (GGMLTokenDictionary *token_dictionary,
+                        const char          *string,
+                        size_t               length,
+                        int32_t             *out_tokens)
 {
-  g_autoptr(GMatchInfo) match_info = NULL;
-  g_autoptr(GPtrArray) words_ptr_array = g_ptr_array_new_full (0, g_free);
-  g_regex_match (regex, string, 0, &match_info);
-  while (g_match_info_matches (match_info))
+  size_t n_tokens = 0;
+  size_t word_len;
+
+  for (size_t offset = 0; offset < length; offset += word_len)
     {
-      gchar *word = g_match_info_fetch (match_info, 0);
-      if (word != NULL)
+      const char *word = &string[offset];
+      size_t word_first_token = n_tokens;
+      size_t n_word_tokens;
+
+      word_len = ggml_gpt_pre_tokenize_next_word (string, length, offset);
+
+      if (ggml_token_dictionary_lookup_word_cache (token_dictionary,
+                                                   word,
+                                                   word_len,
+                                                   &out_tokens[n_tokens],
+                                                   &n_word_tokens))
         {
-          g_ptr_array_add (words_ptr_array, word);
+          n_tokens += n_word_tokens;
+          continue;
         }
-      g_match_info_next (match_info, NULL);
+
+      for (size_t word_start = 0; word_start < word_len;)
+        {
+          size_t token_len = 0;
+
+          if (ggml_token_dictionary_lookup_longest_prefix (token_dictionary,
+                                                           &word[word_start],
+                                                           word_len - word_start,
+                                                           &out_tokens[n_tokens],
+                                                           &token_len))
+            {
+              ++n_tokens;
+              word_start += token_len;
+            }
+          else
+            {
+              ++word_start;
+            }
+        }
+
+      ggml_token_dictionary_insert_word_cache (token_dictionary,
+                                               word,
+                                               word_len,
+                                               &out_tokens[word_first_token],
+                                               n_tokens - word_first_token);
     }
 
-  return g_steal_pointer (&words_ptr_array);
+  return n_tokens;
 }
 
 /**
@@ -62,67 +278,191 @@ ggml_gpt_tokenize (GGMLTokenDictionary *token_dictionary,
                    size_t  *out_size,
                    GError **error)
 {
-  /* Split first into words */
-  g_autoptr(GArray) tokens_array = NULL;
-  g_autoptr(GRegex) regex = NULL;
-  g_autoptr(GPtrArray) words_ptr_array = NULL;
+  size_t length = strlen (string);
+  g_autoptr(GArray) tokens_array = g_array_sized_new (FALSE,
+                                                      FALSE,
+                                                      sizeof (int32_t),
+                                                      length);
+
+  g_array_set_size (tokens_array, length);
+  g_array_set_size (tokens_array,
+                    ggml_gpt_tokenize_into (token_dictionary,
+                                            string,
+                                            length,
+                                            (int32_t *) tokens_array->data));
 
-  regex = g_regex_new (GPT_SPLIT_REGEX,
-                       0,
-                       0,
-                       error);
+  *out_tokens = g_array_steal (tokens_array, out_size);
+  return TRUE;
+}
 
-  if (regex == NULL)
+typedef struct _GGMLGPTTokenizeBatchChunk
+{
+  GGMLTokenDictionary *token_dictionary;
+  const char * const *strings;
+  const size_t *lengths;
+  size_t first_string;
+  size_t n_strings;
+  int32_t *tokens;
+  size_t *n_string_tokens;
+  size_t n_tokens;
+} GGMLGPTTokenizeBatchChunk;
+
+static void
+ggml_gpt_tokenize_batch_chunk (GGMLGPTTokenizeBatchChunk *chunk)
+{
+  chunk->n_tokens = 0;
+
+  for (size_t i = chunk->first_string; i < chunk->first_string + chunk->n_strings; ++i)
     {
-      return FALSE;
+      chunk->n_string_tokens[i] = ggml_gpt_tokenize_into (chunk->token_dictionary,
+                                                          chunk->strings[i],
+                                                          chunk->lengths[i],
+                                                          &chunk->tokens[chunk->n_tokens]);
+      chunk->n_tokens += chunk->n_string_tokens[i];
+    }
+}
+
+static void
+ggml_gpt_tokenize_batch_chunk_thread (gpointer data,
+                                      gpointer user_data)
+{
+  ggml_gpt_tokenize_batch_chunk (data);
+}
+
+/**
+ * ggml_gpt_tokenize_batch:
+ * @token_dictionary: A #GGMLTokenDictionary of tokens
+ * @strings: (array length=n_strings): The strings to tokenize
+ * @n_strings: The number of strings in @strings
+ * @n_threads: The number of threads to tokenize on, or 0 for one per processor
+ * @out_tokens: (out) (array length=out_n_tokens) (transfer full): The tokens of
+ *              all the strings, one after the other
+ * @out_offsets: (out) (transfer full): An array of @n_strings + 1 offsets into
+ *               @out_tokens, where the tokens of string i are between
+ *               offsets i and i + 1
+ * @out_n_tokens: (out): The total number of tokens
+ * @error: A #GError
+ *
+ * Tokenizes many strings at once, splitting them into chunks of about the
+ * same size that are tokenized in parallel. The tokens are packed into a
+ * single buffer.
+ *
+ * Returns: %TRUE with @out_tokens, @out_offsets and @out_n_tokens set on
+ *          success, %FALSE with @error set otherwise.
+ */
+gboolean
+ggml_gpt_tokenize_batch (GGMLTokenDictionary  *token_dictionary,
+                         const char * const   *strings,
+                         size_t                n_strings,
+                         size_t                n_threads,
+                         int32_t             **out_tokens,
+                         size_t              **out_offsets,
+                         size_t               *out_n_tokens,
+                         GError              **error)
+{
+  g_autofree size_t *lengths = g_new (size_t, n_strings);
+  g_autofree size_t *offsets = g_new (size_t, n_strings + 1);
+  g_autofree int32_t *tokens = NULL;
+  g_autofree GGMLGPTTokenizeBatchChunk *chunks = NULL;
+  size_t total_length = 0;
+  size_t n_chunks = 0;
+  size_t max_chunks;
+  size_t chunk_length;
+
+  if (n_threads == 0)
+    {
+      n_threads = g_get_num_processors ();
+    }
+
+  for (size_t i = 0; i < n_strings; ++i)
+    {
+      lengths[i] = strlen (strings[i]);
+      total_length += lengths[i];
     }
 
-  words_ptr_array = ggml_iterate_words_in_regex (regex, string);
+  /* Allocate for the worst case of one token per byte up front, then
+   * shrink the buffer once all the tokens are packed together */
+  tokens = g_new (int32_t, total_length);
 
-  /* Now we have to find corresponding tokens in the dictionary */
-  tokens_array = g_array_sized_new (FALSE,
-                                    TRUE,
-                                    sizeof (int32_t),
-                                    words_ptr_array->len);
+  /* Split into a few more chunks than threads, so that the
+   * threads are still kept busy if some strings are slower */
+  max_chunks = MAX (MIN (n_threads * 4, n_strings), 1);
+  chunks = g_new0 (GGMLGPTTokenizeBatchChunk, max_chunks);
+  chunk_length = total_length / max_chunks + 1;
 
-  for (size_t i = 0; i < words_ptr_array->len; ++i)
+  for (size_t i = 0, chunk_start = 0, chunk_bytes = 0, tokens_offset = 0; i < n_strings; ++i)
     {
-      const char *word = words_ptr_array->pdata[i];
-      size_t word_len = strlen(word);
+      chunk_bytes += lengths[i];
 
-      for (size_t word_start = 0; word_start < word_len;)
+      if (chunk_bytes >= chunk_length || i == n_strings - 1)
         {
-          for (size_t word_end = word_len - 1;
-               word_end >= word_start;
-               --word_end)
-            {
-              /* Can't use autofree here because we're in a loop */
-              char *candidate = g_strndup (&word[word_start],
-                                           word_end - word_start + 1);
-              int32_t token = 0;
-
-              if (ggml_token_dictionary_lookup_extended (token_dictionary,
-                                                         candidate,
-                                                         &token))
-                {
-                  g_array_append_vals (tokens_array, &token, 1);
-                  word_start = word_end + 1;
-                  g_free (candidate);
-                  break;
-                }
-              else if (word_end == word_start)
-                {
-                  ++word_start;
-                  g_free (candidate);
-                  break;
-                }
-
-              g_free (candidate);
-            }
+          GGMLGPTTokenizeBatchChunk *chunk = &chunks[n_chunks++];
+
+          chunk->token_dictionary = token_dictionary;
+          chunk->strings = strings;
+          chunk->lengths = lengths;
+          chunk->first_string = chunk_start;
+          chunk->n_strings = i + 1 - chunk_start;
+          chunk->tokens = &tokens[tokens_offset];
+          chunk->n_string_tokens = &offsets[1];
+
+          tokens_offset += chunk_bytes;
+          chunk_start = i + 1;
+          chunk_bytes = 0;
         }
     }
 
-  *out_tokens = g_array_steal (tokens_array, out_size);
+  if (n_threads > 1 && n_chunks > 1)
+    {
+      GThreadPool *pool = g_thread_pool_new (ggml_gpt_tokenize_batch_chunk_thread,
+                                             NULL,
+                                             n_threads,
+                                             FALSE,
+                                             error);
+
+      if (pool == NULL)
+        {
+          return FALSE;
+        }
+
+      for (size_t i = 0; i < n_chunks; ++i)
+        {
+          g_thread_pool_push (pool, &chunks[i], NULL);
+        }
+
+      /* Waits for all the queued chunks to be tokenized */
+      g_thread_pool_free (pool, FALSE, TRUE);
+    }
+  else
+    {
+      for (size_t i = 0; i < n_chunks; ++i)
+        {
+          ggml_gpt_tokenize_batch_chunk (&chunks[i]);
+        }
+    }
+
+  /* Pack the tokens of each chunk after the previous one. Chunks only
+   * ever move back, so this can be done in place. */
+  offsets[0] = 0;
+
+  for (size_t i = 0; i < n_chunks; ++i)
+    {
+      GGMLGPTTokenizeBatchChunk *chunk = &chunks[i];
+
+      memmove (&tokens[offsets[chunk->first_string]],
+               chunk->tokens,
+               chunk->n_tokens * sizeof (int32_t));
+
+      for (size_t j = chunk->first_string; j < chunk->first_string + chunk->n_strings; ++j)
+        {
+          offsets[j + 1] += offsets[j];
+        }
+    }
+
+  *out_n_tokens = offsets[n_strings];
+  *out_tokens = g_renew (int32_t, g_steal_pointer (&tokens), *out_n_tokens);
+  *out_offsets = g_steal_pointer (&offsets);
+
   return TRUE;
 }
 
@@ -161,6 +501,167 @@ ggml_nn_layer_norm (GGMLContext *context,
   return g_steal_pointer (&elementwise_bias_output);
 }
 
+/* A run of new keys and values that go into consecutive
+ * rows of the key-value memory */
+typedef struct _GGMLGPTMemoryWriteRun
+{
+  int32_t token_offset;
+  int32_t row;
+  int32_t length;
+} GGMLGPTMemoryWriteRun;
+
+/* Where the tokens and keys of one sequence of a batch are */
+typedef struct _GGMLGPTBatchSequence
+{
+  int32_t n_past;
+  int32_t n_tokens;
+  int32_t token_offset;
+  int32_t n_keys;
+  int32_t key_offset;
+} GGMLGPTBatchSequence;
+
+/* Values may be stored transposed, with one row of positions
+ * for each channel and layer, see ggml_model_config_set_key_value_cache_transposed_values */
+static gboolean
+ggml_gpt_memory_v_is_transposed (GGMLTensor *memory_v)
+{
+  size_t n_dims;
+
+  ggml_tensor_get_shape (memory_v, &n_dims);
+
+  return n_dims == 2;
+}
+
+/* Where the values for @row of @layer start in the memory */
+static size_t
+ggml_gpt_memory_v_offset (GGMLTensor *memory_v,
+                          int32_t     n_embd,
+                          size_t      layer,
+                          int32_t     n_memory_positions,
+                          int32_t     row)
+{
+  if (ggml_gpt_memory_v_is_transposed (memory_v))
+    {
+      return n_embd * layer * n_memory_positions + row;
+    }
+
+  return n_embd * (layer * n_memory_positions + row);
+}
+
+/* Attends from the @n_tokens queries in @q_head over the first @n_keys
+ * positions of the memory for @current_layer. Returns the attention
+ * output with one row per token, permuted but not yet contiguous. */
+static GGMLTensor *
+ggml_gpt_attention (GGMLContext  *context,
+                    GGMLTensor   *q_head,
+                    size_t        current_layer,
+                    int32_t       n_embd,
+                    int32_t       nhead,
+                    int32_t       n_memory_positions,
+                    int32_t       n_past,
+                    int32_t       n_tokens,
+                    int32_t       n_keys,
+                    int32_t       memory_read_base_row,
+                    GGMLTensor   *memory_read_rows,
+                    GGMLTensor   *kq_scale,
+                    GGMLTensor   *memory_k,
+                    GGMLTensor   *memory_v,
+                    GGMLTensor  **out_kq_mask)
+{
+  const gboolean memory_v_transposed = ggml_gpt_memory_v_is_transposed (memory_v);
+  g_autoptr(GGMLTensor) q_head_contiguous_blank = ggml_context_new_tensor_3d (context, GGML_DATA_TYPE_F32, n_embd / nhead, nhead, n_tokens);
+  g_autoptr(GGMLTensor) q_head_contiguous = ggml_op_cpy (context, q_head, q_head_contiguous_blank);
+  g_autoptr(GGMLTensor) permuted_q_head = ggml_op_permute (context, q_head_contiguous, 0, 2, 1, 3);
+
+  /* We attend over n_keys positions of the memory, which may be a few more
+   * than n_past + n_tokens. The extra positions are masked out below, which
+   * means that the graph stays valid for the next few values of n_past.
+   *
+   * If the positions are in consecutive rows, then we can view them directly,
+   * otherwise they have to be gathered from their pages first. Gathering
+   * converts them to F32, viewing keeps the type of the memory, which the
+   * matrix multiplications below can use directly.
+   *
+   * Quantized values are always gathered, since they cannot be transposed
+   * in their stored type. In that case, memory_read_rows is set even if
+   * the positions are in consecutive rows. */
+  size_t memory_layer_offset = n_embd * current_layer * n_memory_positions;
+  g_autoptr(GGMLTensor) memory_all_k = NULL;
+
+  if (memory_read_base_row >= 0)
+    {
+      size_t memory_offset = memory_layer_offset + n_embd * memory_read_base_row;
+
+      memory_all_k = ggml_op_view_1d (context, memory_k, n_keys * n_embd, memory_offset);
+    }
+  else
+    {
+      g_autoptr(GGMLTensor) memory_layer_k = ggml_op_view_2d (context, memory_k, n_embd, n_memory_positions, memory_layer_offset);
+
+      memory_all_k = ggml_op_get_rows (context, memory_layer_k, memory_read_rows);
+    }
+
+  g_autoptr(GGMLTensor) reshaped_per_head_memory_k = ggml_op_reshape_3d (context, memory_all_k, n_embd / nhead, nhead, n_keys);
+  g_autoptr(GGMLTensor) permuted_per_head_memory_k = ggml_op_permute (context, reshaped_per_head_memory_k, 0, 2, 1, 3);
+
+  /* The values need to be in (position, channel, head) order for the second
+   * multiplication. Transposed values already are, so they can be viewed per
+   * head without copying. They are only stored without paging, so the
+   * positions always start at the first row. Otherwise, all the values
+   * have to be transposed into a new tensor. */
+  g_autoptr(GGMLTensor) per_head_memory_v = NULL;
+
+  if (memory_v_transposed)
+    {
+      per_head_memory_v = ggml_op_view_3d (context,
+                                           memory_v,
+                                           n_keys,
+                                           n_embd / nhead,
+                                           nhead,
+                                           n_memory_positions,
+                                           (n_embd / nhead) * n_memory_positions,
+                                           memory_layer_offset);
+    }
+  else
+    {
+      g_autoptr(GGMLTensor) memory_all_v = NULL;
+
+      if (memory_read_base_row >= 0 && ggml_tensor_block_size (memory_v) == 1)
+        {
+          size_t memory_offset = memory_layer_offset + n_embd * memory_read_base_row;
+
+          memory_all_v = ggml_op_view_1d (context, memory_v, n_keys * n_embd, memory_offset);
+        }
+      else
+        {
+          g_autoptr(GGMLTensor) memory_layer_v = ggml_op_view_2d (context, memory_v, n_embd, n_memory_positions, memory_layer_offset);
+
+          memory_all_v = ggml_op_get_rows (context, memory_layer_v, memory_read_rows);
+        }
+
+      g_autoptr(GGMLTensor) reshaped_per_head_memory_v = ggml_op_reshape_3d (context, memory_all_v, n_embd / nhead, nhead, n_keys);
+      g_autoptr(GGMLTensor) permuted_per_head_memory_v = ggml_op_permute (context, reshaped_per_head_memory_v, 1, 2, 0, 3);
+      g_autoptr(GGMLTensor) permuted_per_head_memory_v_contiguous_blank = ggml_context_new_tensor_3d(context, ggml_tensor_get_data_type (memory_all_v), n_keys, n_embd / nhead, nhead);
+
+      per_head_memory_v = ggml_op_cpy (context, permuted_per_head_memory_v, permuted_per_head_memory_v_contiguous_blank);
+    }
+
+  /* After all that permutation, we can compute the attention matrix */
+  g_autoptr(GGMLTensor) kq = ggml_op_mul_mat (context, permuted_per_head_memory_k, permuted_q_head);
+  g_autoptr(GGMLTensor) kq_scaled = ggml_op_scale_inplace (context, kq, kq_scale);
+  g_autoptr(GGMLTensor) kq_masked = ggml_op_diag_mask_inf (context, kq_scaled, n_past);
+
+  g_autoptr(GGMLTensor) kq_softmax = ggml_op_soft_max (context, kq_masked);
+
+  *out_kq_mask = ggml_tensor_ref (kq_masked);
+
+  /* Now that we have the attention matrix, compute A(KQ)V */
+  g_autoptr(GGMLTensor) kqv = ggml_op_mul_mat (context, per_head_memory_v, kq_softmax);
+  g_autoptr(GGMLTensor) kqv_permute = ggml_op_permute (context, kqv, 0, 2, 1, 3);
+
+  return g_steal_pointer (&kqv_permute);
+}
+
 GGMLTensor *
 ggml_nn_causal_mha_ar_layer (GGMLContext *context,
                              GGMLTensor  *input,
@@ -171,67 +672,135 @@ ggml_nn_causal_mha_ar_layer (GGMLContext *context,
                              size_t       current_layer,
                              int32_t      n_embd,
                              int32_t      nhead,
-                             int32_t      n_ctx,
+                             int32_t      n_memory_positions,
                              int32_t      n_past,
                              int32_t      n_tokens,
+                             int32_t      n_keys,
+                             GArray      *memory_write_runs,
+                             int32_t      memory_read_base_row,
+                             GGMLTensor  *memory_read_rows,
+                             GGMLTensor  *kq_scale,
+                             GArray      *sequences,
                              GGMLTensor  *memory_k,
                              GGMLTensor  *memory_v,
-                             GGMLTensor **out_mem_k,
-                             GGMLTensor **out_mem_v)
+                             GPtrArray   *out_memory_writes,
+                             GPtrArray   *out_attention_writes,
+                             GPtrArray   *out_kq_masks)
 {
   g_autoptr(GGMLTensor) proj_qkv_output = ggml_nn_linear_layer (context,
                                                                 input,
                                                                 in_attn_w,
                                                                 in_attn_b);
+  const gboolean memory_v_transposed = ggml_gpt_memory_v_is_transposed (memory_v);
 
   /* Chop into query, key and value head */
   g_autoptr(GGMLTensor) q_head = ggml_op_view_2d (context, proj_qkv_output, n_embd, n_tokens, 0 * n_embd);
-  g_autoptr(GGMLTensor) k_head = ggml_op_view_2d (context, proj_qkv_output, n_embd, n_tokens, 1 * n_embd);
-  g_autoptr(GGMLTensor) v_head = ggml_op_view_2d (context, proj_qkv_output, n_embd, n_tokens, 2 * n_embd);
 
   /* store into the memory tensor
    *
    * This is an optimization - basically we store the current computed keys and
    * values into a leaf-node memory and fetch from it on later iterations. This
    * means that we don't have to re-compute all the keys and values for every token
-   * on each iteration, only the keys and values for the most recent token
-   */
-  g_autoptr(GGMLTensor) memory_view_cur_k = ggml_op_view_1d (context, memory_k, n_tokens * n_embd, n_embd * (current_layer * n_ctx + n_past));
-  g_autoptr(GGMLTensor) memory_view_cur_v = ggml_op_view_1d (context, memory_v, n_tokens * n_embd, n_embd * (current_layer * n_ctx + n_past));
+   * on each iteration, only the keys and values for the most recent token.
+   *
+   * If the memory is paged, the new keys and values may be spread over several
+   * pages, so there is one copy for each run of consecutive rows. The copy
+   * nodes are stored in out_memory_writes, keys first. The copies also convert
+   * the keys and values to the type of the memory, which may be F16 or Q8_0. */
+  for (size_t i = 0; i < memory_write_runs->len; ++i)
+    {
+      GGMLGPTMemoryWriteRun *run = &g_array_index (memory_write_runs, GGMLGPTMemoryWriteRun, i);
+      size_t memory_offset = n_embd * (current_layer * n_memory_positions + run->row);
 
-  /* Copy current key/value into the memory at the offset
-   * and store the compute node in out_mem_k, out_mem_v */
-  *out_mem_k = ggml_op_cpy (context, k_head, memory_view_cur_k);
-  *out_mem_v = ggml_op_cpy (context, v_head, memory_view_cur_v);
+      g_autoptr(GGMLTensor) k_head_run = ggml_op_view_2d (context, proj_qkv_output, n_embd, run->length, (3 * run->token_offset + 1) * n_embd);
+      g_autoptr(GGMLTensor) v_head_run = ggml_op_view_2d (context, proj_qkv_output, n_embd, run->length, (3 * run->token_offset + 2) * n_embd);
+      g_autoptr(GGMLTensor) memory_view_run_k = ggml_op_view_1d (context, memory_k, run->length * n_embd, memory_offset);
 
-  /* Now we continue with our computation */
-  g_autoptr(GGMLTensor) q_head_contiguous_blank = ggml_context_new_tensor_3d (context, GGML_DATA_TYPE_F32, n_embd / nhead, nhead, n_tokens);
-  g_autoptr(GGMLTensor) q_head_contiguous = ggml_op_cpy (context, q_head, q_head_contiguous_blank);
-  g_autoptr(GGMLTensor) permuted_q_head = ggml_op_permute (context, q_head_contiguous, 0, 2, 1, 3);
+      g_ptr_array_add (out_memory_writes, ggml_op_cpy (context, k_head_run, memory_view_run_k));
 
-  g_autoptr(GGMLTensor) memory_view_all_k = ggml_op_view_1d (context, memory_k, (n_past + n_tokens) * n_embd, current_layer * n_ctx * n_embd);
-  g_autoptr(GGMLTensor) memory_view_all_v = ggml_op_view_1d (context, memory_v, (n_past + n_tokens) * n_embd, current_layer * n_ctx * n_embd);
+      /* Transposed values go into the same columns of n_embd rows */
+      if (memory_v_transposed)
+        {
+          size_t memory_v_offset = ggml_gpt_memory_v_offset (memory_v, n_embd, current_layer, n_memory_positions, run->row);
+          g_autoptr(GGMLTensor) v_head_run_transposed = ggml_op_transpose (context, v_head_run);
+          g_autoptr(GGMLTensor) memory_view_run_v = ggml_op_view_2d (context, memory_v, run->length, n_embd, memory_v_offset);
 
-  g_autoptr(GGMLTensor) reshaped_per_head_memory_k = ggml_op_reshape_3d (context, memory_view_all_k, n_embd / nhead, nhead, n_tokens + n_past);
-  g_autoptr(GGMLTensor) permuted_per_head_memory_k = ggml_op_permute (context, reshaped_per_head_memory_k, 0, 2, 1, 3);
+          g_ptr_array_add (out_memory_writes, ggml_op_cpy (context, v_head_run_transposed, memory_view_run_v));
+        }
+      else
+        {
+          g_autoptr(GGMLTensor) memory_view_run_v = ggml_op_view_1d (context, memory_v, run->length * n_embd, memory_offset);
 
-  g_autoptr(GGMLTensor) reshaped_per_head_memory_v = ggml_op_reshape_3d (context, memory_view_all_v, n_embd / nhead, nhead, n_tokens + n_past);
-  g_autoptr(GGMLTensor) permuted_per_head_memory_v = ggml_op_permute (context, reshaped_per_head_memory_v, 1, 2, 0, 3);
-  g_autoptr(GGMLTensor) permuted_per_head_memory_v_contiguous_blank = ggml_context_new_tensor_3d(context, GGML_DATA_TYPE_F32, n_tokens + n_past, n_embd / nhead, nhead);
-  g_autoptr(GGMLTensor) permuted_per_head_memory_v_contiguous = ggml_op_cpy (context, permuted_per_head_memory_v, permuted_per_head_memory_v_contiguous_blank);
+          g_ptr_array_add (out_memory_writes, ggml_op_cpy (context, v_head_run, memory_view_run_v));
+        }
+    }
 
-  /* After all that permutation, we can compute the attention matrix */
-  g_autoptr(GGMLTensor) kq = ggml_op_mul_mat (context, permuted_per_head_memory_k, permuted_q_head);
-  g_autoptr(GGMLTensor) scale_factor = ggml_context_new_scalar_f32 (context, 1.0 / sqrt (n_embd / nhead));
-  g_autoptr(GGMLTensor) kq_scaled = ggml_op_scale_inplace (context, kq, scale_factor);
-  g_autoptr(GGMLTensor) kq_masked = ggml_op_diag_mask_inf (context, kq_scaled, n_past);
-  g_autoptr(GGMLTensor) kq_softmax = ggml_op_soft_max (context, kq_masked);
+  g_autoptr(GGMLTensor) kqv_contiguous_blank = ggml_context_new_tensor_2d (context, GGML_DATA_TYPE_F32, n_embd, n_tokens);
+  g_autoptr(GGMLTensor) kqv_contiguous = NULL;
 
-  /* Now that we have the attention matrix, compute A(KQ)V */
-  g_autoptr(GGMLTensor) kqv = ggml_op_mul_mat (context, permuted_per_head_memory_v_contiguous, kq_softmax);
-  g_autoptr(GGMLTensor) kqv_permute = ggml_op_permute (context, kqv, 0, 2, 1, 3);
-  g_autoptr(GGMLTensor) kqv_permute_blank = ggml_context_new_tensor_2d (context, GGML_DATA_TYPE_F32, n_embd, n_tokens);
-  g_autoptr(GGMLTensor) kqv_contiguous = ggml_op_cpy (context, kqv_permute, kqv_permute_blank);
+  /* When several sequences are run at once, each of them only attends over
+   * its own keys, so the work grows with the keys of each sequence and not
+   * with all the keys in the batch. The outputs of the sequences are copied
+   * next to each other. Nothing depends on those copies in the graph, so
+   * they are stored in out_attention_writes and have to be added to the
+   * graph before the output projection. */
+  if (sequences != NULL)
+    {
+      for (size_t i = 0; i < sequences->len; ++i)
+        {
+          GGMLGPTBatchSequence *sequence = &g_array_index (sequences, GGMLGPTBatchSequence, i);
+          GGMLTensor *kq_mask = NULL;
+          g_autoptr(GGMLTensor) sequence_q_head = ggml_op_view_2d (context, proj_qkv_output, n_embd, sequence->n_tokens, 3 * sequence->token_offset * n_embd);
+          g_autoptr(GGMLTensor) sequence_memory_read_rows = ggml_op_view_1d (context, memory_read_rows, sequence->n_keys, sequence->key_offset);
+          g_autoptr(GGMLTensor) sequence_kqv_permute = ggml_gpt_attention (context,
+                                                                           sequence_q_head,
+                                                                           current_layer,
+                                                                           n_embd,
+                                                                           nhead,
+                                                                           n_memory_positions,
+                                                                           sequence->n_past,
+                                                                           sequence->n_tokens,
+                                                                           sequence->n_keys,
+                                                                           -1,
+                                                                           sequence_memory_read_rows,
+                                                                           kq_scale,
+                                                                           memory_k,
+                                                                           memory_v,
+                                                                           &kq_mask);
+          g_autoptr(GGMLTensor) kqv_contiguous_view = ggml_op_view_2d (context,
+                                                                       kqv_contiguous_blank,
+                                                                       n_embd,
+                                                                       sequence->n_tokens,
+                                                                       sequence->token_offset * n_embd);
+
+          g_ptr_array_add (out_attention_writes, ggml_op_cpy (context, sequence_kqv_permute, kqv_contiguous_view));
+          g_ptr_array_add (out_kq_masks, kq_mask);
+        }
+
+      kqv_contiguous = g_steal_pointer (&kqv_contiguous_blank);
+    }
+  else
+    {
+      GGMLTensor *kq_mask = NULL;
+      g_autoptr(GGMLTensor) kqv_permute = ggml_gpt_attention (context,
+                                                              q_head,
+                                                              current_layer,
+                                                              n_embd,
+                                                              nhead,
+                                                              n_memory_positions,
+                                                              n_past,
+                                                              n_tokens,
+                                                              n_keys,
+                                                              memory_read_base_row,
+                                                              memory_read_rows,
+                                                              kq_scale,
+                                                              memory_k,
+                                                              memory_v,
+                                                              &kq_mask);
+
+      kqv_contiguous = ggml_op_cpy (context, kqv_permute, kqv_contiguous_blank);
+      g_ptr_array_add (out_kq_masks, kq_mask);
+    }
 
   /* Project into output space */
   g_autoptr(GGMLTensor) output = ggml_nn_linear_layer (context, kqv_contiguous, out_attn_w, out_attn_b);
@@ -239,6 +808,40 @@ ggml_nn_causal_mha_ar_layer (GGMLContext *context,
   return g_steal_pointer (&output);
 }
 
+typedef enum {
+  GGML_GPT_LAYER_WEIGHT_LN_1_G,
+  GGML_GPT_LAYER_WEIGHT_LN_1_B,
+  GGML_GPT_LAYER_WEIGHT_ATTN_C_ATTN_W,
+  GGML_GPT_LAYER_WEIGHT_ATTN_C_ATTN_B,
+  GGML_GPT_LAYER_WEIGHT_ATTN_C_PROJ_W,
+  GGML_GPT_LAYER_WEIGHT_ATTN_C_PROJ_B,
+  GGML_GPT_LAYER_WEIGHT_LN_2_G,
+  GGML_GPT_LAYER_WEIGHT_LN_2_B,
+  GGML_GPT_LAYER_WEIGHT_MLP_C_FC_W,
+  GGML_GPT_LAYER_WEIGHT_MLP_C_FC_B,
+  GGML_GPT_LAYER_WEIGHT_MLP_C_PROJ_W,
+  GGML_GPT_LAYER_WEIGHT_MLP_C_PROJ_B,
+  GGML_GPT_LAYER_WEIGHT_N_SLOTS
+} GGMLGPTLayerWeightSlot;
+
+/* Must be in the same order as GGMLGPTLayerWeightSlot */
+static const char *ggml_gpt_layer_weight_slot_names[] = {
+  "ln_1/g",
+  "ln_1/b",
+  "attn/c_attn/w",
+  "attn/c_attn/b",
+  "attn/c_proj/w",
+  "attn/c_proj/b",
+  "ln_2/g",
+  "ln_2/b",
+  "mlp/c_fc/w",
+  "mlp/c_fc/b",
+  "mlp/c_proj/w",
+  "mlp/c_proj/b"
+};
+
+G_STATIC_ASSERT (G_N_ELEMENTS (ggml_gpt_layer_weight_slot_names) == GGML_GPT_LAYER_WEIGHT_N_SLOTS);
+
 GGMLTensor *
 ggml_nn_decoder_ar_layer (GGMLContext  *context,
                           GGMLModel    *model,
@@ -246,67 +849,69 @@ ggml_nn_decoder_ar_layer (GGMLContext  *context,
                           size_t        i,
                           int32_t       n_embd,
                           int32_t       nhead,
-                          int32_t       n_ctx,
+                          int32_t       n_memory_positions,
                           int32_t       n_past,
                           int32_t       n_tokens,
-                          GGMLTensor  *memory_k,
-                          GGMLTensor  *memory_v,
-                          GGMLTensor **out_mem_k,
-                          GGMLTensor **out_mem_v)
+                          int32_t       n_keys,
+                          GArray       *memory_write_runs,
+                          int32_t       memory_read_base_row,
+                          GGMLTensor   *memory_read_rows,
+                          GGMLTensor   *kq_scale,
+                          GArray       *sequences,
+                          GGMLTensor   *memory_k,
+                          GGMLTensor   *memory_v,
+                          GPtrArray    *out_memory_writes,
+                          GPtrArray    *out_attention_writes,
+                          GPtrArray    *out_kq_masks)
 {
   GGMLTensor *residual = input;
-  g_autofree char *first_ln_g_key = g_strdup_printf ("model/h%zu/ln_1/g", i);
-  g_autofree char *first_ln_b_key = g_strdup_printf ("model/h%zu/ln_1/b", i);
   g_autoptr(GGMLTensor) first_ln_output = ggml_nn_layer_norm (context,
                                                               input,
-                                                              ggml_model_get (model, first_ln_g_key),
-                                                              ggml_model_get (model, first_ln_b_key));
+                                                              ggml_model_get_layer_weight (model, i, GGML_GPT_LAYER_WEIGHT_LN_1_G),
+                                                              ggml_model_get_layer_weight (model, i, GGML_GPT_LAYER_WEIGHT_LN_1_B));
 
-  g_autofree char *in_attn_w_key = g_strdup_printf ("model/h%zu/attn/c_attn/w", i);
-  g_autofree char *in_attn_b_key = g_strdup_printf ("model/h%zu/attn/c_attn/b", i);
-  g_autofree char *out_attn_w_key = g_strdup_printf ("model/h%zu/attn/c_proj/w", i);
-  g_autofree char *out_attn_b_key = g_strdup_printf ("model/h%zu/attn/c_proj/b", i);
   g_autoptr(GGMLTensor) attn_output = ggml_nn_causal_mha_ar_layer (context,
                                                                    first_ln_output,
-                                                                   ggml_model_get (model, in_attn_w_key),
-                                                                   ggml_model_get (model, in_attn_b_key),
-                                                                   ggml_model_get (model, out_attn_w_key),
-                                                                   ggml_model_get (model, out_attn_b_key),
+                                                                   ggml_model_get_layer_weight (model, i, GGML_GPT_LAYER_WEIGHT_ATTN_C_ATTN_W),
+                                                                   ggml_model_get_layer_weight (model, i, GGML_GPT_LAYER_WEIGHT_ATTN_C_ATTN_B),
+                                                                   ggml_model_get_layer_weight (model, i, GGML_GPT_LAYER_WEIGHT_ATTN_C_PROJ_W),
+                                                                   ggml_model_get_layer_weight (model, i, GGML_GPT_LAYER_WEIGHT_ATTN_C_PROJ_B),
                                                                    i,
                                                                    n_embd,
                                                                    nhead,
-                                                                   n_ctx,
+                                                                   n_memory_positions,
                                                                    n_past,
                                                                    n_tokens,
+                                                                   n_keys,
+                                                                   memory_write_runs,
+                                                                   memory_read_base_row,
+                                                                   memory_read_rows,
+                                                                   kq_scale,
+                                                                   sequences,
                                                                    memory_k,
                                                                    memory_v,
-                                                                   out_mem_k,
-                                                                   out_mem_v);
+                                                                   out_memory_writes,
+                                                                   out_attention_writes,
+                                                                   out_kq_masks);
 
   g_autoptr(GGMLTensor) attn_output_residual = ggml_op_add (context, attn_output, residual);
   GGMLTensor *residual_ff = attn_output_residual;
 
-  g_autofree char *second_ln_g_key = g_strdup_printf ("model/h%zu/ln_2/g", i);
-  g_autofree char *second_ln_b_key = g_strdup_printf ("model/h%zu/ln_2/b", i);
   g_autoptr(GGMLTensor) second_ln_output = ggml_nn_layer_norm (context,
                                                                attn_output_residual,
-                                                               ggml_model_get (model, second_ln_g_key),
-                                                               ggml_model_get (model, second_ln_b_key));
+                                                               ggml_model_get_layer_weight (model, i, GGML_GPT_LAYER_WEIGHT_LN_2_G),
+                                                               ggml_model_get_layer_weight (model, i, GGML_GPT_LAYER_WEIGHT_LN_2_B));
 
-  g_autofree char *mlp_proj_up_w_key = g_strdup_printf ("model/h%zu/mlp/c_fc/w", i);
-  g_autofree char *mlp_proj_up_b_key = g_strdup_printf ("model/h%zu/mlp/c_fc/b", i);
   g_autoptr(GGMLTensor) mlp_proj_up_output = ggml_nn_linear_layer (context,
                                                                    second_ln_output,
-                                                                   ggml_model_get (model, mlp_proj_up_w_key),
-                                                                   ggml_model_get (model, mlp_proj_up_b_key));
+                                                                   ggml_model_get_layer_weight (model, i, GGML_GPT_LAYER_WEIGHT_MLP_C_FC_W),
+                                                                   ggml_model_get_layer_weight (model, i, GGML_GPT_LAYER_WEIGHT_MLP_C_FC_B));
   g_autoptr(GGMLTensor) mlp_gelu_output = ggml_op_gelu (context, mlp_proj_up_output);
 
-  g_autofree char *mlp_proj_down_w_key = g_strdup_printf ("model/h%zu/mlp/c_proj/w", i);
-  g_autofree char *mlp_proj_down_b_key = g_strdup_printf ("model/h%zu/mlp/c_proj/b", i);
   g_autoptr(GGMLTensor) mlp_proj_down_output = ggml_nn_linear_layer (context,
                                                                      mlp_gelu_output,
-                                                                     ggml_model_get (model, mlp_proj_down_w_key),
-                                                                     ggml_model_get (model, mlp_proj_down_b_key));
+                                                                     ggml_model_get_layer_weight (model, i, GGML_GPT_LAYER_WEIGHT_MLP_C_PROJ_W),
+                                                                     ggml_model_get_layer_weight (model, i, GGML_GPT_LAYER_WEIGHT_MLP_C_PROJ_B));
 
   g_autoptr(GGMLTensor) mlp_residual_output = ggml_op_add (context, mlp_proj_down_output, residual_ff);
 
@@ -394,7 +999,9 @@ ggml_create_gpt2_model_desc (int32_t n_vocab,
 
   int64_t wte_size[] = { d_model, n_vocab };
   g_autoptr(GGMLModelDescNode) wte_node = ggml_model_desc_node_new_leaf (wte_size, 2, GGML_DATA_TYPE_F16);
-  g_autoptr(GGMLModelDescNode) lm_head_node = ggml_model_desc_node_new_leaf (wte_size, 2, GGML_DATA_TYPE_F16);
+  /* Some GPT-2 checkpoints don't have a separate lm_head, in which
+   * case it uses the same weights as the token embedding */
+  g_autoptr(GGMLModelDescNode) lm_head_node = ggml_model_desc_node_new_tied_leaf (wte_size, 2, GGML_DATA_TYPE_F16, "model/wte");
 
   int64_t wpe_size[] = { d_model, n_ctx };
   g_autoptr(GGMLModelDescNode) wpe_node = ggml_model_desc_node_new_leaf (wpe_size, 2, GGML_DATA_TYPE_F32);
@@ -430,9 +1037,11 @@ ggml_create_gpt2_memory_desc (int32_t d_model,
                               int32_t n_layer,
                               int32_t n_ctx)
 {
-  int64_t memory_size[] = { n_layer * n_ctx * d_model };
-  g_autoptr(GGMLModelDescNode) memory_k_node = ggml_model_desc_node_new_leaf (memory_size, 1, GGML_DATA_TYPE_F32);
-  g_autoptr(GGMLModelDescNode) memory_v_node = ggml_model_desc_node_new_leaf (memory_size, 1, GGML_DATA_TYPE_F32);
+  /* One row per position and layer, so that the memory can also
+   * be split into pages by a GGMLKeyValuePagePool */
+  int64_t memory_size[] = { d_model, n_ctx, n_layer };
+  g_autoptr(GGMLModelDescNode) memory_k_node = ggml_model_desc_node_new_leaf (memory_size, 3, GGML_DATA_TYPE_F32);
+  g_autoptr(GGMLModelDescNode) memory_v_node = ggml_model_desc_node_new_leaf (memory_size, 3, GGML_DATA_TYPE_F32);
   g_autoptr(GHashTable) memory_parameters = g_hash_table_new_full (g_str_hash,
                                                                    g_str_equal,
                                                                    g_free,
@@ -513,13 +1122,634 @@ arange_int32 (int32_t start, int32_t stop)
   return array;
 }
 
+/* Graphs attend over the key-value memory in multiples of this many
+ * positions, so that one graph can be re-used for that many decoding
+ * steps, with only the inputs and the memory offsets changing. */
+#define GGML_GPT_N_KEYS_BUCKET_SIZE 32
+
+static int32_t
+ggml_gpt_n_keys_for_pass (int32_t n_past,
+                          int32_t n_tokens,
+                          int32_t n_ctx)
+{
+  int32_t n_keys = ((n_past + n_tokens + GGML_GPT_N_KEYS_BUCKET_SIZE - 1) /
+                    GGML_GPT_N_KEYS_BUCKET_SIZE) * GGML_GPT_N_KEYS_BUCKET_SIZE;
+
+  return MAX (MIN (n_keys, n_ctx), n_past + n_tokens);
+}
+
+/* The row within each layer of the key-value memory that holds
+ * @position. Memory without a page table is a single page. */
+static int32_t
+ggml_gpt_memory_row_for_position (const int32_t *page_table,
+                                  size_t         n_pages,
+                                  int32_t        page_size,
+                                  int32_t        position)
+{
+  size_t page_index = position / page_size;
+
+  /* Positions past the end of the page table are only
+   * ever read and masked out, so any row will do */
+  if (page_index >= n_pages)
+    {
+      return page_table[0] * page_size;
+    }
+
+  return page_table[page_index] * page_size + position % page_size;
+}
+
+static GArray *
+ggml_gpt_memory_write_runs (const int32_t *page_table,
+                            size_t         n_pages,
+                            int32_t        page_size,
+                            int32_t        n_past,
+                            int32_t        n_tokens)
+{
+  g_autoptr(GArray) runs = g_array_new (FALSE, TRUE, sizeof (GGMLGPTMemoryWriteRun));
+
+  for (int32_t position = n_past; position < n_past + n_tokens;)
+    {
+      int32_t length = MIN (page_size - position % page_size, n_past + n_tokens - position);
+      int32_t row = ggml_gpt_memory_row_for_position (page_table, n_pages, page_size, position);
+      GGMLGPTMemoryWriteRun *last_run = runs->len > 0 ? &g_array_index (runs, GGMLGPTMemoryWriteRun, runs->len - 1) : NULL;
+
+      /* Pages that are next to each other can be written in one go */
+      if (last_run != NULL && last_run->row + last_run->length == row)
+        {
+          last_run->length += length;
+        }
+      else
+        {
+          GGMLGPTMemoryWriteRun run = { position - n_past, row, length };
+          g_array_append_val (runs, run);
+        }
+
+      position += length;
+    }
+
+  return g_steal_pointer (&runs);
+}
+
+static gboolean
+ggml_gpt_memory_write_runs_have_same_shape (GArray *runs,
+                                            GArray *other_runs)
+{
+  if (runs->len != other_runs->len)
+    {
+      return FALSE;
+    }
+
+  for (size_t i = 0; i < runs->len; ++i)
+    {
+      GGMLGPTMemoryWriteRun *run = &g_array_index (runs, GGMLGPTMemoryWriteRun, i);
+      GGMLGPTMemoryWriteRun *other_run = &g_array_index (other_runs, GGMLGPTMemoryWriteRun, i);
+
+      if (run->token_offset != other_run->token_offset ||
+          run->length != other_run->length)
+        {
+          return FALSE;
+        }
+    }
+
+  return TRUE;
+}
+
+/* Returns the row of the first position if the first n_keys positions are
+ * in consecutive rows, so that they can be read with a single view, or -1 if
+ * they have to be gathered from their pages. */
+static int32_t
+ggml_gpt_memory_read_base_row (const int32_t *page_table,
+                               size_t         n_pages,
+                               int32_t        page_size,
+                               int32_t        n_memory_positions,
+                               int32_t        n_keys)
+{
+  size_t n_read_pages = MIN (n_pages, (size_t) (n_keys + page_size - 1) / page_size);
+
+  for (size_t i = 1; i < n_read_pages; ++i)
+    {
+      if (page_table[i] != page_table[0] + (int32_t) i)
+        {
+          return -1;
+        }
+    }
+
+  if (page_table[0] * page_size + n_keys > n_memory_positions)
+    {
+      return -1;
+    }
+
+  return page_table[0] * page_size;
+}
+
+static int32_t *
+ggml_gpt_memory_read_rows (const int32_t *page_table,
+                           size_t         n_pages,
+                           int32_t        page_size,
+                           int32_t        n_keys)
+{
+  int32_t *rows = g_new0 (int32_t, n_keys);
+
+  for (int32_t i = 0; i < n_keys; ++i)
+    {
+      rows[i] = ggml_gpt_memory_row_for_position (page_table, n_pages, page_size, i);
+    }
+
+  return rows;
+}
+
+typedef struct _GGMLGPTCachedGraph
+{
+  GGMLModel  *model;
+  int32_t     n_layer;
+  size_t      n_tokens;
+  int32_t     n_keys;
+  int32_t     n_logits;
+  int32_t     memory_read_base_row;
+  gboolean    is_batch;
+  GArray     *memory_write_runs;
+  GArray     *sequences;
+  GGMLTensor *embedding_indices;
+  GGMLTensor *position_indices;
+  GGMLTensor *memory_read_rows;
+  GGMLTensor *kq_scale;
+  GGMLTensor *logits_rows;
+  GPtrArray  *memory_writes;
+  GPtrArray  *attention_writes;
+  GPtrArray  *kq_masks;
+  GGMLTensor *output;
+} GGMLGPTCachedGraph;
+
+static GGMLGPTCachedGraph *
+ggml_gpt_cached_graph_new (GGMLModel *model,
+                           size_t     n_tokens,
+                           int32_t    n_keys,
+                           int32_t    n_logits,
+                           int32_t    memory_read_base_row,
+                           GArray    *memory_write_runs)
+{
+  GGMLGPTCachedGraph *cached_graph = g_new0 (GGMLGPTCachedGraph, 1);
+
+  /* Holding a reference keeps the weights that the graph reads alive
+   * and means that a different model can never be mistaken for this
+   * one just because it was allocated at the same address */
+  cached_graph->model = ggml_model_ref (model);
+  cached_graph->n_tokens = n_tokens;
+  cached_graph->n_keys = n_keys;
+  cached_graph->n_logits = n_logits;
+  cached_graph->memory_read_base_row = memory_read_base_row;
+  cached_graph->memory_write_runs = g_array_ref (memory_write_runs);
+  cached_graph->memory_writes = g_ptr_array_new_with_free_func ((GDestroyNotify) ggml_tensor_unref);
+  cached_graph->attention_writes = g_ptr_array_new_with_free_func ((GDestroyNotify) ggml_tensor_unref);
+  cached_graph->kq_masks = g_ptr_array_new_with_free_func ((GDestroyNotify) ggml_tensor_unref);
+
+  return cached_graph;
+}
+
+static void
+ggml_gpt_cached_graph_free (GGMLGPTCachedGraph *cached_graph)
+{
+  g_clear_pointer (&cached_graph->model, ggml_model_unref);
+  g_clear_pointer (&cached_graph->memory_write_runs, g_array_unref);
+  g_clear_pointer (&cached_graph->sequences, g_array_unref);
+  g_clear_pointer (&cached_graph->embedding_indices, ggml_tensor_unref);
+  g_clear_pointer (&cached_graph->position_indices, ggml_tensor_unref);
+  g_clear_pointer (&cached_graph->memory_read_rows, ggml_tensor_unref);
+  g_clear_pointer (&cached_graph->kq_scale, ggml_tensor_unref);
+  g_clear_pointer (&cached_graph->logits_rows, ggml_tensor_unref);
+  g_clear_pointer (&cached_graph->memory_writes, g_ptr_array_unref);
+  g_clear_pointer (&cached_graph->attention_writes, g_ptr_array_unref);
+  g_clear_pointer (&cached_graph->kq_masks, g_ptr_array_unref);
+  g_clear_pointer (&cached_graph->output, ggml_tensor_unref);
+
+  g_clear_pointer (&cached_graph, g_free);
+}
+
+G_DEFINE_AUTOPTR_CLEANUP_FUNC (GGMLGPTCachedGraph, ggml_gpt_cached_graph_free)
+
+/* Adds the copies that nothing else in the graph depends on to @cgraph.
+ * The memory writes of a layer have to come before the attention of
+ * that layer reads them, and the attention outputs of a batch have to
+ * be written before the next layer uses them, so they are added one
+ * layer at a time. */
+static void
+ggml_gpt_cached_graph_expand_writes (GGMLGPTCachedGraph *cached_graph,
+                                     GGMLComputeGraph   *cgraph)
+{
+  const size_t n_memory_writes_per_layer = cached_graph->memory_writes->len / cached_graph->n_layer;
+  const size_t n_attention_writes_per_layer = cached_graph->attention_writes->len / cached_graph->n_layer;
+
+  for (size_t i = 0; i < cached_graph->n_layer; ++i)
+    {
+      for (size_t j = 0; j < n_memory_writes_per_layer; ++j)
+        {
+          ggml_compute_graph_build_forward_expand (cgraph, cached_graph->memory_writes->pdata[i * n_memory_writes_per_layer + j]);
+        }
+
+      for (size_t j = 0; j < n_attention_writes_per_layer; ++j)
+        {
+          ggml_compute_graph_build_forward_expand (cgraph, cached_graph->attention_writes->pdata[i * n_attention_writes_per_layer + j]);
+        }
+    }
+}
+
+/* Points the memory writes of each layer at the rows for this pass */
+static void
+ggml_gpt_cached_graph_bind_memory_writes (GGMLGPTCachedGraph *cached_graph,
+                                          int32_t             n_embd,
+                                          int32_t             n_memory_positions,
+                                          GArray             *memory_write_runs,
+                                          GGMLTensor         *memory_v)
+{
+  const size_t n_runs = memory_write_runs->len;
+
+  for (size_t i = 0; i < cached_graph->n_layer; ++i)
+    {
+      for (size_t j = 0; j < n_runs; ++j)
+        {
+          GGMLGPTMemoryWriteRun *run = &g_array_index (memory_write_runs, GGMLGPTMemoryWriteRun, j);
+          size_t memory_offset = n_embd * (i * n_memory_positions + run->row);
+          size_t memory_v_offset = ggml_gpt_memory_v_offset (memory_v, n_embd, i, n_memory_positions, run->row);
+
+          ggml_tensor_set_view_offset (cached_graph->memory_writes->pdata[(i * n_runs + j) * 2], memory_offset);
+          ggml_tensor_set_view_offset (cached_graph->memory_writes->pdata[(i * n_runs + j) * 2 + 1], memory_v_offset);
+        }
+    }
+}
+
+/* Writes everything that changes between two passes over the same
+ * graph. The input tensors and the scale factor need to be written
+ * on every pass, since the allocator may have handed out their memory
+ * to other nodes once they were no longer needed. */
+static void
+ggml_gpt_cached_graph_bind (GGMLGPTCachedGraph *cached_graph,
+                            int32_t            *input_tokens,
+                            int32_t             n_past,
+                            int32_t             n_embd,
+                            int32_t             nhead,
+                            int32_t             n_memory_positions,
+                            GArray             *memory_write_runs,
+                            int32_t            *memory_read_rows,
+                            GGMLTensor         *memory_v)
+{
+  g_autofree int32_t *positions = arange_int32 (n_past, n_past + cached_graph->n_tokens);
+  float kq_scale = 1.0 / sqrt (n_embd / nhead);
+
+  ggml_tensor_set_data_from_int32_array (cached_graph->embedding_indices, input_tokens, cached_graph->n_tokens);
+  ggml_tensor_set_data_from_int32_array (cached_graph->position_indices, positions, cached_graph->n_tokens);
+  ggml_tensor_set_data (cached_graph->kq_scale, (char *) &kq_scale, sizeof (float));
+
+  if (cached_graph->memory_read_rows != NULL)
+    {
+      ggml_tensor_set_data_from_int32_array (cached_graph->memory_read_rows, memory_read_rows, cached_graph->n_keys);
+    }
+
+  ggml_gpt_cached_graph_bind_memory_writes (cached_graph, n_embd, n_memory_positions, memory_write_runs, memory_v);
+
+  for (size_t i = 0; i < cached_graph->kq_masks->len; ++i)
+    {
+      ggml_tensor_set_op_param_int32 (cached_graph->kq_masks->pdata[i], 0, n_past);
+    }
+}
+
+/* Adds the decoder layers to @cgraph, keeping the nodes that need
+ * to be updated when the graph is re-used in @cached_graph */
+static GGMLTensor *
+ggml_gpt_cached_graph_build_layers (GGMLGPTCachedGraph *cached_graph,
+                                    GGMLContext        *context,
+                                    GGMLComputeGraph   *cgraph,
+                                    GGMLModel          *model,
+                                    GGMLTensor         *initial_inputs,
+                                    int32_t             n_layer,
+                                    int32_t             n_embd,
+                                    int32_t             nhead,
+                                    int32_t             n_memory_positions,
+                                    int32_t             n_past,
+                                    GGMLTensor         *memory_k,
+                                    GGMLTensor         *memory_v)
+{
+  g_autoptr(GGMLTensor) residual = ggml_tensor_ref (initial_inputs);
+
+  cached_graph->n_layer = n_layer;
+
+  for (size_t i = 0; i < n_layer; ++i)
+    {
+      GGMLTensor *layer_output = ggml_nn_decoder_ar_layer (context,
+                                                           model,
+                                                           residual,
+                                                           i,
+                                                           n_embd,
+                                                           nhead,
+                                                           n_memory_positions,
+                                                           n_past,
+                                                           cached_graph->n_tokens,
+                                                           cached_graph->n_keys,
+                                                           cached_graph->memory_write_runs,
+                                                           cached_graph->memory_read_base_row,
+                                                           cached_graph->memory_read_rows,
+                                                           cached_graph->kq_scale,
+                                                           cached_graph->sequences,
+                                                           memory_k,
+                                                           memory_v,
+                                                           cached_graph->memory_writes,
+                                                           cached_graph->attention_writes,
+                                                           cached_graph->kq_masks);
+
+      /* Keep the layer_output around as the next residual */
+      g_clear_pointer (&residual, ggml_tensor_unref);
+
+      /* Assigning here is fine because we the final one gets
+       * owned by the autoptr and the prior ones are unref'd manually. */
+      residual = layer_output;
+    }
+
+  /* Now we need to add the memories to the compute graph
+   * so that they get saved in the memory for this round */
+  ggml_gpt_cached_graph_expand_writes (cached_graph, cgraph);
+
+  return g_steal_pointer (&residual);
+}
+
+static gboolean
+ggml_gpt_batch_sequences_have_same_shape (GArray *sequences,
+                                          GArray *other_sequences)
+{
+  if (sequences->len != other_sequences->len)
+    {
+      return FALSE;
+    }
+
+  for (size_t i = 0; i < sequences->len; ++i)
+    {
+      GGMLGPTBatchSequence *sequence = &g_array_index (sequences, GGMLGPTBatchSequence, i);
+      GGMLGPTBatchSequence *other_sequence = &g_array_index (other_sequences, GGMLGPTBatchSequence, i);
+
+      if (sequence->n_tokens != other_sequence->n_tokens ||
+          sequence->n_keys != other_sequence->n_keys)
+        {
+          return FALSE;
+        }
+    }
+
+  return TRUE;
+}
+
+static void
+ggml_gpt_cached_graph_bind_batch (GGMLGPTCachedGraph *cached_graph,
+                                  GArray             *sequences,
+                                  int32_t            *input_tokens,
+                                  int32_t            *positions,
+                                  int32_t             n_embd,
+                                  int32_t             nhead,
+                                  int32_t             n_memory_positions,
+                                  GArray             *memory_write_runs,
+                                  int32_t            *memory_read_rows,
+                                  GGMLTensor         *memory_v)
+{
+  float kq_scale = 1.0 / sqrt (n_embd / nhead);
+  g_autofree int32_t *logits_rows = g_new0 (int32_t, sequences->len);
+
+  for (size_t i = 0; i < sequences->len; ++i)
+    {
+      GGMLGPTBatchSequence *sequence = &g_array_index (sequences, GGMLGPTBatchSequence, i);
+
+      logits_rows[i] = sequence->token_offset + sequence->n_tokens - 1;
+    }
+
+  ggml_tensor_set_data_from_int32_array (cached_graph->embedding_indices, input_tokens, cached_graph->n_tokens);
+  ggml_tensor_set_data_from_int32_array (cached_graph->position_indices, positions, cached_graph->n_tokens);
+  ggml_tensor_set_data (cached_graph->kq_scale, (char *) &kq_scale, sizeof (float));
+  ggml_tensor_set_data_from_int32_array (cached_graph->memory_read_rows, memory_read_rows, cached_graph->n_keys);
+  ggml_tensor_set_data_from_int32_array (cached_graph->logits_rows, logits_rows, sequences->len);
+
+  /* There is one mask for each sequence in each layer */
+  for (size_t i = 0; i < cached_graph->kq_masks->len; ++i)
+    {
+      GGMLGPTBatchSequence *sequence = &g_array_index (sequences, GGMLGPTBatchSequence, i % sequences->len);
+
+      ggml_tensor_set_op_param_int32 (cached_graph->kq_masks->pdata[i], 0, sequence->n_past);
+    }
+
+  ggml_gpt_cached_graph_bind_memory_writes (cached_graph, n_embd, n_memory_positions, memory_write_runs, memory_v);
+}
+
+/* Like ggml_gpt_model_forward_pass, but for several sequences with their
+ * own positions in a shared paged key-value memory, see GGML_GPT_BATCH_INPUTS_TYPE.
+ * The projections and the feed-forward layers run over the tokens of all the
+ * sequences at once, but each sequence only attends over its own keys, which
+ * are gathered from its own pages. */
+static GGMLTensor *
+ggml_gpt_model_forward_pass_batch (GGMLModel            *model,
+                                   GGMLHyperparameters  *hyperparameters,
+                                   GVariant             *inputs,
+                                   GGMLComputeGraph     *cgraph,
+                                   GGMLExecutionMemory  *memory,
+                                   GError              **error)
+{
+  const int32_t n_embd = ggml_hyperparameters_get_int32 (hyperparameters, "n_embd");
+  const int32_t n_layer = ggml_hyperparameters_get_int32 (hyperparameters, "n_layer");
+  const int32_t n_ctx = ggml_hyperparameters_get_int32 (hyperparameters, "n_ctx");
+  const int32_t nhead = ggml_hyperparameters_get_int32 (hyperparameters, "n_head");
+  int32_t page_size;
+  g_autoptr(GVariantIter) sequences_iter = NULL;
+
+  g_variant_get (inputs, GGML_GPT_BATCH_INPUTS_TYPE, &page_size, &sequences_iter);
+
+  GHashTable *memory_key_values = ggml_execution_memory_get_key_value_memory (memory);
+  GGMLTensor *memory_k = g_hash_table_lookup (memory_key_values, "memory/k");
+  GGMLTensor *memory_v = g_hash_table_lookup (memory_key_values, "memory/v");
+  size_t memory_n_dims;
+  const int32_t n_memory_positions = ggml_tensor_get_shape (memory_k, &memory_n_dims)[1];
+
+  if (ggml_gpt_memory_v_is_transposed (memory_v))
+    {
+      g_set_error (error,
+                   G_IO_ERROR,
+                   G_IO_ERROR_NOT_SUPPORTED,
+                   "Batched passes need values that are not transposed");
+      return NULL;
+    }
+
+  g_autoptr(GArray) sequences = g_array_new (FALSE, TRUE, sizeof (GGMLGPTBatchSequence));
+  g_autoptr(GArray) input_tokens = g_array_new (FALSE, TRUE, sizeof (int32_t));
+  g_autoptr(GArray) positions = g_array_new (FALSE, TRUE, sizeof (int32_t));
+  g_autoptr(GArray) memory_write_runs = g_array_new (FALSE, TRUE, sizeof (GGMLGPTMemoryWriteRun));
+  g_autoptr(GArray) memory_read_rows = g_array_new (FALSE, TRUE, sizeof (int32_t));
+  int32_t n_past;
+  GVariant *tokens_variant;
+  GVariant *page_table_variant;
+
+  while (g_variant_iter_next (sequences_iter, "(i@ai@ai)", &n_past, &tokens_variant, &page_table_variant))
+    {
+      g_autoptr(GVariant) owned_tokens_variant = tokens_variant;
+      g_autoptr(GVariant) owned_page_table_variant = page_table_variant;
+      size_t n_tokens, n_pages;
+      const int32_t *tokens = g_variant_get_fixed_array (tokens_variant, &n_tokens, sizeof (int32_t));
+      const int32_t *page_table = g_variant_get_fixed_array (page_table_variant, &n_pages, sizeof (int32_t));
+
+      if (n_tokens == 0 || n_pages * page_size < n_past + n_tokens)
+        {
+          g_set_error (error,
+                       G_IO_ERROR,
+                       G_IO_ERROR_INVALID_ARGUMENT,
+                       "Each sequence in a batch needs at least one token and pages for all its positions");
+          return NULL;
+        }
+
+      GGMLGPTBatchSequence sequence = {
+        .n_past = n_past,
+        .n_tokens = n_tokens,
+        .token_offset = input_tokens->len,
+        .n_keys = ggml_gpt_n_keys_for_pass (n_past, n_tokens, n_ctx),
+        .key_offset = memory_read_rows->len
+      };
+      g_autoptr(GArray) sequence_write_runs = ggml_gpt_memory_write_runs (page_table, n_pages, page_size, n_past, n_tokens);
+      g_autofree int32_t *sequence_read_rows = ggml_gpt_memory_read_rows (page_table, n_pages, page_size, sequence.n_keys);
+
+      for (size_t i = 0; i < sequence_write_runs->len; ++i)
+        {
+          g_array_index (sequence_write_runs, GGMLGPTMemoryWriteRun, i).token_offset += sequence.token_offset;
+        }
+
+      for (int32_t i = 0; i < (int32_t) n_tokens; ++i)
+        {
+          int32_t position = n_past + i;
+          g_array_append_val (positions, position);
+        }
+
+      g_array_append_vals (input_tokens, tokens, n_tokens);
+      g_array_append_vals (memory_write_runs, sequence_write_runs->data, sequence_write_runs->len);
+      g_array_append_vals (memory_read_rows, sequence_read_rows, sequence.n_keys);
+      g_array_append_val (sequences, sequence);
+    }
+
+  if (sequences->len == 0)
+    {
+      g_set_error (error,
+                   G_IO_ERROR,
+                   G_IO_ERROR_INVALID_ARGUMENT,
+                   "A batch needs at least one sequence");
+      return NULL;
+    }
+
+  const size_t n_tokens = input_tokens->len;
+  const int32_t n_keys = memory_read_rows->len;
+  const int32_t n_logits = sequences->len;
+
+  /* The keys are always gathered, so only the number of tokens and keys of
+   * each sequence and the shape of the writes decide whether a graph can be
+   * re-used. Everything else is in the inputs. */
+  const gboolean use_graph_cache = !ggml_execution_memory_is_recorder (memory);
+  GGMLGPTCachedGraph *previous_graph = use_graph_cache ? ggml_execution_memory_get_cached_graph (memory) : NULL;
+
+  if (previous_graph != NULL &&
+      previous_graph->model == model &&
+      previous_graph->is_batch &&
+      previous_graph->n_tokens == n_tokens &&
+      previous_graph->n_keys == n_keys &&
+      previous_graph->n_logits == n_logits &&
+      ggml_gpt_batch_sequences_have_same_shape (previous_graph->sequences, sequences) &&
+      ggml_gpt_memory_write_runs_have_same_shape (previous_graph->memory_write_runs, memory_write_runs))
+    {
+      ggml_gpt_cached_graph_bind_batch (previous_graph,
+                                        sequences,
+                                        (int32_t *) input_tokens->data,
+                                        (int32_t *) positions->data,
+                                        n_embd,
+                                        nhead,
+                                        n_memory_positions,
+                                        memory_write_runs,
+                                        (int32_t *) memory_read_rows->data,
+                                        memory_v);
+
+      ggml_gpt_cached_graph_expand_writes (previous_graph, cgraph);
+
+      return ggml_tensor_ref (previous_graph->output);
+    }
+
+  if (use_graph_cache)
+    {
+      ggml_execution_memory_set_cached_graph (memory, NULL, NULL);
+    }
+
+  g_autoptr(GGMLContext) context = ggml_execution_memory_create_context (memory);
+  g_autoptr(GGMLGPTCachedGraph) cached_graph = ggml_gpt_cached_graph_new (model,
+                                                                          n_tokens,
+                                                                          n_keys,
+                                                                          n_logits,
+                                                                          -1,
+                                                                          memory_write_runs);
+
+  cached_graph->is_batch = TRUE;
+  cached_graph->sequences = g_array_ref (sequences);
+  cached_graph->embedding_indices = ggml_context_new_tensor_1d (context, GGML_DATA_TYPE_I32, n_tokens);
+  cached_graph->position_indices = ggml_context_new_tensor_1d (context, GGML_DATA_TYPE_I32, n_tokens);
+  cached_graph->kq_scale = ggml_context_new_tensor_1d (context, GGML_DATA_TYPE_F32, 1);
+  cached_graph->memory_read_rows = ggml_context_new_tensor_1d (context, GGML_DATA_TYPE_I32, n_keys);
+  cached_graph->logits_rows = ggml_context_new_tensor_1d (context, GGML_DATA_TYPE_I32, n_logits);
+
+  g_autoptr(GGMLTensor) wte_rows = ggml_op_get_rows (context, ggml_model_get (model, "model/wte"), cached_graph->embedding_indices);
+  g_autoptr(GGMLTensor) wpe_rows = ggml_op_get_rows (context, ggml_model_get (model, "model/wpe"), cached_graph->position_indices);
+  g_autoptr(GGMLTensor) initial_inputs = ggml_op_add (context, wte_rows, wpe_rows);
+  g_autoptr(GGMLTensor) residual = ggml_gpt_cached_graph_build_layers (cached_graph,
+                                                                       context,
+                                                                       cgraph,
+                                                                       model,
+                                                                       initial_inputs,
+                                                                       n_layer,
+                                                                       n_embd,
+                                                                       nhead,
+                                                                       n_memory_positions,
+                                                                       0,
+                                                                       memory_k,
+                                                                       memory_v);
+
+  /* Only the last token of each sequence needs logits */
+  g_autoptr(GGMLTensor) logits_residual = ggml_op_get_rows (context, residual, cached_graph->logits_rows);
+  g_autoptr(GGMLTensor) final_ln_output = ggml_nn_layer_norm (context,
+                                                              logits_residual,
+                                                              ggml_model_get (model, "model/ln_f/g"),
+                                                              ggml_model_get (model, "model/ln_f/b"));
+
+  cached_graph->output = ggml_nn_linear_layer (context,
+                                               final_ln_output,
+                                               ggml_model_get (model, "model/lm_head"),
+                                               NULL);
+
+  if (!use_graph_cache)
+    {
+      return ggml_tensor_ref (cached_graph->output);
+    }
+
+  ggml_compute_graph_build_forward_expand (cgraph, cached_graph->output);
+  ggml_compute_graph_allocate (cgraph, context);
+  ggml_gpt_cached_graph_bind_batch (cached_graph,
+                                    sequences,
+                                    (int32_t *) input_tokens->data,
+                                    (int32_t *) positions->data,
+                                    n_embd,
+                                    nhead,
+                                    n_memory_positions,
+                                    memory_write_runs,
+                                    (int32_t *) memory_read_rows->data,
+                                    memory_v);
+
+  g_autoptr(GGMLTensor) output = ggml_tensor_ref (cached_graph->output);
+  ggml_execution_memory_set_cached_graph (memory,
+                                          g_steal_pointer (&cached_graph),
+                                          (GDestroyNotify) ggml_gpt_cached_graph_free);
+
+  return g_steal_pointer (&output);
+}
+
 /**
  * ggml_gpt_model_forward_pass:
  * @model: (transfer none): A #GGMLModel
  * @hyperparameters: (transfer none): A #GGMLHyperparameters
  * @inputs: (transfer none): A #GVariant with the model inputs. Should be of type "ai"
  * @input_parameters: (transfer none) (element-type utf8 int): A #GHashTable with per-pass parameters.
- *                    Should contain at least "n_past".
+ *                    Should contain at least "n_past". May contain "n_logits", the number of
+ *                    trailing input positions to compute logits for, which defaults to 1.
  * @cgraph: (transfer none): A #GGMLComputeGraph
  * @execution_memory: (transfer none): A #GGMLExecutionMemory containing enough memory for this forward pass to
  *              be executed. The @execution_memory must be sufficiently large to carry at least all the intermediate
@@ -533,6 +1763,25 @@ arange_int32 (int32_t start, int32_t stop)
  * parameter in @input_parameters. You can pass this callback directly as as #GGMLModelForwardFunc, eg
  * to ggml_model_new_from_flattened_desc.
  *
+ * If the key-value memory of @execution_memory is paged (see ggml_execution_memory_new_paged),
+ * the positions for this pass are reserved first and the keys and values are read and written
+ * through the page table. Pages that are next to each other are read with a single view,
+ * otherwise the rows for each position are gathered from their pages.
+ *
+ * The compute graph is kept in @execution_memory and re-used by later passes with the same
+ * number of input tokens and a similar "n_past", which is the common case when decoding one
+ * token at a time. The graph's memory is then allocated upfront with ggml_compute_graph_allocate.
+ *
+ * The output tensor has "n_logits" rows of logits, one for each of the last "n_logits"
+ * input positions. The final layer norm and the language model head are not run for
+ * the other positions, since they are not needed to predict the next token.
+ *
+ * @inputs may also be of type %GGML_GPT_BATCH_INPUTS_TYPE, to run several sequences
+ * whose keys and values are in the same key-value page pool through the model at
+ * once, each at its own position. "n_past" is then ignored, the positions for each
+ * sequence must already be reserved in its page table and the output tensor has
+ * one row of logits for the last token of each sequence.
+ *
  * Note that calling this function directly does NOT run the model - it merely defines the compute
  * graph output. You need to call ggml_compute_graph_build_forward_expand on the output and then
  * ggml_compute_graph_compute, then the result will be realized in the output tensor.
@@ -555,77 +1804,184 @@ ggml_gpt_model_forward_pass (GGMLModel *model,
   const int32_t nhead = ggml_hyperparameters_get_int32 (hyperparameters, "n_head");
   const int32_t n_past = GPOINTER_TO_INT (g_hash_table_lookup (input_parameters, "n_past"));
 
-  GHashTable *memory_key_values = ggml_execution_memory_get_key_value_memory (memory);
-  g_autoptr(GGMLContext) context = ggml_execution_memory_create_context (memory);
+  /* Only does any work on the first pass for this model */
+  if (!ggml_model_index_layer_weights (model,
+                                       "model/h",
+                                       n_layer,
+                                       ggml_gpt_layer_weight_slot_names,
+                                       GGML_GPT_LAYER_WEIGHT_N_SLOTS,
+                                       error))
+    {
+      return NULL;
+    }
+
+  if (g_variant_is_of_type (inputs, G_VARIANT_TYPE (GGML_GPT_BATCH_INPUTS_TYPE)))
+    {
+      return ggml_gpt_model_forward_pass_batch (model, hyperparameters, inputs, cgraph, memory, error);
+    }
+
+  size_t n_tokens;
+  g_autofree int32_t *input_tokens = read_array_from_variant (inputs, &n_tokens);
+  const int32_t n_keys = ggml_gpt_n_keys_for_pass (n_past, n_tokens, n_ctx);
+  const int32_t requested_n_logits = GPOINTER_TO_INT (g_hash_table_lookup (input_parameters, "n_logits"));
+  const int32_t n_logits = CLAMP (requested_n_logits, 1, (int32_t) n_tokens);
+
+  /* Work out which rows of the key-value memory this pass writes
+   * to and reads from. Memory without a page table is a single page. */
+  static const int32_t single_page_table[] = { 0 };
+  const int32_t *page_table = single_page_table;
+  size_t n_pages = G_N_ELEMENTS (single_page_table);
+  int32_t page_size = n_ctx;
+  int32_t n_memory_positions = n_ctx;
+  GGMLKeyValuePagePool *page_pool = ggml_execution_memory_get_key_value_page_pool (memory);
+
+  if (page_pool != NULL)
+    {
+      if (!ggml_execution_memory_reserve_key_value_positions (memory, n_past, n_tokens, error))
+        {
+          return NULL;
+        }
+
+      page_table = ggml_execution_memory_get_key_value_page_table (memory, &n_pages);
+      page_size = ggml_key_value_page_pool_get_page_size (page_pool);
+      n_memory_positions = ggml_key_value_page_pool_get_n_positions (page_pool);
+    }
+
+  /* Recorder passes only measure the memory usage, so there
+   * is nothing to keep around for them. They always gather the
+   * keys and values, which needs a bit more memory than viewing them,
+   * so that the measured size is enough either way. */
+  const gboolean is_recorder = ggml_execution_memory_is_recorder (memory);
+  const gboolean use_graph_cache = !is_recorder;
+  g_autoptr(GArray) memory_write_runs = ggml_gpt_memory_write_runs (page_table, n_pages, page_size, n_past, n_tokens);
+  const int32_t memory_read_base_row = (
+    is_recorder ? -1 : ggml_gpt_memory_read_base_row (page_table, n_pages, page_size, n_memory_positions, n_keys)
+  );
 
   /* We save things in the memory so that we dont have to constantly
    * recompute past keys and values that we've already computed during
    * the decoding process. */
+  GHashTable *memory_key_values = ggml_execution_memory_get_key_value_memory (memory);
   GGMLTensor *memory_k = g_hash_table_lookup (memory_key_values, "memory/k");
   GGMLTensor *memory_v = g_hash_table_lookup (memory_key_values, "memory/v");
 
-  size_t n_tokens;
-  g_autofree int32_t *input_tokens = read_array_from_variant (inputs, &n_tokens);
-  g_autofree int32_t *positions = arange_int32 (n_past, n_past + n_tokens);
+  /* Quantized values are always gathered, see ggml_nn_causal_mha_ar_layer */
+  const gboolean gather_memory_rows = memory_read_base_row < 0 || ggml_tensor_block_size (memory_v) > 1;
+  g_autofree int32_t *memory_read_rows = (
+    gather_memory_rows ? ggml_gpt_memory_read_rows (page_table, n_pages, page_size, n_keys) : NULL
+  );
+  GGMLGPTCachedGraph *previous_graph = use_graph_cache ? ggml_execution_memory_get_cached_graph (memory) : NULL;
+
+  if (previous_graph != NULL &&
+      previous_graph->model == model &&
+      !previous_graph->is_batch &&
+      previous_graph->n_tokens == n_tokens &&
+      previous_graph->n_keys == n_keys &&
+      previous_graph->n_logits == n_logits &&
+      previous_graph->memory_read_base_row == memory_read_base_row &&
+      ggml_gpt_memory_write_runs_have_same_shape (previous_graph->memory_write_runs, memory_write_runs))
+    {
+      ggml_gpt_cached_graph_bind (previous_graph,
+                                  input_tokens,
+                                  n_past,
+                                  n_embd,
+                                  nhead,
+                                  n_memory_positions,
+                                  memory_write_runs,
+                                  memory_read_rows,
+                                  memory_v);
+
+      /* Expand in the same order as when the graph was built */
+      ggml_gpt_cached_graph_expand_writes (previous_graph, cgraph);
+
+      return ggml_tensor_ref (previous_graph->output);
+    }
 
-  g_autoptr(GGMLTensor) embedding_indices = ggml_context_new_tensor_1d (context, GGML_DATA_TYPE_I32, n_tokens);
-  ggml_tensor_set_data_from_int32_array (embedding_indices, input_tokens, n_tokens);
+  /* Drop the previous graph first, since the new one may be
+   * built over the same memory */
+  if (use_graph_cache)
+    {
+      ggml_execution_memory_set_cached_graph (memory, NULL, NULL);
+    }
 
-  g_autoptr(GGMLTensor) position_indices = ggml_context_new_tensor_1d (context, GGML_DATA_TYPE_I32, n_tokens);
-  ggml_tensor_set_data_from_int32_array (position_indices, positions, n_tokens);
+  g_autoptr(GGMLContext) context = ggml_execution_memory_create_context (memory);
+  g_autoptr(GGMLGPTCachedGraph) cached_graph = ggml_gpt_cached_graph_new (model,
+                                                                          n_tokens,
+                                                                          n_keys,
+                                                                          n_logits,
+                                                                          memory_read_base_row,
+                                                                          memory_write_runs);
+
+  cached_graph->embedding_indices = ggml_context_new_tensor_1d (context, GGML_DATA_TYPE_I32, n_tokens);
+  cached_graph->position_indices = ggml_context_new_tensor_1d (context, GGML_DATA_TYPE_I32, n_tokens);
+  cached_graph->kq_scale = ggml_context_new_tensor_1d (context, GGML_DATA_TYPE_F32, 1);
+
+  if (gather_memory_rows)
+    {
+      cached_graph->memory_read_rows = ggml_context_new_tensor_1d (context, GGML_DATA_TYPE_I32, n_keys);
+    }
 
-  g_autoptr(GGMLTensor) wte_rows = ggml_op_get_rows (context, ggml_model_get (model, "model/wte"), embedding_indices);
-  g_autoptr(GGMLTensor) wpe_rows = ggml_op_get_rows (context, ggml_model_get (model, "model/wpe"), position_indices);
+  g_autoptr(GGMLTensor) wte_rows = ggml_op_get_rows (context, ggml_model_get (model, "model/wte"), cached_graph->embedding_indices);
+  g_autoptr(GGMLTensor) wpe_rows = ggml_op_get_rows (context, ggml_model_get (model, "model/wpe"), cached_graph->position_indices);
 
   g_autoptr(GGMLTensor) initial_inputs = ggml_op_add (context, wte_rows, wpe_rows);
 
-  g_autoptr(GGMLTensor) residual = ggml_tensor_ref (initial_inputs);
-
-  for (size_t i = 0; i < n_layer; ++i)
-    {
-      GGMLTensor *save_mem_k = NULL;
-      GGMLTensor *save_mem_v = NULL;
-      GGMLTensor *layer_output = ggml_nn_decoder_ar_layer (context,
-                                                           model,
+  g_autoptr(GGMLTensor) residual = ggml_gpt_cached_graph_build_layers (cached_graph,
+                                                                       context,
+                                                                       cgraph,
+                                                                       model,
+                                                                       initial_inputs,
+                                                                       n_layer,
+                                                                       n_embd,
+                                                                       nhead,
+                                                                       n_memory_positions,
+                                                                       n_past,
+                                                                       memory_k,
+                                                                       memory_v);
+
+  /* Now that we have the layer outputs, we have do the final layer norm,
+   * but only on the positions that we want logits for */
+  g_autoptr(GGMLTensor) logits_residual = ggml_op_view_2d (context,
                                                            residual,
-                                                           i,
                                                            n_embd,
-                                                           nhead,
-                                                           n_ctx,
-                                                           n_past,
-                                                           n_tokens,
-                                                           memory_k,
-                                                           memory_v,
-                                                           &save_mem_k,
-                                                           &save_mem_v);
-
-      /* Keep the layer_output around as the next residual */
-      g_clear_pointer (&residual, ggml_tensor_unref);
-
-      /* Assigning here is fine because we the final one gets
-       * owned by the autoptr and the prior ones are unref'd manually. */
-      residual = layer_output;
+                                                           n_logits,
+                                                           (n_tokens - n_logits) * n_embd);
+  g_autoptr(GGMLTensor) final_ln_output = ggml_nn_layer_norm (context,
+                                                              logits_residual,
+                                                              ggml_model_get (model, "model/ln_f/g"),
+                                                              ggml_model_get (model, "model/ln_f/b"));
 
-      /* Now we need to add the memories to the compute graph
-       * so that they get saved in the memory for this round */
-      ggml_compute_graph_build_forward_expand (cgraph, save_mem_k);
-      ggml_compute_graph_build_forward_expand (cgraph, save_mem_v);
+  cached_graph->output = ggml_nn_linear_layer (context,
+                                               final_ln_output,
+                                               ggml_model_get (model, "model/lm_head"),
+                                               NULL);
 
-      g_clear_pointer (&save_mem_k, ggml_tensor_unref);
-      g_clear_pointer (&save_mem_v, ggml_tensor_unref);
+  /* Nothing gets written in recorder mode, so we are done */
+  if (!use_graph_cache)
+    {
+      return ggml_tensor_ref (cached_graph->output);
     }
 
-  /* Now that we have the layer outputs, we have do the final layer norm */
-  g_autoptr(GGMLTensor) final_ln_output = ggml_nn_layer_norm (context,
-                                                              residual,
-                                                              ggml_model_get (model, "model/ln_f/g"),
-                                                              ggml_model_get (model, "model/ln_f/b"));
+  /* Allocate everything now so that the node memory stays put
+   * for the next passes that re-use this graph */
+  ggml_compute_graph_build_forward_expand (cgraph, cached_graph->output);
+  ggml_compute_graph_allocate (cgraph, context);
+  ggml_gpt_cached_graph_bind (cached_graph,
+                              input_tokens,
+                              n_past,
+                              n_embd,
+                              nhead,
+                              n_memory_positions,
+                              memory_write_runs,
+                              memory_read_rows,
+                              memory_v);
+
+  g_autoptr(GGMLTensor) output = ggml_tensor_ref (cached_graph->output);
+  ggml_execution_memory_set_cached_graph (memory,
+                                          g_steal_pointer (&cached_graph),
+                                          (GDestroyNotify) ggml_gpt_cached_graph_free);
 
-  g_autoptr(GGMLTensor) lm_head_output = ggml_nn_linear_layer (context,
-                                                               final_ln_output,
-                                                               ggml_model_get (model, "model/lm_head"),
-                                                               NULL);
-  return g_steal_pointer (&lm_head_output);
+  return g_steal_pointer (&output);
 }
 
 static const char *ggml_gpt_model_quantize_regexes[] = {
@@ -34,11 +34,32 @@
 
 G_BEGIN_DECLS
 
+/**
+ * GGML_GPT_BATCH_INPUTS_TYPE:
+ *
+ * The #GVariant type of the inputs for a batched GPT forward pass: the page
+ * size of the key-value page pool, followed by an array with the number of
+ * positions already in the memory, the input tokens and the page table of
+ * each sequence.
+ */
+#define GGML_GPT_BATCH_INPUTS_TYPE "(ia(iaiai))"
+
+size_t ggml_gpt_pre_tokenize_next_word (const char *string,
+                                        size_t      length,
+                                        size_t      offset);
 gboolean ggml_gpt_tokenize (GGMLTokenDictionary *token_dictionary,
                             const char *string,
                             int32_t **out_tokens,
                             size_t  *out_size,
                             GError **error);
+gboolean ggml_gpt_tokenize_batch (GGMLTokenDictionary  *token_dictionary,
+                                  const char * const   *strings,
+                                  size_t                n_strings,
+                                  size_t                n_threads,
+                                  int32_t             **out_tokens,
+                                  size_t              **out_offsets,
+                                  size_t               *out_n_tokens,
+                                  GError              **error);
 GGMLTensor * ggml_gpt_model_forward_pass (GGMLModel *model,
                                           GGMLHyperparameters *hyperparameters,
                                           GVariant *inputs,
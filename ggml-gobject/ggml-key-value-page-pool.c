@@ -0,0 +1,412 @@
+/*
+ * ggml-gobject/ggml-key-value-page-pool.c
+ *
+ * Library code for ggml-key-value-page-pool
+ *
+ * Copyright (C) 2023 Sam Spilsbury.
+ *
+ * ggml-gobject is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation; either version 2.1 of the License, or
+ * (at your option) any later version.
+ *
+ * ggml-gobject is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License along
+ * with ggml-gobject; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+#include <gio/gio.h>
+#include <ggml-gobject/ggml-key-value-page-pool.h>
+#include <ggml-gobject/internal/ggml-tensor-internal.h>
+
+struct _GGMLKeyValuePagePool {
+  GMutex mutex;
+  GHashTable *memory;
+  size_t page_size;
+  size_t n_pages;
+  guint *page_ref_counts;
+  GArray *free_pages;
+  gatomicrefcount ref_count;
+};
+
+static size_t
+ggml_key_value_page_pool_estimate_tensor_size (GGMLModelDescLeaf *leaf,
+                                               size_t             n_positions)
+{
+  return (ggml_type_size (leaf->type) *
+          (leaf->dimensions[0] / ggml_blck_size (leaf->type)) *
+          n_positions *
+          leaf->dimensions[2]);
+}
+
+/**
+ * ggml_key_value_page_pool_new:
+ * @memory_desc: (transfer none): A #GGMLModelDescNode describing the key-value memory of
+ *               a single sequence. Each leaf must have three dimensions, which are the
+ *               size of one row, the number of positions and the number of groups of rows,
+ *               for instance the number of layers.
+ * @n_positions: The number of positions that the pool can hold, across all sequences. It
+ *               is rounded up to a whole number of pages.
+ * @page_size: The number of positions in each page.
+ * @error: A #GError
+ *
+ * Creates a new #GGMLKeyValuePagePool, which holds the key-value memory for
+ * many sequences at once, for instance all the completion cursors of a
+ * language model. Instead of reserving the memory for the whole context
+ * upfront, each sequence gets pages of @page_size positions as it grows and
+ * gives them back when it goes away, so short sequences only use as much
+ * memory as they need.
+ *
+ * Each leaf of @memory_desc becomes a tensor with @n_positions positions. Page
+ * number n is made up of positions n * @page_size to (n + 1) * @page_size - 1 in
+ * every group. The memory starts out zeroed.
+ *
+ * Returns: (transfer full): A new #GGMLKeyValuePagePool or %NULL with @error set on failure.
+ */
+GGMLKeyValuePagePool *
+ggml_key_value_page_pool_new (GGMLModelDescNode  *memory_desc,
+                              size_t              n_positions,
+                              size_t              page_size,
+                              GError            **error)
+{
+  g_autoptr(GHashTable) flattened_memory_desc = ggml_model_desc_node_flatten (memory_desc);
+  const size_t n_pages = (n_positions + page_size - 1) / page_size;
+  const size_t n_pool_positions = n_pages * page_size;
+  size_t memory_size = 0;
+
+  GHashTableIter iter;
+  gpointer key, value;
+
+  if (page_size == 0 || n_pages == 0)
+    {
+      g_set_error (error,
+                   G_IO_ERROR,
+                   G_IO_ERROR_INVALID_ARGUMENT,
+                   "Key-value page pool must have at least one page of at least one position");
+      return NULL;
+    }
+
+  g_hash_table_iter_init (&iter, flattened_memory_desc);
+  while (g_hash_table_iter_next (&iter, &key, &value))
+    {
+      GGMLModelDescLeaf *leaf = value;
+
+      if (leaf->n_dim != 3)
+        {
+          g_set_error (error,
+                       G_IO_ERROR,
+                       G_IO_ERROR_INVALID_ARGUMENT,
+                       "Key-value memory %s must have three dimensions (row, position, group), but has %zu",
+                       (const char *) key,
+                       leaf->n_dim);
+          return NULL;
+        }
+
+      if (leaf->dimensions[0] % ggml_blck_size (leaf->type) != 0)
+        {
+          g_set_error (error,
+                       G_IO_ERROR,
+                       G_IO_ERROR_INVALID_ARGUMENT,
+                       "Key-value memory %s has rows of %" G_GINT64_FORMAT " elements, which is not a multiple of the block size of its type",
+                       (const char *) key,
+                       leaf->dimensions[0]);
+          return NULL;
+        }
+
+      memory_size += ggml_tensor_overhead () + GGML_MEM_ALIGN + ggml_key_value_page_pool_estimate_tensor_size (leaf, n_pool_positions);
+    }
+
+  /* The memory is zeroed, so that positions which have not been written
+   * yet still hold finite values if they are read and masked out. Most
+   * allocators get zeroed memory for large allocations from the kernel
+   * lazily, so the pages are only really allocated once they are used. */
+  g_autoptr(GBytes) mem_buffer = g_bytes_new_take (g_malloc0 (memory_size), memory_size);
+  g_autoptr(GGMLContext) context = ggml_context_new_from_mem_buffer (mem_buffer);
+  g_autoptr(GHashTable) memory = g_hash_table_new_full (g_str_hash,
+                                                        g_str_equal,
+                                                        g_free,
+                                                        (GDestroyNotify) ggml_tensor_unref);
+
+  g_hash_table_iter_init (&iter, flattened_memory_desc);
+  while (g_hash_table_iter_next (&iter, &key, &value))
+    {
+      GGMLModelDescLeaf *leaf = value;
+      GGMLTensor *tensor = ggml_context_new_tensor_3d (context,
+                                                       leaf->type,
+                                                       leaf->dimensions[0],
+                                                       n_pool_positions,
+                                                       leaf->dimensions[2]);
+
+      ggml_tensor_set_name (tensor, key);
+      g_hash_table_insert (memory, g_strdup (key), tensor);
+    }
+
+  GGMLKeyValuePagePool *page_pool = g_new0 (GGMLKeyValuePagePool, 1);
+
+  g_mutex_init (&page_pool->mutex);
+  page_pool->memory = g_steal_pointer (&memory);
+  page_pool->page_size = page_size;
+  page_pool->n_pages = n_pages;
+  page_pool->page_ref_counts = g_new0 (guint, n_pages);
+  page_pool->free_pages = g_array_sized_new (FALSE, FALSE, sizeof (int32_t), n_pages);
+
+  /* Pages are handed out from the back of the free list, so push them
+   * in reverse. A sequence that grows on its own then gets pages that are
+   * next to each other, which lets the forward pass read them in one go. */
+  for (size_t i = 0; i < n_pages; ++i)
+    {
+      int32_t page = n_pages - i - 1;
+      g_array_append_val (page_pool->free_pages, page);
+    }
+
+  g_atomic_ref_count_init (&page_pool->ref_count);
+
+  return page_pool;
+}
+
+/**
+ * ggml_key_value_page_pool_ref:
+ * @page_pool: A #GGMLKeyValuePagePool
+ *
+ * Increases the reference count on @page_pool
+ *
+ * Returns: (transfer full): The @page_pool
+ */
+GGMLKeyValuePagePool *
+ggml_key_value_page_pool_ref (GGMLKeyValuePagePool *page_pool)
+{
+  g_atomic_ref_count_inc (&page_pool->ref_count);
+  return page_pool;
+}
+
+/**
+ * ggml_key_value_page_pool_unref:
+ * @page_pool: A #GGMLKeyValuePagePool
+ *
+ * Decreases the reference count on @page_pool. If the reference
+ * count goes to zero, then the @page_pool and its memory will be freed.
+ */
+void
+ggml_key_value_page_pool_unref (GGMLKeyValuePagePool *page_pool)
+{
+  if (g_atomic_ref_count_dec (&page_pool->ref_count))
+    {
+      g_mutex_clear (&page_pool->mutex);
+      g_clear_pointer (&page_pool->memory, g_hash_table_unref);
+      g_clear_pointer (&page_pool->page_ref_counts, g_free);
+      g_clear_pointer (&page_pool->free_pages, g_array_unref);
+      g_clear_pointer (&page_pool, g_free);
+    }
+}
+
+/**
+ * ggml_key_value_page_pool_get_memory:
+ * @page_pool: A #GGMLKeyValuePagePool
+ *
+ * Returns: (transfer none) (element-type utf8 GGMLTensor): The #GHashTable with
+ *          the key-value memory tensors of @page_pool, which have the same keys
+ *          as the memory description that @page_pool was created with.
+ */
+GHashTable *
+ggml_key_value_page_pool_get_memory (GGMLKeyValuePagePool *page_pool)
+{
+  return page_pool->memory;
+}
+
+/**
+ * ggml_key_value_page_pool_get_page_size:
+ * @page_pool: A #GGMLKeyValuePagePool
+ *
+ * Returns: The number of positions in each page of @page_pool
+ */
+size_t
+ggml_key_value_page_pool_get_page_size (GGMLKeyValuePagePool *page_pool)
+{
+  return page_pool->page_size;
+}
+
+/**
+ * ggml_key_value_page_pool_get_n_positions:
+ * @page_pool: A #GGMLKeyValuePagePool
+ *
+ * Returns: The number of positions in each group of the memory of @page_pool,
+ *          which is the number of pages times the page size.
+ */
+size_t
+ggml_key_value_page_pool_get_n_positions (GGMLKeyValuePagePool *page_pool)
+{
+  return page_pool->n_pages * page_pool->page_size;
+}
+
+/**
+ * ggml_key_value_page_pool_get_n_pages:
+ * @page_pool: A #GGMLKeyValuePagePool
+ *
+ * Returns: The total number of pages in @page_pool
+ */
+size_t
+ggml_key_value_page_pool_get_n_pages (GGMLKeyValuePagePool *page_pool)
+{
+  return page_pool->n_pages;
+}
+
+/**
+ * ggml_key_value_page_pool_get_n_free_pages:
+ * @page_pool: A #GGMLKeyValuePagePool
+ *
+ * Returns: The number of pages in @page_pool which are not in use
+ */
+size_t
+ggml_key_value_page_pool_get_n_free_pages (GGMLKeyValuePagePool *page_pool)
+{
+  g_autoptr(GMutexLocker) locker = g_mutex_locker_new (&page_pool->mutex);
+
+  return page_pool->free_pages->len;
+}
+
+/**
+ * ggml_key_value_page_pool_allocate_page:
+ * @page_pool: A #GGMLKeyValuePagePool
+ * @out_page: (out): The number of the allocated page
+ * @error: A #GError
+ *
+ * Takes a page from the free pages of @page_pool, with a page reference
+ * count of one. The page still holds whatever was written to it before,
+ * so the positions in it should be written before they are read.
+ *
+ * Returns: %TRUE with @out_page set on success, %FALSE with @error set if
+ *          there are no free pages left.
+ */
+gboolean
+ggml_key_value_page_pool_allocate_page (GGMLKeyValuePagePool  *page_pool,
+                                        int32_t               *out_page,
+                                        GError               **error)
+{
+  g_autoptr(GMutexLocker) locker = g_mutex_locker_new (&page_pool->mutex);
+
+  if (page_pool->free_pages->len == 0)
+    {
+      g_set_error (error,
+                   G_IO_ERROR,
+                   G_IO_ERROR_NO_SPACE,
+                   "All %zu pages of %zu positions in the key-value page pool are in use",
+                   page_pool->n_pages,
+                   page_pool->page_size);
+      return FALSE;
+    }
+
+  int32_t page = g_array_index (page_pool->free_pages, int32_t, page_pool->free_pages->len - 1);
+  g_array_set_size (page_pool->free_pages, page_pool->free_pages->len - 1);
+
+  g_assert (page_pool->page_ref_counts[page] == 0);
+  page_pool->page_ref_counts[page] = 1;
+
+  *out_page = page;
+  return TRUE;
+}
+
+/**
+ * ggml_key_value_page_pool_ref_page:
+ * @page_pool: A #GGMLKeyValuePagePool
+ * @page: The number of an allocated page
+ *
+ * Increases the reference count of @page, for instance because
+ * another sequence shares the same prefix.
+ */
+void
+ggml_key_value_page_pool_ref_page (GGMLKeyValuePagePool *page_pool,
+                                   int32_t               page)
+{
+  g_autoptr(GMutexLocker) locker = g_mutex_locker_new (&page_pool->mutex);
+
+  g_assert (page >= 0 && page < page_pool->n_pages);
+  g_assert (page_pool->page_ref_counts[page] > 0);
+
+  ++page_pool->page_ref_counts[page];
+}
+
+/**
+ * ggml_key_value_page_pool_unref_page:
+ * @page_pool: A #GGMLKeyValuePagePool
+ * @page: The number of an allocated page
+ *
+ * Decreases the reference count of @page. Once it goes to
+ * zero, the page is returned to the free pages of @page_pool.
+ */
+void
+ggml_key_value_page_pool_unref_page (GGMLKeyValuePagePool *page_pool,
+                                     int32_t               page)
+{
+  g_autoptr(GMutexLocker) locker = g_mutex_locker_new (&page_pool->mutex);
+
+  g_assert (page >= 0 && page < page_pool->n_pages);
+  g_assert (page_pool->page_ref_counts[page] > 0);
+
+  if (--page_pool->page_ref_counts[page] == 0)
+    {
+      g_array_append_val (page_pool->free_pages, page);
+    }
+}
+
+/**
+ * ggml_key_value_page_pool_page_is_shared:
+ * @page_pool: A #GGMLKeyValuePagePool
+ * @page: The number of an allocated page
+ *
+ * Returns: %TRUE if @page has more than one reference, in which case it
+ *          needs to be copied before it is written to.
+ */
+gboolean
+ggml_key_value_page_pool_page_is_shared (GGMLKeyValuePagePool *page_pool,
+                                         int32_t               page)
+{
+  g_autoptr(GMutexLocker) locker = g_mutex_locker_new (&page_pool->mutex);
+
+  g_assert (page >= 0 && page < page_pool->n_pages);
+
+  return page_pool->page_ref_counts[page] > 1;
+}
+
+/**
+ * ggml_key_value_page_pool_copy_page:
+ * @page_pool: A #GGMLKeyValuePagePool
+ * @src_page: The number of the page to copy from
+ * @dst_page: The number of the page to copy to
+ *
+ * Copies the contents of @src_page into @dst_page, in every group of
+ * every tensor of the memory of @page_pool.
+ */
+void
+ggml_key_value_page_pool_copy_page (GGMLKeyValuePagePool *page_pool,
+                                    int32_t               src_page,
+                                    int32_t               dst_page)
+{
+  GHashTableIter iter;
+  gpointer value;
+
+  g_assert (src_page >= 0 && src_page < page_pool->n_pages);
+  g_assert (dst_page >= 0 && dst_page < page_pool->n_pages);
+
+  g_hash_table_iter_init (&iter, page_pool->memory);
+  while (g_hash_table_iter_next (&iter, NULL, &value))
+    {
+      struct ggml_tensor *tensor = ((GGMLTensor *) value)->tensor;
+      const size_t page_n_bytes = tensor->nb[1] * page_pool->page_size;
+
+      for (int64_t group = 0; group < tensor->ne[2]; ++group)
+        {
+          char *group_data = (char *) tensor->data + group * tensor->nb[2];
+
+          memcpy (group_data + dst_page * page_n_bytes,
+                  group_data + src_page * page_n_bytes,
+                  page_n_bytes);
+        }
+    }
+}
+
+G_DEFINE_BOXED_TYPE (GGMLKeyValuePagePool, ggml_key_value_page_pool, ggml_key_value_page_pool_ref, ggml_key_value_page_pool_unref)
@@ -0,0 +1,65 @@
+/*
+ * ggml-gobject/ggml-key-value-page-pool.h
+ *
+ * Header file for ggml-key-value-page-pool
+ *
+ * Copyright (C) 2023 Sam Spilsbury.
+ *
+ * ggml-gobject is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation; either version 2.1 of the License, or
+ * (at your option) any later version.
+ *
+ * ggml-gobject is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with ggml-gobject; if not, write to the Free Software Foundation,
+ * Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+#pragma once
+
+#include <glib-object.h>
+#include <ggml-gobject/ggml-model-desc.h>
+
+G_BEGIN_DECLS
+
+#define GGML_KEY_VALUE_PAGE_POOL_DEFAULT_PAGE_SIZE 32
+
+typedef struct _GGMLKeyValuePagePool GGMLKeyValuePagePool;
+
+#define GGML_TYPE_KEY_VALUE_PAGE_POOL (ggml_key_value_page_pool_get_type ())
+GType ggml_key_value_page_pool_get_type (void);
+
+GGMLKeyValuePagePool * ggml_key_value_page_pool_new (GGMLModelDescNode  *memory_desc,
+                                                     size_t              n_positions,
+                                                     size_t              page_size,
+                                                     GError            **error);
+GGMLKeyValuePagePool * ggml_key_value_page_pool_ref (GGMLKeyValuePagePool *page_pool);
+void ggml_key_value_page_pool_unref (GGMLKeyValuePagePool *page_pool);
+
+GHashTable * ggml_key_value_page_pool_get_memory (GGMLKeyValuePagePool *page_pool);
+size_t ggml_key_value_page_pool_get_page_size (GGMLKeyValuePagePool *page_pool);
+size_t ggml_key_value_page_pool_get_n_positions (GGMLKeyValuePagePool *page_pool);
+size_t ggml_key_value_page_pool_get_n_pages (GGMLKeyValuePagePool *page_pool);
+size_t ggml_key_value_page_pool_get_n_free_pages (GGMLKeyValuePagePool *page_pool);
+
+gboolean ggml_key_value_page_pool_allocate_page (GGMLKeyValuePagePool  *page_pool,
+                                                 int32_t               *out_page,
+                                                 GError               **error);
+void ggml_key_value_page_pool_ref_page (GGMLKeyValuePagePool *page_pool,
+                                        int32_t               page);
+void ggml_key_value_page_pool_unref_page (GGMLKeyValuePagePool *page_pool,
+                                          int32_t               page);
+gboolean ggml_key_value_page_pool_page_is_shared (GGMLKeyValuePagePool *page_pool,
+                                                  int32_t               page);
+void ggml_key_value_page_pool_copy_page (GGMLKeyValuePagePool *page_pool,
+                                         int32_t               src_page,
+                                         int32_t               dst_page);
+
+G_DEFINE_AUTOPTR_CLEANUP_FUNC (GGMLKeyValuePagePool, ggml_key_value_page_pool_unref)
+
+G_END_DECLS
@@ -54,6 +54,176 @@ ggml_language_model_sampler_sample_logits_tensor (GGMLLanguageModelSampler *samp
                                                                                 out_n_samples);
 }
 
+/**
+ * ggml_language_model_sampler_get_state:
+ * @sampler: A #GGMLLanguageModelSampler
+ *
+ * Gets whatever @sampler needs to carry on sampling in the same way after
+ * being re-created, for instance the position in its random sequence. This
+ * is used to save the state of a completion cursor.
+ *
+ * Returns: (transfer full) (nullable): A #GVariant with the state of @sampler, or
+ *          %NULL if @sampler has no state.
+ */
+GVariant *
+ggml_language_model_sampler_get_state (GGMLLanguageModelSampler *sampler)
+{
+  GGMLLanguageModelSamplerInterface *iface = GGML_LANGUAGE_MODEL_SAMPLER_GET_IFACE (sampler);
+
+  if (iface->get_state == NULL)
+    {
+      return NULL;
+    }
+
+  return iface->get_state (sampler);
+}
+
+/**
+ * ggml_language_model_sampler_set_state:
+ * @sampler: A #GGMLLanguageModelSampler
+ * @state: (transfer none) (nullable): A #GVariant from ggml_language_model_sampler_get_state
+ * @error: A #GError
+ *
+ * Puts @sampler back into the state it was in when @state was taken. A %NULL
+ * @state is only accepted by samplers without any state.
+ *
+ * Returns: %TRUE on success or %FALSE with @error set if @state does not
+ *          belong to this kind of sampler.
+ */
+gboolean
+ggml_language_model_sampler_set_state (GGMLLanguageModelSampler  *sampler,
+                                       GVariant                  *state,
+                                       GError                   **error)
+{
+  GGMLLanguageModelSamplerInterface *iface = GGML_LANGUAGE_MODEL_SAMPLER_GET_IFACE (sampler);
+
+  if (iface->set_state == NULL)
+    {
+      if (state != NULL)
+        {
+          g_set_error (error,
+                       G_IO_ERROR,
+                       G_IO_ERROR_INVALID_DATA,
+                       "Sampler of type %s has no state to set",
+                       G_OBJECT_TYPE_NAME (sampler));
+          return FALSE;
+        }
+
+      return TRUE;
+    }
+
+  return iface->set_state (sampler, state, error);
+}
+
+/**
+ * ggml_language_model_sampler_copy:
+ * @sampler: A #GGMLLanguageModelSampler
+ *
+ * Makes a new sampler that samples in the same way as @sampler, but does
+ * not share any state with @sampler. This is used to fork a completion
+ * cursor. Samplers that make random choices give the copy a random sequence
+ * of its own, so that forks of the same cursor do not all make the same
+ * choices. Samplers without any state of their own can return @sampler itself.
+ *
+ * Returns: (transfer full): A new #GGMLLanguageModelSampler
+ */
+GGMLLanguageModelSampler *
+ggml_language_model_sampler_copy (GGMLLanguageModelSampler *sampler)
+{
+  GGMLLanguageModelSamplerInterface *iface = GGML_LANGUAGE_MODEL_SAMPLER_GET_IFACE (sampler);
+
+  if (iface->copy == NULL)
+    {
+      return g_object_ref (sampler);
+    }
+
+  return iface->copy (sampler);
+}
+
+static size_t
+ggml_language_model_sampler_sample_logits_row (GGMLLanguageModelSampler *sampler,
+                                               float                    *logits_data,
+                                               size_t                    n_vocab)
+{
+  size_t n_samples;
+  size_t shape[] = { n_vocab };
+  g_autofree size_t *samples = ggml_language_model_sampler_sample_logits_tensor (sampler,
+                                                                                 logits_data,
+                                                                                 n_vocab,
+                                                                                 shape,
+                                                                                 G_N_ELEMENTS (shape),
+                                                                                 &n_samples);
+
+  return samples[0];
+}
+
+/**
+ * ggml_language_model_sampler_verify_draft_tokens:
+ * @sampler: A #GGMLLanguageModelSampler
+ * @draft_logits_data: (array): @n_draft_tokens rows of @n_vocab logits from the draft
+ *                     model, one for each of @draft_tokens
+ * @target_logits_data: (array): @n_draft_tokens + 1 rows of @n_vocab logits from the
+ *                      target model, for the positions before and after each of @draft_tokens
+ * @n_vocab: The number of logits in each row
+ * @draft_tokens: (array length=n_draft_tokens): The tokens that @sampler sampled
+ *                from @draft_logits_data
+ * @n_draft_tokens: The number of tokens in @draft_tokens
+ * @out_next_token: (out): The token that comes after the accepted draft tokens
+ *
+ * Decides how many of the tokens that a smaller draft model proposed
+ * the target model would have produced, for speculative decoding. The
+ * tokens that come out are distributed as if @sampler had sampled from
+ * @target_logits_data one position at a time.
+ *
+ * By default, each row of @target_logits_data is sampled in turn, and draft
+ * tokens are accepted for as long as they are the same as the sampled ones.
+ * Samplers can do better than that, for instance with rejection sampling.
+ *
+ * Returns: The number of accepted draft tokens. @out_next_token is either the
+ *          replacement for the first rejected token or the token after the
+ *          last draft token if all were accepted.
+ */
+size_t
+ggml_language_model_sampler_verify_draft_tokens (GGMLLanguageModelSampler *sampler,
+                                                 float                    *draft_logits_data,
+                                                 float                    *target_logits_data,
+                                                 size_t                    n_vocab,
+                                                 const size_t             *draft_tokens,
+                                                 size_t                    n_draft_tokens,
+                                                 size_t                   *out_next_token)
+{
+  GGMLLanguageModelSamplerInterface *iface = GGML_LANGUAGE_MODEL_SAMPLER_GET_IFACE (sampler);
+
+  if (iface->verify_draft_tokens != NULL)
+    {
+      return iface->verify_draft_tokens (sampler,
+                                         draft_logits_data,
+                                         target_logits_data,
+                                         n_vocab,
+                                         draft_tokens,
+                                         n_draft_tokens,
+                                         out_next_token);
+    }
+
+  for (size_t i = 0; i < n_draft_tokens; ++i)
+    {
+      size_t token = ggml_language_model_sampler_sample_logits_row (sampler,
+                                                                    target_logits_data + i * n_vocab,
+                                                                    n_vocab);
+
+      if (token != draft_tokens[i])
+        {
+          *out_next_token = token;
+          return i;
+        }
+    }
+
+  *out_next_token = ggml_language_model_sampler_sample_logits_row (sampler,
+                                                                   target_logits_data + n_draft_tokens * n_vocab,
+                                                                   n_vocab);
+  return n_draft_tokens;
+}
+
 static void ggml_language_model_sampler_default_init (GGMLLanguageModelSamplerInterface *iface)
 {
 }
@@ -40,6 +40,18 @@ struct _GGMLLanguageModelSamplerInterface
                                     size_t                   *shape,
                                     size_t                    n_shape,
                                     size_t                   *out_n_samples);
+  GVariant * (*get_state) (GGMLLanguageModelSampler *sampler);
+  gboolean   (*set_state) (GGMLLanguageModelSampler  *sampler,
+                           GVariant                  *state,
+                           GError                   **error);
+  size_t     (*verify_draft_tokens) (GGMLLanguageModelSampler *sampler,
+                                     float                    *draft_logits_data,
+                                     float                    *target_logits_data,
+                                     size_t                    n_vocab,
+                                     const size_t             *draft_tokens,
+                                     size_t                    n_draft_tokens,
+                                     size_t                   *out_next_token);
+  GGMLLanguageModelSampler * (*copy) (GGMLLanguageModelSampler *sampler);
 };
 
 size_t * ggml_language_model_sampler_sample_logits_tensor (GGMLLanguageModelSampler *sampler,
@@ -49,4 +61,17 @@ size_t * ggml_language_model_sampler_sample_logits_tensor (GGMLLanguageModelSamp
                                                            size_t                    n_shape,
                                                            size_t                   *out_n_samples);
 
+GVariant * ggml_language_model_sampler_get_state (GGMLLanguageModelSampler *sampler);
+gboolean ggml_language_model_sampler_set_state (GGMLLanguageModelSampler  *sampler,
+                                                GVariant                  *state,
+                                                GError                   **error);
+size_t ggml_language_model_sampler_verify_draft_tokens (GGMLLanguageModelSampler *sampler,
+                                                        float                    *draft_logits_data,
+                                                        float                    *target_logits_data,
+                                                        size_t                    n_vocab,
+                                                        const size_t             *draft_tokens,
+                                                        size_t                    n_draft_tokens,
+                                                        size_t                   *out_next_token);
+GGMLLanguageModelSampler * ggml_language_model_sampler_copy (GGMLLanguageModelSampler *sampler);
+
 G_END_DECLS
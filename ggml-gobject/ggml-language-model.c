@@ -20,13 +20,18 @@
  * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
  */
 
+#include <errno.h>
+#include <glib/gstdio.h>
 #include <ggml-gobject/ggml-argmax-language-model-sampler.h>
 #include <ggml-gobject/ggml-cached-model.h>
+#include <ggml-gobject/ggml-detokenizer.h>
 #include <ggml-gobject/ggml-execution-memory.h>
 #include <ggml-gobject/ggml-gpt.h>
 #include <ggml-gobject/ggml-language-model.h>
 #include <ggml-gobject/ggml-quantize.h>
+#include <ggml-gobject/ggml-enum-types.h>
 #include <ggml-gobject/internal/ggml-async-queue-source.h>
+#include <ggml-gobject/internal/ggml-batch-decoder.h>
 #include <ggml-gobject/internal/ggml-stream-internal.h>
 
 struct _GGMLLanguageModelCompletionCursor {
@@ -34,9 +39,18 @@ struct _GGMLLanguageModelCompletionCursor {
   GGMLExecutionMemory *execution_memory;
   GGMLLanguageModelSampler *sampler;
   char *prompt;
+  GArray *pending_tokens;
+  GString *pending_text;
+  GGMLDetokenizer *detokenizer;
   size_t max_completion_tokens;
   size_t memory_position;
   int32_t most_recent_token;
+  size_t n_threads;
+  GGMLLanguageModel *draft_language_model;
+  GGMLExecutionMemory *draft_execution_memory;
+  size_t n_draft_tokens;
+  size_t draft_memory_position;
+  GArray *draft_pending_tokens;
   gboolean is_executing;
   size_t ref_count;
 };
@@ -57,6 +71,15 @@ ggml_language_model_completion_cursor_unref (GGMLLanguageModelCompletionCursor *
       g_clear_pointer (&cursor->execution_memory, ggml_execution_memory_unref);
       g_clear_pointer (&cursor->sampler, g_object_unref);
       g_clear_pointer (&cursor->prompt, g_free);
+      g_clear_pointer (&cursor->pending_tokens, g_array_unref);
+      if (cursor->pending_text != NULL)
+        {
+          g_string_free (g_steal_pointer (&cursor->pending_text), TRUE);
+        }
+      g_clear_pointer (&cursor->detokenizer, ggml_detokenizer_unref);
+      g_clear_pointer (&cursor->draft_language_model, ggml_language_model_unref);
+      g_clear_pointer (&cursor->draft_execution_memory, ggml_execution_memory_unref);
+      g_clear_pointer (&cursor->draft_pending_tokens, g_array_unref);
       g_clear_pointer (&cursor, g_free);
     }
 }
@@ -110,6 +133,9 @@ struct _GGMLLanguageModel {
   GGMLTokenDictionary *token_dictionary;
   GGMLModel *model;
   GGMLModelDescNode *memory_desc_node;
+  GGMLKeyValuePagePool *key_value_page_pool;
+  GGMLPrefixCache *prefix_cache;
+  GGMLBatchDecoder *batch_decoder;
   size_t ref_count;
 };
 
@@ -215,6 +241,241 @@ ggml_language_model_new (GGMLHyperparameters *hyperparameters,
   return language_model;
 }
 
+/**
+ * ggml_language_model_set_key_value_page_pool:
+ * @language_model: A #GGMLLanguageModel
+ * @page_pool: (transfer none) (nullable): A #GGMLKeyValuePagePool
+ *
+ * Sets a #GGMLKeyValuePagePool that completion cursors created from
+ * @language_model take their key-value memory from. The @page_pool must
+ * have been created from the memory description of @language_model.
+ * Cursors that already have their memory are not affected.
+ *
+ * If @page_pool is %NULL, then each cursor gets its own key-value memory.
+ */
+void
+ggml_language_model_set_key_value_page_pool (GGMLLanguageModel    *language_model,
+                                             GGMLKeyValuePagePool *page_pool)
+{
+  g_clear_pointer (&language_model->key_value_page_pool, ggml_key_value_page_pool_unref);
+  language_model->key_value_page_pool = page_pool != NULL ? ggml_key_value_page_pool_ref (page_pool) : NULL;
+}
+
+/**
+ * ggml_language_model_get_key_value_page_pool:
+ * @language_model: A #GGMLLanguageModel
+ *
+ * Returns: (transfer none) (nullable): The #GGMLKeyValuePagePool that
+ *          completion cursors take their key-value memory from, or %NULL
+ *          if they have their own.
+ */
+GGMLKeyValuePagePool *
+ggml_language_model_get_key_value_page_pool (GGMLLanguageModel *language_model)
+{
+  return language_model->key_value_page_pool;
+}
+
+/**
+ * ggml_language_model_set_prefix_cache:
+ * @language_model: A #GGMLLanguageModel
+ * @prefix_cache: (transfer none) (nullable): A #GGMLPrefixCache
+ *
+ * Sets a #GGMLPrefixCache for the completion cursors created from
+ * @language_model. When a cursor processes its prompt, it first
+ * restores the keys and values for the longest prefix of the prompt
+ * in @prefix_cache, then adds a snapshot for the whole prompt.
+ * The same @prefix_cache can be set on several models, snapshots
+ * are only restored into models with the same memory description.
+ *
+ * If @prefix_cache is %NULL, then each cursor processes its whole prompt.
+ */
+void
+ggml_language_model_set_prefix_cache (GGMLLanguageModel *language_model,
+                                      GGMLPrefixCache   *prefix_cache)
+{
+  g_clear_pointer (&language_model->prefix_cache, ggml_prefix_cache_unref);
+  language_model->prefix_cache = prefix_cache != NULL ? ggml_prefix_cache_ref (prefix_cache) : NULL;
+}
+
+/**
+ * ggml_language_model_get_prefix_cache:
+ * @language_model: A #GGMLLanguageModel
+ *
+ * Returns: (transfer none) (nullable): The #GGMLPrefixCache of @language_model,
+ *          or %NULL if there is none.
+ */
+GGMLPrefixCache *
+ggml_language_model_get_prefix_cache (GGMLLanguageModel *language_model)
+{
+  return language_model->prefix_cache;
+}
+
+typedef struct {
+  GGMLDataType data_type;
+  gboolean transposed_values;
+} KeyValueCacheMapFuncData;
+
+static GGMLModelDescLeaf *
+key_value_cache_map_func (const char              *path,
+                          const GGMLModelDescLeaf *leaf,
+                          gpointer                 user_data)
+{
+  KeyValueCacheMapFuncData *data = user_data;
+
+  /* Transposed values have one row of positions for each channel
+   * and layer, eg {n_ctx, n_embd * n_layer} instead of
+   * {n_embd, n_ctx, n_layer}. */
+  if (data->transposed_values && g_str_equal (path, "memory/v") && leaf->n_dim == 3)
+    {
+      int64_t transposed_dimensions[] = { leaf->dimensions[1], leaf->dimensions[0] * leaf->dimensions[2] };
+
+      return ggml_model_desc_leaf_new (transposed_dimensions, 2, data->data_type);
+    }
+
+  return ggml_model_desc_leaf_new (leaf->dimensions, leaf->n_dim, data->data_type);
+}
+
+static gboolean
+ggml_language_model_configure_key_value_cache (GGMLLanguageModel  *language_model,
+                                               GGMLModelConfig    *model_config,
+                                               GError            **error)
+{
+  size_t key_value_cache_capacity = ggml_model_config_get_key_value_cache_capacity (model_config);
+  GGMLDataType key_value_cache_type = ggml_model_config_get_key_value_cache_type (model_config);
+  gboolean key_value_cache_transposed_values = ggml_model_config_get_key_value_cache_transposed_values (model_config);
+  size_t prefix_cache_max_bytes = ggml_model_config_get_prefix_cache_max_bytes (model_config);
+  size_t batch_decoding_max_sequences = ggml_model_config_get_batch_decoding_max_sequences (model_config);
+
+  if (key_value_cache_type != GGML_DATA_TYPE_F32 &&
+      key_value_cache_type != GGML_DATA_TYPE_F16 &&
+      key_value_cache_type != GGML_DATA_TYPE_Q8_0)
+    {
+      g_set_error (error,
+                   G_IO_ERROR,
+                   G_IO_ERROR_NOT_SUPPORTED,
+                   "Key-value memory can only be stored as F32, F16 or Q8_0");
+      return FALSE;
+    }
+
+  /* Values are written one channel at a time when they are
+   * transposed, which does not work with quantized blocks or pages */
+  if (key_value_cache_transposed_values &&
+      (key_value_cache_type == GGML_DATA_TYPE_Q8_0 || key_value_cache_capacity > 0))
+    {
+      g_set_error (error,
+                   G_IO_ERROR,
+                   G_IO_ERROR_NOT_SUPPORTED,
+                   "Transposed values cannot be stored as Q8_0 or in a shared key-value cache");
+      return FALSE;
+    }
+
+  /* The memory is only created once there is a cursor, so it is enough
+   * to change the description. The model itself is not affected. */
+  if (key_value_cache_type != GGML_DATA_TYPE_F32 || key_value_cache_transposed_values)
+    {
+      KeyValueCacheMapFuncData data = {
+        .data_type = key_value_cache_type,
+        .transposed_values = key_value_cache_transposed_values
+      };
+      GGMLModelDescNode *memory_desc_node = ggml_model_desc_map (language_model->memory_desc_node,
+                                                                 key_value_cache_map_func,
+                                                                 &data);
+
+      g_clear_pointer (&language_model->memory_desc_node, ggml_model_desc_node_unref);
+      language_model->memory_desc_node = memory_desc_node;
+    }
+
+  /* Sequences are batched by where their pages are in the shared pool */
+  if (batch_decoding_max_sequences > 0 && key_value_cache_capacity == 0)
+    {
+      g_set_error (error,
+                   G_IO_ERROR,
+                   G_IO_ERROR_NOT_SUPPORTED,
+                   "Batched decoding needs a shared key-value cache");
+      return FALSE;
+    }
+
+  if (prefix_cache_max_bytes > 0)
+    {
+      g_autoptr(GGMLPrefixCache) prefix_cache = ggml_prefix_cache_new (prefix_cache_max_bytes);
+
+      ggml_language_model_set_prefix_cache (language_model, prefix_cache);
+    }
+
+  if (key_value_cache_capacity == 0)
+    {
+      return TRUE;
+    }
+
+  g_autoptr(GGMLKeyValuePagePool) page_pool = ggml_key_value_page_pool_new (language_model->memory_desc_node,
+                                                                             key_value_cache_capacity,
+                                                                             GGML_KEY_VALUE_PAGE_POOL_DEFAULT_PAGE_SIZE,
+                                                                             error);
+
+  if (page_pool == NULL)
+    {
+      return FALSE;
+    }
+
+  ggml_language_model_set_key_value_page_pool (language_model, page_pool);
+
+  if (batch_decoding_max_sequences == 0)
+    {
+      return TRUE;
+    }
+
+  language_model->batch_decoder = ggml_batch_decoder_new (language_model->model,
+                                                          language_model->hyperparameters,
+                                                          language_model->memory_desc_node,
+                                                          page_pool,
+                                                          batch_decoding_max_sequences,
+                                                          error);
+
+  return language_model->batch_decoder != NULL;
+}
+
+static int32_t
+ggml_language_model_sample_logits_row (GGMLLanguageModelSampler *sampler,
+                                       float                    *logits,
+                                       int32_t                   n_vocab)
+{
+  size_t n_tokens;
+  size_t logits_shape[] = { n_vocab };
+
+  g_autofree size_t *tokens = ggml_language_model_sampler_sample_logits_tensor (sampler,
+                                                                                logits,
+                                                                                logits_shape[0],
+                                                                                logits_shape,
+                                                                                1,
+                                                                                &n_tokens);
+
+  return tokens[0];
+}
+
+static GGMLTensor *
+ggml_language_model_forward_tokens (GGMLModel            *model,
+                                    GGMLHyperparameters  *hyperparameters,
+                                    GHashTable           *inference_parameters,
+                                    GGMLExecutionMemory  *execution_memory,
+                                    int32_t              *input_tokens,
+                                    size_t                n_input_tokens,
+                                    GCancellable         *cancellable,
+                                    GError              **error)
+{
+  g_autoptr(GVariant) variant = g_variant_ref_sink(g_variant_new_fixed_array (G_VARIANT_TYPE_INT32,
+                                                                              input_tokens,
+                                                                              n_input_tokens,
+                                                                              sizeof (int32_t)));
+
+  return ggml_model_forward (model,
+                             hyperparameters,
+                             variant,
+                             inference_parameters,
+                             execution_memory,
+                             cancellable,
+                             error);
+}
+
 static gboolean
 ggml_language_model_forward_single_iteration (GGMLModel                 *model,
                                               GGMLHyperparameters       *hyperparameters,
@@ -228,17 +489,14 @@ ggml_language_model_forward_single_iteration (GGMLModel                 *model,
                                               GError                   **error)
 {
   int32_t n_vocab = ggml_hyperparameters_get_int32 (hyperparameters, "n_vocab");
-  g_autoptr(GVariant) variant = g_variant_ref_sink(g_variant_new_fixed_array (G_VARIANT_TYPE_INT32,
-                                                                              input_tokens,
-                                                                              n_input_tokens,
-                                                                              sizeof (int32_t)));
-  g_autoptr(GGMLTensor) logits_tensor = ggml_model_forward (model,
-                                                            hyperparameters,
-                                                            variant,
-                                                            inference_parameters,
-                                                            execution_memory,
-                                                            cancellable,
-                                                            error);
+  g_autoptr(GGMLTensor) logits_tensor = ggml_language_model_forward_tokens (model,
+                                                                            hyperparameters,
+                                                                            inference_parameters,
+                                                                            execution_memory,
+                                                                            input_tokens,
+                                                                            n_input_tokens,
+                                                                            cancellable,
+                                                                            error);
 
   if (logits_tensor == NULL)
     {
@@ -246,26 +504,57 @@ ggml_language_model_forward_single_iteration (GGMLModel                 *model,
       return FALSE;
     }
 
+  /* The forward function may only have computed the logits for the
+   * last few positions (by default only the last one), so find the
+   * last row from the size of the output */
   size_t logits_tensor_n_bytes;
   float *logits_tensor_data = (float *) ggml_tensor_get_data (logits_tensor, &logits_tensor_n_bytes);
-  float *end_logit_data = logits_tensor_data + (((int32_t) (n_input_tokens - 1)) * n_vocab);
+  size_t n_logits_rows = logits_tensor_n_bytes / (n_vocab * sizeof (float));
+  float *end_logit_data = logits_tensor_data + ((n_logits_rows - 1) * n_vocab);
 
-  size_t n_tokens;
-  size_t logits_shape[] = { n_vocab };
+  *out_token = ggml_language_model_sample_logits_row (sampler, end_logit_data, n_vocab);
 
-  g_autofree size_t *tokens = ggml_language_model_sampler_sample_logits_tensor (sampler,
-                                                                                end_logit_data,
-                                                                                logits_shape[0],
-                                                                                logits_shape,
-                                                                                1,
-                                                                                &n_tokens);
+  return TRUE;
+}
+
+/* Like ggml_language_model_forward_single_iteration for a single token,
+ * but in the same forward pass as the other cursors that are decoding */
+static gboolean
+ggml_language_model_batch_decode_single_iteration (GGMLBatchDecoder          *batch_decoder,
+                                                   GGMLHyperparameters       *hyperparameters,
+                                                   GGMLExecutionMemory       *execution_memory,
+                                                   GGMLLanguageModelSampler  *sampler,
+                                                   size_t                     n_past,
+                                                   int32_t                    input_token,
+                                                   size_t                     n_threads,
+                                                   GCancellable              *cancellable,
+                                                   int32_t                   *out_token,
+                                                   GError                   **error)
+{
+  int32_t n_vocab = ggml_hyperparameters_get_int32 (hyperparameters, "n_vocab");
+  g_autofree float *logits = g_new0 (float, n_vocab);
+
+  if (!ggml_batch_decoder_decode (batch_decoder,
+                                  execution_memory,
+                                  n_past,
+                                  input_token,
+                                  n_threads,
+                                  logits,
+                                  cancellable,
+                                  error))
+    {
+      *out_token = -1;
+      return FALSE;
+    }
 
-  *out_token = tokens[0];
+  *out_token = ggml_language_model_sample_logits_row (sampler, logits, n_vocab);
 
   return TRUE;
 }
 
 static const char n_past_key[] = "n_past";
+static const char n_threads_key[] = "n_threads";
+static const char n_logits_key[] = "n_logits";
 
 /**
  * ggml_language_model_decode_tokens:
@@ -285,6 +574,46 @@ ggml_language_model_decode_tokens (GGMLLanguageModel *language_model,
                                        length);
 }
 
+/**
+ * ggml_language_model_tokenize_batch:
+ * @language_model: A #GGMLLanguageModel
+ * @strings: (array length=n_strings): The strings to tokenize
+ * @n_strings: The number of strings in @strings
+ * @n_threads: The number of threads to tokenize on, or 0 for one per processor
+ * @out_tokens: (out) (array length=out_n_tokens) (transfer full): The tokens of
+ *              all the strings, one after the other
+ * @out_offsets: (out) (transfer full): An array of @n_strings + 1 offsets into
+ *               @out_tokens, where the tokens of string i are between
+ *               offsets i and i + 1
+ * @out_n_tokens: (out): The total number of tokens
+ * @error: A #GError
+ *
+ * Tokenizes many strings at once with the token dictionary of @language_model,
+ * see ggml_gpt_tokenize_batch().
+ *
+ * Returns: %TRUE with @out_tokens, @out_offsets and @out_n_tokens set on
+ *          success, %FALSE with @error set otherwise.
+ */
+gboolean
+ggml_language_model_tokenize_batch (GGMLLanguageModel   *language_model,
+                                    const char * const  *strings,
+                                    size_t               n_strings,
+                                    size_t               n_threads,
+                                    int32_t            **out_tokens,
+                                    size_t             **out_offsets,
+                                    size_t              *out_n_tokens,
+                                    GError             **error)
+{
+  return ggml_gpt_tokenize_batch (language_model->token_dictionary,
+                                  strings,
+                                  n_strings,
+                                  n_threads,
+                                  out_tokens,
+                                  out_offsets,
+                                  out_n_tokens,
+                                  error);
+}
+
 typedef struct _GGMLLanguageModelChunkCompletionResult
 {
   char     *chunk;
@@ -445,6 +774,344 @@ ggml_language_model_complete_thread_push_tokens_or_error (GGMLLanguageModelCompl
     }
 }
 
+static gboolean
+ggml_language_model_completion_cursor_restore_prompt_prefix (GGMLLanguageModelCompletionCursor  *cursor,
+                                                             const int32_t                      *prompt_tokens,
+                                                             size_t                              n_prompt_tokens,
+                                                             size_t                             *out_n_restored_tokens,
+                                                             GError                            **error)
+{
+  GGMLPrefixCache *prefix_cache = cursor->language_model->prefix_cache;
+  g_autoptr(GBytes) snapshot = NULL;
+  size_t n_snapshot_tokens = 0;
+
+  *out_n_restored_tokens = 0;
+
+  /* The last prompt token always goes through the model,
+   * since we need its logits to sample the next token. */
+  if (prefix_cache == NULL || n_prompt_tokens < 2)
+    {
+      return TRUE;
+    }
+
+  g_autoptr(GVariant) memory_desc = ggml_model_desc_node_serialize (cursor->language_model->memory_desc_node);
+  size_t n_matched_tokens = ggml_prefix_cache_lookup (prefix_cache,
+                                                      memory_desc,
+                                                      prompt_tokens,
+                                                      n_prompt_tokens - 1,
+                                                      &snapshot,
+                                                      &n_snapshot_tokens);
+
+  if (n_matched_tokens == 0)
+    {
+      return TRUE;
+    }
+
+  if (!ggml_execution_memory_restore_key_value_positions (cursor->execution_memory,
+                                                          snapshot,
+                                                          n_snapshot_tokens,
+                                                          n_matched_tokens,
+                                                          error))
+    {
+      return FALSE;
+    }
+
+  *out_n_restored_tokens = n_matched_tokens;
+  return TRUE;
+}
+
+static gboolean
+ggml_language_model_completion_cursor_save_prompt_prefix (GGMLLanguageModelCompletionCursor  *cursor,
+                                                          const int32_t                      *prompt_tokens,
+                                                          size_t                              n_prompt_tokens,
+                                                          size_t                              n_restored_tokens,
+                                                          GError                            **error)
+{
+  GGMLPrefixCache *prefix_cache = cursor->language_model->prefix_cache;
+
+  /* Nothing new to save if everything up to the last
+   * prompt token came from the cache already */
+  if (prefix_cache == NULL || n_restored_tokens + 1 >= n_prompt_tokens)
+    {
+      return TRUE;
+    }
+
+  /* The cache would not keep a snapshot that is larger than
+   * all of it, so don't copy the key-value memory at all */
+  if (ggml_execution_memory_get_key_value_positions_n_bytes (cursor->execution_memory,
+                                                             n_prompt_tokens) > ggml_prefix_cache_get_max_bytes (prefix_cache))
+    {
+      return TRUE;
+    }
+
+  g_autoptr(GBytes) snapshot = ggml_execution_memory_save_key_value_positions (cursor->execution_memory,
+                                                                               n_prompt_tokens,
+                                                                               error);
+
+  if (snapshot == NULL)
+    {
+      return FALSE;
+    }
+
+  g_autoptr(GVariant) memory_desc = ggml_model_desc_node_serialize (cursor->language_model->memory_desc_node);
+
+  ggml_prefix_cache_insert (prefix_cache, memory_desc, prompt_tokens, n_prompt_tokens, snapshot);
+  return TRUE;
+}
+
+/* Measures the execution memory for a pass of @max_completion_tokens tokens
+ * which asks for the logits of the last @n_logits of them, the most that any
+ * pass of the cursor will ask for. */
+static GGMLExecutionMemory *
+ggml_language_model_create_execution_memory (GGMLLanguageModel  *language_model,
+                                             size_t              max_completion_tokens,
+                                             size_t              n_logits,
+                                             size_t              n_past,
+                                             GHashTable         *inference_parameters,
+                                             GError            **error)
+{
+  g_autoptr(GGMLExecutionMemory) recorder_execution_memory = ggml_execution_memory_recorder_new (language_model->memory_desc_node);
+
+  /* Create an input with max_completion_tokens. We have to allocate
+   * here because creating the variant will copy */
+  g_autoptr(GArray) dummy_input_array = g_array_sized_new (FALSE,
+                                                           TRUE,
+                                                           sizeof (int32_t),
+                                                           max_completion_tokens);
+  g_array_set_size (dummy_input_array, max_completion_tokens);
+
+  g_autoptr(GVariant) dummy_inputs = g_variant_ref_sink (g_variant_new_fixed_array (G_VARIANT_TYPE_INT32,
+                                                                                    dummy_input_array->data,
+                                                                                    max_completion_tokens,
+                                                                                    sizeof (int32_t)));
+
+  /* In this case, n_past is always zero */
+  g_hash_table_insert (inference_parameters,
+                       (gpointer) n_past_key,
+                       GINT_TO_POINTER (n_past));
+  g_hash_table_insert (inference_parameters,
+                       (gpointer) n_logits_key,
+                       GINT_TO_POINTER (n_logits));
+
+  /* We must first do a worst-case pass through the model to
+   * determine what the real exection memory usage is */
+  g_autoptr(GGMLTensor) output_tensor = NULL;
+  g_autoptr(GGMLComputeGraph) compute_graph = ggml_model_build_graph (
+    language_model->model,
+    language_model->hyperparameters,
+    dummy_inputs,
+    inference_parameters,
+    recorder_execution_memory,
+    &output_tensor,
+    error
+  );
+
+  g_hash_table_remove (inference_parameters, n_logits_key);
+
+  if (compute_graph == NULL)
+    {
+      return NULL;
+    }
+
+  size_t execution_memory_size = ggml_compute_graph_get_computation_size (compute_graph,
+                                                                          output_tensor);
+
+  /* Cursors either take their key-value memory page by page from
+   * the shared pool, or have their own for the whole context */
+  if (language_model->key_value_page_pool != NULL)
+    {
+      return ggml_execution_memory_new_paged (
+        execution_memory_size,
+        language_model->key_value_page_pool
+      );
+    }
+
+  g_autoptr(GHashTable) flattened_memory_desc = ggml_model_desc_node_flatten (language_model->memory_desc_node);
+  g_autoptr(GHashTable) memory_weight_set = ggml_new_weight_set_from_flattened_desc (NULL, flattened_memory_desc);
+
+  return ggml_execution_memory_new (
+    execution_memory_size,
+    memory_weight_set
+  );
+}
+
+static gboolean
+ggml_language_model_completion_cursor_create_execution_memory (GGMLLanguageModelCompletionCursor  *cursor,
+                                                               GHashTable                         *inference_parameters,
+                                                               GError                            **error)
+{
+  /* The speculative decoding pass asks for the logits after
+   * each of the draft tokens and the most recent token */
+  cursor->execution_memory = ggml_language_model_create_execution_memory (cursor->language_model,
+                                                                          cursor->max_completion_tokens,
+                                                                          cursor->n_draft_tokens + 1,
+                                                                          cursor->memory_position,
+                                                                          inference_parameters,
+                                                                          error);
+
+  return cursor->execution_memory != NULL;
+}
+
+/* Runs one step of speculative decoding. The draft model first catches up
+ * on the tokens that the model has seen since the last step, then proposes
+ * @n_draft_tokens tokens after the most recent one, one at a time. The model
+ * checks all of them in a single forward pass and the sampler decides how many
+ * to keep.
+ *
+ * Returns the kept draft tokens followed by the token that the sampler picked
+ * after them, so there is always at least one token. */
+static GArray *
+ggml_language_model_completion_cursor_speculative_step (GGMLLanguageModelCompletionCursor  *cursor,
+                                                        GHashTable                         *inference_parameters,
+                                                        size_t                              n_draft_tokens,
+                                                        GCancellable                       *cancellable,
+                                                        GError                            **error)
+{
+  GGMLLanguageModel *language_model = cursor->language_model;
+  GGMLLanguageModel *draft_language_model = cursor->draft_language_model;
+  int32_t n_vocab = ggml_hyperparameters_get_int32 (language_model->hyperparameters, "n_vocab");
+
+  if (cursor->draft_execution_memory == NULL)
+    {
+      cursor->draft_execution_memory = ggml_language_model_create_execution_memory (draft_language_model,
+                                                                                    cursor->max_completion_tokens,
+                                                                                    1,
+                                                                                    cursor->draft_memory_position,
+                                                                                    inference_parameters,
+                                                                                    error);
+
+      if (cursor->draft_execution_memory == NULL)
+        {
+          return NULL;
+        }
+    }
+
+  g_autofree float *draft_logits = g_new0 (float, n_draft_tokens * n_vocab);
+  g_autofree size_t *draft_tokens = g_new0 (size_t, n_draft_tokens);
+  g_autoptr(GArray) draft_input_tokens = g_array_copy (cursor->draft_pending_tokens);
+  g_autoptr(GArray) input_tokens = g_array_sized_new (FALSE, FALSE, sizeof (int32_t), n_draft_tokens + 1);
+  size_t draft_memory_position = cursor->draft_memory_position;
+
+  g_array_append_val (draft_input_tokens, cursor->most_recent_token);
+  g_array_append_val (input_tokens, cursor->most_recent_token);
+
+  /* Nothing on the cursor changes until the model has checked the
+   * draft, so that a failed step can be retried */
+  for (size_t i = 0; i < n_draft_tokens; ++i)
+    {
+      g_hash_table_insert (inference_parameters,
+                           (gpointer) n_past_key,
+                           GINT_TO_POINTER (draft_memory_position));
+
+      g_autoptr(GGMLTensor) draft_logits_tensor = ggml_language_model_forward_tokens (draft_language_model->model,
+                                                                                      draft_language_model->hyperparameters,
+                                                                                      inference_parameters,
+                                                                                      cursor->draft_execution_memory,
+                                                                                      (int32_t *) draft_input_tokens->data,
+                                                                                      draft_input_tokens->len,
+                                                                                      cancellable,
+                                                                                      error);
+
+      if (draft_logits_tensor == NULL)
+        {
+          return NULL;
+        }
+
+      size_t draft_logits_tensor_n_bytes;
+      float *draft_logits_tensor_data = (float *) ggml_tensor_get_data (draft_logits_tensor, &draft_logits_tensor_n_bytes);
+      float *draft_logits_row = draft_logits + i * n_vocab;
+
+      memcpy (draft_logits_row,
+              draft_logits_tensor_data + (draft_logits_tensor_n_bytes / sizeof (float) - n_vocab),
+              n_vocab * sizeof (float));
+      draft_tokens[i] = ggml_language_model_sample_logits_row (cursor->sampler, draft_logits_row, n_vocab);
+      draft_memory_position += draft_input_tokens->len;
+
+      int32_t draft_token = draft_tokens[i];
+      g_array_set_size (draft_input_tokens, 0);
+      g_array_append_val (draft_input_tokens, draft_token);
+      g_array_append_val (input_tokens, draft_token);
+    }
+
+  /* The model needs the logits after each of the draft tokens */
+  g_hash_table_insert (inference_parameters,
+                       (gpointer) n_past_key,
+                       GINT_TO_POINTER (cursor->memory_position));
+  g_hash_table_insert (inference_parameters,
+                       (gpointer) n_logits_key,
+                       GINT_TO_POINTER (input_tokens->len));
+
+  g_autoptr(GGMLTensor) logits_tensor = ggml_language_model_forward_tokens (language_model->model,
+                                                                            language_model->hyperparameters,
+                                                                            inference_parameters,
+                                                                            cursor->execution_memory,
+                                                                            (int32_t *) input_tokens->data,
+                                                                            input_tokens->len,
+                                                                            cancellable,
+                                                                            error);
+
+  g_hash_table_remove (inference_parameters, n_logits_key);
+
+  if (logits_tensor == NULL)
+    {
+      return NULL;
+    }
+
+  size_t next_token;
+  size_t n_accepted_tokens = ggml_language_model_sampler_verify_draft_tokens (cursor->sampler,
+                                                                              draft_logits,
+                                                                              (float *) ggml_tensor_get_data (logits_tensor, NULL),
+                                                                              n_vocab,
+                                                                              draft_tokens,
+                                                                              n_draft_tokens,
+                                                                              &next_token);
+
+  /* The keys and values for the rejected tokens are still in both
+   * memories, but they are past the new positions, so they get
+   * overwritten. The last draft token never went through the draft
+   * model, so it has to go in on the next step if it was kept. */
+  g_autoptr(GArray) accepted_tokens = g_array_sized_new (FALSE, FALSE, sizeof (int32_t), n_accepted_tokens + 1);
+  int32_t next_token_int32 = next_token;
+
+  g_array_append_vals (accepted_tokens, &g_array_index (input_tokens, int32_t, 1), n_accepted_tokens);
+  g_array_append_val (accepted_tokens, next_token_int32);
+
+  cursor->draft_memory_position += cursor->draft_pending_tokens->len + 1 + MIN (n_accepted_tokens, n_draft_tokens - 1);
+  g_array_set_size (cursor->draft_pending_tokens, 0);
+
+  if (n_accepted_tokens == n_draft_tokens)
+    {
+      g_array_append_val (cursor->draft_pending_tokens, g_array_index (input_tokens, int32_t, n_draft_tokens));
+    }
+
+  cursor->memory_position += 1 + n_accepted_tokens;
+  cursor->most_recent_token = next_token;
+
+  return g_steal_pointer (&accepted_tokens);
+}
+
+/* Adds @token to the chunk that is being collected in the detokenizer
+ * of the cursor, sending the chunk to the caller once it is full */
+static void
+ggml_language_model_complete_thread_push_token (GGMLLanguageModelCompleteState *state,
+                                                size_t                         *n_chunk_tokens,
+                                                int32_t                         token)
+{
+  ggml_detokenizer_push_token (state->cursor->detokenizer, token);
+
+  if (++(*n_chunk_tokens) == state->chunk_size)
+    {
+      g_autofree char *chunk = ggml_detokenizer_take (state->cursor->detokenizer);
+      /* We completed a chunk, send it to the caller. */
+      ggml_language_model_complete_thread_push_tokens_or_error (state,
+                                                                g_steal_pointer (&chunk),
+                                                                FALSE,
+                                                                FALSE,
+                                                                NULL);
+      *n_chunk_tokens = 0;
+    }
+}
+
 static gpointer
 ggml_language_model_complete_cursor_thread_loop (gpointer data)
 {
@@ -452,6 +1119,12 @@ ggml_language_model_complete_cursor_thread_loop (gpointer data)
   g_autofree int32_t *out_prompt_tokens = NULL;
   size_t   out_n_prompt_tokens = 0;
   int32_t  n_completed_iterations = 0;
+  int32_t  n_ctx = ggml_hyperparameters_get_int32 (state->cursor->language_model->hyperparameters, "n_ctx");
+  int32_t  draft_n_ctx = (
+    state->cursor->draft_language_model != NULL ?
+    ggml_hyperparameters_get_int32 (state->cursor->draft_language_model->hyperparameters, "n_ctx") :
+    0
+  );
   g_autoptr(GError) error = NULL;
   g_autoptr(GHashTable) inference_parameters = NULL;
 
@@ -474,82 +1147,55 @@ ggml_language_model_complete_cursor_thread_loop (gpointer data)
 
   inference_parameters = g_hash_table_new_full (g_str_hash, g_str_equal, NULL , NULL);
 
-  /* Allocate space for a chunk buffer to save processed tokens into */
-  g_autoptr(GArray) chunk_tokens = g_array_sized_new (FALSE, TRUE, sizeof (int32_t), state->chunk_size);
-  int32_t *chunk_tokens_data = &(g_array_index (chunk_tokens, int32_t, 0));
+  if (state->cursor->n_threads > 0)
+    {
+      g_hash_table_insert (inference_parameters,
+                           (gpointer) n_threads_key,
+                           GSIZE_TO_POINTER (state->cursor->n_threads));
+    }
 
-  /* We allocate enough space upfront and also set the size.
-   * This is used as a ring buffer, so all zeros are fine */
-  chunk_tokens->len = state->chunk_size;
+  /* The number of tokens in the chunk that is being collected */
+  size_t n_chunk_tokens = 0;
 
-  int32_t current_chunk_index = 0;
+  if (state->cursor->execution_memory == NULL &&
+      !ggml_language_model_completion_cursor_create_execution_memory (state->cursor,
+                                                                      inference_parameters,
+                                                                      &error))
+    {
+      ggml_language_model_complete_thread_push_tokens_or_error (state,
+                                                                NULL,
+                                                                FALSE,
+                                                                FALSE,
+                                                                g_steal_pointer (&error));
+      return GINT_TO_POINTER (FALSE);
+    }
 
-  if (state->cursor->execution_memory == NULL)
+  for (; n_completed_iterations < state->iterations; ++n_completed_iterations)
     {
-      g_autoptr(GGMLExecutionMemory) recorder_execution_memory = ggml_execution_memory_recorder_new (state->cursor->language_model->memory_desc_node);
+      g_autoptr(GArray) appended_tokens = NULL;
+      int32_t *forward_input_tokens_ptr = NULL;
+      size_t n_forward_input_tokens = 0;
+      gboolean is_prompt_iteration = FALSE;
+      size_t n_draft_tokens = 0;
 
-      /* Create an input with max_completion_tokens. We have to allocate
-       * here because creating the variant will copy */
-      g_autoptr(GArray) dummy_input_array = g_array_sized_new (FALSE,
-                                                               TRUE,
-                                                               sizeof (int32_t),
-                                                               state->cursor->max_completion_tokens);
-      g_array_set_size (dummy_input_array, state->cursor->max_completion_tokens);
-
-      g_autoptr(GVariant) dummy_inputs = g_variant_ref_sink (g_variant_new_fixed_array (G_VARIANT_TYPE_INT32,
-                                                                                        dummy_input_array->data,
-                                                                                        state->cursor->max_completion_tokens,
-                                                                                        sizeof (int32_t)));
-
-      /* In this case, n_past is always zero */
       g_hash_table_insert (inference_parameters,
                            (gpointer) n_past_key,
                            GINT_TO_POINTER (state->cursor->memory_position));
 
-      /* We must first do a worst-case pass through the model to
-       * determine what the real exection memory usage is */
-      g_autoptr(GGMLTensor) output_tensor = NULL;
-      g_autoptr(GGMLComputeGraph) compute_graph = ggml_model_build_graph (
-        state->cursor->language_model->model,
-        state->cursor->language_model->hyperparameters,
-        dummy_inputs,
-        inference_parameters,
-        recorder_execution_memory,
-        &output_tensor,
-        &error
-      );
-
-      if (compute_graph == NULL)
+      /* The draft model can only propose tokens after the most recent one,
+       * and only as many as there are iterations and context left for in
+       * both models. The draft model first catches up on the tokens it has
+       * not seen yet, including the most recent one. */
+      if (state->cursor->draft_language_model != NULL &&
+          state->cursor->memory_position + 1 < (size_t) n_ctx &&
+          state->cursor->draft_memory_position + state->cursor->draft_pending_tokens->len + 1 <= (size_t) draft_n_ctx)
         {
-          ggml_language_model_complete_thread_push_tokens_or_error (state,
-                                                                    NULL,
-                                                                    FALSE,
-                                                                    FALSE,
-                                                                    g_steal_pointer (&error));
-          return GINT_TO_POINTER (FALSE);
+          n_draft_tokens = MIN (MIN (state->cursor->n_draft_tokens,
+                                     state->iterations - n_completed_iterations - 1),
+                                MIN (n_ctx - state->cursor->memory_position - 1,
+                                     draft_n_ctx - state->cursor->draft_memory_position - state->cursor->draft_pending_tokens->len));
         }
 
-      size_t execution_memory_size = ggml_compute_graph_get_computation_size (compute_graph,
-                                                                              output_tensor);
-
-      g_autoptr(GHashTable) flattened_memory_desc = ggml_model_desc_node_flatten (state->cursor->language_model->memory_desc_node);
-      g_autoptr(GHashTable) memory_weight_set = ggml_new_weight_set_from_flattened_desc (NULL, flattened_memory_desc);
-
-      state->cursor->execution_memory = ggml_execution_memory_new (
-        execution_memory_size,
-        memory_weight_set
-      );
-    }
-
-  for (; n_completed_iterations < state->iterations; ++n_completed_iterations)
-    {
-      int32_t *forward_input_tokens_ptr = NULL;
-      size_t n_forward_input_tokens = 0;
-
-      g_hash_table_insert (inference_parameters,
-                           (gpointer) n_past_key,
-                           GINT_TO_POINTER (state->cursor->memory_position));
-
       if (state->cursor->memory_position == 0)
         {
           /* First iteration, we have to initially tokenize and seed the memory */
@@ -567,9 +1213,26 @@ ggml_language_model_complete_cursor_thread_loop (gpointer data)
               return GINT_TO_POINTER (FALSE);
             }
 
+          /* Anything appended before the first pass goes right after the prompt */
+          if (state->cursor->pending_tokens->len > 0)
+            {
+              out_prompt_tokens = g_renew (int32_t,
+                                           out_prompt_tokens,
+                                           out_n_prompt_tokens + state->cursor->pending_tokens->len);
+              memcpy (out_prompt_tokens + out_n_prompt_tokens,
+                      state->cursor->pending_tokens->data,
+                      state->cursor->pending_tokens->len * sizeof (int32_t));
+              out_n_prompt_tokens += state->cursor->pending_tokens->len;
+            }
+
           /* Immediately return this chunk back to the caller. They will need to
            * collect the tokens. */
-          g_autofree char *init_chunk = g_strdup (state->cursor->prompt);
+          g_autofree char *init_chunk = g_strconcat (state->cursor->prompt,
+                                                     state->cursor->pending_text->str,
+                                                     NULL);
+
+          g_array_set_size (state->cursor->pending_tokens, 0);
+          g_string_truncate (state->cursor->pending_text, 0);
           /* We completed a chunk, send it to the caller. */
           ggml_language_model_complete_thread_push_tokens_or_error (state,
                                                                     g_steal_pointer (&init_chunk),
@@ -577,9 +1240,81 @@ ggml_language_model_complete_cursor_thread_loop (gpointer data)
                                                                     FALSE,
                                                                     NULL);
 
-          /* Set the forward_input_tokens_ptr to the tokenized tokens */
-          forward_input_tokens_ptr = out_prompt_tokens;
-          n_forward_input_tokens = out_n_prompt_tokens;
+          size_t n_restored_prompt_tokens = 0;
+
+          if (!ggml_language_model_completion_cursor_restore_prompt_prefix (state->cursor,
+                                                                            out_prompt_tokens,
+                                                                            out_n_prompt_tokens,
+                                                                            &n_restored_prompt_tokens,
+                                                                            &error))
+            {
+              ggml_language_model_complete_thread_push_tokens_or_error (state,
+                                                                        NULL,
+                                                                        FALSE,
+                                                                        FALSE,
+                                                                        g_steal_pointer (&error));
+              return GINT_TO_POINTER (FALSE);
+            }
+
+          state->cursor->memory_position = n_restored_prompt_tokens;
+          g_hash_table_insert (inference_parameters,
+                               (gpointer) n_past_key,
+                               GINT_TO_POINTER (state->cursor->memory_position));
+
+          /* Set the forward_input_tokens_ptr to the tokenized tokens
+           * which were not restored from the prefix cache */
+          forward_input_tokens_ptr = out_prompt_tokens + n_restored_prompt_tokens;
+          n_forward_input_tokens = out_n_prompt_tokens - n_restored_prompt_tokens;
+          is_prompt_iteration = TRUE;
+        }
+      else if (state->cursor->pending_tokens->len > 0)
+        {
+          /* The most recent token has not been through the model yet, so
+           * it goes in first, followed by everything that was appended */
+          appended_tokens = g_steal_pointer (&state->cursor->pending_tokens);
+          state->cursor->pending_tokens = g_array_new (FALSE, FALSE, sizeof (int32_t));
+          g_array_prepend_val (appended_tokens, state->cursor->most_recent_token);
+
+          /* Like the prompt, the appended text goes back to the caller as is */
+          g_autofree char *appended_chunk = g_string_free (g_steal_pointer (&state->cursor->pending_text), FALSE);
+          state->cursor->pending_text = g_string_new (NULL);
+          ggml_language_model_complete_thread_push_tokens_or_error (state,
+                                                                    g_steal_pointer (&appended_chunk),
+                                                                    FALSE,
+                                                                    FALSE,
+                                                                    NULL);
+
+          forward_input_tokens_ptr = (int32_t *) appended_tokens->data;
+          n_forward_input_tokens = appended_tokens->len;
+        }
+      else if (n_draft_tokens > 0)
+        {
+          g_autoptr(GArray) speculative_tokens = ggml_language_model_completion_cursor_speculative_step (state->cursor,
+                                                                                                         inference_parameters,
+                                                                                                         n_draft_tokens,
+                                                                                                         state->cancellable,
+                                                                                                         &error);
+
+          if (speculative_tokens == NULL)
+            {
+              ggml_language_model_complete_thread_push_tokens_or_error (state,
+                                                                        NULL,
+                                                                        FALSE,
+                                                                        FALSE,
+                                                                        g_steal_pointer (&error));
+              return GINT_TO_POINTER (FALSE);
+            }
+
+          for (size_t i = 0; i < speculative_tokens->len; ++i)
+            {
+              ggml_language_model_complete_thread_push_token (state,
+                                                              &n_chunk_tokens,
+                                                              g_array_index (speculative_tokens, int32_t, i));
+            }
+
+          /* Each token counts as one iteration */
+          n_completed_iterations += speculative_tokens->len - 1;
+          continue;
         }
       else
         {
@@ -588,16 +1323,40 @@ ggml_language_model_complete_cursor_thread_loop (gpointer data)
           n_forward_input_tokens = 1;
         }
 
-      if (!ggml_language_model_forward_single_iteration (state->cursor->language_model->model,
-                                                         state->cursor->language_model->hyperparameters,
-                                                         inference_parameters,
-                                                         state->cursor->execution_memory,
-                                                         state->cursor->sampler,
-                                                         forward_input_tokens_ptr,
-                                                         n_forward_input_tokens,
-                                                         state->cancellable,
-                                                         &state->cursor->most_recent_token,
-                                                         &error))
+      /* Single tokens can share a pass with the other cursors if their
+       * memory is in the pool that the batch decoder works with */
+      GGMLBatchDecoder *batch_decoder = state->cursor->language_model->batch_decoder;
+      gboolean use_batch_decoder = (
+        batch_decoder != NULL &&
+        n_forward_input_tokens == 1 &&
+        ggml_execution_memory_get_key_value_page_pool (state->cursor->execution_memory) ==
+          ggml_batch_decoder_get_key_value_page_pool (batch_decoder)
+      );
+      gboolean forward_succeeded = (
+        use_batch_decoder ?
+        ggml_language_model_batch_decode_single_iteration (batch_decoder,
+                                                           state->cursor->language_model->hyperparameters,
+                                                           state->cursor->execution_memory,
+                                                           state->cursor->sampler,
+                                                           state->cursor->memory_position,
+                                                           forward_input_tokens_ptr[0],
+                                                           state->cursor->n_threads,
+                                                           state->cancellable,
+                                                           &state->cursor->most_recent_token,
+                                                           &error) :
+        ggml_language_model_forward_single_iteration (state->cursor->language_model->model,
+                                                      state->cursor->language_model->hyperparameters,
+                                                      inference_parameters,
+                                                      state->cursor->execution_memory,
+                                                      state->cursor->sampler,
+                                                      forward_input_tokens_ptr,
+                                                      n_forward_input_tokens,
+                                                      state->cancellable,
+                                                      &state->cursor->most_recent_token,
+                                                      &error)
+      );
+
+      if (!forward_succeeded)
         {
           ggml_language_model_complete_thread_push_tokens_or_error (state,
                                                                     NULL,
@@ -607,31 +1366,40 @@ ggml_language_model_complete_cursor_thread_loop (gpointer data)
           return GINT_TO_POINTER (FALSE);
         }
 
-      chunk_tokens_data[current_chunk_index++] = state->cursor->most_recent_token;
-
-      if (current_chunk_index == state->chunk_size)
+      /* The whole prompt is in the memory now, so other cursors can use it */
+      if (is_prompt_iteration &&
+          !ggml_language_model_completion_cursor_save_prompt_prefix (state->cursor,
+                                                                     out_prompt_tokens,
+                                                                     out_n_prompt_tokens,
+                                                                     out_n_prompt_tokens - n_forward_input_tokens,
+                                                                     &error))
         {
-          g_autofree char *chunk = ggml_token_dictionary_decode (state->cursor->language_model->token_dictionary,
-                                                                 chunk_tokens_data,
-                                                                 chunk_tokens->len);
-          /* We completed a chunk, send it to the caller. */
           ggml_language_model_complete_thread_push_tokens_or_error (state,
-                                                                    g_steal_pointer (&chunk),
+                                                                    NULL,
                                                                     FALSE,
                                                                     FALSE,
-                                                                    NULL);
-          current_chunk_index = 0;
+                                                                    g_steal_pointer (&error));
+          return GINT_TO_POINTER (FALSE);
+        }
+
+      /* The draft model sees these tokens at the start of its next step */
+      if (state->cursor->draft_language_model != NULL)
+        {
+          g_array_append_vals (state->cursor->draft_pending_tokens,
+                               is_prompt_iteration ? out_prompt_tokens : forward_input_tokens_ptr,
+                               is_prompt_iteration ? out_n_prompt_tokens : n_forward_input_tokens);
         }
 
+      ggml_language_model_complete_thread_push_token (state,
+                                                      &n_chunk_tokens,
+                                                      state->cursor->most_recent_token);
+
       /* Increment by num_forward_input_tokens - this is the number of tokens
        * we had to process and add to the memory */
       state->cursor->memory_position += n_forward_input_tokens;
     }
 
-  g_array_set_size (chunk_tokens, current_chunk_index);
-  g_autofree char *chunk = ggml_token_dictionary_decode (state->cursor->language_model->token_dictionary,
-                                                         (int32_t *) chunk_tokens->data,
-                                                         chunk_tokens->len);
+  g_autofree char *chunk = ggml_detokenizer_take (state->cursor->detokenizer);
 
   /* We completed a chunk, send it to the caller. */
   ggml_language_model_complete_thread_push_tokens_or_error (state,
@@ -671,163 +1439,932 @@ ggml_language_model_complete_monitor_state_new (GGMLLanguageModelCompletionCurso
   return state;
 }
 
-static void
-ggml_language_model_complete_monitor_state_unref (GGMLLanguageModelCompleteMonitorState *state)
-{
-  if (--state->ref_count == 0)
+static void
+ggml_language_model_complete_monitor_state_unref (GGMLLanguageModelCompleteMonitorState *state)
+{
+  if (--state->ref_count == 0)
+    {
+      /* Assuming here that we will have called the callback
+       * at the end */
+      if (state->stream_func_data_destroy != NULL)
+        {
+          g_clear_pointer (&state->stream_func_data, state->stream_func_data_destroy);
+        }
+
+      g_clear_pointer (&state, g_free);
+    }
+}
+
+static GGMLLanguageModelCompleteMonitorState *
+ggml_language_model_complete_monitor_state_ref (GGMLLanguageModelCompleteMonitorState *state)
+{
+  ++state->ref_count;
+  return state;
+}
+
+G_DEFINE_AUTOPTR_CLEANUP_FUNC (GGMLLanguageModelCompleteMonitorState, ggml_language_model_complete_monitor_state_unref)
+
+static void
+ggml_language_model_monitor_process_completion_ready (GObject      *source_object,
+                                                      GAsyncResult *result,
+                                                      gpointer      user_data)
+{
+  g_autoptr(GGMLLanguageModelCompleteMonitorState) state = user_data;
+  g_autoptr(GTask) task = G_TASK (result);
+
+  /* We call the real callback. That will also want to unref the task
+   * so we have to ref it before calling the callback. */
+  (*state->callback) (source_object, G_ASYNC_RESULT (g_object_ref (task)), state->user_data);
+}
+
+/**
+ * ggml_language_model_monitor_process_completion: (skip)
+ * @completion: A #GGMLLanguageModelChunkCompletion fragment
+ * @state: A #GGMLLanguageModelCompleteMonitorState
+ *
+ * Processes a partial completion and returns either an error
+ * or a partial completion to the GAsyncReadyCallback.
+ *
+ * Returns: %TRUE if the monitor source should be terminated (eg, the
+ *          thread has reached some end condition) or %FALSE
+ *          if the monitor source should continue.
+ */
+static gboolean
+ggml_language_model_monitor_process_completion (GGMLLanguageModelCompleteMonitorState *state,
+                                                GGMLLanguageModelChunkCompletion      *completion)
+{
+  if (completion->error != NULL)
+    {
+      GTask *task = g_task_new (NULL,
+                                NULL,
+                                ggml_language_model_monitor_process_completion_ready,
+                                ggml_language_model_complete_monitor_state_ref (state));
+
+      GError *error = NULL;
+      g_propagate_error (&error, g_steal_pointer (&completion->error));
+      g_task_return_error (task, error);
+      return TRUE;
+    }
+
+  if (completion->result != NULL)
+    {
+      (*state->stream_func) (completion->result->chunk,
+                             completion->result->is_complete_eos,
+                             state->stream_func_data);
+
+      if (completion->result->is_complete)
+        {
+          /* We got a sentinel value. This means that we can now complete
+           * the task. We have to use an extra trampoline with a ref on the
+           * GGMLLanguageModelCompleteMonitorState here because
+           * g_task_return_error / g_task_return_pointer could
+           * end up on the main loop for another iteration. */
+          GTask *task = g_task_new (NULL,
+                                    NULL,
+                                    ggml_language_model_monitor_process_completion_ready,
+                                    ggml_language_model_complete_monitor_state_ref (state));
+
+          g_task_return_boolean (task, TRUE);
+
+          /* We're all done, return TRUE because we got a sentinel value */
+          return TRUE;
+        }
+
+      return FALSE;
+    }
+
+  g_assert_not_reached ();
+  return TRUE;
+}
+
+static gboolean
+ggml_language_model_monitor_callback (gpointer message, gpointer user_data)
+{
+  GGMLLanguageModelCompleteMonitorState *state = user_data;
+  g_autoptr(GGMLLanguageModelChunkCompletion) completion = message;
+
+  /* If we return TRUE*/
+  if (ggml_language_model_monitor_process_completion (state, completion))
+    {
+      return G_SOURCE_REMOVE;
+    }
+
+  return G_SOURCE_CONTINUE;
+}
+
+/**
+ * ggml_language_model_create_completion:
+ * @language_model: A #GGMLLanguageModel
+ * @prompt: (transfer none): A text prompt to seed the language model
+ * @max_completion_tokens: Maximum number of tokens in this query. Generating any more
+ *                         requires creating a new cursor.
+ *
+ * Returns: (transfer full): A new #GGMLLanguageModelCompletionCursor representing the
+ *          initial state of execution of the language model evaluated on some prompt.
+ */
+GGMLLanguageModelCompletionCursor *
+ggml_language_model_create_completion (GGMLLanguageModel *language_model,
+                                       const char        *prompt,
+                                       size_t             max_completion_tokens)
+{
+  GGMLLanguageModelCompletionCursor *cursor = g_new0 (GGMLLanguageModelCompletionCursor, 1);
+  cursor->language_model = ggml_language_model_ref (language_model);
+  cursor->execution_memory = NULL;
+  cursor->sampler = ggml_argmax_language_model_sampler_new ();
+  cursor->prompt = g_strdup (prompt);
+  cursor->pending_tokens = g_array_new (FALSE, FALSE, sizeof (int32_t));
+  cursor->pending_text = g_string_new (NULL);
+  cursor->detokenizer = ggml_detokenizer_new (language_model->token_dictionary);
+  cursor->draft_pending_tokens = g_array_new (FALSE, FALSE, sizeof (int32_t));
+  cursor->max_completion_tokens = max_completion_tokens;
+  cursor->memory_position = 0;
+  cursor->ref_count = 1;
+
+  return cursor;
+}
+
+/**
+ * ggml_language_model_completion_cursor_set_sampler:
+ * @cursor: A #GGMLLanguageModelCompletionCursor
+ * @sampler: (transfer none): A #GGMLLanguageModelSampler
+ *
+ * Set the sampler used for this cursor. The sampler determines how the model outputs
+ * are converted into tokens. The default is to use deterministic sampling, eg,
+ * argmax sampling, but this can lead to unnatural generations.
+ */
+void
+ggml_language_model_completion_cursor_set_sampler (GGMLLanguageModelCompletionCursor *cursor,
+                                                   GGMLLanguageModelSampler *sampler)
+{
+  g_clear_object (&cursor->sampler);
+  cursor->sampler = g_object_ref (sampler);
+}
+
+
+/**
+ * ggml_language_model_completion_cursor_set_n_threads:
+ * @cursor: A #GGMLLanguageModelCompletionCursor
+ * @n_threads: The maximum number of threads to use, or 0 for the default
+ *
+ * Sets the thread budget for the forward passes run from this cursor. The
+ * threads are taken from the #GGMLComputeContext of the model, so when many
+ * cursors run at the same time, giving each a smaller budget lets them run
+ * side by side instead of waiting for each other. The default is the
+ * number of threads per request of the model's #GGMLComputeContext.
+ */
+void
+ggml_language_model_completion_cursor_set_n_threads (GGMLLanguageModelCompletionCursor *cursor,
+                                                     size_t                             n_threads)
+{
+  cursor->n_threads = n_threads;
+}
+
+/**
+ * ggml_language_model_completion_cursor_set_draft_model:
+ * @cursor: A #GGMLLanguageModelCompletionCursor
+ * @draft_model: (transfer none) (nullable): A smaller #GGMLLanguageModel with the
+ *               same vocabulary as the model of @cursor, or %NULL
+ * @n_draft_tokens: The number of tokens that @draft_model proposes on each step
+ * @error: A #GError
+ *
+ * Turns on speculative decoding for @cursor. On each step, @draft_model
+ * proposes the next @n_draft_tokens tokens, then the model of @cursor
+ * checks all of them in a single forward pass and keeps as many as it
+ * agrees with, plus one of its own. Since @draft_model is much cheaper to
+ * run, this generates several tokens for about the cost of one pass through
+ * the larger model when the two models mostly agree.
+ *
+ * The sampler of @cursor decides which draft tokens to keep, see
+ * ggml_language_model_sampler_verify_draft_tokens(), so that the output is
+ * the same as without a draft model. With argmax sampling, that means that
+ * the completions are identical.
+ *
+ * @draft_model has to see everything that @cursor has seen, so it can
+ * only be set before @cursor is first executed. Passing %NULL turns
+ * speculative decoding off again. @n_draft_tokens is capped at one less than
+ * the @max_completion_tokens that @cursor was created with, and fewer tokens
+ * are drafted once either model is close to the end of its context.
+ *
+ * Returns: %TRUE on success or %FALSE with @error set if @cursor is executing
+ *          or has already been executed, or if the vocabularies differ.
+ */
+gboolean
+ggml_language_model_completion_cursor_set_draft_model (GGMLLanguageModelCompletionCursor  *cursor,
+                                                       GGMLLanguageModel                  *draft_model,
+                                                       size_t                              n_draft_tokens,
+                                                       GError                            **error)
+{
+  if (cursor->is_executing == TRUE)
+    {
+      g_set_error (error,
+                   G_IO_ERROR,
+                   G_IO_ERROR_BUSY,
+                   "Cannot set the draft model of a cursor while it is executing");
+      return FALSE;
+    }
+
+  if (cursor->memory_position > 0)
+    {
+      g_set_error (error,
+                   G_IO_ERROR,
+                   G_IO_ERROR_NOT_SUPPORTED,
+                   "The draft model can only be set before the cursor is executed");
+      return FALSE;
+    }
+
+  if (draft_model != NULL &&
+      ggml_hyperparameters_get_int32 (draft_model->hyperparameters, "n_vocab") !=
+      ggml_hyperparameters_get_int32 (cursor->language_model->hyperparameters, "n_vocab"))
+    {
+      g_set_error (error,
+                   G_IO_ERROR,
+                   G_IO_ERROR_INVALID_ARGUMENT,
+                   "The draft model must have the same vocabulary as the model");
+      return FALSE;
+    }
+
+  g_clear_pointer (&cursor->draft_language_model, ggml_language_model_unref);
+  g_clear_pointer (&cursor->draft_execution_memory, ggml_execution_memory_unref);
+  g_array_set_size (cursor->draft_pending_tokens, 0);
+
+  /* The execution memory is sized for the number of logits rows that the
+   * checking pass asks for, so it has to be measured again. Nothing has
+   * gone into its key-value memory yet. */
+  g_clear_pointer (&cursor->execution_memory, ggml_execution_memory_unref);
+
+  /* The draft tokens go through the model in one pass along with the
+   * most recent token, which is as long as a pass of @cursor can be.
+   * They also have to fit in the context of the draft model after the
+   * most recent token. */
+  cursor->draft_language_model = draft_model != NULL ? ggml_language_model_ref (draft_model) : NULL;
+  cursor->n_draft_tokens = (
+    draft_model != NULL ?
+    MIN (n_draft_tokens,
+         MIN (MAX (cursor->max_completion_tokens, 1),
+              (size_t) MAX (ggml_hyperparameters_get_int32 (draft_model->hyperparameters, "n_ctx"), 1)) - 1) :
+    0
+  );
+  cursor->draft_memory_position = 0;
+
+  return TRUE;
+}
+
+/**
+ * ggml_language_model_completion_cursor_fork:
+ * @cursor: A #GGMLLanguageModelCompletionCursor
+ * @error: A #GError
+ *
+ * Creates a new cursor that continues from the same point as @cursor, for
+ * instance to sample several different completions of the same prompt without
+ * running the prompt through the model again. The new cursor has the same
+ * thread budget as @cursor and a copy of its sampler, see
+ * ggml_language_model_sampler_copy(), so both can be executed independently
+ * of each other afterwards, even at the same time. If the language model has a key-value page pool,
+ * the two cursors share the pages that are already filled in and a page is
+ * only copied once either cursor writes to it. Otherwise the key-value memory
+ * of @cursor is copied.
+ *
+ * Returns: (transfer full): A new #GGMLLanguageModelCompletionCursor or %NULL
+ *          with @error set if @cursor is executing or its key-value memory could
+ *          not be forked.
+ */
+GGMLLanguageModelCompletionCursor *
+ggml_language_model_completion_cursor_fork (GGMLLanguageModelCompletionCursor  *cursor,
+                                            GError                            **error)
+{
+  g_autoptr(GGMLExecutionMemory) execution_memory = NULL;
+  g_autoptr(GGMLExecutionMemory) draft_execution_memory = NULL;
+
+  if (cursor->is_executing == TRUE)
+    {
+      g_set_error (error,
+                   G_IO_ERROR,
+                   G_IO_ERROR_BUSY,
+                   "Cannot fork a cursor while it is executing");
+      return NULL;
+    }
+
+  if (cursor->execution_memory != NULL)
+    {
+      execution_memory = ggml_execution_memory_fork (cursor->execution_memory,
+                                                     cursor->memory_position,
+                                                     error);
+
+      if (execution_memory == NULL)
+        {
+          return NULL;
+        }
+    }
+
+  if (cursor->draft_execution_memory != NULL)
+    {
+      draft_execution_memory = ggml_execution_memory_fork (cursor->draft_execution_memory,
+                                                           cursor->draft_memory_position,
+                                                           error);
+
+      if (draft_execution_memory == NULL)
+        {
+          return NULL;
+        }
+    }
+
+  GGMLLanguageModelCompletionCursor *fork = g_new0 (GGMLLanguageModelCompletionCursor, 1);
+  fork->language_model = ggml_language_model_ref (cursor->language_model);
+  fork->execution_memory = g_steal_pointer (&execution_memory);
+  fork->sampler = ggml_language_model_sampler_copy (cursor->sampler);
+  fork->prompt = g_strdup (cursor->prompt);
+  fork->pending_tokens = g_array_copy (cursor->pending_tokens);
+  fork->pending_text = g_string_new_len (cursor->pending_text->str, cursor->pending_text->len);
+  fork->detokenizer = ggml_detokenizer_copy (cursor->detokenizer);
+  fork->max_completion_tokens = cursor->max_completion_tokens;
+  fork->memory_position = cursor->memory_position;
+  fork->most_recent_token = cursor->most_recent_token;
+  fork->n_threads = cursor->n_threads;
+  fork->draft_language_model = (
+    cursor->draft_language_model != NULL ? ggml_language_model_ref (cursor->draft_language_model) : NULL
+  );
+  fork->draft_execution_memory = g_steal_pointer (&draft_execution_memory);
+  fork->n_draft_tokens = cursor->n_draft_tokens;
+  fork->draft_memory_position = cursor->draft_memory_position;
+  fork->draft_pending_tokens = g_array_copy (cursor->draft_pending_tokens);
+  fork->ref_count = 1;
+
+  return fork;
+}
+
+/* Moves the complete text out of the detokenizer of @cursor and on to the
+ * end of the text that goes back to the caller at the start of the next
+ * execution, keeping the bytes of an incomplete UTF-8 sequence back. */
+static void
+ggml_language_model_completion_cursor_take_pending_text (GGMLLanguageModelCompletionCursor *cursor)
+{
+  size_t text_length;
+  const char *text = ggml_detokenizer_peek (cursor->detokenizer, &text_length);
+
+  g_string_append_len (cursor->pending_text, text, text_length);
+  ggml_detokenizer_consume (cursor->detokenizer, text_length);
+}
+
+/* Checks that @n_tokens more tokens fit in the next pass of @cursor. That
+ * pass runs the prompt, or the most recent token if the prompt already went
+ * through, followed by everything appended so far. It can only be as long as
+ * the pass that the execution memory was sized for and it has to stay within
+ * the context of the model. */
+static gboolean
+ggml_language_model_completion_cursor_check_append (GGMLLanguageModelCompletionCursor  *cursor,
+                                                    size_t                              n_tokens,
+                                                    GError                            **error)
+{
+  int32_t n_ctx = ggml_hyperparameters_get_int32 (cursor->language_model->hyperparameters, "n_ctx");
+  size_t n_pass_tokens = 1;
+
+  if (cursor->memory_position == 0)
+    {
+      g_autofree int32_t *prompt_tokens = NULL;
+
+      if (!ggml_gpt_tokenize (cursor->language_model->token_dictionary,
+                              cursor->prompt,
+                              &prompt_tokens,
+                              &n_pass_tokens,
+                              error))
+        {
+          return FALSE;
+        }
+    }
+
+  n_pass_tokens += cursor->pending_tokens->len + n_tokens;
+
+  if (n_pass_tokens > cursor->max_completion_tokens)
+    {
+      g_set_error (error,
+                   G_IO_ERROR,
+                   G_IO_ERROR_INVALID_ARGUMENT,
+                   "Appending %zu tokens would make the next pass %zu tokens long, "
+                   "but the cursor was created for at most %zu tokens",
+                   n_tokens,
+                   n_pass_tokens,
+                   cursor->max_completion_tokens);
+      return FALSE;
+    }
+
+  if (cursor->memory_position + n_pass_tokens > (size_t) n_ctx)
+    {
+      g_set_error (error,
+                   G_IO_ERROR,
+                   G_IO_ERROR_INVALID_ARGUMENT,
+                   "Appending %zu tokens at position %zu would go past the context of %d tokens",
+                   n_tokens,
+                   cursor->memory_position,
+                   n_ctx);
+      return FALSE;
+    }
+
+  return TRUE;
+}
+
+/**
+ * ggml_language_model_completion_cursor_append_tokens:
+ * @cursor: A #GGMLLanguageModelCompletionCursor
+ * @tokens: (array length=n_tokens): The tokens to append
+ * @n_tokens: The number of tokens in @tokens
+ * @error: A #GError
+ *
+ * Appends @tokens to what @cursor has seen so far, for instance the next
+ * message in a conversation. They get run through the model at the start
+ * of the next execution of @cursor, on top of the key-value memory that is
+ * already there, so only the appended tokens have to be processed. The
+ * decoded tokens are also streamed back at that point, like the prompt is.
+ *
+ * The tokens go through the model in a single pass along with the most recent
+ * token and anything else that was appended since the last execution, so
+ * together they must not be longer than the @max_completion_tokens that
+ * @cursor was created with, or go past the context of the model.
+ *
+ * Returns: %TRUE on success or %FALSE with @error set if @cursor is executing,
+ *          some of @tokens are not in the vocabulary or they do not fit, in
+ *          which case the error is %G_IO_ERROR_INVALID_ARGUMENT.
+ */
+gboolean
+ggml_language_model_completion_cursor_append_tokens (GGMLLanguageModelCompletionCursor  *cursor,
+                                                     const int32_t                      *tokens,
+                                                     size_t                              n_tokens,
+                                                     GError                            **error)
+{
+  int32_t n_vocab = ggml_hyperparameters_get_int32 (cursor->language_model->hyperparameters, "n_vocab");
+
+  if (cursor->is_executing == TRUE)
+    {
+      g_set_error (error,
+                   G_IO_ERROR,
+                   G_IO_ERROR_BUSY,
+                   "Cannot append to a cursor while it is executing");
+      return FALSE;
+    }
+
+  for (size_t i = 0; i < n_tokens; ++i)
+    {
+      if (tokens[i] < 0 || tokens[i] >= n_vocab)
+        {
+          g_set_error (error,
+                       G_IO_ERROR,
+                       G_IO_ERROR_INVALID_ARGUMENT,
+                       "Token %d is not in the vocabulary of %d tokens",
+                       tokens[i],
+                       n_vocab);
+          return FALSE;
+        }
+    }
+
+  if (!ggml_language_model_completion_cursor_check_append (cursor, n_tokens, error))
+    {
+      return FALSE;
+    }
+
+  /* Go through the detokenizer, so that the tokens come after any
+   * bytes it was still holding back from the last execution */
+  ggml_detokenizer_push_tokens (cursor->detokenizer, tokens, n_tokens);
+
+  g_array_append_vals (cursor->pending_tokens, tokens, n_tokens);
+  ggml_language_model_completion_cursor_take_pending_text (cursor);
+
+  return TRUE;
+}
+
+/**
+ * ggml_language_model_completion_cursor_append_text:
+ * @cursor: A #GGMLLanguageModelCompletionCursor
+ * @text: The text to append
+ * @error: A #GError
+ *
+ * Tokenizes @text and appends it to @cursor, see
+ * ggml_language_model_completion_cursor_append_tokens.
+ *
+ * Returns: %TRUE on success or %FALSE with @error set on failure.
+ */
+gboolean
+ggml_language_model_completion_cursor_append_text (GGMLLanguageModelCompletionCursor  *cursor,
+                                                   const char                         *text,
+                                                   GError                            **error)
+{
+  g_autofree int32_t *tokens = NULL;
+  size_t n_tokens = 0;
+
+  if (cursor->is_executing == TRUE)
+    {
+      g_set_error (error,
+                   G_IO_ERROR,
+                   G_IO_ERROR_BUSY,
+                   "Cannot append to a cursor while it is executing");
+      return FALSE;
+    }
+
+  if (!ggml_gpt_tokenize (cursor->language_model->token_dictionary,
+                          text,
+                          &tokens,
+                          &n_tokens,
+                          error))
+    {
+      return FALSE;
+    }
+
+  if (!ggml_language_model_completion_cursor_check_append (cursor, n_tokens, error))
+    {
+      return FALSE;
+    }
+
+  /* Like the appended tokens, the text has to come after any bytes
+   * the detokenizer was holding back from the last execution */
+  ggml_detokenizer_push_bytes (cursor->detokenizer, text, strlen (text));
+
+  g_array_append_vals (cursor->pending_tokens, tokens, n_tokens);
+  ggml_language_model_completion_cursor_take_pending_text (cursor);
+
+  return TRUE;
+}
+
+#define GGML_LANGUAGE_MODEL_COMPLETION_CURSOR_STATE_MAGIC 0x67676d63
+#define GGML_LANGUAGE_MODEL_COMPLETION_CURSOR_STATE_VERSION 3
+#define GGML_LANGUAGE_MODEL_COMPLETION_CURSOR_SAMPLER_STATE_TYPE "(smv)"
+#define GGML_LANGUAGE_MODEL_COMPLETION_CURSOR_PENDING_INPUT_TYPE "(@ai@ay@ay)"
+#define GGML_LANGUAGE_MODEL_COMPLETION_CURSOR_MEMORY_DESC_TYPE "a{s(uax)}"
+
+/* The saved state of a cursor is this header, followed by the serialized
+ * sampler state, the serialized input that was appended but not yet run
+ * through the model (the pending tokens, the pending text and the bytes
+ * held back by the detokenizer), the names, types and shapes of the key-value
+ * memory as serialized by ggml_model_desc_node_serialize and then the key-value
+ * positions as laid out by ggml_execution_memory_save_key_value_positions, so
+ * that they can be copied straight out of a mapped file when loading. */
+typedef struct {
+  uint32_t magic;
+  uint32_t version;
+  uint64_t memory_position;
+  int32_t  most_recent_token;
+  uint32_t sampler_state_n_bytes;
+  uint32_t pending_input_n_bytes;
+  uint32_t memory_desc_n_bytes;
+  uint64_t key_value_n_bytes;
+} GGMLLanguageModelCompletionCursorStateHeader;
+
+/**
+ * ggml_language_model_completion_cursor_save_state:
+ * @cursor: A #GGMLLanguageModelCompletionCursor
+ * @ostream: A #GOutputStream to write the state to
+ * @cancellable: (nullable): A #GCancellable
+ * @error: A #GError
+ *
+ * Writes the filled positions of the key-value memory of @cursor, the most
+ * recently sampled token, the state of its sampler and any input appended
+ * with ggml_language_model_completion_cursor_append_tokens or
+ * ggml_language_model_completion_cursor_append_text that has not been run
+ * through the model yet to @ostream, so that
+ * the cursor can be picked up again later with
+ * ggml_language_model_completion_cursor_load_state, for instance after the
+ * process restarts, without running everything through the model again.
+ *
+ * Returns: %TRUE on success or %FALSE with @error set on failure.
+ */
+gboolean
+ggml_language_model_completion_cursor_save_state (GGMLLanguageModelCompletionCursor  *cursor,
+                                                  GOutputStream                      *ostream,
+                                                  GCancellable                       *cancellable,
+                                                  GError                            **error)
+{
+  g_autoptr(GBytes) key_value_positions = NULL;
+
+  if (cursor->is_executing == TRUE)
+    {
+      g_set_error (error,
+                   G_IO_ERROR,
+                   G_IO_ERROR_BUSY,
+                   "Cannot save the state of a cursor while it is executing");
+      return FALSE;
+    }
+
+  if (cursor->memory_position > 0)
     {
-      /* Assuming here that we will have called the callback
-       * at the end */
-      if (state->stream_func_data_destroy != NULL)
+      key_value_positions = ggml_execution_memory_save_key_value_positions (cursor->execution_memory,
+                                                                            cursor->memory_position,
+                                                                            error);
+
+      if (key_value_positions == NULL)
         {
-          g_clear_pointer (&state->stream_func_data, state->stream_func_data_destroy);
+          return FALSE;
         }
+    }
 
-      g_clear_pointer (&state, g_free);
+  g_autoptr(GVariant) sampler_state = ggml_language_model_sampler_get_state (cursor->sampler);
+  g_autoptr(GVariant) serialized_sampler_state = g_variant_ref_sink (g_variant_new (GGML_LANGUAGE_MODEL_COMPLETION_CURSOR_SAMPLER_STATE_TYPE,
+                                                                                    G_OBJECT_TYPE_NAME (cursor->sampler),
+                                                                                    sampler_state));
+  g_autoptr(GBytes) sampler_state_bytes = g_variant_get_data_as_bytes (serialized_sampler_state);
+
+  size_t detokenizer_n_pending_bytes;
+  const char *detokenizer_pending_bytes = ggml_detokenizer_get_pending_bytes (cursor->detokenizer,
+                                                                              &detokenizer_n_pending_bytes);
+  g_autoptr(GVariant) serialized_pending_input = g_variant_ref_sink (g_variant_new (GGML_LANGUAGE_MODEL_COMPLETION_CURSOR_PENDING_INPUT_TYPE,
+                                                                                    g_variant_new_fixed_array (G_VARIANT_TYPE_INT32,
+                                                                                                               cursor->pending_tokens->data,
+                                                                                                               cursor->pending_tokens->len,
+                                                                                                               sizeof (int32_t)),
+                                                                                    g_variant_new_fixed_array (G_VARIANT_TYPE_BYTE,
+                                                                                                               cursor->pending_text->str,
+                                                                                                               cursor->pending_text->len,
+                                                                                                               sizeof (char)),
+                                                                                    g_variant_new_fixed_array (G_VARIANT_TYPE_BYTE,
+                                                                                                               detokenizer_pending_bytes,
+                                                                                                               detokenizer_n_pending_bytes,
+                                                                                                               sizeof (char))));
+  g_autoptr(GBytes) pending_input_bytes = g_variant_get_data_as_bytes (serialized_pending_input);
+  g_autoptr(GVariant) serialized_memory_desc = ggml_model_desc_node_serialize (cursor->language_model->memory_desc_node);
+  g_autoptr(GBytes) memory_desc_bytes = g_variant_get_data_as_bytes (serialized_memory_desc);
+
+  GGMLLanguageModelCompletionCursorStateHeader header = {
+    .magic = GGML_LANGUAGE_MODEL_COMPLETION_CURSOR_STATE_MAGIC,
+    .version = GGML_LANGUAGE_MODEL_COMPLETION_CURSOR_STATE_VERSION,
+    .memory_position = cursor->memory_position,
+    .most_recent_token = cursor->most_recent_token,
+    .sampler_state_n_bytes = g_bytes_get_size (sampler_state_bytes),
+    .pending_input_n_bytes = g_bytes_get_size (pending_input_bytes),
+    .memory_desc_n_bytes = g_bytes_get_size (memory_desc_bytes),
+    .key_value_n_bytes = key_value_positions != NULL ? g_bytes_get_size (key_value_positions) : 0
+  };
+
+  if (!g_output_stream_write_all (ostream, &header, sizeof (header), NULL, cancellable, error) ||
+      !g_output_stream_write_all (ostream,
+                                  g_bytes_get_data (sampler_state_bytes, NULL),
+                                  header.sampler_state_n_bytes,
+                                  NULL,
+                                  cancellable,
+                                  error) ||
+      !g_output_stream_write_all (ostream,
+                                  g_bytes_get_data (pending_input_bytes, NULL),
+                                  header.pending_input_n_bytes,
+                                  NULL,
+                                  cancellable,
+                                  error) ||
+      !g_output_stream_write_all (ostream,
+                                  g_bytes_get_data (memory_desc_bytes, NULL),
+                                  header.memory_desc_n_bytes,
+                                  NULL,
+                                  cancellable,
+                                  error))
+    {
+      return FALSE;
+    }
+
+  if (key_value_positions != NULL &&
+      !g_output_stream_write_all (ostream,
+                                  g_bytes_get_data (key_value_positions, NULL),
+                                  header.key_value_n_bytes,
+                                  NULL,
+                                  cancellable,
+                                  error))
+    {
+      return FALSE;
     }
+
+  return TRUE;
 }
 
-static GGMLLanguageModelCompleteMonitorState *
-ggml_language_model_complete_monitor_state_ref (GGMLLanguageModelCompleteMonitorState *state)
+static GBytes *
+ggml_language_model_completion_cursor_read_key_value_positions (GInputStream  *istream,
+                                                                size_t         n_bytes,
+                                                                GCancellable  *cancellable,
+                                                                GError       **error)
 {
-  ++state->ref_count;
-  return state;
-}
+  size_t mapped_offset = 0;
+  g_autoptr(GBytes) mapped_bytes = ggml_input_stream_try_map (istream, &mapped_offset);
 
-G_DEFINE_AUTOPTR_CLEANUP_FUNC (GGMLLanguageModelCompleteMonitorState, ggml_language_model_complete_monitor_state_unref)
+  if (mapped_bytes != NULL && g_bytes_get_size (mapped_bytes) - mapped_offset >= n_bytes)
+    {
+      if (g_input_stream_skip (istream, n_bytes, cancellable, error) == -1)
+        {
+          return NULL;
+        }
 
-static void
-ggml_language_model_monitor_process_completion_ready (GObject      *source_object,
-                                                      GAsyncResult *result,
-                                                      gpointer      user_data)
-{
-  g_autoptr(GGMLLanguageModelCompleteMonitorState) state = user_data;
-  g_autoptr(GTask) task = G_TASK (result);
+      return g_bytes_new_from_bytes (mapped_bytes, mapped_offset, n_bytes);
+    }
 
-  /* We call the real callback. That will also want to unref the task
-   * so we have to ref it before calling the callback. */
-  (*state->callback) (source_object, G_ASYNC_RESULT (g_object_ref (task)), state->user_data);
+  g_autofree char *buffer = g_malloc (n_bytes);
+
+  if (!ggml_input_stream_read_exactly (istream, buffer, n_bytes, cancellable, error))
+    {
+      return NULL;
+    }
+
+  return g_bytes_new_take (g_steal_pointer (&buffer), n_bytes);
 }
 
 /**
- * ggml_language_model_monitor_process_completion: (skip)
- * @completion: A #GGMLLanguageModelChunkCompletion fragment
- * @state: A #GGMLLanguageModelCompleteMonitorState
+ * ggml_language_model_completion_cursor_load_state:
+ * @cursor: A #GGMLLanguageModelCompletionCursor
+ * @istream: A #GInputStream to read the state from
+ * @cancellable: (nullable): A #GCancellable
+ * @error: A #GError
  *
- * Processes a partial completion and returns either an error
- * or a partial completion to the GAsyncReadyCallback.
+ * Reads a state written by ggml_language_model_completion_cursor_save_state
+ * into @cursor, which carries on from there the next time it is executed.
+ * @cursor must be for the same model, with the same names, types and shapes
+ * of key-value memory, and have the same kind of sampler as
+ * the cursor that was saved, otherwise %G_IO_ERROR_INVALID_DATA is returned. Its prompt is not used any more, since the saved
+ * key-value memory already covers the prompt. Input that was appended to @cursor
+ * before loading is replaced by the input that was pending when saving. If
+ * @istream is backed by a file,
+ * the key-value memory is copied straight out of a mapping of that file.
  *
- * Returns: %TRUE if the monitor source should be terminated (eg, the
- *          thread has reached some end condition) or %FALSE
- *          if the monitor source should continue.
+ * Returns: %TRUE on success or %FALSE with @error set on failure.
  */
-static gboolean
-ggml_language_model_monitor_process_completion (GGMLLanguageModelCompleteMonitorState *state,
-                                                GGMLLanguageModelChunkCompletion      *completion)
+gboolean
+ggml_language_model_completion_cursor_load_state (GGMLLanguageModelCompletionCursor  *cursor,
+                                                  GInputStream                       *istream,
+                                                  GCancellable                       *cancellable,
+                                                  GError                            **error)
 {
-  if (completion->error != NULL)
+  GGMLLanguageModelCompletionCursorStateHeader header;
+
+  if (cursor->is_executing == TRUE)
     {
-      GTask *task = g_task_new (NULL,
-                                NULL,
-                                ggml_language_model_monitor_process_completion_ready,
-                                ggml_language_model_complete_monitor_state_ref (state));
+      g_set_error (error,
+                   G_IO_ERROR,
+                   G_IO_ERROR_BUSY,
+                   "Cannot load the state of a cursor while it is executing");
+      return FALSE;
+    }
 
-      GError *error = NULL;
-      g_propagate_error (&error, g_steal_pointer (&completion->error));
-      g_task_return_error (task, error);
-      return TRUE;
+  /* The saved state only has the key-value memory of the model,
+   * so the draft model would have nothing to continue from */
+  if (cursor->draft_language_model != NULL)
+    {
+      g_set_error (error,
+                   G_IO_ERROR,
+                   G_IO_ERROR_NOT_SUPPORTED,
+                   "Cannot load the state of a cursor with a draft model");
+      return FALSE;
     }
 
-  if (completion->result != NULL)
+  if (!ggml_input_stream_read_exactly (istream, (char *) &header, sizeof (header), cancellable, error))
     {
-      (*state->stream_func) (completion->result->chunk,
-                             completion->result->is_complete_eos,
-                             state->stream_func_data);
+      return FALSE;
+    }
 
-      if (completion->result->is_complete)
-        {
-          /* We got a sentinel value. This means that we can now complete
-           * the task. We have to use an extra trampoline with a ref on the
-           * GGMLLanguageModelCompleteMonitorState here because
-           * g_task_return_error / g_task_return_pointer could
-           * end up on the main loop for another iteration. */
-          GTask *task = g_task_new (NULL,
-                                    NULL,
-                                    ggml_language_model_monitor_process_completion_ready,
-                                    ggml_language_model_complete_monitor_state_ref (state));
+  if (header.magic != GGML_LANGUAGE_MODEL_COMPLETION_CURSOR_STATE_MAGIC)
+    {
+      g_set_error (error, G_IO_ERROR, G_IO_ERROR_INVALID_DATA, "Invalid magic %#010x expected %#010x", header.magic, GGML_LANGUAGE_MODEL_COMPLETION_CURSOR_STATE_MAGIC);
+      return FALSE;
+    }
 
-          g_task_return_boolean (task, TRUE);
+  if (header.version != GGML_LANGUAGE_MODEL_COMPLETION_CURSOR_STATE_VERSION)
+    {
+      g_set_error (error, G_IO_ERROR, G_IO_ERROR_NOT_SUPPORTED, "Unsupported cursor state version %u", header.version);
+      return FALSE;
+    }
 
-          /* We're all done, return TRUE because we got a sentinel value */
-          return TRUE;
-        }
+  g_autofree char *sampler_state_data = g_malloc (header.sampler_state_n_bytes);
 
+  if (!ggml_input_stream_read_exactly (istream, sampler_state_data, header.sampler_state_n_bytes, cancellable, error))
+    {
       return FALSE;
     }
 
-  g_assert_not_reached ();
-  return TRUE;
-}
+  g_autoptr(GBytes) sampler_state_bytes = g_bytes_new_take (g_steal_pointer (&sampler_state_data), header.sampler_state_n_bytes);
+  g_autoptr(GVariant) serialized_sampler_state = g_variant_ref_sink (g_variant_new_from_bytes (G_VARIANT_TYPE (GGML_LANGUAGE_MODEL_COMPLETION_CURSOR_SAMPLER_STATE_TYPE),
+                                                                                              sampler_state_bytes,
+                                                                                              FALSE));
+  g_autofree char *sampler_type_name = NULL;
+  g_autoptr(GVariant) sampler_state = NULL;
 
-static gboolean
-ggml_language_model_monitor_callback (gpointer message, gpointer user_data)
-{
-  GGMLLanguageModelCompleteMonitorState *state = user_data;
-  g_autoptr(GGMLLanguageModelChunkCompletion) completion = message;
+  g_variant_get (serialized_sampler_state,
+                 GGML_LANGUAGE_MODEL_COMPLETION_CURSOR_SAMPLER_STATE_TYPE,
+                 &sampler_type_name,
+                 &sampler_state);
 
-  /* If we return TRUE*/
-  if (ggml_language_model_monitor_process_completion (state, completion))
+  if (g_strcmp0 (sampler_type_name, G_OBJECT_TYPE_NAME (cursor->sampler)) != 0)
     {
-      return G_SOURCE_REMOVE;
+      g_set_error (error,
+                   G_IO_ERROR,
+                   G_IO_ERROR_INVALID_DATA,
+                   "Cursor state was saved with a sampler of type %s, but the cursor has a sampler of type %s",
+                   sampler_type_name,
+                   G_OBJECT_TYPE_NAME (cursor->sampler));
+      return FALSE;
     }
 
-  return G_SOURCE_CONTINUE;
-}
+  g_autofree char *pending_input_data = g_malloc (header.pending_input_n_bytes);
 
-/**
- * ggml_language_model_create_completion:
- * @language_model: A #GGMLLanguageModel
- * @prompt: (transfer none): A text prompt to seed the language model
- * @max_completion_tokens: Maximum number of tokens in this query. Generating any more
- *                         requires creating a new cursor.
- *
- * Returns: (transfer full): A new #GGMLLanguageModelCompletionCursor representing the
- *          initial state of execution of the language model evaluated on some prompt.
- */
-GGMLLanguageModelCompletionCursor *
-ggml_language_model_create_completion (GGMLLanguageModel *language_model,
-                                       const char        *prompt,
-                                       size_t             max_completion_tokens)
-{
-  GGMLLanguageModelCompletionCursor *cursor = g_new0 (GGMLLanguageModelCompletionCursor, 1);
-  cursor->language_model = ggml_language_model_ref (language_model);
-  cursor->execution_memory = NULL;
-  cursor->sampler = ggml_argmax_language_model_sampler_new ();
-  cursor->prompt = g_strdup (prompt);
-  cursor->max_completion_tokens = max_completion_tokens;
-  cursor->memory_position = 0;
-  cursor->ref_count = 1;
+  if (!ggml_input_stream_read_exactly (istream, pending_input_data, header.pending_input_n_bytes, cancellable, error))
+    {
+      return FALSE;
+    }
 
-  return cursor;
-}
+  g_autoptr(GBytes) pending_input_bytes = g_bytes_new_take (g_steal_pointer (&pending_input_data), header.pending_input_n_bytes);
+  g_autoptr(GVariant) serialized_pending_input = g_variant_ref_sink (g_variant_new_from_bytes (G_VARIANT_TYPE (GGML_LANGUAGE_MODEL_COMPLETION_CURSOR_PENDING_INPUT_TYPE),
+                                                                                              pending_input_bytes,
+                                                                                              FALSE));
+  g_autoptr(GVariant) pending_tokens_variant = NULL;
+  g_autoptr(GVariant) pending_text_variant = NULL;
+  g_autoptr(GVariant) detokenizer_pending_bytes_variant = NULL;
 
-/**
- * ggml_language_model_completion_cursor_set_sampler:
- * @cursor: A #GGMLLanguageModelCompletionCursor
- * @sampler: (transfer none): A #GGMLLanguageModelSampler
- *
- * Set the sampler used for this cursor. The sampler determines how the model outputs
- * are converted into tokens. The default is to use deterministic sampling, eg,
- * argmax sampling, but this can lead to unnatural generations.
- */
-void
-ggml_language_model_completion_cursor_set_sampler (GGMLLanguageModelCompletionCursor *cursor,
-                                                   GGMLLanguageModelSampler *sampler)
-{
-  g_clear_object (&cursor->sampler);
-  cursor->sampler = g_object_ref (sampler);
-}
+  g_variant_get (serialized_pending_input,
+                 GGML_LANGUAGE_MODEL_COMPLETION_CURSOR_PENDING_INPUT_TYPE,
+                 &pending_tokens_variant,
+                 &pending_text_variant,
+                 &detokenizer_pending_bytes_variant);
+
+  g_autofree char *memory_desc_data = g_malloc (header.memory_desc_n_bytes);
 
+  if (!ggml_input_stream_read_exactly (istream, memory_desc_data, header.memory_desc_n_bytes, cancellable, error))
+    {
+      return FALSE;
+    }
+
+  /* The key-value positions are copied in byte for byte, so a memory
+   * with the same size but a different layout, for instance with transposed
+   * values or another type, would silently end up with garbage in it */
+  g_autoptr(GBytes) memory_desc_bytes = g_bytes_new_take (g_steal_pointer (&memory_desc_data), header.memory_desc_n_bytes);
+  g_autoptr(GVariant) saved_memory_desc = g_variant_ref_sink (g_variant_new_from_bytes (G_VARIANT_TYPE (GGML_LANGUAGE_MODEL_COMPLETION_CURSOR_MEMORY_DESC_TYPE),
+                                                                                       memory_desc_bytes,
+                                                                                       FALSE));
+  g_autoptr(GVariant) memory_desc = ggml_model_desc_node_serialize (cursor->language_model->memory_desc_node);
+
+  if (!g_variant_equal (saved_memory_desc, memory_desc))
+    {
+      g_autofree char *saved_memory_desc_str = g_variant_print (saved_memory_desc, FALSE);
+      g_autofree char *memory_desc_str = g_variant_print (memory_desc, FALSE);
+
+      g_set_error (error,
+                   G_IO_ERROR,
+                   G_IO_ERROR_INVALID_DATA,
+                   "Cursor state was saved with key-value memory %s, but the cursor has key-value memory %s",
+                   saved_memory_desc_str,
+                   memory_desc_str);
+      return FALSE;
+    }
+
+  if (header.memory_position > 0)
+    {
+      g_autoptr(GBytes) key_value_positions = ggml_language_model_completion_cursor_read_key_value_positions (istream,
+                                                                                                            header.key_value_n_bytes,
+                                                                                                            cancellable,
+                                                                                                            error);
+
+      if (key_value_positions == NULL)
+        {
+          return FALSE;
+        }
+
+      if (cursor->execution_memory == NULL)
+        {
+          g_autoptr(GHashTable) inference_parameters = g_hash_table_new (g_str_hash, g_str_equal);
+
+          if (!ggml_language_model_completion_cursor_create_execution_memory (cursor, inference_parameters, error))
+            {
+              return FALSE;
+            }
+        }
+
+      if (!ggml_execution_memory_restore_key_value_positions (cursor->execution_memory,
+                                                              key_value_positions,
+                                                              header.memory_position,
+                                                              header.memory_position,
+                                                              error))
+        {
+          return FALSE;
+        }
+    }
+
+  if (!ggml_language_model_sampler_set_state (cursor->sampler, sampler_state, error))
+    {
+      return FALSE;
+    }
+
+  cursor->memory_position = header.memory_position;
+  cursor->most_recent_token = header.most_recent_token;
+
+  /* Anything appended before loading belonged to the old state,
+   * so replace it with the input that was pending when saving */
+  size_t n_pending_tokens;
+  size_t pending_text_n_bytes;
+  size_t detokenizer_n_pending_bytes;
+  const int32_t *pending_tokens = g_variant_get_fixed_array (pending_tokens_variant,
+                                                             &n_pending_tokens,
+                                                             sizeof (int32_t));
+  const char *pending_text = g_variant_get_fixed_array (pending_text_variant,
+                                                        &pending_text_n_bytes,
+                                                        sizeof (char));
+  const char *detokenizer_pending_bytes = g_variant_get_fixed_array (detokenizer_pending_bytes_variant,
+                                                                     &detokenizer_n_pending_bytes,
+                                                                     sizeof (char));
+
+  g_array_set_size (cursor->pending_tokens, 0);
+  g_array_append_vals (cursor->pending_tokens, pending_tokens, n_pending_tokens);
+  g_string_truncate (cursor->pending_text, 0);
+  g_string_append_len (cursor->pending_text, pending_text, pending_text_n_bytes);
+  ggml_detokenizer_reset (cursor->detokenizer);
+  ggml_detokenizer_push_bytes (cursor->detokenizer, detokenizer_pending_bytes, detokenizer_n_pending_bytes);
+
+  return TRUE;
+}
 
 /**
  * ggml_language_model_completion_cursor_exec_stream_async:
@@ -1162,28 +2699,130 @@ ggml_language_model_completion_cursor_exec (GGMLLanguageModelCompletionCursor  *
   return g_strjoinv ("", (char **) completions_ptr_array->pdata);
 }
 
+/* If @istream comes from the model download cache, returns a file
+ * next to the downloaded model where the quantized weights can be
+ * cached. The file name is keyed by the quantization type, the
+ * regular expressions used to select the weights to quantize and the
+ * size and modification time of the downloaded model, so that changing
+ * any of them, for instance by downloading the model again, results in
+ * a different cache file. */
+static GFile *
+ggml_language_model_quantized_weights_cache_file (GInputStream  *istream,
+                                                  GGMLDataType   quantized_type,
+                                                  const char   **quantize_regexes,
+                                                  const char   **skip_quantize_regexes)
+{
+  if (!GGML_IS_CACHED_MODEL_ISTREAM (istream))
+    {
+      return NULL;
+    }
+
+  g_autofree char *local_path = NULL;
+  g_object_get (istream, "local-path", &local_path, NULL);
+
+  if (local_path == NULL)
+    {
+      return NULL;
+    }
+
+  g_autoptr(GFile) local_file = g_file_new_for_path (local_path);
+  g_autoptr(GFileInfo) local_file_info = g_file_query_info (local_file,
+                                                            G_FILE_ATTRIBUTE_STANDARD_SIZE ","
+                                                            G_FILE_ATTRIBUTE_TIME_MODIFIED ","
+                                                            G_FILE_ATTRIBUTE_TIME_MODIFIED_USEC,
+                                                            G_FILE_QUERY_INFO_NONE,
+                                                            NULL,
+                                                            NULL);
+
+  /* Without knowing which version of the model the cache would
+   * be for, it is safer not to cache at all */
+  if (local_file_info == NULL)
+    {
+      return NULL;
+    }
+
+  g_autoptr(GEnumClass) data_type_class = g_type_class_ref (GGML_TYPE_DATA_TYPE);
+  GEnumValue *data_type_value = g_enum_get_value (data_type_class, quantized_type);
+  g_autoptr(GString) cache_key = g_string_new (data_type_value->value_nick);
+
+  g_string_append_printf (cache_key,
+                          "\nsize=%" G_GOFFSET_FORMAT "\nmtime=%" G_GUINT64_FORMAT ".%06" G_GUINT32_FORMAT,
+                          g_file_info_get_size (local_file_info),
+                          g_file_info_get_attribute_uint64 (local_file_info, G_FILE_ATTRIBUTE_TIME_MODIFIED),
+                          g_file_info_get_attribute_uint32 (local_file_info, G_FILE_ATTRIBUTE_TIME_MODIFIED_USEC));
+
+  for (const char **it = quantize_regexes; it != NULL && *it != NULL; ++it)
+    {
+      g_string_append_printf (cache_key, "\n+%s", *it);
+    }
+
+  for (const char **it = skip_quantize_regexes; it != NULL && *it != NULL; ++it)
+    {
+      g_string_append_printf (cache_key, "\n-%s", *it);
+    }
+
+  g_autofree char *cache_key_checksum = g_compute_checksum_for_string (G_CHECKSUM_SHA256,
+                                                                       cache_key->str,
+                                                                       cache_key->len);
+  g_autofree char *dirname = g_path_get_dirname (local_path);
+  g_autofree char *basename = g_path_get_basename (local_path);
+
+  if (g_str_has_suffix (basename, ".bin"))
+    {
+      basename[strlen (basename) - strlen (".bin")] = '\0';
+    }
+
+  g_autofree char *cache_basename = g_strdup_printf ("%s-%s-%.16s.bin",
+                                                     basename,
+                                                     data_type_value->value_nick,
+                                                     cache_key_checksum);
+
+  return g_file_new_build_filename (dirname, "quantized", cache_basename, NULL);
+}
+
+/* Cache files for the same model and quantization type only differ in
+ * their cache key, which is the part of the name after the last '-'.
+ * Once @weights_cache_file is in place, any others are left over from
+ * an older download of the model or from other quantization settings,
+ * so remove them rather than letting them pile up. */
 static void
-ggml_model_set_possible_tied_weights (GGMLModel *model,
-                                      const char **loaded_keys,
-                                      const char **src_weights,
-                                      const char **dst_weights)
+ggml_language_model_remove_stale_weights_caches (GFile *weights_cache_file)
 {
-  const char **src_weights_it = src_weights;
-  const char **dst_weights_it = dst_weights;
+  g_autofree char *path = g_file_get_path (weights_cache_file);
+
+  if (path == NULL || !g_file_test (path, G_FILE_TEST_EXISTS))
+    {
+      return;
+    }
+
+  g_autofree char *dirname = g_path_get_dirname (path);
+  g_autofree char *basename = g_path_get_basename (path);
+  const char *cache_key = strrchr (basename, '-');
+  g_autoptr(GDir) cache_dir = g_dir_open (dirname, 0, NULL);
+  const char *name;
+
+  if (cache_key == NULL || cache_dir == NULL)
+    {
+      return;
+    }
 
-  for (; *src_weights_it != NULL && *dst_weights_it != NULL; ++src_weights_it, ++dst_weights_it)
+  size_t cache_prefix_length = cache_key - basename + 1;
+
+  while ((name = g_dir_read_name (cache_dir)) != NULL)
     {
-      if (!g_strv_contains (loaded_keys, *dst_weights_it) && g_strv_contains (loaded_keys, *src_weights_it))
+      if (strncmp (name, basename, cache_prefix_length) != 0 ||
+          strlen (name) != strlen (basename) ||
+          !g_str_has_suffix (name, ".bin") ||
+          strcmp (name, basename) == 0)
         {
-          GGMLTensor *src_tensor = ggml_model_get (model, *src_weights_it);
-          GGMLTensor *dst_tensor = ggml_model_get (model, *dst_weights_it);
+          continue;
+        }
 
-          g_assert (src_tensor != NULL);
-          g_assert (dst_tensor != NULL);
+      g_autofree char *stale_path = g_build_filename (dirname, name, NULL);
 
-          size_t src_n_bytes = 0;
-          char *src_data = ggml_tensor_get_data (src_tensor, &src_n_bytes);
-          ggml_tensor_set_data (dst_tensor, src_data, src_n_bytes);
+      if (g_unlink (stale_path) != 0)
+        {
+          g_warning ("Could not remove stale weights cache %s: %s", stale_path, g_strerror (errno));
         }
     }
 }
@@ -1203,6 +2842,12 @@ ggml_model_set_possible_tied_weights (GGMLModel *model,
  * Reads a GGML language model from @istream , which includes the hyperparameters, token
  * dictionary and model weights and returns a #GGMLLanguageModel
  *
+ * If @model_config asks for quantization and @istream was created by
+ * ggml_language_model_stream_from_cache(), the quantized weights are cached
+ * on disk next to the downloaded model, so that later loads with the same
+ * configuration do not need to quantize again. Only the most recently used
+ * cache for each quantization type is kept.
+ *
  * Returns: (transfer full): A #GGMLLanguageModel with the loaded weights on success
  */
 GGMLLanguageModel *
@@ -1264,30 +2909,47 @@ ggml_language_model_load_from_istream (GInputStream *istream,
       return NULL;
     }
 
-  g_auto(GStrv) loaded_keys = NULL;
-  g_autoptr(GGMLModel) model = ggml_model_load_from_istream (istream,
-                                                             postprocessed_model_desc_node,
-                                                             hyperparameters,
-                                                             forward_func,
-                                                             forward_func_user_data,
-                                                             forward_func_user_data_destroy,
-                                                             &loaded_keys,
-                                                             cancellable,
-                                                             error);
+  g_autoptr(GFile) weights_cache_file = (
+    should_quantize ? ggml_language_model_quantized_weights_cache_file (istream,
+                                                                        quantized_type,
+                                                                        quantize_regexes,
+                                                                        skip_quantize_regexes) :
+                      NULL
+  );
+  g_autoptr(GGMLModel) model = ggml_model_load_from_istream_with_weights_cache (istream,
+                                                                                weights_cache_file,
+                                                                                postprocessed_model_desc_node,
+                                                                                hyperparameters,
+                                                                                forward_func,
+                                                                                forward_func_user_data,
+                                                                                forward_func_user_data_destroy,
+                                                                                NULL,
+                                                                                cancellable,
+                                                                                error);
 
   if (model == NULL)
     {
       return NULL;
     }
 
-  const char *src_weights[] = {"model/wte", NULL};
-  const char *dst_weights[] = {"model/lm_head", NULL};
-  ggml_model_set_possible_tied_weights (model, (const char **) loaded_keys, src_weights, dst_weights);
+  if (weights_cache_file != NULL)
+    {
+      ggml_language_model_remove_stale_weights_caches (weights_cache_file);
+    }
+
+  ggml_model_set_compute_context (model, ggml_model_config_get_compute_context (model_config));
+
+  g_autoptr(GGMLLanguageModel) language_model = ggml_language_model_new (hyperparameters,
+                                                                         token_dictionary,
+                                                                         model,
+                                                                         language_model_desc->memory_desc);
+
+  if (!ggml_language_model_configure_key_value_cache (language_model, model_config, error))
+    {
+      return NULL;
+    }
 
-  return ggml_language_model_new (hyperparameters,
-                                  token_dictionary,
-                                  model,
-                                  language_model_desc->memory_desc);
+  return g_steal_pointer (&language_model);
 }
 
 static struct GGMLLanguageModelDefinitions {
@@ -1362,6 +3024,7 @@ typedef struct _GGMLLanguageModelLoadFromIstreamData
   GDestroyNotify forward_func_user_data_destroy;
 
   /* Things that get loaded as we go */
+  GFile *weights_cache_file;
   GGMLModelDescNode *model_desc;
   GGMLModelDescNode *memory_desc_node;
   GGMLHyperparameters *hyperparameters;
@@ -1401,6 +3064,7 @@ ggml_language_model_load_from_istream_data_free (GGMLLanguageModelLoadFromIstrea
   g_clear_pointer (&data->create_model_desc_user_data, data->create_model_desc_user_data_destroy);
   g_clear_pointer (&data->forward_func_user_data, data->forward_func_user_data_destroy);
 
+  g_clear_object (&data->weights_cache_file);
   g_clear_pointer (&data->memory_desc_node, ggml_model_desc_node_unref);
   g_clear_pointer (&data->model_desc, ggml_model_desc_node_unref);
   g_clear_pointer (&data->model, ggml_model_unref);
@@ -1427,7 +3091,7 @@ ggml_language_model_load_from_istream_on_model_read (GObject *src,
   g_autoptr(GGMLModel) model = NULL;
   g_auto(GStrv) loaded_keys = NULL;
 
-  if ((model = ggml_model_load_from_istream_finish (result, &loaded_keys, &error)) == NULL)
+  if ((model = ggml_model_load_from_istream_with_weights_cache_finish (result, &loaded_keys, &error)) == NULL)
     {
       g_task_return_error (task, error);
       return;
@@ -1435,17 +3099,27 @@ ggml_language_model_load_from_istream_on_model_read (GObject *src,
 
   GGMLLanguageModelLoadFromIstreamData *data = g_task_get_task_data (task);
 
+  if (data->weights_cache_file != NULL)
+    {
+      ggml_language_model_remove_stale_weights_caches (data->weights_cache_file);
+    }
+
+  ggml_model_set_compute_context (model, ggml_model_config_get_compute_context (data->config));
   data->model = g_steal_pointer (&model);
 
-  const char *src_weights[] = {"model/wte", NULL};
-  const char *dst_weights[] = {"model/lm_head", NULL};
-  ggml_model_set_possible_tied_weights (data->model, (const char **) loaded_keys, src_weights, dst_weights);
+  g_autoptr(GGMLLanguageModel) language_model = ggml_language_model_new (data->hyperparameters,
+                                                                         data->token_dictionary,
+                                                                         data->model,
+                                                                         data->memory_desc_node);
+
+  if (!ggml_language_model_configure_key_value_cache (language_model, data->config, &error))
+    {
+      g_task_return_error (task, error);
+      return;
+    }
 
   g_task_return_pointer (task,
-                         ggml_language_model_new (data->hyperparameters,
-                                                  data->token_dictionary,
-                                                  data->model,
-                                                  data->memory_desc_node),
+                         g_steal_pointer (&language_model),
                          (GDestroyNotify) ggml_language_model_unref);
 }
 
@@ -1473,15 +3147,16 @@ ggml_language_model_load_from_istream_on_token_dictionary_read (GObject *src,
    * After launching this, the model_forward_func_user_data is transferred
    * to the subtask, so set to %NULL in the GGMLHyperparametersLoadFromIstreamData
    */
-  ggml_model_load_from_istream_async (data->istream,
-                                      data->model_desc,
-                                      data->hyperparameters,
-                                      g_steal_pointer (&data->forward_func),
-                                      g_steal_pointer (&data->forward_func_user_data),
-                                      g_steal_pointer (&data->forward_func_user_data_destroy),
-                                      g_task_get_cancellable (task),
-                                      ggml_language_model_load_from_istream_on_model_read,
-                                      task);
+  ggml_model_load_from_istream_with_weights_cache_async (data->istream,
+                                                         data->weights_cache_file,
+                                                         data->model_desc,
+                                                         data->hyperparameters,
+                                                         g_steal_pointer (&data->forward_func),
+                                                         g_steal_pointer (&data->forward_func_user_data),
+                                                         g_steal_pointer (&data->forward_func_user_data_destroy),
+                                                         g_task_get_cancellable (task),
+                                                         ggml_language_model_load_from_istream_on_model_read,
+                                                         task);
 }
 
 static void
@@ -1531,6 +3206,13 @@ ggml_language_model_load_from_istream_on_hyperparameters_read (GObject *src,
     }
 
   data->model_desc = g_steal_pointer (&postprocessed_model_desc_node);
+  data->weights_cache_file = (
+    should_quantize ? ggml_language_model_quantized_weights_cache_file (data->istream,
+                                                                        quantized_type,
+                                                                        quantize_regexes,
+                                                                        skip_quantize_regexes) :
+                      NULL
+  );
 
   /* Continue reading the stream, now for the token dictionary */
   ggml_token_dictionary_load_from_istream_async (data->istream,
@@ -1762,6 +3444,9 @@ ggml_language_model_unref (GGMLLanguageModel *language_model)
       g_clear_pointer (&language_model->token_dictionary, ggml_token_dictionary_unref);
       g_clear_pointer (&language_model->model, ggml_model_unref);
       g_clear_pointer (&language_model->memory_desc_node, ggml_model_desc_node_unref);
+      g_clear_pointer (&language_model->key_value_page_pool, ggml_key_value_page_pool_unref);
+      g_clear_pointer (&language_model->prefix_cache, ggml_prefix_cache_unref);
+      g_clear_pointer (&language_model->batch_decoder, ggml_batch_decoder_unref);
       g_clear_pointer (&language_model, g_free);
     }
 }
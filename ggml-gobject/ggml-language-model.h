@@ -26,10 +26,12 @@
 #include <gio/gio.h>
 #include <ggml-gobject/ggml-cached-model.h>
 #include <ggml-gobject/ggml-hyperparameters.h>
+#include <ggml-gobject/ggml-key-value-page-pool.h>
 #include <ggml-gobject/ggml-language-model-sampler.h>
 #include <ggml-gobject/ggml-model-desc.h>
 #include <ggml-gobject/ggml-model-config.h>
 #include <ggml-gobject/ggml-model.h>
+#include <ggml-gobject/ggml-prefix-cache.h>
 #include <ggml-gobject/ggml-token-dictionary.h>
 
 G_BEGIN_DECLS
@@ -57,6 +59,13 @@ ggml_language_model_new (GGMLHyperparameters *hyperparameters,
 GGMLLanguageModel *ggml_language_model_ref (GGMLLanguageModel *language_model);
 void ggml_language_model_unref (GGMLLanguageModel *language_model);
 
+void ggml_language_model_set_key_value_page_pool (GGMLLanguageModel    *language_model,
+                                                  GGMLKeyValuePagePool *page_pool);
+GGMLKeyValuePagePool * ggml_language_model_get_key_value_page_pool (GGMLLanguageModel *language_model);
+void ggml_language_model_set_prefix_cache (GGMLLanguageModel *language_model,
+                                           GGMLPrefixCache   *prefix_cache);
+GGMLPrefixCache * ggml_language_model_get_prefix_cache (GGMLLanguageModel *language_model);
+
 typedef struct {
   GGMLModelDescNode *weights_desc;
   GGMLModelDescNode *memory_desc;
@@ -150,6 +159,14 @@ GGMLLanguageModel *ggml_language_model_load_defined_from_istream_finish (GAsyncR
 GGMLCachedModelIstream *ggml_language_model_stream_from_cache (GGMLDefinedLanguageModel   defined_model,
                                                                GError                   **error);
 
+gboolean ggml_language_model_tokenize_batch (GGMLLanguageModel   *language_model,
+                                             const char * const  *strings,
+                                             size_t               n_strings,
+                                             size_t               n_threads,
+                                             int32_t            **out_tokens,
+                                             size_t             **out_offsets,
+                                             size_t              *out_n_tokens,
+                                             GError             **error);
 char * ggml_language_model_decode_tokens (GGMLLanguageModel *language_model,
                                           int32_t           *tokens,
                                           size_t             length);
@@ -160,6 +177,29 @@ GGMLLanguageModelCompletionCursor * ggml_language_model_create_completion (GGMLL
 
 void ggml_language_model_completion_cursor_set_sampler (GGMLLanguageModelCompletionCursor *cursor,
                                                         GGMLLanguageModelSampler *sampler);
+void ggml_language_model_completion_cursor_set_n_threads (GGMLLanguageModelCompletionCursor *cursor,
+                                                          size_t                             n_threads);
+gboolean ggml_language_model_completion_cursor_set_draft_model (GGMLLanguageModelCompletionCursor  *cursor,
+                                                                GGMLLanguageModel                  *draft_model,
+                                                                size_t                              n_draft_tokens,
+                                                                GError                            **error);
+GGMLLanguageModelCompletionCursor * ggml_language_model_completion_cursor_fork (GGMLLanguageModelCompletionCursor  *cursor,
+                                                                                GError                            **error);
+gboolean ggml_language_model_completion_cursor_append_tokens (GGMLLanguageModelCompletionCursor  *cursor,
+                                                              const int32_t                      *tokens,
+                                                              size_t                              n_tokens,
+                                                              GError                            **error);
+gboolean ggml_language_model_completion_cursor_append_text (GGMLLanguageModelCompletionCursor  *cursor,
+                                                            const char                         *text,
+                                                            GError                            **error);
+gboolean ggml_language_model_completion_cursor_save_state (GGMLLanguageModelCompletionCursor  *cursor,
+                                                           GOutputStream                      *ostream,
+                                                           GCancellable                       *cancellable,
+                                                           GError                            **error);
+gboolean ggml_language_model_completion_cursor_load_state (GGMLLanguageModelCompletionCursor  *cursor,
+                                                           GInputStream                       *istream,
+                                                           GCancellable                       *cancellable,
+                                                           GError                            **error);
 
 typedef void (*GGMLLanguageModelCompletionCursorStreamFunc) (const char *decoded,
                                                              gboolean    is_complete_eos,
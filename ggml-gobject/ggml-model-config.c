@@ -27,8 +27,14 @@ struct _GGMLModelConfig {
   GGMLDataType quantization_type;
   GStrv quantization_regexes;
   GStrv skip_quantization_regexes;
+  GGMLComputeContext *compute_context;
+  size_t key_value_cache_capacity;
+  GGMLDataType key_value_cache_type;
+  size_t prefix_cache_max_bytes;
+  size_t batch_decoding_max_sequences;
 
   gboolean quantization_type_set : 1;
+  gboolean key_value_cache_transposed_values : 1;
 };
 
 /**
@@ -41,6 +47,7 @@ ggml_model_config_new (void)
 {
   GGMLModelConfig *config = g_new0 (GGMLModelConfig, 1);
   config->ref_count = 1;
+  config->key_value_cache_type = GGML_DATA_TYPE_F32;
 
   return config;
 }
@@ -72,6 +79,9 @@ ggml_model_config_unref (GGMLModelConfig *config)
 {
   if (--config->ref_count == 0)
     {
+      g_clear_pointer (&config->quantization_regexes, g_strfreev);
+      g_clear_pointer (&config->skip_quantization_regexes, g_strfreev);
+      g_clear_pointer (&config->compute_context, ggml_compute_context_unref);
       g_clear_pointer (&config, g_free);
     }
 }
@@ -91,6 +101,9 @@ ggml_model_config_set_quantization_config (GGMLModelConfig  *config,
                                            const char      **quantization_regexes,
                                            const char      **skip_quantization_regexes)
 {
+  g_clear_pointer (&config->quantization_regexes, g_strfreev);
+  g_clear_pointer (&config->skip_quantization_regexes, g_strfreev);
+
   config->quantization_type = quantization_type;
   config->quantization_regexes = g_strdupv ((GStrv) quantization_regexes);
   config->skip_quantization_regexes = g_strdupv ((GStrv) skip_quantization_regexes);
@@ -144,4 +157,236 @@ ggml_model_config_get_quantization_config (GGMLModelConfig   *config,
   return TRUE;
 }
 
+/**
+ * ggml_model_config_set_compute_context:
+ * @config: A #GGMLModelConfig
+ * @compute_context: (transfer none) (nullable): A #GGMLComputeContext
+ *
+ * Sets the #GGMLComputeContext that models loaded with @config take
+ * their threads from. Models share the process-wide default context
+ * if this is not set.
+ */
+void
+ggml_model_config_set_compute_context (GGMLModelConfig    *config,
+                                       GGMLComputeContext *compute_context)
+{
+  g_clear_pointer (&config->compute_context, ggml_compute_context_unref);
+  config->compute_context = compute_context != NULL ? ggml_compute_context_ref (compute_context) : NULL;
+}
+
+/**
+ * ggml_model_config_get_compute_context:
+ * @config: (nullable): A #GGMLModelConfig
+ *
+ * Returns: (transfer none) (nullable): The #GGMLComputeContext set on @config,
+ *          or %NULL if there is none.
+ */
+GGMLComputeContext *
+ggml_model_config_get_compute_context (GGMLModelConfig *config)
+{
+  if (config == NULL)
+    {
+      return NULL;
+    }
+
+  return config->compute_context;
+}
+
+/**
+ * ggml_model_config_set_key_value_cache_capacity:
+ * @config: A #GGMLModelConfig
+ * @n_positions: The number of positions in the shared key-value cache, or 0
+ *
+ * Sets the number of positions in a key-value cache that is shared between
+ * all the completion cursors of models loaded with @config. The cache is
+ * split into pages, which are handed out to cursors as they need them,
+ * so that short completions do not hold on to memory for the whole context.
+ *
+ * If this is 0, which is the default, then each cursor gets its own
+ * key-value memory covering the whole context.
+ */
+void
+ggml_model_config_set_key_value_cache_capacity (GGMLModelConfig *config,
+                                                size_t           n_positions)
+{
+  config->key_value_cache_capacity = n_positions;
+}
+
+/**
+ * ggml_model_config_get_key_value_cache_capacity:
+ * @config: (nullable): A #GGMLModelConfig
+ *
+ * Returns: The number of positions in the shared key-value cache set on @config,
+ *          or 0 if cursors should have their own key-value memory.
+ */
+size_t
+ggml_model_config_get_key_value_cache_capacity (GGMLModelConfig *config)
+{
+  if (config == NULL)
+    {
+      return 0;
+    }
+
+  return config->key_value_cache_capacity;
+}
+
+/**
+ * ggml_model_config_set_key_value_cache_type:
+ * @config: A #GGMLModelConfig
+ * @data_type: A #GGMLDataType, one of %GGML_DATA_TYPE_F32, %GGML_DATA_TYPE_F16
+ *             or %GGML_DATA_TYPE_Q8_0
+ *
+ * Sets the type that keys and values are stored as in the key-value
+ * memory of models loaded with @config. Keys and values are converted
+ * when they are written to the memory. %GGML_DATA_TYPE_F16 halves and
+ * %GGML_DATA_TYPE_Q8_0 roughly quarters the size of the memory, as well
+ * as the amount of it that has to be read on each decoding step, at
+ * some cost in precision.
+ *
+ * The default is %GGML_DATA_TYPE_F32. Loading a model fails if
+ * @data_type is not one of the supported types.
+ */
+void
+ggml_model_config_set_key_value_cache_type (GGMLModelConfig *config,
+                                            GGMLDataType     data_type)
+{
+  config->key_value_cache_type = data_type;
+}
+
+/**
+ * ggml_model_config_get_key_value_cache_type:
+ * @config: (nullable): A #GGMLModelConfig
+ *
+ * Returns: The #GGMLDataType that keys and values are stored as, which
+ *          is %GGML_DATA_TYPE_F32 if @config is %NULL.
+ */
+GGMLDataType
+ggml_model_config_get_key_value_cache_type (GGMLModelConfig *config)
+{
+  if (config == NULL)
+    {
+      return GGML_DATA_TYPE_F32;
+    }
+
+  return config->key_value_cache_type;
+}
+
+/**
+ * ggml_model_config_set_key_value_cache_transposed_values:
+ * @config: A #GGMLModelConfig
+ * @transposed_values: Whether to store values transposed
+ *
+ * Sets whether values are stored transposed in the key-value memory
+ * of models loaded with @config, with one row of positions for each
+ * channel. This means that attention can read them as they are,
+ * instead of transposing all the past values on each decoding step.
+ *
+ * Transposed values can not be stored as %GGML_DATA_TYPE_Q8_0 and
+ * can not be used with a shared key-value cache, loading a model with
+ * such a configuration fails.
+ */
+void
+ggml_model_config_set_key_value_cache_transposed_values (GGMLModelConfig *config,
+                                                         gboolean         transposed_values)
+{
+  config->key_value_cache_transposed_values = !!transposed_values;
+}
+
+/**
+ * ggml_model_config_get_key_value_cache_transposed_values:
+ * @config: (nullable): A #GGMLModelConfig
+ *
+ * Returns: %TRUE if values should be stored transposed in the key-value
+ *          memory, %FALSE otherwise or if @config is %NULL.
+ */
+gboolean
+ggml_model_config_get_key_value_cache_transposed_values (GGMLModelConfig *config)
+{
+  if (config == NULL)
+    {
+      return FALSE;
+    }
+
+  return config->key_value_cache_transposed_values;
+}
+
+/**
+ * ggml_model_config_set_prefix_cache_max_bytes:
+ * @config: A #GGMLModelConfig
+ * @max_bytes: The most bytes of key-value memory snapshots to keep, or 0
+ *
+ * Sets the size of a #GGMLPrefixCache that is shared between all
+ * the completion cursors of models loaded with @config. Cursors whose
+ * prompt starts with the same tokens as an earlier one then restore
+ * the keys and values for those tokens instead of computing them again.
+ *
+ * If this is 0, which is the default, then there is no prefix cache.
+ */
+void
+ggml_model_config_set_prefix_cache_max_bytes (GGMLModelConfig *config,
+                                              size_t           max_bytes)
+{
+  config->prefix_cache_max_bytes = max_bytes;
+}
+
+/**
+ * ggml_model_config_get_prefix_cache_max_bytes:
+ * @config: (nullable): A #GGMLModelConfig
+ *
+ * Returns: The size of the prefix cache set on @config, or 0 if there
+ *          should be no prefix cache.
+ */
+size_t
+ggml_model_config_get_prefix_cache_max_bytes (GGMLModelConfig *config)
+{
+  if (config == NULL)
+    {
+      return 0;
+    }
+
+  return config->prefix_cache_max_bytes;
+}
+
+/**
+ * ggml_model_config_set_batch_decoding_max_sequences:
+ * @config: A #GGMLModelConfig
+ * @max_sequences: The most cursors to decode together, or 0
+ *
+ * Lets up to @max_sequences completion cursors of models loaded with
+ * @config that are decoding at the same time share one forward pass
+ * for each of their next tokens, instead of each running their own.
+ * Cursors join and leave between steps, so they do not need to start
+ * or finish at the same time. Prompts and appended text are still
+ * processed by each cursor on its own.
+ *
+ * Batched decoding needs a shared key-value cache, see
+ * ggml_model_config_set_key_value_cache_capacity.
+ *
+ * If this is 0, which is the default, then each cursor decodes on its own.
+ */
+void
+ggml_model_config_set_batch_decoding_max_sequences (GGMLModelConfig *config,
+                                                    size_t           max_sequences)
+{
+  config->batch_decoding_max_sequences = max_sequences;
+}
+
+/**
+ * ggml_model_config_get_batch_decoding_max_sequences:
+ * @config: (nullable): A #GGMLModelConfig
+ *
+ * Returns: The most cursors that are decoded together for models loaded
+ *          with @config, or 0 if there is no batched decoding.
+ */
+size_t
+ggml_model_config_get_batch_decoding_max_sequences (GGMLModelConfig *config)
+{
+  if (config == NULL)
+    {
+      return 0;
+    }
+
+  return config->batch_decoding_max_sequences;
+}
+
 G_DEFINE_BOXED_TYPE (GGMLModelConfig, ggml_model_config, ggml_model_config_ref, ggml_model_config_unref);
@@ -23,6 +23,7 @@
 #pragma once
 
 #include <glib-object.h>
+#include <ggml-gobject/ggml-compute-context.h>
 #include <ggml-gobject/ggml-types.h>
 
 G_BEGIN_DECLS
@@ -41,6 +42,24 @@ gboolean ggml_model_config_get_quantization_config (GGMLModelConfig   *config,
                                                     GGMLDataType      *out_quantization_type,
                                                     const char     ***out_quantization_regexes,
                                                     const char     ***out_skip_quantization_regexes);
+void ggml_model_config_set_compute_context (GGMLModelConfig    *config,
+                                            GGMLComputeContext *compute_context);
+GGMLComputeContext * ggml_model_config_get_compute_context (GGMLModelConfig *config);
+void ggml_model_config_set_key_value_cache_capacity (GGMLModelConfig *config,
+                                                     size_t           n_positions);
+size_t ggml_model_config_get_key_value_cache_capacity (GGMLModelConfig *config);
+void ggml_model_config_set_key_value_cache_type (GGMLModelConfig *config,
+                                                 GGMLDataType     data_type);
+GGMLDataType ggml_model_config_get_key_value_cache_type (GGMLModelConfig *config);
+void ggml_model_config_set_key_value_cache_transposed_values (GGMLModelConfig *config,
+                                                              gboolean         transposed_values);
+gboolean ggml_model_config_get_key_value_cache_transposed_values (GGMLModelConfig *config);
+void ggml_model_config_set_prefix_cache_max_bytes (GGMLModelConfig *config,
+                                                   size_t           max_bytes);
+size_t ggml_model_config_get_prefix_cache_max_bytes (GGMLModelConfig *config);
+void ggml_model_config_set_batch_decoding_max_sequences (GGMLModelConfig *config,
+                                                         size_t           max_sequences);
+size_t ggml_model_config_get_batch_decoding_max_sequences (GGMLModelConfig *config);
 
 #define GGML_TYPE_MODEL_CONFIG (ggml_model_config_get_type ());
 GType ggml_model_config_get_type (void);
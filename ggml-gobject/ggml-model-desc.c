@@ -24,6 +24,7 @@
 
 typedef struct _GGMLModelDescLeafExtended  {
   GGMLModelDescLeaf base;
+  char *tied_to;
   size_t ref_count;
 } GGMLModelDescLeafExtended;
 
@@ -72,10 +73,50 @@ ggml_model_desc_leaf_unref (GGMLModelDescLeaf *leaf)
   if (--ext->ref_count == 0)
     {
       g_clear_pointer (&ext->base.dimensions, g_free);
+      g_clear_pointer (&ext->tied_to, g_free);
       g_clear_pointer (&ext, g_free);
     }
 }
 
+/**
+ * ggml_model_desc_leaf_set_tied_to:
+ * @leaf: A #GGMLModelDescLeaf
+ * @tied_to: (nullable): The path of another weight in the same model, or %NULL
+ *
+ * Marks the weight at @leaf as tied to the weight at @tied_to. When a model
+ * is created from the description, both weights refer to the same tensor and
+ * the memory for @leaf is not allocated. If the weights for @leaf are loaded
+ * separately, for instance because they are in the model file, then the tie is
+ * broken and @leaf gets its own tensor. The tie is also broken if @leaf has a
+ * different type or shape to @tied_to, for instance because only one of them
+ * is quantized. If @leaf is not in the model file, its data is then converted
+ * from the data of @tied_to when the model is loaded.
+ */
+void
+ggml_model_desc_leaf_set_tied_to (GGMLModelDescLeaf *leaf,
+                                  const char        *tied_to)
+{
+  GGMLModelDescLeafExtended *ext = (GGMLModelDescLeafExtended *) leaf;
+
+  g_clear_pointer (&ext->tied_to, g_free);
+  ext->tied_to = g_strdup (tied_to);
+}
+
+/**
+ * ggml_model_desc_leaf_get_tied_to:
+ * @leaf: A #GGMLModelDescLeaf
+ *
+ * Returns: (transfer none) (nullable): The path of the weight that @leaf is tied to,
+ *          or %NULL if it is not tied to anything.
+ */
+const char *
+ggml_model_desc_leaf_get_tied_to (const GGMLModelDescLeaf *leaf)
+{
+  const GGMLModelDescLeafExtended *ext = (const GGMLModelDescLeafExtended *) leaf;
+
+  return ext->tied_to;
+}
+
 G_DEFINE_BOXED_TYPE (GGMLModelDescLeaf,
                      ggml_model_desc_leaf,
                      ggml_model_desc_leaf_ref,
@@ -156,6 +197,30 @@ ggml_model_desc_node_new_leaf (int64_t *dimensions, size_t n_dim, GGMLDataType t
   return node;
 }
 
+/**
+ * ggml_model_desc_node_new_tied_leaf:
+ * @dimensions: (array length=n_dim): An #int64_t array with leaf node dimensions
+ * @n_dim: Number of dimensions in @dimensions
+ * @type: A #GGMLDataType for this leaf node
+ * @tied_to: The path of the weight that this leaf is tied to
+ *
+ * Like ggml_model_desc_node_new_leaf(), but the leaf shares its tensor with
+ * @tied_to, see ggml_model_desc_leaf_set_tied_to().
+ *
+ * Returns: (transfer full): A new #GGMLModelDescNode with a new #GGMLModelDescLeaf and no children
+ */
+GGMLModelDescNode *
+ggml_model_desc_node_new_tied_leaf (int64_t      *dimensions,
+                                    size_t        n_dim,
+                                    GGMLDataType  type,
+                                    const char   *tied_to)
+{
+  g_autoptr(GGMLModelDescLeaf) leaf = ggml_model_desc_leaf_new (dimensions, n_dim, type);
+  ggml_model_desc_leaf_set_tied_to (leaf, tied_to);
+
+  return ggml_model_desc_node_new (leaf, NULL);
+}
+
 void
 ggml_model_node_flatten_recurse (GHashTable *table, GGMLModelDescNode *current_node, const gchar *current_path)
 {
@@ -270,6 +335,44 @@ ggml_model_desc_node_flatten (GGMLModelDescNode *node)
   return ht;
 }
 
+/**
+ * ggml_model_desc_node_serialize:
+ * @node: A #GGMLModelDescNode
+ *
+ * Describes the name, type and shape of every leaf of @node, sorted by name,
+ * as a #GVariant of type a{s(uax)}. Two descriptions with the same leaves
+ * serialize to equal variants, so the result can be stored along with data
+ * laid out according to @node and compared with g_variant_equal() later to
+ * check that the data still fits.
+ *
+ * Returns: (transfer full): A new #GVariant describing the leaves of @node
+ */
+GVariant *
+ggml_model_desc_node_serialize (GGMLModelDescNode *node)
+{
+  g_autoptr(GHashTable) flattened_desc = ggml_model_desc_node_flatten (node);
+  g_autoptr(GList) paths = g_list_sort (g_hash_table_get_keys (flattened_desc), (GCompareFunc) g_strcmp0);
+  GVariantBuilder builder;
+
+  g_variant_builder_init (&builder, G_VARIANT_TYPE ("a{s(uax)}"));
+
+  for (GList *it = paths; it != NULL; it = it->next)
+    {
+      GGMLModelDescLeaf *leaf = g_hash_table_lookup (flattened_desc, it->data);
+
+      g_variant_builder_add (&builder,
+                             "{s(u@ax)}",
+                             (const char *) it->data,
+                             (guint32) leaf->type,
+                             g_variant_new_fixed_array (G_VARIANT_TYPE_INT64,
+                                                        leaf->dimensions,
+                                                        leaf->n_dim,
+                                                        sizeof (int64_t)));
+    }
+
+  return g_variant_ref_sink (g_variant_builder_end (&builder));
+}
+
 /**
  * ggml_model_desc_node_ref:
  * @node: (transfer none): A #GGMLModelDescNode
@@ -49,6 +49,9 @@ GGMLModelDescLeaf *ggml_model_desc_leaf_new (int64_t *dimensions, size_t n_dim,
                                              GGMLDataType type);
 GGMLModelDescLeaf *ggml_model_desc_leaf_ref (GGMLModelDescLeaf *leaf);
 void ggml_model_desc_leaf_unref (GGMLModelDescLeaf *leaf);
+void ggml_model_desc_leaf_set_tied_to (GGMLModelDescLeaf *leaf,
+                                       const char        *tied_to);
+const char *ggml_model_desc_leaf_get_tied_to (const GGMLModelDescLeaf *leaf);
 
 G_DEFINE_AUTOPTR_CLEANUP_FUNC (GGMLModelDescLeaf, ggml_model_desc_leaf_unref)
 
@@ -72,8 +75,13 @@ GGMLModelDescNode *ggml_model_desc_node_new (GGMLModelDescLeaf *leaf,
 GGMLModelDescNode *ggml_model_desc_node_new_leaf (int64_t *dimensions,
                                                   size_t n_dim,
                                                   GGMLDataType type);
+GGMLModelDescNode *ggml_model_desc_node_new_tied_leaf (int64_t      *dimensions,
+                                                       size_t        n_dim,
+                                                       GGMLDataType  type,
+                                                       const char   *tied_to);
 GGMLModelDescNode *ggml_model_desc_node_ref (GGMLModelDescNode *node);
 GHashTable *ggml_model_desc_node_flatten (GGMLModelDescNode *node);
+GVariant *ggml_model_desc_node_serialize (GGMLModelDescNode *node);
 
 /**
  * GGMLModelDescMapFunc:
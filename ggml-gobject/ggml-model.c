@@ -21,6 +21,7 @@
  */
 
 #include <ggml-gobject/ggml-model.h>
+#include <ggml-gobject/internal/ggml-context-internal.h>
 #include <ggml-gobject/internal/ggml-stream-internal.h>
 #include <ggml-gobject/internal/ggml-tensor-internal.h>
 #include <ggml-gobject/ggml-enum-types.h>
@@ -31,6 +32,18 @@ struct _GGMLModel {
   GGMLModelForwardFunc forward_func;
   gpointer forward_func_user_data;
   GDestroyNotify forward_func_user_data_destroy;
+
+  /* Layer weights resolved by ggml_model_index_layer_weights,
+   * stored layer-major with n_layer_weight_slots per layer */
+  GMutex layer_weights_mutex;
+  GPtrArray *layer_weights;
+  char *layer_prefix;
+  GStrv layer_weight_slot_names;
+  size_t n_layers;
+  size_t n_layer_weight_slots;
+
+  GGMLComputeContext *compute_context;
+
   size_t ref_count;
 };
 
@@ -60,8 +73,26 @@ ggml_estimate_tensor_size_for_type (GGMLDataType  data_type,
   return ne[GGML_MAX_DIMS - 1] * nb[GGML_MAX_DIMS - 1];
 }
 
+/* A tied leaf only shares the tensor of its target if the target
+ * is actually part of the same description and has the same type
+ * and shape. Otherwise, for instance if only one of them gets
+ * quantized, the tie is broken and the leaf gets its own tensor. */
+static gboolean
+ggml_model_desc_leaf_is_tied_within (GGMLModelDescLeaf *leaf,
+                                     GHashTable        *flattened_desc)
+{
+  const char *tied_to = ggml_model_desc_leaf_get_tied_to (leaf);
+  GGMLModelDescLeaf *tied_leaf = tied_to != NULL ? g_hash_table_lookup (flattened_desc, tied_to) : NULL;
+
+  return (tied_leaf != NULL &&
+          tied_leaf->type == leaf->type &&
+          tied_leaf->n_dim == leaf->n_dim &&
+          memcmp (tied_leaf->dimensions, leaf->dimensions, sizeof (int64_t) * leaf->n_dim) == 0);
+}
+
 static size_t
-ggml_estimate_model_size_from_flattened_desc (GHashTable *flattened_desc)
+ggml_estimate_model_size_from_flattened_desc (GHashTable *flattened_desc,
+                                              gboolean    resolve_ties)
 {
   gpointer key, value;
   GHashTableIter iter;
@@ -74,6 +105,12 @@ ggml_estimate_model_size_from_flattened_desc (GHashTable *flattened_desc)
     {
       GGMLModelDescLeaf *leaf = value;
 
+      /* Tied weights share their memory with another weight */
+      if (resolve_ties && ggml_model_desc_leaf_is_tied_within (leaf, flattened_desc))
+        {
+          continue;
+        }
+
       size_t n_dims = leaf->n_dim;
       int64_t *shape = leaf->dimensions;
 
@@ -86,30 +123,41 @@ ggml_estimate_model_size_from_flattened_desc (GHashTable *flattened_desc)
   return computed_size;
 }
 
-/**
- * ggml_new_weight_set_from_flattened_desc:
- * @existing_context: (transfer none) (nullable): A #GGMLContext to allocate tensors
- *                    from or %NULL if a new context should be created.
- * @flattened_desc: (element-type utf8 GGMLModelDescLeaf): A #GHashTable containing
- *                  key-value pairs of weight names and their descriptions
- *
- * Returns: (transfer full) (element-type utf8 GGMLTensor): A #GHashTable of names
- *          and #GGMLTensor objects, either allocated on the @context or with an implicit
- *          context if none is provided.
- */
-GHashTable *
-ggml_new_weight_set_from_flattened_desc (GGMLContext *existing_context,
-                                         GHashTable  *flattened_desc)
+static GGMLTensor *
+ggml_context_new_tensor_for_leaf (GGMLContext       *context,
+                                  GGMLModelDescLeaf *leaf,
+                                  const char        *name)
+{
+  GGMLTensor *tensor = NULL;
+
+  if (leaf->n_dim == 1)
+    {
+      tensor = ggml_context_new_tensor_1d (context, leaf->type, leaf->dimensions[0]);
+    }
+  else if (leaf->n_dim == 2)
+    {
+      tensor = ggml_context_new_tensor_2d (context, leaf->type, leaf->dimensions[0], leaf->dimensions[1]);
+    }
+  else if (leaf->n_dim == 3)
+    {
+      tensor = ggml_context_new_tensor_3d (context, leaf->type, leaf->dimensions[0], leaf->dimensions[1], leaf->dimensions[2]);
+    }
+
+  g_assert (tensor != NULL);
+  ggml_tensor_set_name (tensor, name);
+
+  return tensor;
+}
+
+static GHashTable *
+ggml_new_weight_set_from_flattened_desc_in_context (GGMLContext *context,
+                                                    GHashTable  *flattened_desc,
+                                                    gboolean     resolve_ties)
 {
   g_autoptr(GHashTable) weight_set = g_hash_table_new_full (g_str_hash,
                                                             g_str_equal,
                                                             g_free,
                                                             (GDestroyNotify) ggml_tensor_unref);
-  g_autoptr(GGMLContext) context = (
-    existing_context != NULL ?
-    ggml_context_ref (existing_context) :
-    ggml_context_new (ggml_estimate_model_size_from_flattened_desc (flattened_desc))
-  );
 
   GHashTableIter iter;
   gpointer key, value;
@@ -118,29 +166,90 @@ ggml_new_weight_set_from_flattened_desc (GGMLContext *existing_context,
   while (g_hash_table_iter_next (&iter, &key, &value))
     {
       GGMLModelDescLeaf *leaf = value;
-      GGMLTensor *tensor = NULL;
 
-      if (leaf->n_dim == 1)
-        {
-          tensor = ggml_context_new_tensor_1d (context, leaf->type, leaf->dimensions[0]);
-        }
-      else if (leaf->n_dim == 2)
+      if (resolve_ties && ggml_model_desc_leaf_is_tied_within (leaf, flattened_desc))
         {
-          tensor = ggml_context_new_tensor_2d (context, leaf->type, leaf->dimensions[0], leaf->dimensions[1]);
+          continue;
         }
-      else if (leaf->n_dim == 3)
+
+      g_hash_table_insert (weight_set,
+                           g_strdup (key),
+                           ggml_context_new_tensor_for_leaf (context, leaf, key));
+    }
+
+  if (!resolve_ties)
+    {
+      return g_steal_pointer (&weight_set);
+    }
+
+  /* Now that all the other tensors exist, point the tied ones at their targets */
+  g_hash_table_iter_init (&iter, flattened_desc);
+  while (g_hash_table_iter_next (&iter, &key, &value))
+    {
+      GGMLModelDescLeaf *leaf = value;
+
+      if (!ggml_model_desc_leaf_is_tied_within (leaf, flattened_desc))
         {
-          tensor = ggml_context_new_tensor_3d (context, leaf->type, leaf->dimensions[0], leaf->dimensions[1], leaf->dimensions[2]);
+          continue;
         }
 
-      g_assert (tensor != NULL);
-      ggml_tensor_set_name (tensor, key);
-      g_hash_table_insert (weight_set, g_strdup (key), tensor);
+      GGMLTensor *tied_tensor = g_hash_table_lookup (weight_set, ggml_model_desc_leaf_get_tied_to (leaf));
+
+      g_assert (tied_tensor != NULL);
+      g_hash_table_insert (weight_set, g_strdup (key), ggml_tensor_ref (tied_tensor));
     }
 
   return g_steal_pointer (&weight_set);
 }
 
+/**
+ * ggml_new_weight_set_from_flattened_desc:
+ * @existing_context: (transfer none) (nullable): A #GGMLContext to allocate tensors
+ *                    from or %NULL if a new context should be created.
+ * @flattened_desc: (element-type utf8 GGMLModelDescLeaf): A #GHashTable containing
+ *                  key-value pairs of weight names and their descriptions
+ *
+ * Weights which are tied to another weight in @flattened_desc (see
+ * ggml_model_desc_leaf_set_tied_to()) with the same type and shape are not
+ * allocated, instead they map to the same #GGMLTensor as the weight they
+ * are tied to.
+ *
+ * Returns: (transfer full) (element-type utf8 GGMLTensor): A #GHashTable of names
+ *          and #GGMLTensor objects, either allocated on the @context or with an implicit
+ *          context if none is provided.
+ */
+GHashTable *
+ggml_new_weight_set_from_flattened_desc (GGMLContext *existing_context,
+                                         GHashTable  *flattened_desc)
+{
+  g_autoptr(GGMLContext) context = (
+    existing_context != NULL ?
+    ggml_context_ref (existing_context) :
+    ggml_context_new (ggml_estimate_model_size_from_flattened_desc (flattened_desc, TRUE))
+  );
+
+  return ggml_new_weight_set_from_flattened_desc_in_context (context, flattened_desc, TRUE);
+}
+
+static GGMLModel *
+ggml_model_new_from_weight_set (GGMLContext *context,
+                                GHashTable  *weights,
+                                GGMLModelForwardFunc forward_func,
+                                gpointer forward_func_user_data,
+                                GDestroyNotify forward_func_user_data_destroy)
+{
+  GGMLModel *model = g_new0 (GGMLModel, 1);
+  model->owning_context = ggml_context_ref (context);
+  model->weights = weights; /* transfer full */
+  model->forward_func = forward_func;
+  model->forward_func_user_data = forward_func_user_data;
+  model->forward_func_user_data_destroy = forward_func_user_data_destroy;
+  g_mutex_init (&model->layer_weights_mutex);
+  model->ref_count = 1;
+
+  return model;
+}
+
 /**
  * ggml_model_new_from_flattened_desc:
  * @context: A #GGMLContext
@@ -159,15 +268,11 @@ ggml_model_new_from_flattened_desc (GGMLContext *context,
                                     gpointer forward_func_user_data,
                                     GDestroyNotify forward_func_user_data_destroy)
 {
-  GGMLModel *model = g_new0 (GGMLModel, 1);
-  model->owning_context = ggml_context_ref (context);
-  model->weights = ggml_new_weight_set_from_flattened_desc (context, flattened_desc);
-  model->forward_func = forward_func;
-  model->forward_func_user_data = forward_func_user_data;
-  model->forward_func_user_data_destroy = forward_func_user_data_destroy;
-  model->ref_count = 1;
-
-  return model;
+  return ggml_model_new_from_weight_set (context,
+                                         ggml_new_weight_set_from_flattened_desc (context, flattened_desc),
+                                         forward_func,
+                                         forward_func_user_data,
+                                         forward_func_user_data_destroy);
 }
 
 static inline int32_t
@@ -384,14 +489,188 @@ convert_data_for_model (GGMLDataType   src_type,
   return TRUE;
 }
 
+/* Weight conversion (eg, quantization) is CPU bound and independent
+ * for each tensor, so it is handed off to a pool of workers while the
+ * loading thread carries on reading the next tensor. The number of
+ * conversions in flight is bounded, so that we don't buffer the whole
+ * model in memory if reading is faster than converting. */
+typedef struct _GGMLWeightConversionJob
+{
+  GGMLTensor *tensor; /* unowned, the pipeline is always finished before the weights go away */
+  char *name;
+  GGMLDataType src_type;
+  GBytes *src_data;
+} GGMLWeightConversionJob;
+
+static GGMLWeightConversionJob *
+ggml_weight_conversion_job_new (GGMLTensor   *tensor,
+                                const char   *name,
+                                GGMLDataType  src_type,
+                                GBytes       *src_data)
+{
+  GGMLWeightConversionJob *job = g_new0 (GGMLWeightConversionJob, 1);
+  job->tensor = tensor;
+  job->name = g_strdup (name);
+  job->src_type = src_type;
+  job->src_data = g_bytes_ref (src_data);
+
+  return job;
+}
+
+static void
+ggml_weight_conversion_job_free (GGMLWeightConversionJob *job)
+{
+  g_clear_pointer (&job->name, g_free);
+  g_clear_pointer (&job->src_data, g_bytes_unref);
+  g_clear_pointer (&job, g_free);
+}
+
+typedef struct _GGMLWeightConversionPipeline
+{
+  GThreadPool *pool;
+  GMutex mutex;
+  GCond cond;
+  size_t n_pending;
+  size_t max_pending;
+  GError *error;
+} GGMLWeightConversionPipeline;
+
+static void
+ggml_weight_conversion_pipeline_worker (gpointer data,
+                                        gpointer user_data)
+{
+  GGMLWeightConversionJob *job = data;
+  GGMLWeightConversionPipeline *pipeline = user_data;
+  int64_t histogram[1 << 4] = { 0 };
+  GError *my_error = NULL;
+  size_t n_dims;
+  int64_t *shape = ggml_tensor_get_shape (job->tensor, &n_dims);
+  size_t allocated_bytes = 0;
+  char *tensor_data_ptr = ggml_tensor_get_data (job->tensor, &allocated_bytes);
+  size_t src_data_len = 0;
+  char *src_data_ptr = (char *) g_bytes_get_data (job->src_data, &src_data_len);
+
+  gboolean success = convert_data_for_model (job->src_type,
+                                             src_data_ptr,
+                                             src_data_len,
+                                             shape,
+                                             n_dims,
+                                             ggml_tensor_get_data_type (job->tensor),
+                                             histogram,
+                                             G_N_ELEMENTS (histogram),
+                                             tensor_data_ptr,
+                                             allocated_bytes,
+                                             &my_error);
+
+  g_mutex_lock (&pipeline->mutex);
+
+  if (!success)
+    {
+      if (pipeline->error == NULL)
+        {
+          g_set_error (&pipeline->error,
+                       G_IO_ERROR,
+                       G_IO_ERROR_FAILED,
+                       "Unable to convert tensor %s: %s",
+                       job->name,
+                       my_error->message);
+        }
+
+      g_clear_error (&my_error);
+    }
+
+  --pipeline->n_pending;
+  g_cond_broadcast (&pipeline->cond);
+  g_mutex_unlock (&pipeline->mutex);
+
+  ggml_weight_conversion_job_free (job);
+}
+
+static GGMLWeightConversionPipeline *
+ggml_weight_conversion_pipeline_new (void)
+{
+  GGMLWeightConversionPipeline *pipeline = g_new0 (GGMLWeightConversionPipeline, 1);
+  size_t n_workers = g_get_num_processors ();
+
+  g_mutex_init (&pipeline->mutex);
+  g_cond_init (&pipeline->cond);
+  pipeline->max_pending = n_workers * 2;
+  pipeline->pool = g_thread_pool_new (ggml_weight_conversion_pipeline_worker,
+                                      pipeline,
+                                      n_workers,
+                                      FALSE,
+                                      NULL);
+
+  return pipeline;
+}
+
+/* Takes ownership of @job. Blocks while the pipeline is full. Returns
+ * %FALSE with @error set if a previous conversion already failed, in
+ * which case there is no point in continuing. */
+static gboolean
+ggml_weight_conversion_pipeline_push (GGMLWeightConversionPipeline  *pipeline,
+                                      GGMLWeightConversionJob       *job,
+                                      GError                       **error)
+{
+  g_mutex_lock (&pipeline->mutex);
+
+  while (pipeline->n_pending >= pipeline->max_pending && pipeline->error == NULL)
+    {
+      g_cond_wait (&pipeline->cond, &pipeline->mutex);
+    }
+
+  if (pipeline->error != NULL)
+    {
+      g_propagate_error (error, g_error_copy (pipeline->error));
+      g_mutex_unlock (&pipeline->mutex);
+      ggml_weight_conversion_job_free (job);
+      return FALSE;
+    }
+
+  ++pipeline->n_pending;
+  g_mutex_unlock (&pipeline->mutex);
+
+  g_thread_pool_push (pipeline->pool, job, NULL);
+  return TRUE;
+}
+
+/* Waits for all pending conversions to finish and frees @pipeline. */
+static gboolean
+ggml_weight_conversion_pipeline_finish (GGMLWeightConversionPipeline  *pipeline,
+                                        GError                       **error)
+{
+  g_thread_pool_free (g_steal_pointer (&pipeline->pool), FALSE, TRUE);
+
+  g_mutex_clear (&pipeline->mutex);
+  g_cond_clear (&pipeline->cond);
+
+  if (pipeline->error != NULL)
+    {
+      g_propagate_error (error, g_steal_pointer (&pipeline->error));
+      g_free (pipeline);
+      return FALSE;
+    }
+
+  g_free (pipeline);
+  return TRUE;
+}
+
+static void
+ggml_weight_conversion_pipeline_abort (GGMLWeightConversionPipeline *pipeline)
+{
+  ggml_weight_conversion_pipeline_finish (pipeline, NULL);
+}
+
+G_DEFINE_AUTOPTR_CLEANUP_FUNC (GGMLWeightConversionPipeline, ggml_weight_conversion_pipeline_abort)
+
 static gboolean
-read_into_tensor (GGMLTensor    *tensor,
-                  GGMLDataType   stream_data_type,
-                  GInputStream  *istream,
-                  int64_t       *histogram,
-                  size_t         histogram_len,
-                  GCancellable  *cancellable,
-                  GError       **error)
+read_into_tensor (GGMLTensor                    *tensor,
+                  const char                    *name,
+                  GGMLDataType                   stream_data_type,
+                  GInputStream                  *istream,
+                  GGMLWeightConversionPipeline  *pipeline,
+                  GCancellable                  *cancellable,
+                  GError                       **error)
 {
   GGMLDataType tensor_data_type = ggml_tensor_get_data_type (tensor);
   size_t tensor_definition_n_elements = ggml_tensor_n_elements (tensor);
@@ -403,13 +682,14 @@ read_into_tensor (GGMLTensor    *tensor,
   if (stream_data_type != tensor_data_type)
     {
       /* Conversion required. First read the data from the stream,
-       * then convert it and write the result into the tensor */
-      g_autoptr(GArray) stream_data = g_array_sized_new (FALSE, TRUE, sizeof (char), expected_bytes);
-      stream_data->len = expected_bytes;
+       * then hand it off to the pipeline to convert it and write
+       * the result into the tensor */
+      char *stream_data = g_malloc (expected_bytes);
+      g_autoptr(GBytes) stream_bytes = g_bytes_new_take (stream_data, expected_bytes);
 
       /* Now we can read the tensor data */
       if (!ggml_input_stream_read_exactly (istream,
-                                           stream_data->data,
+                                           stream_data,
                                            expected_bytes,
                                            cancellable,
                                            error))
@@ -417,33 +697,12 @@ read_into_tensor (GGMLTensor    *tensor,
           return FALSE;
         }
 
-      /* Now apply the conversion required */
-      GError *my_error = NULL;
-      size_t n_dims;
-      int64_t *shape = ggml_tensor_get_shape (tensor, &n_dims);
-
-      if (!convert_data_for_model (stream_data_type,
-                                   stream_data->data,
-                                   stream_data->len,
-                                   shape,
-                                   n_dims,
-                                   tensor_data_type,
-                                   histogram,
-                                   histogram_len,
-                                   tensor_data_ptr,
-                                   allocated_bytes,
-                                   &my_error))
-        {
-          g_set_error (error,
-                       G_IO_ERROR,
-                       G_IO_ERROR_FAILED,
-                       "Unable to convert %s",
-                       my_error->message);
-          g_clear_error (&my_error);
-          return FALSE;
-        }
-
-      return TRUE;
+      return ggml_weight_conversion_pipeline_push (pipeline,
+                                                   ggml_weight_conversion_job_new (tensor,
+                                                                                   name,
+                                                                                   stream_data_type,
+                                                                                   stream_bytes),
+                                                   error);
     }
 
   if (expected_bytes != allocated_bytes)
@@ -470,16 +729,132 @@ read_into_tensor (GGMLTensor    *tensor,
   return TRUE;
 }
 
+/* If @name is currently sharing the tensor of the weight it is tied to,
+ * give it its own tensor so that it can be loaded separately. */
+static GGMLTensor *
+ggml_model_untie_weight (GGMLModel         *model,
+                         const char        *name,
+                         GGMLModelDescLeaf *leaf)
+{
+  GGMLTensor *tensor = ggml_model_get (model, name);
+
+  if (ggml_model_desc_leaf_get_tied_to (leaf) == NULL ||
+      g_strcmp0 (ggml_tensor_get_name (tensor), name) == 0)
+    {
+      return tensor;
+    }
+
+  g_autoptr(GHashTable) untied_desc = g_hash_table_new (g_str_hash, g_str_equal);
+  g_hash_table_insert (untied_desc, (gpointer) name, leaf);
+
+  g_autoptr(GGMLContext) context = ggml_context_new (ggml_estimate_model_size_from_flattened_desc (untied_desc, FALSE));
+  GGMLTensor *untied_tensor = ggml_context_new_tensor_for_leaf (context, leaf, name);
+
+  g_hash_table_replace (model->weights, g_strdup (name), untied_tensor);
+
+  return untied_tensor;
+}
+
+/* A weight whose tie was broken, because it has a different type or
+ * shape to the weight that it is tied to, still needs data if it was
+ * not in the file. Convert it from the weight that it is tied to, once
+ * that has been loaded. */
+static gboolean
+ggml_model_fill_broken_ties (GHashTable   *weights,
+                             GHashTable   *flattened_desc,
+                             const char  **loaded_keys,
+                             GError      **error)
+{
+  GHashTableIter iter;
+  gpointer key, value;
+
+  g_hash_table_iter_init (&iter, flattened_desc);
+  while (g_hash_table_iter_next (&iter, &key, &value))
+    {
+      GGMLModelDescLeaf *leaf = value;
+      const char *tied_to = ggml_model_desc_leaf_get_tied_to (leaf);
+
+      if (tied_to == NULL ||
+          ggml_model_desc_leaf_is_tied_within (leaf, flattened_desc) ||
+          g_strv_contains (loaded_keys, key))
+        {
+          continue;
+        }
+
+      GGMLTensor *tied_tensor = g_hash_table_lookup (weights, tied_to);
+
+      /* Nothing to fill it from */
+      if (tied_tensor == NULL)
+        {
+          continue;
+        }
+
+      GGMLTensor *tensor = g_hash_table_lookup (weights, key);
+      int64_t histogram[1 << 4] = { 0 };
+      size_t tied_n_bytes, n_bytes;
+      char *tied_data = ggml_tensor_get_data (tied_tensor, &tied_n_bytes);
+      char *data = ggml_tensor_get_data (tensor, &n_bytes);
+      g_autoptr(GError) my_error = NULL;
+
+      if (ggml_tensor_n_elements (tied_tensor) != ggml_tensor_n_elements (tensor))
+        {
+          g_set_error (error,
+                       G_IO_ERROR,
+                       G_IO_ERROR_FAILED,
+                       "Weight %s is tied to %s, but they have a different number of elements",
+                       (const char *) key,
+                       tied_to);
+          return FALSE;
+        }
+
+      if (!convert_data_for_model (ggml_tensor_get_data_type (tied_tensor),
+                                   tied_data,
+                                   tied_n_bytes,
+                                   leaf->dimensions,
+                                   leaf->n_dim,
+                                   leaf->type,
+                                   histogram,
+                                   G_N_ELEMENTS (histogram),
+                                   data,
+                                   n_bytes,
+                                   &my_error))
+        {
+          g_set_error (error,
+                       G_IO_ERROR,
+                       G_IO_ERROR_FAILED,
+                       "Weight %s is tied to %s, but has a different type and cannot be converted from it: %s",
+                       (const char *) key,
+                       tied_to,
+                       my_error->message);
+          return FALSE;
+        }
+    }
+
+  return TRUE;
+}
+
+/* The number of bytes needed to pad @offset up to a multiple of @alignment */
+static size_t
+padding_for_alignment (size_t offset,
+                       size_t alignment)
+{
+  return (alignment - offset % alignment) % alignment;
+}
+
+/* @position is the offset of @istream in the file, which tensor data
+ * is aligned to @data_alignment relative to. */
 static gboolean
 ggml_model_load_weights_from_istream (GInputStream *istream,
+                                      goffset position,
+                                      size_t data_alignment,
                                       GGMLModel *model,
+                                      GHashTable *flattened_desc,
                                       char ***out_loaded_keys,
                                       GCancellable *cancellable,
                                       GError **error)
 {
   g_autoptr(GPtrArray) loaded_keys = g_ptr_array_new_full (0, g_free);
-  g_autoptr(GArray) histogram = g_array_sized_new (FALSE, TRUE, sizeof (int64_t), 1 << 4);
-  histogram->len = 1 << 4;
+  g_autoptr(GGMLWeightConversionPipeline) pipeline = ggml_weight_conversion_pipeline_new ();
 
   while (TRUE)
     {
@@ -528,16 +903,32 @@ ggml_model_load_weights_from_istream (GInputStream *istream,
         }
 
       name_buffer[name_length] = '\0';
+      position += sizeof (int32_t) * (3 + n_dims) + name_length;
+
+      size_t padding = padding_for_alignment (position, data_alignment);
+      char padding_buffer[GGML_MEM_ALIGN];
+
+      g_assert (padding <= sizeof (padding_buffer));
+
+      if (!ggml_input_stream_read_exactly (istream, padding_buffer, padding, cancellable, error))
+        {
+          return FALSE;
+        }
+
+      position += padding;
 
       /* Lookup tensor in the model weights. If its not there, then we have an error. */
-      GGMLTensor *tensor = ggml_model_get (model, name_buffer);
+      GGMLModelDescLeaf *leaf = g_hash_table_lookup (flattened_desc, name_buffer);
 
-      if (tensor == NULL)
+      if (leaf == NULL)
         {
           g_set_error (error, G_IO_ERROR, G_IO_ERROR_FAILED, "Tensor %s not found in model definition", name_buffer);
           return FALSE;
         }
 
+      /* Tied weights which are in the stream are loaded on their own */
+      GGMLTensor *tensor = ggml_model_untie_weight (model, name_buffer, leaf);
+
       /* We did find the tensor, lets check that the size matches */
       size_t tensor_definition_n_elements = ggml_tensor_n_elements (tensor);
 
@@ -550,10 +941,10 @@ ggml_model_load_weights_from_istream (GInputStream *istream,
       GError *my_error = NULL;
 
       if (!read_into_tensor (tensor,
+                             name_buffer,
                              ttype,
                              istream,
-                             (int64_t *) histogram->data,
-                             histogram->len,
+                             pipeline,
                              cancellable,
                              &my_error))
         {
@@ -567,12 +958,27 @@ ggml_model_load_weights_from_istream (GInputStream *istream,
           return FALSE;
         }
 
+      position += input_stream_tensor_n_elements * ggml_size_of_data_type (ttype) / ggml_blck_size ((enum ggml_type) ttype);
       g_ptr_array_add (loaded_keys, g_strdup (name_buffer));
     }
 
+  /* Wait for the remaining conversions to finish */
+  if (!ggml_weight_conversion_pipeline_finish (g_steal_pointer (&pipeline), error))
+    {
+      return FALSE;
+    }
+
   /* Add sentinel */
   g_ptr_array_add (loaded_keys, NULL);
 
+  if (!ggml_model_fill_broken_ties (model->weights,
+                                    flattened_desc,
+                                    (const char **) loaded_keys->pdata,
+                                    error))
+    {
+      return FALSE;
+    }
+
   if (out_loaded_keys != NULL)
     {
       *out_loaded_keys = (char **) g_ptr_array_steal (loaded_keys, NULL);
@@ -581,20 +987,407 @@ ggml_model_load_weights_from_istream (GInputStream *istream,
   return TRUE;
 }
 
-/**
- * ggml_model_load_from_istream:
- * @istream: (transfer none): A #GInputStream
- * @model_desc_node: (transfer none): A #GGMLModelDescNode
- * @hyperparameters: (transfer none): A #GGMLHyperparameters
- * @forward_func: A #GGMLModelForwardFunc
- * @forward_func_user_data: (closure forward_func): A user-data closure for @forward_func
- * @forward_func_user_data_destroy: (destroy forward_func): A #GDestroyNotify for @forward_func_user_data
- * @out_loaded_keys: (out) (transfer full) (nullable): A #GStrv out-parameter for the loaded keys.
- * @cancellable: (transfer none) (nullable): A #GCancellable
- * @error: A #GError out-parameter
- *
- * Returns: (transfer full): A new #GGMLModel with structure @model_desc_node,
- *                           loaded from @istream or %NULL with @error set on failure.
+typedef struct _GGMLMappedTensorEntry
+{
+  GGMLDataType data_type;
+  size_t offset;
+  size_t n_bytes;
+} GGMLMappedTensorEntry;
+
+static gboolean
+check_mapped_bytes_available (size_t    data_len,
+                              size_t    offset,
+                              size_t    n_bytes,
+                              GError  **error)
+{
+  if (data_len - offset < n_bytes)
+    {
+      g_set_error (error,
+                   G_IO_ERROR,
+                   G_IO_ERROR_FAILED,
+                   "Expected to read %zu bytes but only read %zu bytes, truncated file?",
+                   n_bytes,
+                   data_len - offset);
+      return FALSE;
+    }
+
+  return TRUE;
+}
+
+/* Tensor data in the file is packed right after the tensor header,
+ * so it is usually not aligned to GGML_MEM_ALIGN. ggml's CPU ops read
+ * F32 and F16 data with unaligned loads, so those types can alias the
+ * mapping wherever they are. Everything else has to be aligned. */
+static gboolean
+can_alias_mapped_tensor_data (GGMLDataType  data_type,
+                              const char   *data,
+                              size_t        offset)
+{
+  if (data_type == GGML_DATA_TYPE_F32 || data_type == GGML_DATA_TYPE_F16)
+    {
+      return TRUE;
+    }
+
+  return ((uintptr_t) (data + offset)) % GGML_MEM_ALIGN == 0;
+}
+
+/* Walks over the tensor headers in the mapped region and records
+ * where the data for each tensor lives, without touching the data
+ * itself. The data of each tensor starts at the next multiple of
+ * @data_alignment after its header. The names of the tensors are
+ * added to @loaded_keys in the order that they appear. */
+static GHashTable *
+ggml_model_index_mapped_weights (const char  *data,
+                                 size_t       data_len,
+                                 size_t       offset,
+                                 size_t       data_alignment,
+                                 GHashTable  *flattened_desc,
+                                 GPtrArray   *loaded_keys,
+                                 GError     **error)
+{
+  g_autoptr(GHashTable) index = g_hash_table_new_full (g_str_hash,
+                                                       g_str_equal,
+                                                       g_free,
+                                                       g_free);
+
+  while (offset < data_len)
+    {
+      int32_t n_dims = 0;
+      int32_t name_length = 0;
+      int32_t ttype = 0;
+      int32_t dims_buffer[2];
+
+      if (!check_mapped_bytes_available (data_len, offset, sizeof (int32_t) * 3, error))
+        {
+          return NULL;
+        }
+
+      memcpy (&n_dims, data + offset, sizeof (int32_t));
+      memcpy (&name_length, data + offset + sizeof (int32_t), sizeof (int32_t));
+      memcpy (&ttype, data + offset + sizeof (int32_t) * 2, sizeof (int32_t));
+      offset += sizeof (int32_t) * 3;
+
+      if (n_dims < 1 || n_dims > 2 || name_length < 0)
+        {
+          g_set_error (error,
+                       G_IO_ERROR,
+                       G_IO_ERROR_FAILED,
+                       "Invalid tensor header with %d dimensions and name length %d",
+                       n_dims,
+                       name_length);
+          return NULL;
+        }
+
+      if (!check_mapped_bytes_available (data_len, offset, sizeof (int32_t) * n_dims + name_length, error))
+        {
+          return NULL;
+        }
+
+      memcpy (dims_buffer, data + offset, sizeof (int32_t) * n_dims);
+      offset += sizeof (int32_t) * n_dims;
+
+      g_autofree char *name = g_strndup (data + offset, name_length);
+      offset += name_length;
+
+      size_t padding = padding_for_alignment (offset, data_alignment);
+
+      if (!check_mapped_bytes_available (data_len, offset, padding, error))
+        {
+          return NULL;
+        }
+
+      offset += padding;
+
+      /* Lookup tensor in the model description. If its not there, then we have an error. */
+      GGMLModelDescLeaf *leaf = g_hash_table_lookup (flattened_desc, name);
+
+      if (leaf == NULL)
+        {
+          g_set_error (error, G_IO_ERROR, G_IO_ERROR_FAILED, "Tensor %s not found in model definition", name);
+          return NULL;
+        }
+
+      size_t tensor_definition_n_elements = product_i64 (leaf->dimensions, leaf->n_dim);
+      int32_t mapped_tensor_n_elements = product_i32 (dims_buffer, n_dims);
+
+      if (tensor_definition_n_elements != (size_t) mapped_tensor_n_elements)
+        {
+          g_set_error (error, G_IO_ERROR, G_IO_ERROR_FAILED, "Tensor %s had %zu elements in its definition, but the input stream has %d elements", name, tensor_definition_n_elements, mapped_tensor_n_elements);
+          return NULL;
+        }
+
+      GGMLMappedTensorEntry *entry = g_new0 (GGMLMappedTensorEntry, 1);
+      entry->data_type = ttype;
+      entry->offset = offset;
+      entry->n_bytes = (mapped_tensor_n_elements * ggml_size_of_data_type (ttype) / ggml_blck_size ((enum ggml_type) ttype));
+
+      if (!check_mapped_bytes_available (data_len, offset, entry->n_bytes, error))
+        {
+          g_free (entry);
+          return NULL;
+        }
+
+      offset += entry->n_bytes;
+
+      g_ptr_array_add (loaded_keys, g_strdup (name));
+      g_hash_table_insert (index, g_steal_pointer (&name), entry);
+    }
+
+  return g_steal_pointer (&index);
+}
+
+/* Loads the model weights from a memory-mapped model file. Tensors
+ * whose type in the file matches the type in @flattened_desc are not
+ * copied at all, they just point into the mapping and the pages get
+ * faulted in on first use. Only the tensors which need to be converted,
+ * for instance because they get quantized, or quantized tensors which
+ * are not aligned are allocated and filled. */
+static GGMLModel *
+ggml_model_load_from_mapped_bytes (GBytes                                 *mapped_bytes,
+                                   size_t                                  offset,
+                                   size_t                                  data_alignment,
+                                   GHashTable                             *flattened_desc,
+                                   GGMLModelForwardFunc                    forward_func,
+                                   gpointer                                forward_func_user_data,
+                                   GDestroyNotify                          forward_func_user_data_destroy,
+                                   char                                 ***out_loaded_keys,
+                                   GCancellable                           *cancellable,
+                                   GError                                **error)
+{
+  size_t data_len = 0;
+  const char *data = g_bytes_get_data (mapped_bytes, &data_len);
+  g_autoptr(GPtrArray) loaded_keys = g_ptr_array_new_full (0, g_free);
+  g_autoptr(GHashTable) index = ggml_model_index_mapped_weights (data,
+                                                                 data_len,
+                                                                 offset,
+                                                                 data_alignment,
+                                                                 flattened_desc,
+                                                                 loaded_keys,
+                                                                 error);
+
+  if (index == NULL)
+    {
+      return NULL;
+    }
+
+  /* Split the description into the tensors that can alias the mapping,
+   * those that need their own memory and tied tensors which are not in
+   * the file and so share the tensor of the weight they are tied to. */
+  g_autoptr(GHashTable) mapped_desc = g_hash_table_new (g_str_hash, g_str_equal);
+  g_autoptr(GHashTable) allocated_desc = g_hash_table_new (g_str_hash, g_str_equal);
+  g_autoptr(GHashTable) tied_desc = g_hash_table_new (g_str_hash, g_str_equal);
+  GHashTableIter iter;
+  gpointer key, value;
+
+  g_hash_table_iter_init (&iter, flattened_desc);
+  while (g_hash_table_iter_next (&iter, &key, &value))
+    {
+      GGMLModelDescLeaf *leaf = value;
+      GGMLMappedTensorEntry *entry = g_hash_table_lookup (index, key);
+
+      if (entry == NULL && ggml_model_desc_leaf_is_tied_within (leaf, flattened_desc))
+        {
+          g_hash_table_insert (tied_desc, key, value);
+        }
+      else if (entry != NULL &&
+               entry->data_type == leaf->type &&
+               can_alias_mapped_tensor_data (entry->data_type, data, entry->offset))
+        {
+          g_hash_table_insert (mapped_desc, key, value);
+        }
+      else
+        {
+          g_hash_table_insert (allocated_desc, key, value);
+        }
+    }
+
+  g_autoptr(GGMLContext) mapped_context = ggml_context_new_for_external_data (mapped_bytes,
+                                                                              g_hash_table_size (mapped_desc));
+  size_t allocated_memory_size = ggml_estimate_model_size_from_flattened_desc (allocated_desc, FALSE);
+  g_autoptr(GGMLContext) context = (
+    allocated_memory_size > 0 ?
+    ggml_context_new (allocated_memory_size) :
+    ggml_context_ref (mapped_context)
+  );
+  g_autoptr(GHashTable) weights = ggml_new_weight_set_from_flattened_desc_in_context (context, allocated_desc, FALSE);
+  g_autoptr(GHashTable) mapped_weights = ggml_new_weight_set_from_flattened_desc_in_context (mapped_context, mapped_desc, FALSE);
+  g_autoptr(GGMLWeightConversionPipeline) pipeline = ggml_weight_conversion_pipeline_new ();
+
+  g_hash_table_iter_init (&iter, weights);
+  while (g_hash_table_iter_next (&iter, &key, &value))
+    {
+      GGMLTensor *tensor = value;
+      GGMLMappedTensorEntry *entry = g_hash_table_lookup (index, key);
+
+      /* Not in the file, nothing to load */
+      if (entry == NULL)
+        {
+          continue;
+        }
+
+      if (g_cancellable_set_error_if_cancelled (cancellable, error))
+        {
+          return NULL;
+        }
+
+      /* Conversions read F32 or F16 data, which does not need to be
+       * aligned, so the source is always just a view into the mapping */
+      g_autoptr(GBytes) src_data = g_bytes_new_from_bytes (mapped_bytes,
+                                                           entry->offset,
+                                                           entry->n_bytes);
+
+      if (!ggml_weight_conversion_pipeline_push (pipeline,
+                                                 ggml_weight_conversion_job_new (tensor,
+                                                                                 key,
+                                                                                 entry->data_type,
+                                                                                 src_data),
+                                                 error))
+        {
+          return NULL;
+        }
+    }
+
+  if (!ggml_weight_conversion_pipeline_finish (g_steal_pointer (&pipeline), error))
+    {
+      return NULL;
+    }
+
+  g_hash_table_iter_init (&iter, mapped_weights);
+  while (g_hash_table_iter_next (&iter, &key, &value))
+    {
+      GGMLTensor *tensor = value;
+      GGMLMappedTensorEntry *entry = g_hash_table_lookup (index, key);
+
+      tensor->tensor->data = (char *) data + entry->offset;
+
+      g_hash_table_iter_steal (&iter);
+      g_hash_table_insert (weights, key, tensor);
+    }
+
+  g_hash_table_iter_init (&iter, tied_desc);
+  while (g_hash_table_iter_next (&iter, &key, &value))
+    {
+      GGMLTensor *tied_tensor = g_hash_table_lookup (weights, ggml_model_desc_leaf_get_tied_to (value));
+
+      g_assert (tied_tensor != NULL);
+      g_hash_table_insert (weights, g_strdup (key), ggml_tensor_ref (tied_tensor));
+    }
+
+  /* Add sentinel */
+  g_ptr_array_add (loaded_keys, NULL);
+
+  if (!ggml_model_fill_broken_ties (weights,
+                                    flattened_desc,
+                                    (const char **) loaded_keys->pdata,
+                                    error))
+    {
+      return NULL;
+    }
+
+  if (out_loaded_keys != NULL)
+    {
+      *out_loaded_keys = (char **) g_ptr_array_steal (loaded_keys, NULL);
+    }
+
+  return ggml_model_new_from_weight_set (context,
+                                         g_steal_pointer (&weights),
+                                         forward_func,
+                                         forward_func_user_data,
+                                         forward_func_user_data_destroy);
+}
+
+static GGMLModel *
+ggml_model_load_from_istream_with_data_alignment (GInputStream                           *istream,
+                                                  size_t                                  data_alignment,
+                                                  GGMLModelDescNode                      *model_desc_node,
+                                                  GGMLModelForwardFunc                    forward_func,
+                                                  gpointer                                forward_func_user_data,
+                                                  GDestroyNotify                          forward_func_user_data_destroy,
+                                                  char                                 ***out_loaded_keys,
+                                                  GCancellable                           *cancellable,
+                                                  GError                                **error)
+{
+  g_autoptr (GHashTable) flattened_desc = ggml_model_desc_node_flatten (model_desc_node);
+  size_t mapped_offset = 0;
+  g_autoptr (GBytes) mapped_bytes = ggml_input_stream_try_map (istream, &mapped_offset);
+
+  if (mapped_bytes != NULL)
+    {
+      g_autoptr (GGMLModel) mapped_model = ggml_model_load_from_mapped_bytes (mapped_bytes,
+                                                                              mapped_offset,
+                                                                              data_alignment,
+                                                                              flattened_desc,
+                                                                              forward_func,
+                                                                              forward_func_user_data,
+                                                                              forward_func_user_data_destroy,
+                                                                              out_loaded_keys,
+                                                                              cancellable,
+                                                                              error);
+
+      if (mapped_model == NULL)
+        {
+          return NULL;
+        }
+
+      /* Consume the rest of the stream, so that callers see the
+       * same stream position as if we had read the weights from it */
+      if (g_input_stream_skip (istream,
+                               g_bytes_get_size (mapped_bytes) - mapped_offset,
+                               cancellable,
+                               error) == -1)
+        {
+          return NULL;
+        }
+
+      return g_steal_pointer (&mapped_model);
+    }
+
+  size_t memory_size = ggml_estimate_model_size_from_flattened_desc (flattened_desc, TRUE);
+  g_autoptr (GGMLContext) context = ggml_context_new (memory_size);
+  g_autoptr (GGMLModel) model = ggml_model_new_from_flattened_desc (context,
+                                                                    flattened_desc,
+                                                                    forward_func,
+                                                                    forward_func_user_data,
+                                                                    forward_func_user_data_destroy);
+
+  /* Tensor data is aligned relative to the start of the file, so
+   * if the data is aligned at all, we need to know where we are */
+  goffset position = G_IS_SEEKABLE (istream) ? g_seekable_tell (G_SEEKABLE (istream)) : 0;
+
+  /* Now that we have the model, we can start loading in the weights */
+  if (!ggml_model_load_weights_from_istream (istream,
+                                             position,
+                                             data_alignment,
+                                             model,
+                                             flattened_desc,
+                                             out_loaded_keys,
+                                             cancellable,
+                                             error))
+    {
+      return FALSE;
+    }
+
+  return g_steal_pointer (&model);
+}
+
+/**
+ * ggml_model_load_from_istream:
+ * @istream: (transfer none): A #GInputStream
+ * @model_desc_node: (transfer none): A #GGMLModelDescNode
+ * @hyperparameters: (transfer none): A #GGMLHyperparameters
+ * @forward_func: A #GGMLModelForwardFunc
+ * @forward_func_user_data: (closure forward_func): A user-data closure for @forward_func
+ * @forward_func_user_data_destroy: (destroy forward_func): A #GDestroyNotify for @forward_func_user_data
+ * @out_loaded_keys: (out) (transfer full) (nullable): A #GStrv out-parameter for the loaded keys.
+ * @cancellable: (transfer none) (nullable): A #GCancellable
+ * @error: A #GError out-parameter
+ *
+ * If @istream is backed by a local file, the file is memory-mapped and tensors
+ * which do not need to be converted point directly into the mapping instead of
+ * being copied. In that case @istream is advanced to the end of the file.
+ *
+ * Returns: (transfer full): A new #GGMLModel with structure @model_desc_node,
+ *                           loaded from @istream or %NULL with @error set on failure.
  */
 GGMLModel *
 ggml_model_load_from_istream (GInputStream                           *istream,
@@ -607,27 +1400,312 @@ ggml_model_load_from_istream (GInputStream                           *istream,
                               GCancellable                           *cancellable,
                               GError                                **error)
 {
-  g_autoptr (GHashTable) flattened_desc = ggml_model_desc_node_flatten (model_desc_node);
-  size_t memory_size = ggml_estimate_model_size_from_flattened_desc (flattened_desc);
-  g_autoptr (GGMLContext) context = ggml_context_new (memory_size);
-  g_autoptr (GGMLModel) model = ggml_model_new_from_flattened_desc (context,
-                                                                    flattened_desc,
-                                                                    forward_func,
-                                                                    forward_func_user_data,
-                                                                    forward_func_user_data_destroy);
+  /* Model files pack the tensor data right after each header */
+  return ggml_model_load_from_istream_with_data_alignment (istream,
+                                                           1,
+                                                           model_desc_node,
+                                                           forward_func,
+                                                           forward_func_user_data,
+                                                           forward_func_user_data_destroy,
+                                                           out_loaded_keys,
+                                                           cancellable,
+                                                           error);
+}
 
-  /* Now that we have the model, we can start loading in the weights */
-  if (!ggml_model_load_weights_from_istream (istream, model, out_loaded_keys, cancellable, error))
+/* The weights cache starts with a magic number and a format version,
+ * followed by the tensors in the same format as a model file, except
+ * that the data of each tensor is padded to start on a multiple of
+ * GGML_MEM_ALIGN in the file, so that all of it can alias a mapping
+ * of the file. */
+#define GGML_MODEL_WEIGHTS_CACHE_MAGIC 0x67676d77
+#define GGML_MODEL_WEIGHTS_CACHE_VERSION 1
+
+typedef struct _GGMLModelWeightsCacheHeader
+{
+  uint32_t magic;
+  uint32_t version;
+} GGMLModelWeightsCacheHeader;
+
+static gboolean
+ggml_model_write_weights_to_ostream (GGMLModel      *model,
+                                     const char    **keys,
+                                     GOutputStream  *ostream,
+                                     GCancellable   *cancellable,
+                                     GError        **error)
+{
+  static const char padding_buffer[GGML_MEM_ALIGN] = { 0 };
+  GGMLModelWeightsCacheHeader cache_header = {
+    .magic = GGML_MODEL_WEIGHTS_CACHE_MAGIC,
+    .version = GGML_MODEL_WEIGHTS_CACHE_VERSION
+  };
+  size_t position = sizeof (cache_header);
+
+  if (!g_output_stream_write_all (ostream, &cache_header, sizeof (cache_header), NULL, cancellable, error))
     {
       return FALSE;
     }
 
+  for (const char **keys_it = keys; *keys_it != NULL; ++keys_it)
+    {
+      GGMLTensor *tensor = ggml_model_get (model, *keys_it);
+
+      g_assert (tensor != NULL);
+
+      size_t n_dims;
+      int64_t *shape = ggml_tensor_get_shape (tensor, &n_dims);
+      int32_t header[] = {
+        n_dims,
+        strlen (*keys_it),
+        ggml_tensor_get_data_type (tensor)
+      };
+      int32_t dims_buffer[GGML_MAX_DIMS];
+
+      for (size_t i = 0; i < n_dims; ++i)
+        {
+          dims_buffer[i] = shape[i];
+        }
+
+      size_t n_bytes = 0;
+      char *tensor_data_ptr = ggml_tensor_get_data (tensor, &n_bytes);
+
+      position += sizeof (header) + sizeof (int32_t) * n_dims + header[1];
+
+      size_t padding = padding_for_alignment (position, GGML_MEM_ALIGN);
+
+      if (!g_output_stream_write_all (ostream, header, sizeof (header), NULL, cancellable, error) ||
+          !g_output_stream_write_all (ostream, dims_buffer, sizeof (int32_t) * n_dims, NULL, cancellable, error) ||
+          !g_output_stream_write_all (ostream, *keys_it, header[1], NULL, cancellable, error) ||
+          !g_output_stream_write_all (ostream, padding_buffer, padding, NULL, cancellable, error) ||
+          !g_output_stream_write_all (ostream, tensor_data_ptr, n_bytes, NULL, cancellable, error))
+        {
+          return FALSE;
+        }
+
+      position += padding + n_bytes;
+    }
+
+  return TRUE;
+}
+
+static gboolean
+ggml_model_write_weights_cache (GGMLModel     *model,
+                                const char   **keys,
+                                GFile         *weights_cache_file,
+                                GCancellable  *cancellable,
+                                GError       **error)
+{
+  g_autoptr(GFile) weights_cache_directory = g_file_get_parent (weights_cache_file);
+  g_autoptr(GError) my_error = NULL;
+
+  if (!g_file_make_directory_with_parents (weights_cache_directory, cancellable, &my_error))
+    {
+      if (!g_error_matches (my_error, G_IO_ERROR, G_IO_ERROR_EXISTS))
+        {
+          g_propagate_error (error, g_steal_pointer (&my_error));
+          return FALSE;
+        }
+    }
+
+  /* g_file_replace writes into a temporary file and only moves it
+   * into place once the stream is closed, so readers never see a
+   * partially written cache. */
+  g_autoptr(GFileOutputStream) ostream = g_file_replace (weights_cache_file,
+                                                         NULL,
+                                                         FALSE,
+                                                         G_FILE_CREATE_REPLACE_DESTINATION,
+                                                         cancellable,
+                                                         error);
+
+  if (ostream == NULL)
+    {
+      return FALSE;
+    }
+
+  if (!ggml_model_write_weights_to_ostream (model,
+                                            keys,
+                                            G_OUTPUT_STREAM (ostream),
+                                            cancellable,
+                                            error))
+    {
+      /* Closing with a cancelled cancellable discards the temporary
+       * file instead of replacing the destination */
+      g_autoptr(GCancellable) abort_cancellable = g_cancellable_new ();
+      g_cancellable_cancel (abort_cancellable);
+      g_output_stream_close (G_OUTPUT_STREAM (ostream), abort_cancellable, NULL);
+      return FALSE;
+    }
+
+  return g_output_stream_close (G_OUTPUT_STREAM (ostream), cancellable, error);
+}
+
+static GGMLModel *
+ggml_model_load_from_weights_cache (GFile                                  *weights_cache_file,
+                                    GGMLModelDescNode                      *model_desc_node,
+                                    GGMLHyperparameters                    *hyperparameters,
+                                    char                                 ***out_loaded_keys,
+                                    GCancellable                           *cancellable,
+                                    GError                                **error)
+{
+  g_autoptr(GFileInputStream) istream = g_file_read (weights_cache_file, cancellable, error);
+  GGMLModelWeightsCacheHeader cache_header;
+
+  if (istream == NULL)
+    {
+      return NULL;
+    }
+
+  if (!ggml_input_stream_read_exactly (G_INPUT_STREAM (istream),
+                                       (char *) &cache_header,
+                                       sizeof (cache_header),
+                                       cancellable,
+                                       error))
+    {
+      return NULL;
+    }
+
+  if (cache_header.magic != GGML_MODEL_WEIGHTS_CACHE_MAGIC)
+    {
+      g_set_error (error, G_IO_ERROR, G_IO_ERROR_INVALID_DATA, "Invalid magic %#010x expected %#010x", cache_header.magic, GGML_MODEL_WEIGHTS_CACHE_MAGIC);
+      return NULL;
+    }
+
+  if (cache_header.version != GGML_MODEL_WEIGHTS_CACHE_VERSION)
+    {
+      g_set_error (error, G_IO_ERROR, G_IO_ERROR_INVALID_DATA, "Unsupported weights cache version %u, expected %u", cache_header.version, GGML_MODEL_WEIGHTS_CACHE_VERSION);
+      return NULL;
+    }
+
+  return ggml_model_load_from_istream_with_data_alignment (G_INPUT_STREAM (istream),
+                                                           GGML_MEM_ALIGN,
+                                                           model_desc_node,
+                                                           NULL,
+                                                           NULL,
+                                                           NULL,
+                                                           out_loaded_keys,
+                                                           cancellable,
+                                                           error);
+}
+
+/**
+ * ggml_model_load_from_istream_with_weights_cache:
+ * @istream: (transfer none): A #GInputStream
+ * @weights_cache_file: (transfer none) (nullable): A #GFile to cache the loaded weights in
+ * @model_desc_node: (transfer none): A #GGMLModelDescNode
+ * @hyperparameters: (transfer none): A #GGMLHyperparameters
+ * @forward_func: A #GGMLModelForwardFunc
+ * @forward_func_user_data: (closure forward_func): A user-data closure for @forward_func
+ * @forward_func_user_data_destroy: (destroy forward_func): A #GDestroyNotify for @forward_func_user_data
+ * @out_loaded_keys: (out) (transfer full) (nullable): A #GStrv out-parameter for the loaded keys.
+ * @cancellable: (transfer none) (nullable): A #GCancellable
+ * @error: A #GError out-parameter
+ *
+ * Like ggml_model_load_from_istream(), but first tries to load the weights
+ * from @weights_cache_file. The cache holds the weights exactly as described
+ * by @model_desc_node, for instance already quantized, with their data aligned,
+ * so loading from it needs no conversion and all the weights point into a
+ * mapping of the cache file. If the cache does not exist or cannot be used, the weights are
+ * loaded from @istream instead and then written to @weights_cache_file for
+ * next time. Failing to write the cache is not an error. If @weights_cache_file
+ * is %NULL, this behaves exactly like ggml_model_load_from_istream().
+ *
+ * Note that when the weights are loaded from the cache, @istream is not read.
+ *
+ * Returns: (transfer full): A new #GGMLModel with structure @model_desc_node,
+ *                           or %NULL with @error set on failure.
+ */
+GGMLModel *
+ggml_model_load_from_istream_with_weights_cache (GInputStream                           *istream,
+                                                 GFile                                  *weights_cache_file,
+                                                 GGMLModelDescNode                      *model_desc_node,
+                                                 GGMLHyperparameters                    *hyperparameters,
+                                                 GGMLModelForwardFunc                    forward_func,
+                                                 gpointer                                forward_func_user_data,
+                                                 GDestroyNotify                          forward_func_user_data_destroy,
+                                                 char                                 ***out_loaded_keys,
+                                                 GCancellable                           *cancellable,
+                                                 GError                                **error)
+{
+  if (weights_cache_file != NULL)
+    {
+      g_autoptr(GError) cache_error = NULL;
+      g_autoptr(GGMLModel) cached_model = ggml_model_load_from_weights_cache (weights_cache_file,
+                                                                             model_desc_node,
+                                                                             hyperparameters,
+                                                                             out_loaded_keys,
+                                                                             cancellable,
+                                                                             &cache_error);
+
+      if (cached_model != NULL)
+        {
+          /* The cached model was loaded without a forward func, so
+           * that we keep ownership of it in case of failure */
+          cached_model->forward_func = forward_func;
+          cached_model->forward_func_user_data = forward_func_user_data;
+          cached_model->forward_func_user_data_destroy = forward_func_user_data_destroy;
+
+          return g_steal_pointer (&cached_model);
+        }
+
+      if (g_error_matches (cache_error, G_IO_ERROR, G_IO_ERROR_CANCELLED))
+        {
+          g_propagate_error (error, g_steal_pointer (&cache_error));
+          return NULL;
+        }
+
+      if (!g_error_matches (cache_error, G_IO_ERROR, G_IO_ERROR_NOT_FOUND))
+        {
+          g_autofree char *weights_cache_path = g_file_get_path (weights_cache_file);
+          g_warning ("Could not load weights from cache %s, loading from stream instead: %s",
+                     weights_cache_path,
+                     cache_error->message);
+        }
+    }
+
+  g_auto(GStrv) loaded_keys = NULL;
+  g_autoptr(GGMLModel) model = ggml_model_load_from_istream (istream,
+                                                             model_desc_node,
+                                                             hyperparameters,
+                                                             forward_func,
+                                                             forward_func_user_data,
+                                                             forward_func_user_data_destroy,
+                                                             &loaded_keys,
+                                                             cancellable,
+                                                             error);
+
+  if (model == NULL)
+    {
+      return NULL;
+    }
+
+  if (weights_cache_file != NULL)
+    {
+      g_autoptr(GError) cache_error = NULL;
+
+      if (!ggml_model_write_weights_cache (model,
+                                           (const char **) loaded_keys,
+                                           weights_cache_file,
+                                           cancellable,
+                                           &cache_error))
+        {
+          g_autofree char *weights_cache_path = g_file_get_path (weights_cache_file);
+          g_warning ("Could not write weights cache %s: %s",
+                     weights_cache_path,
+                     cache_error->message);
+        }
+    }
+
+  if (out_loaded_keys != NULL)
+    {
+      *out_loaded_keys = g_steal_pointer (&loaded_keys);
+    }
+
   return g_steal_pointer (&model);
 }
 
 typedef struct _GGMLModelLoadFromIstreamData
 {
   GInputStream *istream;
+  GFile *weights_cache_file;
   GGMLHyperparameters *hyperparameters;
   GGMLModelDescNode *model_desc_node;
   GGMLModelForwardFunc forward_func;
@@ -637,6 +1715,7 @@ typedef struct _GGMLModelLoadFromIstreamData
 
 static GGMLModelLoadFromIstreamData *
 ggml_model_load_from_istream_data_new (GInputStream *istream,
+                                       GFile *weights_cache_file,
                                        GGMLModelDescNode *model_desc_node,
                                        GGMLHyperparameters *hyperparameters,
                                        GGMLModelForwardFunc forward_func,
@@ -645,6 +1724,7 @@ ggml_model_load_from_istream_data_new (GInputStream *istream,
 {
   GGMLModelLoadFromIstreamData *data = g_new0 (GGMLModelLoadFromIstreamData, 1);
   data->istream = g_object_ref (istream);
+  data->weights_cache_file = weights_cache_file != NULL ? g_object_ref (weights_cache_file) : NULL;
   data->model_desc_node = ggml_model_desc_node_ref (model_desc_node);
   data->hyperparameters = ggml_hyperparameters_ref (hyperparameters);
   data->forward_func = forward_func;
@@ -658,6 +1738,7 @@ static void
 ggml_model_load_from_istream_data_free (GGMLModelLoadFromIstreamData *data)
 {
   g_clear_pointer (&data->istream, g_object_unref);
+  g_clear_object (&data->weights_cache_file);
   g_clear_pointer (&data->model_desc_node, ggml_model_desc_node_unref);
   g_clear_pointer (&data->hyperparameters, ggml_hyperparameters_unref);
   g_clear_pointer (&data->forward_func_user_data, data->forward_func_user_data_destroy);
@@ -703,15 +1784,16 @@ ggml_model_load_from_istream_async_thread (GTask         *task,
   g_auto(GStrv) out_loaded_keys = NULL;
   GError *error = NULL;
 
-  g_autoptr(GGMLModel) model = ggml_model_load_from_istream (data->istream,
-                                                             data->model_desc_node,
-                                                             data->hyperparameters,
-                                                             data->forward_func,
-                                                             data->forward_func_user_data,
-                                                             data->forward_func_user_data_destroy,
-                                                             &out_loaded_keys,
-                                                             cancellable,
-                                                             &error);
+  g_autoptr(GGMLModel) model = ggml_model_load_from_istream_with_weights_cache (data->istream,
+                                                                                data->weights_cache_file,
+                                                                                data->model_desc_node,
+                                                                                data->hyperparameters,
+                                                                                data->forward_func,
+                                                                                data->forward_func_user_data,
+                                                                                data->forward_func_user_data_destroy,
+                                                                                &out_loaded_keys,
+                                                                                cancellable,
+                                                                                &error);
 
   if (model == NULL)
     {
@@ -762,6 +1844,48 @@ ggml_model_load_from_istream_async (GInputStream *istream,
                                     gpointer user_data)
 {
   g_autoptr(GGMLModelLoadFromIstreamData) data = ggml_model_load_from_istream_data_new(istream,
+                                                                                       NULL,
+                                                                                       model_desc,
+                                                                                       hyperparameters,
+                                                                                       forward_func,
+                                                                                       forward_func_user_data,
+                                                                                       forward_func_user_data_destroy);
+
+  g_autoptr(GTask) task = g_task_new (NULL, cancellable, callback, user_data);
+  g_task_set_task_data (task, g_steal_pointer (&data), (GDestroyNotify) ggml_model_load_from_istream_data_free);
+  g_task_run_in_thread (task, ggml_model_load_from_istream_async_thread);
+}
+
+/**
+ * ggml_model_load_from_istream_with_weights_cache_async:
+ * @istream: (transfer none): A #GInputStream
+ * @weights_cache_file: (transfer none) (nullable): A #GFile to cache the loaded weights in
+ * @model_desc: (transfer none): A #GGMLModelDescNode
+ * @hyperparameters: (transfer none): A #GGMLHyperparameters
+ * @forward_func: A #GGMLModelForwardFunc
+ * @forward_func_user_data: (closure forward_func): A user-data closure for @forward_func
+ * @forward_func_user_data_destroy: (destroy forward_func): A #GDestroyNotify for @forward_func_user_data
+ * @cancellable: (transfer none) (nullable): A #GCancellable
+ * @callback: A #GAsyncReadyCallback to be called when loading is complete.
+ * @user_data: (closure callback): Some user data for @callback
+ *
+ * Asynchronous version of ggml_model_load_from_istream_with_weights_cache(). Finish
+ * it with ggml_model_load_from_istream_with_weights_cache_finish().
+ */
+void
+ggml_model_load_from_istream_with_weights_cache_async (GInputStream *istream,
+                                                       GFile *weights_cache_file,
+                                                       GGMLModelDescNode *model_desc,
+                                                       GGMLHyperparameters *hyperparameters,
+                                                       GGMLModelForwardFunc forward_func,
+                                                       gpointer forward_func_user_data,
+                                                       GDestroyNotify forward_func_user_data_destroy,
+                                                       GCancellable *cancellable,
+                                                       GAsyncReadyCallback callback,
+                                                       gpointer user_data)
+{
+  g_autoptr(GGMLModelLoadFromIstreamData) data = ggml_model_load_from_istream_data_new(istream,
+                                                                                       weights_cache_file,
                                                                                        model_desc,
                                                                                        hyperparameters,
                                                                                        forward_func,
@@ -773,6 +1897,24 @@ ggml_model_load_from_istream_async (GInputStream *istream,
   g_task_run_in_thread (task, ggml_model_load_from_istream_async_thread);
 }
 
+/**
+ * ggml_model_load_from_istream_with_weights_cache_finish:
+ * @result: A #GAsyncResult
+ * @out_loaded_keys: (out) (transfer full) (nullable): A #GStrv out-parameter for the loaded keys.
+ * @error: A #GError out-parameter
+ *
+ * Finish an async call to ggml_model_load_from_istream_with_weights_cache_async().
+ *
+ * Returns: (transfer full): A new #GGMLModel or %NULL with @error set on failure.
+ */
+GGMLModel *
+ggml_model_load_from_istream_with_weights_cache_finish (GAsyncResult  *result,
+                                                        char        ***out_loaded_keys,
+                                                        GError       **error)
+{
+  return ggml_model_load_from_istream_finish (result, out_loaded_keys, error);
+}
+
 /**
  * ggml_model_get:
  * @model: A #GGMLModel
@@ -787,6 +1929,206 @@ ggml_model_get (GGMLModel *model, const char *key)
   return g_hash_table_lookup (model->weights, key);
 }
 
+static gboolean
+ggml_model_check_layer_weights_index (GGMLModel    *model,
+                                      const char   *layer_prefix,
+                                      size_t        n_layers,
+                                      const char  **slot_names,
+                                      size_t        n_slots,
+                                      GError      **error)
+{
+  if (model->n_layers != n_layers || model->n_layer_weight_slots != n_slots)
+    {
+      g_set_error (error,
+                   G_IO_ERROR,
+                   G_IO_ERROR_FAILED,
+                   "Model layer weights were already indexed with %zu layers of %zu weights, "
+                   "but %zu layers of %zu weights were requested",
+                   model->n_layers,
+                   model->n_layer_weight_slots,
+                   n_layers,
+                   n_slots);
+      return FALSE;
+    }
+
+  if (g_strcmp0 (model->layer_prefix, layer_prefix) != 0)
+    {
+      g_set_error (error,
+                   G_IO_ERROR,
+                   G_IO_ERROR_FAILED,
+                   "Model layer weights were already indexed with prefix %s, "
+                   "but prefix %s was requested",
+                   model->layer_prefix,
+                   layer_prefix);
+      return FALSE;
+    }
+
+  for (size_t i = 0; i < n_slots; ++i)
+    {
+      if (g_strcmp0 (model->layer_weight_slot_names[i], slot_names[i]) != 0)
+        {
+          g_set_error (error,
+                       G_IO_ERROR,
+                       G_IO_ERROR_FAILED,
+                       "Model layer weights were already indexed with weight %s in slot %zu, "
+                       "but weight %s was requested",
+                       model->layer_weight_slot_names[i],
+                       i,
+                       slot_names[i]);
+          return FALSE;
+        }
+    }
+
+  return TRUE;
+}
+
+/**
+ * ggml_model_index_layer_weights:
+ * @model: A #GGMLModel
+ * @layer_prefix: The common prefix of the layer weight keys, for example "model/h"
+ * @n_layers: The number of layers
+ * @slot_names: (array length=n_slots): The names of the weights within each layer,
+ *              for example "ln_1/g"
+ * @n_slots: The number of weights in each layer
+ * @error: A #GError
+ *
+ * Looks up the weights named "@layer_prefix<layer>/<slot>" for each layer and
+ * each name in @slot_names once and keeps them in a table, so that forward
+ * functions can fetch them with ggml_model_get_layer_weight by index, without
+ * formatting keys or doing hash table lookups on every pass.
+ *
+ * A model only has one layer table. It is safe to call this at the start of
+ * every forward pass, from multiple threads; only the first call does any work
+ * and later calls only check that the table was indexed with the same
+ * @layer_prefix and @slot_names.
+ *
+ * Returns: %TRUE on success, or %FALSE with @error set if a weight
+ *          does not exist or the table was indexed with a different
+ *          prefix or different slots.
+ */
+gboolean
+ggml_model_index_layer_weights (GGMLModel   *model,
+                                const char  *layer_prefix,
+                                size_t       n_layers,
+                                const char **slot_names,
+                                size_t       n_slots,
+                                GError     **error)
+{
+  if (g_atomic_pointer_get (&model->layer_weights) != NULL)
+    {
+      return ggml_model_check_layer_weights_index (model,
+                                                   layer_prefix,
+                                                   n_layers,
+                                                   slot_names,
+                                                   n_slots,
+                                                   error);
+    }
+
+  g_autoptr(GMutexLocker) locker = g_mutex_locker_new (&model->layer_weights_mutex);
+
+  /* Someone else might have got here first */
+  if (model->layer_weights != NULL)
+    {
+      return ggml_model_check_layer_weights_index (model,
+                                                   layer_prefix,
+                                                   n_layers,
+                                                   slot_names,
+                                                   n_slots,
+                                                   error);
+    }
+
+  g_autoptr(GPtrArray) layer_weights = g_ptr_array_new_full (n_layers * n_slots,
+                                                             (GDestroyNotify) ggml_tensor_unref);
+
+  for (size_t i = 0; i < n_layers; ++i)
+    {
+      for (size_t j = 0; j < n_slots; ++j)
+        {
+          g_autofree char *key = g_strdup_printf ("%s%zu/%s", layer_prefix, i, slot_names[j]);
+          GGMLTensor *tensor = g_hash_table_lookup (model->weights, key);
+
+          if (tensor == NULL)
+            {
+              g_set_error (error,
+                           G_IO_ERROR,
+                           G_IO_ERROR_NOT_FOUND,
+                           "Layer weight %s does not exist in the model",
+                           key);
+              return FALSE;
+            }
+
+          g_ptr_array_add (layer_weights, ggml_tensor_ref (tensor));
+        }
+    }
+
+  /* Everything that is checked on the fast path has to be in place
+   * before layer_weights is published */
+  model->layer_prefix = g_strdup (layer_prefix);
+  model->layer_weight_slot_names = g_new0 (char *, n_slots + 1);
+
+  for (size_t j = 0; j < n_slots; ++j)
+    {
+      model->layer_weight_slot_names[j] = g_strdup (slot_names[j]);
+    }
+
+  model->n_layers = n_layers;
+  model->n_layer_weight_slots = n_slots;
+  g_atomic_pointer_set (&model->layer_weights, g_steal_pointer (&layer_weights));
+
+  return TRUE;
+}
+
+/**
+ * ggml_model_get_layer_weight:
+ * @model: A #GGMLModel
+ * @layer: The layer index
+ * @slot: The index of the weight within the layer, in the order that was
+ *        given to ggml_model_index_layer_weights
+ *
+ * Returns: (transfer none): The #GGMLTensor for the weight. It is an error
+ *          to call this before ggml_model_index_layer_weights has succeeded.
+ */
+GGMLTensor *
+ggml_model_get_layer_weight (GGMLModel *model,
+                             size_t     layer,
+                             size_t     slot)
+{
+  g_assert (model->layer_weights != NULL);
+  g_assert (layer < model->n_layers && slot < model->n_layer_weight_slots);
+
+  return model->layer_weights->pdata[layer * model->n_layer_weight_slots + slot];
+}
+
+/**
+ * ggml_model_set_compute_context:
+ * @model: A #GGMLModel
+ * @compute_context: (transfer none) (nullable): A #GGMLComputeContext
+ *
+ * Sets the #GGMLComputeContext that forward passes on @model take their
+ * threads from. If @compute_context is %NULL, then the process-wide
+ * default context from ggml_compute_context_get_default is used.
+ */
+void
+ggml_model_set_compute_context (GGMLModel          *model,
+                                GGMLComputeContext *compute_context)
+{
+  g_clear_pointer (&model->compute_context, ggml_compute_context_unref);
+  model->compute_context = compute_context != NULL ? ggml_compute_context_ref (compute_context) : NULL;
+}
+
+/**
+ * ggml_model_get_compute_context:
+ * @model: A #GGMLModel
+ *
+ * Returns: (transfer none): The #GGMLComputeContext that forward passes
+ *          on @model take their threads from.
+ */
+GGMLComputeContext *
+ggml_model_get_compute_context (GGMLModel *model)
+{
+  return model->compute_context != NULL ? model->compute_context : ggml_compute_context_get_default ();
+}
+
 /**
  * ggml_model_ref:
  * @model: A #GGMLModel
@@ -818,7 +2160,12 @@ ggml_model_unref (GGMLModel *model)
   if (--model->ref_count == 0)
     {
       g_clear_pointer (&model->owning_context, ggml_context_unref);
+      g_clear_pointer (&model->layer_weights, g_ptr_array_unref);
+      g_clear_pointer (&model->layer_prefix, g_free);
+      g_clear_pointer (&model->layer_weight_slot_names, g_strfreev);
+      g_clear_pointer (&model->compute_context, ggml_compute_context_unref);
       g_clear_pointer (&model->weights, g_hash_table_destroy);
+      g_mutex_clear (&model->layer_weights_mutex);
 
       if (model->forward_func_user_data_destroy)
         {
@@ -896,6 +2243,10 @@ ggml_model_build_graph (GGMLModel *model,
  *
  * Does a forward pass on the model to define the compute graph, then runs the computation.
  *
+ * The computation takes its threads from the model's #GGMLComputeContext. If
+ * @forward_parameters has an "n_threads" entry, up to that many threads are used,
+ * otherwise the context's number of threads per request.
+ *
  * Returns: (transfer full): A #GGMLTensor that can be used to create a #GGMLComputeGraph.
 */
 GGMLTensor *
@@ -922,14 +2273,32 @@ ggml_model_forward (GGMLModel *model,
 
   ggml_compute_graph_build_forward_expand (compute_graph, output);
 
-  size_t num_threads = g_get_num_processors ();
-  g_autoptr(GGMLComputePlan) compute_plan = ggml_compute_graph_plan (compute_graph, num_threads);
+  GGMLComputeContext *compute_context = ggml_model_get_compute_context (model);
+  size_t requested_num_threads = (
+    forward_parameters != NULL ? GPOINTER_TO_INT (g_hash_table_lookup (forward_parameters, "n_threads")) : 0
+  );
+  size_t num_threads = ggml_compute_context_acquire_threads (compute_context,
+                                                             requested_num_threads,
+                                                             cancellable,
+                                                             error);
+
+  if (num_threads == 0)
+    {
+      return NULL;
+    }
+
+  g_autoptr(GGMLComputePlan) compute_plan = ggml_compute_graph_plan_with_execution_memory (compute_graph,
+                                                                                           num_threads,
+                                                                                           execution_memory);
+  gboolean computed = ggml_compute_graph_compute (compute_graph,
+                                                  compute_plan,
+                                                  output->owning_context,
+                                                  cancellable,
+                                                  error);
+
+  ggml_compute_context_release_threads (compute_context, num_threads);
 
-  if (!ggml_compute_graph_compute (compute_graph,
-                                   compute_plan,
-                                   output->owning_context,
-                                   cancellable,
-                                   error))
+  if (!computed)
     {
       return NULL;
     }
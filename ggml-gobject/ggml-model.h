@@ -24,6 +24,7 @@
 
 #include <glib-object.h>
 #include <gio/gio.h>
+#include <ggml-gobject/ggml-compute-context.h>
 #include <ggml-gobject/ggml-compute-graph.h>
 #include <ggml-gobject/ggml-execution-memory.h>
 #include <ggml-gobject/ggml-hyperparameters.h>
@@ -67,6 +68,18 @@ typedef GGMLTensor * (*GGMLModelForwardFunc) (GGMLModel   *model,
 GGMLModel *ggml_model_ref (GGMLModel *model);
 void ggml_model_unref (GGMLModel *model);
 GGMLTensor *ggml_model_get (GGMLModel *model, const char *key);
+gboolean ggml_model_index_layer_weights (GGMLModel   *model,
+                                         const char  *layer_prefix,
+                                         size_t       n_layers,
+                                         const char **slot_names,
+                                         size_t       n_slots,
+                                         GError     **error);
+GGMLTensor *ggml_model_get_layer_weight (GGMLModel *model,
+                                         size_t     layer,
+                                         size_t     slot);
+void ggml_model_set_compute_context (GGMLModel          *model,
+                                     GGMLComputeContext *compute_context);
+GGMLComputeContext *ggml_model_get_compute_context (GGMLModel *model);
 GGMLComputeGraph *ggml_model_build_graph (GGMLModel *model,
                                           GGMLHyperparameters *hyperparameters,
                                           GVariant *inputs,
@@ -104,6 +117,30 @@ GGMLModel * ggml_model_load_from_istream_finish (GAsyncResult  *result,
                                                  char        ***out_loaded_keys,
                                                  GError       **error);
 
+GGMLModel * ggml_model_load_from_istream_with_weights_cache (GInputStream                           *istream,
+                                                             GFile                                  *weights_cache_file,
+                                                             GGMLModelDescNode                      *model_desc_node,
+                                                             GGMLHyperparameters                    *hyperparameters,
+                                                             GGMLModelForwardFunc                    forward_func,
+                                                             gpointer                                forward_func_user_data,
+                                                             GDestroyNotify                          forward_func_user_data_destroy,
+                                                             char                                 ***out_loaded_keys,
+                                                             GCancellable                           *cancellable,
+                                                             GError                                **error);
+void ggml_model_load_from_istream_with_weights_cache_async (GInputStream *istream,
+                                                            GFile *weights_cache_file,
+                                                            GGMLModelDescNode *model_desc,
+                                                            GGMLHyperparameters *hyperparameters,
+                                                            GGMLModelForwardFunc forward_func,
+                                                            gpointer forward_func_user_data,
+                                                            GDestroyNotify forward_func_user_data_destroy,
+                                                            GCancellable *cancellable,
+                                                            GAsyncReadyCallback callback,
+                                                            gpointer user_data);
+GGMLModel * ggml_model_load_from_istream_with_weights_cache_finish (GAsyncResult  *result,
+                                                                    char        ***out_loaded_keys,
+                                                                    GError       **error);
+
 GHashTable * ggml_new_weight_set_from_flattened_desc (GGMLContext *existing_context,
                                                       GHashTable  *flattened_desc);
 
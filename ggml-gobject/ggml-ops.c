@@ -43,7 +43,7 @@ ggml_op_view_1d (GGMLContext *context,
                                   ggml_view_1d (context->ctx,
                                                 tensor->tensor,
                                                 size1,
-                                                offset * ggml_tensor_element_size (tensor)));
+                                                ggml_tensor_internal_offset_bytes (tensor->tensor, offset)));
 }
 
 /**
@@ -88,7 +88,7 @@ ggml_op_view_2d (GGMLContext *context,
                                                 size1,
                                                 size2,
                                                 tensor->tensor->nb[1],
-                                                offset * ggml_tensor_element_size (tensor)));
+                                                ggml_tensor_internal_offset_bytes (tensor->tensor, offset)));
 }
 
 /**
@@ -138,6 +138,44 @@ ggml_op_reshape_3d (GGMLContext *context,
                                                    size3));
 }
 
+/**
+ * ggml_op_view_3d:
+ * @context: (transfer none): A #GGMLContext
+ * @tensor: (transfer none): A #GGMLTensor
+ * @size1: The size on the first dimension
+ * @size2: The size on the second dimension
+ * @size3: The size on the third dimension
+ * @stride2: Number of elements in the original data between items on the second dimension
+ * @stride3: Number of elements in the original data between items on the third dimension
+ * @offset: Number of elements into the original data to offset into
+ *
+ * Unlike ggml_op_view_2d, the strides are not taken from @tensor, which
+ * means that this can view the data in a different layout without copying.
+ * The first dimension is always contiguous.
+ *
+ * Returns: (transfer full): A new #GGMLTensor, viewing the original data
+ */
+GGMLTensor *
+ggml_op_view_3d (GGMLContext *context,
+                 GGMLTensor  *tensor,
+                 int64_t      size1,
+                 int64_t      size2,
+                 int64_t      size3,
+                 size_t       stride2,
+                 size_t       stride3,
+                 size_t       offset)
+{
+  return ggml_tensor_from_tensor (context,
+                                  ggml_view_3d (context->ctx,
+                                                tensor->tensor,
+                                                size1,
+                                                size2,
+                                                size3,
+                                                ggml_tensor_internal_offset_bytes (tensor->tensor, stride2),
+                                                ggml_tensor_internal_offset_bytes (tensor->tensor, stride3),
+                                                ggml_tensor_internal_offset_bytes (tensor->tensor, offset)));
+}
+
 /**
  * ggml_op_permute:
  * @context: (transfer none): A #GGMLContext
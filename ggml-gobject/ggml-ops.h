@@ -52,6 +52,7 @@ GGMLTensor * ggml_op_reshape_1d (GGMLContext *context, GGMLTensor *tensor, int64
 GGMLTensor * ggml_op_view_2d (GGMLContext *context, GGMLTensor *tensor, int64_t size1, int64_t size2, size_t offset);
 GGMLTensor * ggml_op_reshape_2d (GGMLContext *context, GGMLTensor *tensor, int64_t size1, int64_t size2);
 GGMLTensor * ggml_op_reshape_3d (GGMLContext *context, GGMLTensor *tensor, int64_t size1, int64_t size2, int64_t size3);
+GGMLTensor * ggml_op_view_3d (GGMLContext *context, GGMLTensor *tensor, int64_t size1, int64_t size2, int64_t size3, size_t stride2, size_t stride3, size_t offset);
 GGMLTensor * ggml_op_permute (GGMLContext *context, GGMLTensor *tensor, int ax1, int ax2, int ax3, int ax4);
 
 GGMLTensor * ggml_op_diag_mask_inf (GGMLContext *context, GGMLTensor *tensor, int n_past);
@@ -0,0 +1,511 @@
+/*
+ * ggml-gobject/ggml-prefix-cache.c
+ *
+ * Library code for ggml-prefix-cache
+ *
+ * Copyright (C) 2023 Sam Spilsbury.
+ *
+ * ggml-gobject is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation; either version 2.1 of the License, or
+ * (at your option) any later version.
+ *
+ * ggml-gobject is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License along
+ * with ggml-gobject; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+#include <ggml-gobject/ggml-prefix-cache.h>
+
+/* A node in the radix tree. The tokens on the edge from the parent are
+ * stored in the node itself. Every node other than the root either has
+ * a snapshot or at least two children, so every leaf has a snapshot. */
+typedef struct _GGMLPrefixCacheNode GGMLPrefixCacheNode;
+
+struct _GGMLPrefixCacheNode {
+  GGMLPrefixCacheNode *parent;
+  GArray *tokens;
+  GPtrArray *children;
+  GBytes *snapshot;
+  GList *lru_link;
+};
+
+struct _GGMLPrefixCache {
+  GMutex mutex;
+  GHashTable *roots;
+  GQueue lru;
+  size_t max_bytes;
+  size_t n_bytes;
+  size_t n_hits;
+  size_t n_misses;
+  gatomicrefcount ref_count;
+};
+
+static void ggml_prefix_cache_node_free (GGMLPrefixCacheNode *node);
+
+static GGMLPrefixCacheNode *
+ggml_prefix_cache_node_new (GGMLPrefixCacheNode *parent,
+                            const int32_t       *tokens,
+                            size_t               n_tokens)
+{
+  GGMLPrefixCacheNode *node = g_new0 (GGMLPrefixCacheNode, 1);
+
+  node->parent = parent;
+  node->tokens = g_array_sized_new (FALSE, FALSE, sizeof (int32_t), n_tokens);
+  node->children = g_ptr_array_new_with_free_func ((GDestroyNotify) ggml_prefix_cache_node_free);
+
+  g_array_append_vals (node->tokens, tokens, n_tokens);
+
+  return node;
+}
+
+static void
+ggml_prefix_cache_node_free (GGMLPrefixCacheNode *node)
+{
+  g_clear_pointer (&node->tokens, g_array_unref);
+  g_clear_pointer (&node->children, g_ptr_array_unref);
+  g_clear_pointer (&node->snapshot, g_bytes_unref);
+  g_clear_pointer (&node, g_free);
+}
+
+static GGMLPrefixCacheNode *
+ggml_prefix_cache_node_find_child (GGMLPrefixCacheNode *node,
+                                   int32_t              token)
+{
+  for (size_t i = 0; i < node->children->len; ++i)
+    {
+      GGMLPrefixCacheNode *child = node->children->pdata[i];
+
+      if (g_array_index (child->tokens, int32_t, 0) == token)
+        {
+          return child;
+        }
+    }
+
+  return NULL;
+}
+
+static size_t
+ggml_prefix_cache_node_common_length (GGMLPrefixCacheNode *node,
+                                      const int32_t       *tokens,
+                                      size_t               n_tokens)
+{
+  size_t n_common = 0;
+  size_t max_common = MIN (node->tokens->len, n_tokens);
+
+  while (n_common < max_common &&
+         g_array_index (node->tokens, int32_t, n_common) == tokens[n_common])
+    {
+      ++n_common;
+    }
+
+  return n_common;
+}
+
+/* Swaps @node for @replacement in the children of the parent of @node,
+ * without freeing @node */
+static void
+ggml_prefix_cache_node_replace (GGMLPrefixCacheNode *node,
+                                GGMLPrefixCacheNode *replacement)
+{
+  GPtrArray *siblings = node->parent->children;
+  guint index = 0;
+  gboolean found = g_ptr_array_find (siblings, node, &index);
+
+  g_assert (found);
+
+  siblings->pdata[index] = replacement;
+  replacement->parent = node->parent;
+}
+
+/* Splits @node after @n_tokens of its tokens, so that there is a
+ * node which ends exactly there. Returns the new node, which is
+ * the parent of @node. */
+static GGMLPrefixCacheNode *
+ggml_prefix_cache_node_split (GGMLPrefixCacheNode *node,
+                              size_t               n_tokens)
+{
+  GGMLPrefixCacheNode *head = ggml_prefix_cache_node_new (node->parent,
+                                                          (const int32_t *) node->tokens->data,
+                                                          n_tokens);
+
+  ggml_prefix_cache_node_replace (node, head);
+  g_array_remove_range (node->tokens, 0, n_tokens);
+  g_ptr_array_add (head->children, node);
+  node->parent = head;
+
+  return head;
+}
+
+/* Removes nodes which are no longer needed after @node lost its
+ * snapshot, so that every leaf keeps having a snapshot. */
+static void
+ggml_prefix_cache_node_prune (GGMLPrefixCacheNode *node)
+{
+  while (node->parent != NULL && node->snapshot == NULL)
+    {
+      GGMLPrefixCacheNode *parent = node->parent;
+
+      if (node->children->len == 0)
+        {
+          g_ptr_array_remove (parent->children, node);
+          node = parent;
+          continue;
+        }
+
+      if (node->children->len == 1)
+        {
+          /* Merge the only child into this node */
+          GGMLPrefixCacheNode *child = g_ptr_array_steal_index (node->children, 0);
+
+          g_array_prepend_vals (child->tokens, node->tokens->data, node->tokens->len);
+          ggml_prefix_cache_node_replace (node, child);
+          ggml_prefix_cache_node_free (node);
+        }
+
+      break;
+    }
+}
+
+/* Returns some node below @node that has a snapshot. There is always
+ * one, unless @node is the root of an empty tree. */
+static GGMLPrefixCacheNode *
+ggml_prefix_cache_node_find_snapshot (GGMLPrefixCacheNode *node)
+{
+  while (node->snapshot == NULL)
+    {
+      if (node->children->len == 0)
+        {
+          return NULL;
+        }
+
+      node = node->children->pdata[0];
+    }
+
+  return node;
+}
+
+static size_t
+ggml_prefix_cache_node_depth (GGMLPrefixCacheNode *node)
+{
+  size_t depth = 0;
+
+  for (; node != NULL; node = node->parent)
+    {
+      depth += node->tokens->len;
+    }
+
+  return depth;
+}
+
+static void
+ggml_prefix_cache_evict_least_recently_used (GGMLPrefixCache *prefix_cache)
+{
+  GGMLPrefixCacheNode *node = g_queue_pop_head (&prefix_cache->lru);
+
+  prefix_cache->n_bytes -= g_bytes_get_size (node->snapshot);
+  node->lru_link = NULL;
+  g_clear_pointer (&node->snapshot, g_bytes_unref);
+
+  ggml_prefix_cache_node_prune (node);
+}
+
+/* Snapshots for different memory layouts cannot be restored into
+ * each other, so each layout gets a tree of its own. Equal layouts
+ * have the same serialized data in normal form. */
+static GBytes *
+ggml_prefix_cache_memory_desc_key (GVariant *memory_desc)
+{
+  g_autoptr(GVariant) normal_memory_desc = g_variant_get_normal_form (memory_desc);
+
+  return g_variant_get_data_as_bytes (normal_memory_desc);
+}
+
+static void
+ggml_prefix_cache_touch (GGMLPrefixCache     *prefix_cache,
+                         GGMLPrefixCacheNode *node)
+{
+  g_queue_unlink (&prefix_cache->lru, node->lru_link);
+  g_queue_push_tail_link (&prefix_cache->lru, node->lru_link);
+}
+
+/**
+ * ggml_prefix_cache_new:
+ * @max_bytes: The most bytes of snapshots to keep
+ *
+ * Creates a new #GGMLPrefixCache, which keeps snapshots of the key-value
+ * memory after processing some sequences of tokens, for instance common
+ * prompts. A sequence that starts with the same tokens as a cached one
+ * can then start from the snapshot instead of processing those tokens again.
+ *
+ * The sequences are kept in a radix tree for each layout of the key-value
+ * memory, so the same cache can be shared between models. Once the snapshots
+ * take up more than @max_bytes, the least recently used ones are evicted.
+ *
+ * Returns: (transfer full): A new #GGMLPrefixCache
+ */
+GGMLPrefixCache *
+ggml_prefix_cache_new (size_t max_bytes)
+{
+  GGMLPrefixCache *prefix_cache = g_new0 (GGMLPrefixCache, 1);
+
+  g_mutex_init (&prefix_cache->mutex);
+  prefix_cache->roots = g_hash_table_new_full (g_bytes_hash,
+                                               g_bytes_equal,
+                                               (GDestroyNotify) g_bytes_unref,
+                                               (GDestroyNotify) ggml_prefix_cache_node_free);
+  prefix_cache->max_bytes = max_bytes;
+  g_queue_init (&prefix_cache->lru);
+  g_atomic_ref_count_init (&prefix_cache->ref_count);
+
+  return prefix_cache;
+}
+
+/**
+ * ggml_prefix_cache_ref:
+ * @prefix_cache: A #GGMLPrefixCache
+ *
+ * Increases the reference count on @prefix_cache
+ *
+ * Returns: (transfer full): The @prefix_cache
+ */
+GGMLPrefixCache *
+ggml_prefix_cache_ref (GGMLPrefixCache *prefix_cache)
+{
+  g_atomic_ref_count_inc (&prefix_cache->ref_count);
+  return prefix_cache;
+}
+
+/**
+ * ggml_prefix_cache_unref:
+ * @prefix_cache: A #GGMLPrefixCache
+ *
+ * Decreases the reference count on @prefix_cache. If the reference
+ * count goes to zero, then the @prefix_cache and its snapshots will be freed.
+ */
+void
+ggml_prefix_cache_unref (GGMLPrefixCache *prefix_cache)
+{
+  if (g_atomic_ref_count_dec (&prefix_cache->ref_count))
+    {
+      g_mutex_clear (&prefix_cache->mutex);
+      g_queue_clear (&prefix_cache->lru);
+      g_clear_pointer (&prefix_cache->roots, g_hash_table_unref);
+      g_clear_pointer (&prefix_cache, g_free);
+    }
+}
+
+/**
+ * ggml_prefix_cache_insert:
+ * @prefix_cache: A #GGMLPrefixCache
+ * @memory_desc: (transfer none): The layout of the key-value memory that @snapshot
+ *               was saved from, see ggml_model_desc_node_serialize
+ * @tokens: (array length=n_tokens): The tokens that @snapshot is for
+ * @n_tokens: The number of tokens in @tokens
+ * @snapshot: (transfer none): A #GBytes with the key-value memory after
+ *            processing @tokens, see ggml_execution_memory_save_key_value_positions
+ *
+ * Adds @snapshot to @prefix_cache, evicting the least recently used snapshots
+ * if there is not enough space. If there is already a snapshot for @tokens,
+ * it is kept and only marked as recently used. Snapshots larger than the
+ * whole cache are not added.
+ */
+void
+ggml_prefix_cache_insert (GGMLPrefixCache *prefix_cache,
+                          GVariant        *memory_desc,
+                          const int32_t   *tokens,
+                          size_t           n_tokens,
+                          GBytes          *snapshot)
+{
+  g_autoptr(GMutexLocker) locker = g_mutex_locker_new (&prefix_cache->mutex);
+
+  if (n_tokens == 0 || g_bytes_get_size (snapshot) > prefix_cache->max_bytes)
+    {
+      return;
+    }
+
+  g_autoptr(GBytes) key = ggml_prefix_cache_memory_desc_key (memory_desc);
+  GGMLPrefixCacheNode *node = g_hash_table_lookup (prefix_cache->roots, key);
+
+  if (node == NULL)
+    {
+      node = ggml_prefix_cache_node_new (NULL, NULL, 0);
+      g_hash_table_insert (prefix_cache->roots, g_steal_pointer (&key), node);
+    }
+
+  for (size_t i = 0; i < n_tokens;)
+    {
+      GGMLPrefixCacheNode *child = ggml_prefix_cache_node_find_child (node, tokens[i]);
+
+      if (child == NULL)
+        {
+          child = ggml_prefix_cache_node_new (node, &tokens[i], n_tokens - i);
+          g_ptr_array_add (node->children, child);
+          node = child;
+          break;
+        }
+
+      size_t n_common = ggml_prefix_cache_node_common_length (child, &tokens[i], n_tokens - i);
+
+      if (n_common < child->tokens->len)
+        {
+          child = ggml_prefix_cache_node_split (child, n_common);
+        }
+
+      node = child;
+      i += n_common;
+    }
+
+  if (node->snapshot != NULL)
+    {
+      ggml_prefix_cache_touch (prefix_cache, node);
+      return;
+    }
+
+  node->snapshot = g_bytes_ref (snapshot);
+  g_queue_push_tail (&prefix_cache->lru, node);
+  node->lru_link = g_queue_peek_tail_link (&prefix_cache->lru);
+  prefix_cache->n_bytes += g_bytes_get_size (snapshot);
+
+  /* The new snapshot fits on its own, so it never gets evicted here */
+  while (prefix_cache->n_bytes > prefix_cache->max_bytes)
+    {
+      ggml_prefix_cache_evict_least_recently_used (prefix_cache);
+    }
+}
+
+/**
+ * ggml_prefix_cache_lookup:
+ * @prefix_cache: A #GGMLPrefixCache
+ * @memory_desc: (transfer none): The layout of the key-value memory that the
+ *               snapshot will be restored into, see ggml_model_desc_node_serialize
+ * @tokens: (array length=n_tokens): The tokens to look up
+ * @n_tokens: The number of tokens in @tokens
+ * @out_snapshot: (out) (transfer full) (optional): The snapshot with the longest prefix in common with @tokens
+ * @out_n_snapshot_tokens: (out) (optional): The number of tokens that @out_snapshot was saved for
+ *
+ * Looks up the snapshot which has the longest prefix in common with @tokens. The
+ * snapshot may be for more tokens than that, but since each position only depends
+ * on the ones before it, the positions for the common prefix can still be used.
+ * Only snapshots that were inserted with an equal @memory_desc are considered.
+ *
+ * Returns: The number of tokens at the start of @tokens that @out_snapshot can be used for,
+ *          or 0 if there is no snapshot in common with @tokens.
+ */
+size_t
+ggml_prefix_cache_lookup (GGMLPrefixCache  *prefix_cache,
+                          GVariant         *memory_desc,
+                          const int32_t    *tokens,
+                          size_t            n_tokens,
+                          GBytes          **out_snapshot,
+                          size_t           *out_n_snapshot_tokens)
+{
+  g_autoptr(GMutexLocker) locker = g_mutex_locker_new (&prefix_cache->mutex);
+  g_autoptr(GBytes) key = ggml_prefix_cache_memory_desc_key (memory_desc);
+  GGMLPrefixCacheNode *node = g_hash_table_lookup (prefix_cache->roots, key);
+  size_t n_matched = 0;
+
+  while (node != NULL && n_matched < n_tokens)
+    {
+      GGMLPrefixCacheNode *child = ggml_prefix_cache_node_find_child (node, tokens[n_matched]);
+
+      if (child == NULL)
+        {
+          break;
+        }
+
+      size_t n_common = ggml_prefix_cache_node_common_length (child, &tokens[n_matched], n_tokens - n_matched);
+
+      node = child;
+      n_matched += n_common;
+
+      if (n_common < child->tokens->len)
+        {
+          break;
+        }
+    }
+
+  GGMLPrefixCacheNode *snapshot_node = n_matched > 0 ? ggml_prefix_cache_node_find_snapshot (node) : NULL;
+
+  if (snapshot_node == NULL)
+    {
+      ++prefix_cache->n_misses;
+      return 0;
+    }
+
+  ++prefix_cache->n_hits;
+  ggml_prefix_cache_touch (prefix_cache, snapshot_node);
+
+  if (out_snapshot != NULL)
+    {
+      *out_snapshot = g_bytes_ref (snapshot_node->snapshot);
+    }
+
+  if (out_n_snapshot_tokens != NULL)
+    {
+      *out_n_snapshot_tokens = ggml_prefix_cache_node_depth (snapshot_node);
+    }
+
+  return n_matched;
+}
+
+/**
+ * ggml_prefix_cache_get_max_bytes:
+ * @prefix_cache: A #GGMLPrefixCache
+ *
+ * Returns: The most bytes of snapshots that @prefix_cache keeps
+ */
+size_t
+ggml_prefix_cache_get_max_bytes (GGMLPrefixCache *prefix_cache)
+{
+  return prefix_cache->max_bytes;
+}
+
+/**
+ * ggml_prefix_cache_get_n_bytes:
+ * @prefix_cache: A #GGMLPrefixCache
+ *
+ * Returns: The number of bytes of snapshots in @prefix_cache
+ */
+size_t
+ggml_prefix_cache_get_n_bytes (GGMLPrefixCache *prefix_cache)
+{
+  g_autoptr(GMutexLocker) locker = g_mutex_locker_new (&prefix_cache->mutex);
+
+  return prefix_cache->n_bytes;
+}
+
+/**
+ * ggml_prefix_cache_get_n_hits:
+ * @prefix_cache: A #GGMLPrefixCache
+ *
+ * Returns: The number of lookups in @prefix_cache that found a snapshot
+ */
+size_t
+ggml_prefix_cache_get_n_hits (GGMLPrefixCache *prefix_cache)
+{
+  g_autoptr(GMutexLocker) locker = g_mutex_locker_new (&prefix_cache->mutex);
+
+  return prefix_cache->n_hits;
+}
+
+/**
+ * ggml_prefix_cache_get_n_misses:
+ * @prefix_cache: A #GGMLPrefixCache
+ *
+ * Returns: The number of lookups in @prefix_cache that did not find a snapshot
+ */
+size_t
+ggml_prefix_cache_get_n_misses (GGMLPrefixCache *prefix_cache)
+{
+  g_autoptr(GMutexLocker) locker = g_mutex_locker_new (&prefix_cache->mutex);
+
+  return prefix_cache->n_misses;
+}
+
+G_DEFINE_BOXED_TYPE (GGMLPrefixCache, ggml_prefix_cache, ggml_prefix_cache_ref, ggml_prefix_cache_unref);
@@ -0,0 +1,57 @@
+/*
+ * ggml-gobject/ggml-prefix-cache.h
+ *
+ * Header file for ggml-prefix-cache
+ *
+ * Copyright (C) 2023 Sam Spilsbury.
+ *
+ * ggml-gobject is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation; either version 2.1 of the License, or
+ * (at your option) any later version.
+ *
+ * ggml-gobject is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with ggml-gobject; if not, write to the Free Software Foundation,
+ * Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+#pragma once
+
+#include <glib-object.h>
+
+G_BEGIN_DECLS
+
+typedef struct _GGMLPrefixCache GGMLPrefixCache;
+
+#define GGML_TYPE_PREFIX_CACHE (ggml_prefix_cache_get_type ())
+GType ggml_prefix_cache_get_type (void);
+
+GGMLPrefixCache * ggml_prefix_cache_new (size_t max_bytes);
+GGMLPrefixCache * ggml_prefix_cache_ref (GGMLPrefixCache *prefix_cache);
+void ggml_prefix_cache_unref (GGMLPrefixCache *prefix_cache);
+
+void ggml_prefix_cache_insert (GGMLPrefixCache *prefix_cache,
+                               GVariant        *memory_desc,
+                               const int32_t   *tokens,
+                               size_t           n_tokens,
+                               GBytes          *snapshot);
+size_t ggml_prefix_cache_lookup (GGMLPrefixCache  *prefix_cache,
+                                 GVariant         *memory_desc,
+                                 const int32_t    *tokens,
+                                 size_t            n_tokens,
+                                 GBytes          **out_snapshot,
+                                 size_t           *out_n_snapshot_tokens);
+
+size_t ggml_prefix_cache_get_max_bytes (GGMLPrefixCache *prefix_cache);
+size_t ggml_prefix_cache_get_n_bytes (GGMLPrefixCache *prefix_cache);
+size_t ggml_prefix_cache_get_n_hits (GGMLPrefixCache *prefix_cache);
+size_t ggml_prefix_cache_get_n_misses (GGMLPrefixCache *prefix_cache);
+
+G_DEFINE_AUTOPTR_CLEANUP_FUNC (GGMLPrefixCache, ggml_prefix_cache_unref)
+
+G_END_DECLS
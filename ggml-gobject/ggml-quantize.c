@@ -115,14 +115,15 @@ quantize_by_regex_map_func (const char              *path,
                             gpointer                 user_data)
 {
   QuantizeByRegexMapFuncData *data = user_data;
+  gboolean should_quantize = (leaf->n_dim == 2 &&
+                              matches_quantize_regexes (data->quantize_regex_objects, data->skip_regex_objects, path));
+  GGMLModelDescLeaf *mapped_leaf = ggml_model_desc_leaf_new (leaf->dimensions,
+                                                             leaf->n_dim,
+                                                             should_quantize ? data->quantize_type : leaf->type);
 
-  if (leaf->n_dim != 2 ||
-      !matches_quantize_regexes (data->quantize_regex_objects, data->skip_regex_objects, path))
-    {
-      return ggml_model_desc_leaf_new (leaf->dimensions, leaf->n_dim, leaf->type);
-    }
+  ggml_model_desc_leaf_set_tied_to (mapped_leaf, ggml_model_desc_leaf_get_tied_to (leaf));
 
-  return ggml_model_desc_leaf_new (leaf->dimensions, leaf->n_dim, data->quantize_type);
+  return mapped_leaf;
 }
 
 /**
@@ -398,4 +398,81 @@ ggml_tensor_get_cgraph_perf_us (GGMLTensor *tensor)
   return (int32_t) (tensor->tensor->perf_time_us / ((float) tensor->tensor->perf_runs));
 }
 
+/**
+ * ggml_tensor_internal_offset_bytes: (skip)
+ * @tensor: A ggml tensor
+ * @offset: An offset into @tensor, in elements
+ *
+ * Quantized types store several elements in each block, so
+ * the element size is not enough to work out the byte offset.
+ * @offset must be at the start of a block.
+ *
+ * Returns: The number of bytes into the data of @tensor that @offset is at
+ */
+size_t
+ggml_tensor_internal_offset_bytes (struct ggml_tensor *tensor,
+                                   size_t              offset)
+{
+  g_assert (offset % ggml_blck_size (tensor->type) == 0);
+
+  return offset / ggml_blck_size (tensor->type) * ggml_type_size (tensor->type);
+}
+
+/**
+ * ggml_tensor_set_view_offset: (skip)
+ * @tensor: A #GGMLTensor created by ggml_op_view_1d, or a copy into such a view
+ * @offset: The new offset into the viewed tensor, in elements
+ *
+ * Moves a view which is already part of a compute graph so that it
+ * points at @offset in the tensor that it views. If @tensor is a copy
+ * node, its destination view is moved and the copy node follows it.
+ *
+ * This is meant for compute graphs that get re-run without being
+ * rebuilt, where a view into persistent memory (for instance the
+ * key-value memory) needs to point somewhere else on each run.
+ */
+void
+ggml_tensor_set_view_offset (GGMLTensor *tensor,
+                             size_t      offset)
+{
+  struct ggml_tensor *view = tensor->tensor;
+
+  if (view->op == GGML_OP_CPY)
+    {
+      view = view->src[1];
+    }
+
+  g_assert (view->op == GGML_OP_VIEW);
+
+  size_t offset_bytes = ggml_tensor_internal_offset_bytes (view->src[0], offset);
+  memcpy (view->op_params, &offset_bytes, sizeof (offset_bytes));
+  view->data = (char *) view->src[0]->data + offset_bytes;
+
+  if (view != tensor->tensor)
+    {
+      tensor->tensor->data = view->data;
+    }
+}
+
+/**
+ * ggml_tensor_set_op_param_int32: (skip)
+ * @tensor: A #GGMLTensor which is the result of some operation
+ * @index: The index of the parameter
+ * @value: The new value of the parameter
+ *
+ * Changes an integer parameter of the operation producing @tensor,
+ * for instance n_past for ggml_op_diag_mask_inf. Like
+ * ggml_tensor_set_view_offset, this is meant for compute graphs that
+ * get re-run without being rebuilt.
+ */
+void
+ggml_tensor_set_op_param_int32 (GGMLTensor *tensor,
+                                size_t      index,
+                                int32_t     value)
+{
+  g_assert (index < GGML_MAX_OP_PARAMS / sizeof (int32_t));
+
+  tensor->tensor->op_params[index] = value;
+}
+
 G_DEFINE_BOXED_TYPE (GGMLTensor, ggml_tensor, ggml_tensor_ref, ggml_tensor_unref);
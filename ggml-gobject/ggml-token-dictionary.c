@@ -21,16 +21,295 @@
  */
 
 #include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
 
 #include <ggml-gobject/ggml-token-dictionary.h>
 #include <ggml-gobject/internal/ggml-stream-internal.h>
+#include <ggml-gobject/internal/ggml-token-dictionary-internal.h>
+
+/* The trie is stored breadth-first in flat arrays. The edges
+ * of each node are contiguous and sorted by their label, so
+ * that a child can be found with a binary search and walking
+ * the trie never needs to allocate. */
+typedef struct _GGMLTokenDictionaryTrieNode {
+  int32_t token;
+  uint32_t first_edge;
+  uint32_t n_edges;
+} GGMLTokenDictionaryTrieNode;
+
+typedef struct _GGMLTokenDictionaryTrie {
+  GGMLTokenDictionaryTrieNode *nodes;
+  uint8_t *edge_labels;
+  uint32_t *edge_children;
+} GGMLTokenDictionaryTrie;
+
+/* The word cache maps words to the tokens they were split into. It is
+ * split into shards by the hash of the word, each with its own lock and
+ * least-recently-used list, so that threads tokenizing at the same time
+ * rarely wait for each other. */
+#define GGML_TOKEN_DICTIONARY_WORD_CACHE_N_SHARDS 16
+#define GGML_TOKEN_DICTIONARY_WORD_CACHE_DEFAULT_MAX_ENTRIES 0
+#define GGML_TOKEN_DICTIONARY_WORD_CACHE_MAX_WORD_LENGTH 256
+
+typedef struct _GGMLTokenDictionaryWord {
+  const char *word;
+  size_t length;
+} GGMLTokenDictionaryWord;
+
+/* The key must come first, so that the entry can be found from its key.
+ * The tokens and the word itself are stored after the entry. */
+typedef struct _GGMLTokenDictionaryWordCacheEntry {
+  GGMLTokenDictionaryWord key;
+  GList lru_link;
+  size_t n_tokens;
+  int32_t tokens[];
+} GGMLTokenDictionaryWordCacheEntry;
+
+typedef struct _GGMLTokenDictionaryWordCacheShard {
+  GMutex mutex;
+  GHashTable *entries;
+  GQueue lru;
+  size_t n_hits;
+  size_t n_misses;
+} GGMLTokenDictionaryWordCacheShard;
 
 struct _GGMLTokenDictionary {
   gchar **idx_to_word;
+  size_t n_words;
   GHashTable *word_to_idx;
+  GGMLTokenDictionaryTrie trie;
+  GGMLTokenDictionaryWordCacheShard word_cache[GGML_TOKEN_DICTIONARY_WORD_CACHE_N_SHARDS];
+  gsize word_cache_max_entries;
   size_t ref_count;
 };
 
+typedef struct _GGMLTokenDictionaryTrieEntry {
+  const char *word;
+  int32_t token;
+} GGMLTokenDictionaryTrieEntry;
+
+typedef struct _GGMLTokenDictionaryTrieRange {
+  size_t lo;
+  size_t hi;
+  size_t depth;
+  uint32_t node;
+} GGMLTokenDictionaryTrieRange;
+
+static int
+ggml_token_dictionary_trie_entry_compare (gconstpointer a, gconstpointer b)
+{
+  const GGMLTokenDictionaryTrieEntry *entry_a = a;
+  const GGMLTokenDictionaryTrieEntry *entry_b = b;
+  int cmp = strcmp (entry_a->word, entry_b->word);
+
+  if (cmp != 0)
+    {
+      return cmp;
+    }
+
+  return (entry_a->token > entry_b->token) - (entry_a->token < entry_b->token);
+}
+
+static void
+ggml_token_dictionary_trie_build (GGMLTokenDictionaryTrie  *trie,
+                                  const char              **words,
+                                  size_t                    n_words)
+{
+  g_autofree GGMLTokenDictionaryTrieEntry *entries = g_new0 (GGMLTokenDictionaryTrieEntry, n_words);
+  g_autoptr(GArray) nodes = g_array_new (FALSE, TRUE, sizeof (GGMLTokenDictionaryTrieNode));
+  g_autoptr(GArray) edge_labels = g_array_new (FALSE, TRUE, sizeof (uint8_t));
+  g_autoptr(GArray) edge_children = g_array_new (FALSE, TRUE, sizeof (uint32_t));
+  g_autoptr(GArray) queue = g_array_new (FALSE, TRUE, sizeof (GGMLTokenDictionaryTrieRange));
+  GGMLTokenDictionaryTrieNode root = { -1, 0, 0 };
+  GGMLTokenDictionaryTrieRange root_range = { 0, n_words, 0, 0 };
+
+  for (size_t i = 0; i < n_words; ++i)
+    {
+      entries[i].word = words[i];
+      entries[i].token = i;
+    }
+
+  /* After sorting, all the words sharing a prefix are in one range
+   * and duplicate words are ordered by their token, so that the
+   * last one wins, the same as in word_to_idx */
+  qsort (entries, n_words, sizeof (GGMLTokenDictionaryTrieEntry), ggml_token_dictionary_trie_entry_compare);
+
+  g_array_append_val (nodes, root);
+  g_array_append_val (queue, root_range);
+
+  for (size_t head = 0; head < queue->len; ++head)
+    {
+      GGMLTokenDictionaryTrieRange range = g_array_index (queue, GGMLTokenDictionaryTrieRange, head);
+      size_t lo = range.lo;
+
+      /* Words ending at this depth sort first */
+      while (lo < range.hi && entries[lo].word[range.depth] == '\0')
+        {
+          g_array_index (nodes, GGMLTokenDictionaryTrieNode, range.node).token = entries[lo++].token;
+        }
+
+      g_array_index (nodes, GGMLTokenDictionaryTrieNode, range.node).first_edge = edge_labels->len;
+
+      while (lo < range.hi)
+        {
+          uint8_t label = entries[lo].word[range.depth];
+          size_t hi = lo + 1;
+          GGMLTokenDictionaryTrieNode child = { -1, 0, 0 };
+          uint32_t child_index = nodes->len;
+          GGMLTokenDictionaryTrieRange child_range = { lo, 0, range.depth + 1, child_index };
+
+          while (hi < range.hi && (uint8_t) entries[hi].word[range.depth] == label)
+            {
+              ++hi;
+            }
+
+          child_range.hi = hi;
+
+          g_array_append_val (nodes, child);
+          g_array_append_val (edge_labels, label);
+          g_array_append_val (edge_children, child_index);
+          g_array_append_val (queue, child_range);
+          ++g_array_index (nodes, GGMLTokenDictionaryTrieNode, range.node).n_edges;
+
+          lo = hi;
+        }
+    }
+
+  trie->nodes = (GGMLTokenDictionaryTrieNode *) g_array_free (g_steal_pointer (&nodes), FALSE);
+  trie->edge_labels = (uint8_t *) g_array_free (g_steal_pointer (&edge_labels), FALSE);
+  trie->edge_children = (uint32_t *) g_array_free (g_steal_pointer (&edge_children), FALSE);
+}
+
+static void
+ggml_token_dictionary_trie_clear (GGMLTokenDictionaryTrie *trie)
+{
+  g_clear_pointer (&trie->nodes, g_free);
+  g_clear_pointer (&trie->edge_labels, g_free);
+  g_clear_pointer (&trie->edge_children, g_free);
+}
+
+static inline gboolean
+ggml_token_dictionary_trie_find_child (const GGMLTokenDictionaryTrie *trie,
+                                       uint32_t                       node,
+                                       uint8_t                        label,
+                                       uint32_t                      *out_child)
+{
+  size_t lo = trie->nodes[node].first_edge;
+  size_t hi = lo + trie->nodes[node].n_edges;
+
+  while (lo < hi)
+    {
+      size_t mid = lo + (hi - lo) / 2;
+
+      if (trie->edge_labels[mid] < label)
+        {
+          lo = mid + 1;
+        }
+      else
+        {
+          hi = mid;
+        }
+    }
+
+  if (lo < trie->nodes[node].first_edge + trie->nodes[node].n_edges &&
+      trie->edge_labels[lo] == label)
+    {
+      *out_child = trie->edge_children[lo];
+      return TRUE;
+    }
+
+  return FALSE;
+}
+
+static guint
+ggml_token_dictionary_word_hash (gconstpointer key)
+{
+  const GGMLTokenDictionaryWord *word = key;
+  guint hash = 5381;
+
+  for (size_t i = 0; i < word->length; ++i)
+    {
+      hash = (hash << 5) + hash + (guchar) word->word[i];
+    }
+
+  return hash;
+}
+
+static gboolean
+ggml_token_dictionary_word_equal (gconstpointer a, gconstpointer b)
+{
+  const GGMLTokenDictionaryWord *word_a = a;
+  const GGMLTokenDictionaryWord *word_b = b;
+
+  return word_a->length == word_b->length &&
+         memcmp (word_a->word, word_b->word, word_a->length) == 0;
+}
+
+static void
+ggml_token_dictionary_word_cache_init (GGMLTokenDictionary *dictionary)
+{
+  for (size_t i = 0; i < GGML_TOKEN_DICTIONARY_WORD_CACHE_N_SHARDS; ++i)
+    {
+      GGMLTokenDictionaryWordCacheShard *shard = &dictionary->word_cache[i];
+
+      g_mutex_init (&shard->mutex);
+      g_queue_init (&shard->lru);
+      shard->entries = g_hash_table_new_full (ggml_token_dictionary_word_hash,
+                                              ggml_token_dictionary_word_equal,
+                                              NULL,
+                                              g_free);
+    }
+
+  dictionary->word_cache_max_entries = GGML_TOKEN_DICTIONARY_WORD_CACHE_DEFAULT_MAX_ENTRIES;
+}
+
+static void
+ggml_token_dictionary_word_cache_clear (GGMLTokenDictionary *dictionary)
+{
+  for (size_t i = 0; i < GGML_TOKEN_DICTIONARY_WORD_CACHE_N_SHARDS; ++i)
+    {
+      GGMLTokenDictionaryWordCacheShard *shard = &dictionary->word_cache[i];
+
+      /* The links are in the entries, so there is nothing else to free */
+      g_queue_init (&shard->lru);
+      g_clear_pointer (&shard->entries, g_hash_table_destroy);
+      g_mutex_clear (&shard->mutex);
+    }
+}
+
+static inline GGMLTokenDictionaryWordCacheShard *
+ggml_token_dictionary_word_cache_get_shard (GGMLTokenDictionary           *dictionary,
+                                            const GGMLTokenDictionaryWord *word)
+{
+  guint hash = ggml_token_dictionary_word_hash (word);
+
+  return &dictionary->word_cache[(hash >> 8) % GGML_TOKEN_DICTIONARY_WORD_CACHE_N_SHARDS];
+}
+
+static inline size_t
+ggml_token_dictionary_word_cache_max_shard_entries (GGMLTokenDictionary *dictionary)
+{
+  size_t max_entries = ggml_token_dictionary_get_word_cache_max_entries (dictionary);
+
+  return (max_entries + GGML_TOKEN_DICTIONARY_WORD_CACHE_N_SHARDS - 1) / GGML_TOKEN_DICTIONARY_WORD_CACHE_N_SHARDS;
+}
+
+/* Evicts the least recently used words from @shard until it has at most
+ * @max_entries words. The shard lock must be held. */
+static void
+ggml_token_dictionary_word_cache_shard_evict (GGMLTokenDictionaryWordCacheShard *shard,
+                                              size_t                             max_entries)
+{
+  while (shard->lru.length > max_entries)
+    {
+      GList *link = g_queue_pop_tail_link (&shard->lru);
+      GGMLTokenDictionaryWordCacheEntry *entry = link->data;
+
+      g_hash_table_remove (shard->entries, &entry->key);
+    }
+}
+
 /**
  * ggml_token_dictionary_new:
  * @tokens: (array zero-terminated=1): The tokens to add to this dictionary, in order
@@ -53,6 +332,12 @@ ggml_token_dictionary_new (const char **tokens)
       g_hash_table_insert (dictionary->word_to_idx, (gpointer) *(tokens_iterator++), GINT_TO_POINTER (i++));
     }
 
+  dictionary->n_words = i;
+  ggml_token_dictionary_trie_build (&dictionary->trie,
+                                    (const char **) dictionary->idx_to_word,
+                                    i);
+  ggml_token_dictionary_word_cache_init (dictionary);
+
   return dictionary;
 }
 
@@ -209,6 +494,8 @@ ggml_token_dictionary_unref (GGMLTokenDictionary *dictionary)
 {
   if (--dictionary->ref_count == 0)
     {
+      ggml_token_dictionary_word_cache_clear (dictionary);
+      ggml_token_dictionary_trie_clear (&dictionary->trie);
       g_clear_pointer (&dictionary->word_to_idx, g_hash_table_destroy);
       g_clear_pointer (&dictionary->idx_to_word, g_strfreev);
       g_clear_pointer (&dictionary, g_free);
@@ -240,6 +527,303 @@ ggml_token_dictionary_lookup_extended (GGMLTokenDictionary *token_dictionary,
   return FALSE;
 }
 
+/**
+ * ggml_token_dictionary_lookup_longest_prefix:
+ * @token_dictionary: A #GGMLTokenDictionary
+ * @string: (array length=length): A string to match against the @token_dictionary
+ * @length: The number of bytes of @string that may be matched
+ * @out_token: (out): The token for the longest match
+ * @out_length: (out): The length of the longest match in bytes
+ *
+ * Finds the longest non-empty prefix of the first @length bytes of
+ * @string that is a word in the @token_dictionary. @string does not need
+ * to be nul-terminated and this function does not allocate.
+ *
+ * Returns: %TRUE with @out_token and @out_length set if a prefix was found,
+ *          %FALSE otherwise.
+ */
+gboolean
+ggml_token_dictionary_lookup_longest_prefix (GGMLTokenDictionary *token_dictionary,
+                                             const char          *string,
+                                             size_t               length,
+                                             int32_t             *out_token,
+                                             size_t              *out_length)
+{
+  const GGMLTokenDictionaryTrie *trie = &token_dictionary->trie;
+  uint32_t node = 0;
+  int32_t match_token = -1;
+  size_t match_length = 0;
+
+  for (size_t i = 0; i < length; ++i)
+    {
+      if (!ggml_token_dictionary_trie_find_child (trie, node, (uint8_t) string[i], &node))
+        {
+          break;
+        }
+
+      if (trie->nodes[node].token >= 0)
+        {
+          match_token = trie->nodes[node].token;
+          match_length = i + 1;
+        }
+    }
+
+  if (match_length == 0)
+    {
+      return FALSE;
+    }
+
+  *out_token = match_token;
+  *out_length = match_length;
+  return TRUE;
+}
+
+/**
+ * ggml_token_dictionary_lookup_word_cache:
+ * @token_dictionary: A #GGMLTokenDictionary
+ * @word: (array length=length): A word to look up
+ * @length: The length of @word in bytes
+ * @out_tokens: (out caller-allocates) (array length=length): Space for the
+ *              tokens of @word, which is never more than @length tokens
+ * @out_n_tokens: (out): The number of tokens written to @out_tokens
+ *
+ * Looks up the tokens that @word was split into when it was last added to
+ * the word cache of @token_dictionary with
+ * ggml_token_dictionary_insert_word_cache(). This is safe to call from
+ * multiple threads at once.
+ *
+ * Returns: %TRUE with @out_tokens and @out_n_tokens set if @word was in the
+ *          cache, %FALSE otherwise.
+ */
+gboolean
+ggml_token_dictionary_lookup_word_cache (GGMLTokenDictionary *token_dictionary,
+                                         const char          *word,
+                                         size_t               length,
+                                         int32_t             *out_tokens,
+                                         size_t              *out_n_tokens)
+{
+  GGMLTokenDictionaryWord key = { word, length };
+  GGMLTokenDictionaryWordCacheShard *shard;
+  GGMLTokenDictionaryWordCacheEntry *entry;
+
+  if (length > GGML_TOKEN_DICTIONARY_WORD_CACHE_MAX_WORD_LENGTH ||
+      ggml_token_dictionary_get_word_cache_max_entries (token_dictionary) == 0)
+    {
+      return FALSE;
+    }
+
+  shard = ggml_token_dictionary_word_cache_get_shard (token_dictionary, &key);
+
+  g_mutex_lock (&shard->mutex);
+  entry = g_hash_table_lookup (shard->entries, &key);
+
+  if (entry == NULL)
+    {
+      ++shard->n_misses;
+      g_mutex_unlock (&shard->mutex);
+      return FALSE;
+    }
+
+  ++shard->n_hits;
+  g_queue_unlink (&shard->lru, &entry->lru_link);
+  g_queue_push_head_link (&shard->lru, &entry->lru_link);
+  memcpy (out_tokens, entry->tokens, entry->n_tokens * sizeof (int32_t));
+  *out_n_tokens = entry->n_tokens;
+  g_mutex_unlock (&shard->mutex);
+
+  return TRUE;
+}
+
+/**
+ * ggml_token_dictionary_insert_word_cache:
+ * @token_dictionary: A #GGMLTokenDictionary
+ * @word: (array length=length): A word to add to the cache
+ * @length: The length of @word in bytes
+ * @tokens: (array length=n_tokens): The tokens that @word was split into
+ * @n_tokens: The number of tokens in @tokens
+ *
+ * Adds @word to the word cache of @token_dictionary, evicting the least
+ * recently used words if the cache is full. Very long words are not cached.
+ * This is safe to call from multiple threads at once.
+ */
+void
+ggml_token_dictionary_insert_word_cache (GGMLTokenDictionary *token_dictionary,
+                                         const char          *word,
+                                         size_t               length,
+                                         const int32_t       *tokens,
+                                         size_t               n_tokens)
+{
+  GGMLTokenDictionaryWord key = { word, length };
+  GGMLTokenDictionaryWordCacheShard *shard;
+  GGMLTokenDictionaryWordCacheEntry *entry;
+  size_t max_shard_entries;
+
+  if (length > GGML_TOKEN_DICTIONARY_WORD_CACHE_MAX_WORD_LENGTH)
+    {
+      return;
+    }
+
+  shard = ggml_token_dictionary_word_cache_get_shard (token_dictionary, &key);
+
+  g_mutex_lock (&shard->mutex);
+  max_shard_entries = ggml_token_dictionary_word_cache_max_shard_entries (token_dictionary);
+
+  /* Another thread may have added the same word in the meantime */
+  if (max_shard_entries == 0 || g_hash_table_contains (shard->entries, &key))
+    {
+      g_mutex_unlock (&shard->mutex);
+      return;
+    }
+
+  entry = g_malloc (sizeof (GGMLTokenDictionaryWordCacheEntry) + n_tokens * sizeof (int32_t) + length);
+  entry->key.word = (const char *) &entry->tokens[n_tokens];
+  entry->key.length = length;
+  entry->lru_link.data = entry;
+  entry->lru_link.prev = NULL;
+  entry->lru_link.next = NULL;
+  entry->n_tokens = n_tokens;
+  memcpy (entry->tokens, tokens, n_tokens * sizeof (int32_t));
+  memcpy ((char *) entry->key.word, word, length);
+
+  ggml_token_dictionary_word_cache_shard_evict (shard, max_shard_entries - 1);
+  g_hash_table_add (shard->entries, &entry->key);
+  g_queue_push_head_link (&shard->lru, &entry->lru_link);
+  g_mutex_unlock (&shard->mutex);
+}
+
+/**
+ * ggml_token_dictionary_set_word_cache_max_entries:
+ * @token_dictionary: A #GGMLTokenDictionary
+ * @max_entries: The number of words to keep in the word cache, or 0 to
+ *               disable the cache
+ *
+ * Sets how many words the word cache of @token_dictionary keeps, evicting the
+ * least recently used words if there are too many. The cache is off until
+ * this is called, since it only pays off when the same words get tokenized
+ * over and over again, for instance in a server that sees many similar
+ * prompts, and costs memory and locking otherwise. The words are spread over
+ * a few separately locked parts of the cache, so the limit is rounded up to
+ * a multiple of the number of parts.
+ */
+void
+ggml_token_dictionary_set_word_cache_max_entries (GGMLTokenDictionary *token_dictionary,
+                                                  size_t               max_entries)
+{
+  size_t max_shard_entries;
+
+  g_atomic_pointer_set (&token_dictionary->word_cache_max_entries, max_entries);
+  max_shard_entries = ggml_token_dictionary_word_cache_max_shard_entries (token_dictionary);
+
+  for (size_t i = 0; i < GGML_TOKEN_DICTIONARY_WORD_CACHE_N_SHARDS; ++i)
+    {
+      GGMLTokenDictionaryWordCacheShard *shard = &token_dictionary->word_cache[i];
+
+      g_mutex_lock (&shard->mutex);
+      ggml_token_dictionary_word_cache_shard_evict (shard, max_shard_entries);
+      g_mutex_unlock (&shard->mutex);
+    }
+}
+
+/**
+ * ggml_token_dictionary_get_word_cache_max_entries:
+ * @token_dictionary: A #GGMLTokenDictionary
+ *
+ * Returns: The number of words the word cache of @token_dictionary keeps
+ */
+size_t
+ggml_token_dictionary_get_word_cache_max_entries (GGMLTokenDictionary *token_dictionary)
+{
+  return (size_t) g_atomic_pointer_get (&token_dictionary->word_cache_max_entries);
+}
+
+/**
+ * ggml_token_dictionary_get_word_cache_n_entries:
+ * @token_dictionary: A #GGMLTokenDictionary
+ *
+ * Returns: The number of words in the word cache of @token_dictionary
+ */
+size_t
+ggml_token_dictionary_get_word_cache_n_entries (GGMLTokenDictionary *token_dictionary)
+{
+  size_t n_entries = 0;
+
+  for (size_t i = 0; i < GGML_TOKEN_DICTIONARY_WORD_CACHE_N_SHARDS; ++i)
+    {
+      GGMLTokenDictionaryWordCacheShard *shard = &token_dictionary->word_cache[i];
+
+      g_mutex_lock (&shard->mutex);
+      n_entries += shard->lru.length;
+      g_mutex_unlock (&shard->mutex);
+    }
+
+  return n_entries;
+}
+
+/**
+ * ggml_token_dictionary_get_word_cache_n_hits:
+ * @token_dictionary: A #GGMLTokenDictionary
+ *
+ * Returns: The number of words that were found in the word cache
+ */
+size_t
+ggml_token_dictionary_get_word_cache_n_hits (GGMLTokenDictionary *token_dictionary)
+{
+  size_t n_hits = 0;
+
+  for (size_t i = 0; i < GGML_TOKEN_DICTIONARY_WORD_CACHE_N_SHARDS; ++i)
+    {
+      GGMLTokenDictionaryWordCacheShard *shard = &token_dictionary->word_cache[i];
+
+      g_mutex_lock (&shard->mutex);
+      n_hits += shard->n_hits;
+      g_mutex_unlock (&shard->mutex);
+    }
+
+  return n_hits;
+}
+
+/**
+ * ggml_token_dictionary_get_word_cache_n_misses:
+ * @token_dictionary: A #GGMLTokenDictionary
+ *
+ * Returns: The number of words that were not found in the word cache
+ */
+size_t
+ggml_token_dictionary_get_word_cache_n_misses (GGMLTokenDictionary *token_dictionary)
+{
+  size_t n_misses = 0;
+
+  for (size_t i = 0; i < GGML_TOKEN_DICTIONARY_WORD_CACHE_N_SHARDS; ++i)
+    {
+      GGMLTokenDictionaryWordCacheShard *shard = &token_dictionary->word_cache[i];
+
+      g_mutex_lock (&shard->mutex);
+      n_misses += shard->n_misses;
+      g_mutex_unlock (&shard->mutex);
+    }
+
+  return n_misses;
+}
+
+/**
+ * ggml_token_dictionary_get_word:
+ * @token_dictionary: A #GGMLTokenDictionary
+ * @token: A token in @token_dictionary
+ *
+ * It is an error to pass a token which is outside the range of
+ * tokens in @token_dictionary.
+ *
+ * Returns: (transfer none): The word for @token
+ */
+const char *
+ggml_token_dictionary_get_word (GGMLTokenDictionary *token_dictionary,
+                                int32_t              token)
+{
+  g_assert (token >= 0 && (size_t) token < token_dictionary->n_words);
+
+  return token_dictionary->idx_to_word[token];
+}
+
 /**
  * ggml_token_dictionary_decode:
  * @token_dictionary: (transfer none): A #GGMLTokenDictionary
@@ -39,6 +39,19 @@ void ggml_token_dictionary_unref (GGMLTokenDictionary *dictionary);
 gboolean ggml_token_dictionary_lookup_extended (GGMLTokenDictionary *token_dictionary,
                                                 const char *key,
                                                 int32_t *out_token);
+const char * ggml_token_dictionary_get_word (GGMLTokenDictionary *token_dictionary,
+                                             int32_t              token);
+gboolean ggml_token_dictionary_lookup_longest_prefix (GGMLTokenDictionary *token_dictionary,
+                                                      const char          *string,
+                                                      size_t               length,
+                                                      int32_t             *out_token,
+                                                      size_t              *out_length);
+void ggml_token_dictionary_set_word_cache_max_entries (GGMLTokenDictionary *token_dictionary,
+                                                       size_t               max_entries);
+size_t ggml_token_dictionary_get_word_cache_max_entries (GGMLTokenDictionary *token_dictionary);
+size_t ggml_token_dictionary_get_word_cache_n_entries (GGMLTokenDictionary *token_dictionary);
+size_t ggml_token_dictionary_get_word_cache_n_hits (GGMLTokenDictionary *token_dictionary);
+size_t ggml_token_dictionary_get_word_cache_n_misses (GGMLTokenDictionary *token_dictionary);
 
 GGMLTokenDictionary * ggml_token_dictionary_load_from_istream (GInputStream *istream,
                                                                int32_t n_vocab,
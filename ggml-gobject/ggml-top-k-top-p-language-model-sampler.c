@@ -25,12 +25,34 @@
 
 static void ggml_top_k_top_p_language_model_sampler_interface_init (GGMLLanguageModelSamplerInterface *iface);
 
+/* The tokens that may be sampled and their logits or probabilities,
+ * kept as separate arrays so that the softmax runs over contiguous
+ * floats. The buffers only ever grow, so sampling does not allocate
+ * once they are big enough for top_k. */
+typedef struct {
+  float  *values;
+  size_t *indices;
+  size_t  len;
+  size_t  capacity;
+} Candidates;
+
+/* The scratch buffers belong to the thread that samples rather than to
+ * the sampler, so that one sampler can be used by several cursors
+ * running at the same time. */
+typedef struct {
+  Candidates candidates;
+  Candidates draft_candidates;
+} CandidatesScratch;
+
 typedef struct {
   size_t top_k;
   float  top_p;
   size_t seed;
   gboolean seed_set;
+  GMutex rand_mutex;
   GRand  *rand;
+  guint64 n_draws;
+  guint64 n_copies;
 } GGMLTopKTopPLanguageModelSamplerPrivate;
 
 struct _GGMLTopKTopPLanguageModelSampler {
@@ -53,128 +75,512 @@ G_DEFINE_TYPE_WITH_CODE (GGMLTopKTopPLanguageModelSampler,
                                                 ggml_top_k_top_p_language_model_sampler_interface_init))
 
 
-typedef struct {
-  float  value;
-  size_t idx;
-} Logit;
+static void
+candidates_reserve (Candidates *candidates,
+                    size_t      capacity)
+{
+  if (candidates->capacity >= capacity)
+    {
+      return;
+    }
 
+  candidates->values = g_renew (float, candidates->values, capacity);
+  candidates->indices = g_renew (size_t, candidates->indices, capacity);
+  candidates->capacity = capacity;
+}
 
 static void
-partial_sort_f32 (const float *input_buffer,
-                  size_t       input_buffer_size,
-                  Logit       *output_buffer,
-                  size_t       output_buffer_size)
+candidates_clear (Candidates *candidates)
 {
-  g_assert (output_buffer_size >= 1);
-  g_assert (output_buffer_size <= input_buffer_size);
+  g_clear_pointer (&candidates->values, g_free);
+  g_clear_pointer (&candidates->indices, g_free);
+  candidates->len = 0;
+  candidates->capacity = 0;
+}
 
-  for (size_t i = 0; i < output_buffer_size; ++i)
+static void
+candidates_scratch_free (gpointer data)
+{
+  CandidatesScratch *scratch = data;
+
+  candidates_clear (&scratch->candidates);
+  candidates_clear (&scratch->draft_candidates);
+  g_free (scratch);
+}
+
+static GPrivate candidates_scratch_key = G_PRIVATE_INIT (candidates_scratch_free);
+
+static CandidatesScratch *
+candidates_scratch_get (void)
+{
+  CandidatesScratch *scratch = g_private_get (&candidates_scratch_key);
+
+  if (scratch == NULL)
     {
-      output_buffer[i].value = -G_MAXFLOAT;
+      scratch = g_new0 (CandidatesScratch, 1);
+      g_private_set (&candidates_scratch_key, scratch);
     }
 
-  for (size_t i = 0; i < input_buffer_size; ++i)
+  return scratch;
+}
+
+static inline void
+candidates_swap (Candidates *candidates,
+                 size_t      i,
+                 size_t      j)
+{
+  float value = candidates->values[i];
+  size_t index = candidates->indices[i];
+
+  candidates->values[i] = candidates->values[j];
+  candidates->indices[i] = candidates->indices[j];
+  candidates->values[j] = value;
+  candidates->indices[j] = index;
+}
+
+/* Restores the min-heap property below @i in the first @n candidates */
+static void
+candidates_sift_down (Candidates *candidates,
+                      size_t      i,
+                      size_t      n)
+{
+  const float *values = candidates->values;
+
+  while (TRUE)
     {
-      if (input_buffer[i] > output_buffer[output_buffer_size - 1].value)
+      size_t smallest = i;
+      size_t left = 2 * i + 1;
+      size_t right = left + 1;
+
+      if (left < n && values[left] < values[smallest])
+        {
+          smallest = left;
+        }
+
+      if (right < n && values[right] < values[smallest])
+        {
+          smallest = right;
+        }
+
+      if (smallest == i)
         {
-          output_buffer[output_buffer_size - 1].value = input_buffer[i];
-          output_buffer[output_buffer_size - 1].idx = i;
-
-          for (int j = output_buffer_size - 2; j >= 0; --j)
-            {
-              /* Swap if output_buffer[j] < output_buffer[j + 1] -
-               * eg bubble the result up */
-              if (output_buffer[j + 1].value > output_buffer[j].value)
-                {
-                  Logit tmp = output_buffer[j];
-                  output_buffer[j] = output_buffer[j + 1];
-                  output_buffer[j + 1] = tmp;
-                }
-              else
-                {
-                  break;
-                }
-            }
+          return;
         }
+
+      candidates_swap (candidates, i, smallest);
+      i = smallest;
     }
 }
 
-static size_t *
-ggml_top_k_top_p_language_model_sampler_sample_logits_tensor (GGMLLanguageModelSampler *sampler,
-                                                              float                    *logits_data,
-                                                              size_t                    n_logits_data,
-                                                              size_t                   *shape,
-                                                              size_t                    n_shape,
-                                                              size_t                   *out_n_samples)
+/* Selects the @k largest logits into @candidates, largest first. A min-heap
+ * of the @k largest logits so far is kept, so that most logits are rejected
+ * with a single comparison against the smallest of them. That is O(n_vocab)
+ * in practice and O(n_vocab log k) at worst, then O(k log k) for the sort. */
+static void
+candidates_select_top_k (Candidates  *candidates,
+                         const float *logits_data,
+                         size_t       n_logits_data,
+                         size_t       k)
 {
-  GGMLTopKTopPLanguageModelSampler *top_k_top_p_sampler = GGML_TOP_K_TOP_P_LANGUAGE_MODEL_SAMPLER (sampler);
-  GGMLTopKTopPLanguageModelSamplerPrivate *priv = ggml_top_k_top_p_language_model_sampler_get_instance_private (top_k_top_p_sampler);
-  /* First, we need to partial-sort the logits data */
-  g_autoptr(GArray) sample_array = g_array_sized_new (FALSE, FALSE, sizeof (Logit), priv->top_k);
-  sample_array->len = priv->top_k;
+  g_assert (k >= 1);
+  g_assert (k <= n_logits_data);
 
-  partial_sort_f32 (logits_data, n_logits_data, (Logit *) sample_array->data, priv->top_k);
-  Logit *sample_array_logits = (Logit *) sample_array->data;
+  candidates_reserve (candidates, k);
 
-  float maxl = sample_array_logits[0].value;
+  float *values = candidates->values;
+  size_t *indices = candidates->indices;
+
+  for (size_t i = 0; i < k; ++i)
+    {
+      values[i] = logits_data[i];
+      indices[i] = i;
+    }
+
+  for (size_t i = k / 2; i-- > 0;)
+    {
+      candidates_sift_down (candidates, i, k);
+    }
+
+  for (size_t i = k; i < n_logits_data; ++i)
+    {
+      if (logits_data[i] > values[0])
+        {
+          values[0] = logits_data[i];
+          indices[0] = i;
+          candidates_sift_down (candidates, 0, k);
+        }
+    }
+
+  /* Heap sort. Taking the smallest off the top of a min-heap and
+   * putting it at the end leaves the largest first. */
+  for (size_t end = k - 1; end > 0; --end)
+    {
+      candidates_swap (candidates, 0, end);
+      candidates_sift_down (candidates, 0, end);
+    }
+
+  candidates->len = k;
+}
+
+/* Turns the selected logits into probabilities, then drops the least
+ * likely ones past the top_p probability mass. The loops are kept simple
+ * and separate so that the compiler can vectorize them. */
+static void
+candidates_softmax_top_p (Candidates *candidates,
+                          float       top_p)
+{
+  float *values = candidates->values;
+  const size_t n = candidates->len;
+  const float maxl = values[0];
   float sum = 0.0f;
 
-  for (size_t i = 0; i < priv->top_k; ++i)
+  for (size_t i = 0; i < n; ++i)
     {
-      sample_array_logits[i].value = exp(sample_array_logits[i].value - maxl);
-      sum += sample_array_logits[i].value;
+      values[i] = expf (values[i] - maxl);
     }
 
-  for (size_t i = 0; i < priv->top_k; ++i)
+  for (size_t i = 0; i < n; ++i)
     {
-      sample_array_logits[i].value /= sum;
+      sum += values[i];
     }
 
   size_t top_p_limit = 0;
   float cumsum = 0.0f;
 
-  for (size_t i = 0; i < priv->top_k; ++i)
+  for (size_t i = 0; i < n; ++i)
     {
-      float cur_value = sample_array_logits[i].value;
-      sample_array_logits[i].value = cumsum;
-      cumsum += cur_value;
+      cumsum += values[i] / sum;
       ++top_p_limit;
 
-      if (cumsum >= priv->top_p)
+      if (cumsum >= top_p)
         {
           break;
         }
     }
 
+  /* Renormalize over what is left, in one step */
+  const float scale = 1.0f / (cumsum * sum);
+
   for (size_t i = 0; i < top_p_limit; ++i)
     {
-      sample_array_logits[i].value /= cumsum;
+      values[i] *= scale;
     }
 
+  candidates->len = top_p_limit;
+}
+
+static float
+candidates_lookup (const Candidates *candidates,
+                   size_t            token)
+{
+  for (size_t i = 0; i < candidates->len; ++i)
+    {
+      if (candidates->indices[i] == token)
+        {
+          return candidates->values[i];
+        }
+    }
+
+  return 0.0f;
+}
+
+/* Fills @candidates with the tokens that may be sampled from @logits_data
+ * and their probabilities, most likely first */
+static void
+ggml_top_k_top_p_language_model_sampler_distribution (GGMLTopKTopPLanguageModelSamplerPrivate *priv,
+                                                      const float                             *logits_data,
+                                                      size_t                                   n_logits_data,
+                                                      Candidates                              *candidates)
+{
+  candidates_select_top_k (candidates, logits_data, n_logits_data, MIN (priv->top_k, n_logits_data));
+  candidates_softmax_top_p (candidates, priv->top_p);
+}
+
+/* Every random number goes through here, so that
+ * the state can be restored by drawing them again */
+static float
+ggml_top_k_top_p_language_model_sampler_draw (GGMLTopKTopPLanguageModelSamplerPrivate *priv)
+{
+  float draw;
+
+  g_mutex_lock (&priv->rand_mutex);
+  ++priv->n_draws;
+  draw = g_rand_double_range (priv->rand, 0.0, 1.0);
+  g_mutex_unlock (&priv->rand_mutex);
+
+  return draw;
+}
+
+static size_t
+ggml_top_k_top_p_language_model_sampler_pick (GGMLTopKTopPLanguageModelSamplerPrivate *priv,
+                                              const Candidates                        *candidates)
+{
   /* Now we uniformly sample a random number
    * and pick a logit */
-  float rand_pick = g_rand_double_range (priv->rand, 0.0, 1.0);
-  size_t picked = 0;
+  float rand_pick = ggml_top_k_top_p_language_model_sampler_draw (priv);
+  float cumsum = 0.0f;
 
-  for (; picked < top_p_limit; ++picked)
+  for (size_t i = 0; i < candidates->len; ++i)
     {
-      if (sample_array_logits[picked].value > rand_pick)
+      cumsum += candidates->values[i];
+
+      if (cumsum > rand_pick)
         {
-          break;
+          return candidates->indices[i];
         }
     }
 
-  g_autofree size_t *out_tokens = g_new0 (size_t, 1);
-  *out_tokens = sample_array_logits[picked - 1].idx;
+  return candidates->indices[candidates->len - 1];
+}
+
+static size_t *
+ggml_top_k_top_p_language_model_sampler_sample_logits_tensor (GGMLLanguageModelSampler *sampler,
+                                                              float                    *logits_data,
+                                                              size_t                    n_logits_data,
+                                                              size_t                   *shape,
+                                                              size_t                    n_shape,
+                                                              size_t                   *out_n_samples)
+{
+  GGMLTopKTopPLanguageModelSampler *top_k_top_p_sampler = GGML_TOP_K_TOP_P_LANGUAGE_MODEL_SAMPLER (sampler);
+  GGMLTopKTopPLanguageModelSamplerPrivate *priv = ggml_top_k_top_p_language_model_sampler_get_instance_private (top_k_top_p_sampler);
+  Candidates *candidates = &candidates_scratch_get ()->candidates;
+
+  ggml_top_k_top_p_language_model_sampler_distribution (priv, logits_data, n_logits_data, candidates);
+
+  /* The interface hands ownership of the samples to the caller */
+  size_t *out_tokens = g_new (size_t, 1);
+  *out_tokens = ggml_top_k_top_p_language_model_sampler_pick (priv, candidates);
 
   *out_n_samples = 1;
-  return g_steal_pointer (&out_tokens);
+  return out_tokens;
+}
+
+/* Speculative sampling: each draft token is kept with probability
+ * min(1, p / q), where p is its probability under the target model and
+ * q under the draft model. The first rejected token is replaced by a
+ * sample from max(0, p - q), which makes up for the tokens that the draft
+ * model proposes too often, so that the output is distributed as if it
+ * came from the target model alone. */
+static size_t
+ggml_top_k_top_p_language_model_sampler_verify_draft_tokens (GGMLLanguageModelSampler *sampler,
+                                                             float                    *draft_logits_data,
+                                                             float                    *target_logits_data,
+                                                             size_t                    n_vocab,
+                                                             const size_t             *draft_tokens,
+                                                             size_t                    n_draft_tokens,
+                                                             size_t                   *out_next_token)
+{
+  GGMLTopKTopPLanguageModelSampler *top_k_top_p_sampler = GGML_TOP_K_TOP_P_LANGUAGE_MODEL_SAMPLER (sampler);
+  GGMLTopKTopPLanguageModelSamplerPrivate *priv = ggml_top_k_top_p_language_model_sampler_get_instance_private (top_k_top_p_sampler);
+  CandidatesScratch *scratch = candidates_scratch_get ();
+  Candidates *target_candidates = &scratch->candidates;
+  Candidates *draft_candidates = &scratch->draft_candidates;
+
+  for (size_t i = 0; i < n_draft_tokens; ++i)
+    {
+      ggml_top_k_top_p_language_model_sampler_distribution (priv,
+                                                            target_logits_data + i * n_vocab,
+                                                            n_vocab,
+                                                            target_candidates);
+      ggml_top_k_top_p_language_model_sampler_distribution (priv,
+                                                            draft_logits_data + i * n_vocab,
+                                                            n_vocab,
+                                                            draft_candidates);
+
+      float p = candidates_lookup (target_candidates, draft_tokens[i]);
+      float q = candidates_lookup (draft_candidates, draft_tokens[i]);
+
+      if (ggml_top_k_top_p_language_model_sampler_draw (priv) * q < p)
+        {
+          continue;
+        }
+
+      float residual_sum = 0.0f;
+
+      for (size_t j = 0; j < target_candidates->len; ++j)
+        {
+          float draft_p = candidates_lookup (draft_candidates, target_candidates->indices[j]);
+
+          target_candidates->values[j] = MAX (target_candidates->values[j] - draft_p, 0.0f);
+          residual_sum += target_candidates->values[j];
+        }
+
+      /* The two distributions can only be the same if the draft
+       * token was always accepted, but rounding might say otherwise */
+      if (residual_sum <= 0.0f)
+        {
+          *out_next_token = draft_tokens[i];
+          return i;
+        }
+
+      for (size_t j = 0; j < target_candidates->len; ++j)
+        {
+          target_candidates->values[j] /= residual_sum;
+        }
+
+      *out_next_token = ggml_top_k_top_p_language_model_sampler_pick (priv, target_candidates);
+      return i;
+    }
+
+  ggml_top_k_top_p_language_model_sampler_distribution (priv,
+                                                        target_logits_data + n_draft_tokens * n_vocab,
+                                                        n_vocab,
+                                                        target_candidates);
+  *out_next_token = ggml_top_k_top_p_language_model_sampler_pick (priv, target_candidates);
+
+  return n_draft_tokens;
+}
+
+#define GGML_TOP_K_TOP_P_LANGUAGE_MODEL_SAMPLER_STATE_TYPE "(udbut)"
+
+/* Restoring a state replays all of its draws while holding the lock,
+ * which takes a fraction of a second at this many. A saved state is
+ * untrusted input, so anything bigger is rejected. */
+#define GGML_TOP_K_TOP_P_LANGUAGE_MODEL_SAMPLER_MAX_STATE_DRAWS (G_GUINT64_CONSTANT (1) << 24)
+
+static GVariant *
+ggml_top_k_top_p_language_model_sampler_get_state (GGMLLanguageModelSampler *sampler)
+{
+  GGMLTopKTopPLanguageModelSampler *top_k_top_p_sampler = GGML_TOP_K_TOP_P_LANGUAGE_MODEL_SAMPLER (sampler);
+  GGMLTopKTopPLanguageModelSamplerPrivate *priv = ggml_top_k_top_p_language_model_sampler_get_instance_private (top_k_top_p_sampler);
+  GVariant *state;
+
+  g_mutex_lock (&priv->rand_mutex);
+  state = g_variant_ref_sink (g_variant_new (GGML_TOP_K_TOP_P_LANGUAGE_MODEL_SAMPLER_STATE_TYPE,
+                                             (guint32) priv->top_k,
+                                             (double) priv->top_p,
+                                             priv->seed_set,
+                                             (guint32) priv->seed,
+                                             priv->n_draws));
+  g_mutex_unlock (&priv->rand_mutex);
+
+  return state;
+}
+
+static gboolean
+ggml_top_k_top_p_language_model_sampler_set_state (GGMLLanguageModelSampler  *sampler,
+                                                   GVariant                  *state,
+                                                   GError                   **error)
+{
+  GGMLTopKTopPLanguageModelSampler *top_k_top_p_sampler = GGML_TOP_K_TOP_P_LANGUAGE_MODEL_SAMPLER (sampler);
+  GGMLTopKTopPLanguageModelSamplerPrivate *priv = ggml_top_k_top_p_language_model_sampler_get_instance_private (top_k_top_p_sampler);
+  guint32 top_k, seed;
+  double top_p;
+  gboolean seed_set;
+  guint64 n_draws;
+
+  if (state == NULL || !g_variant_is_of_type (state, G_VARIANT_TYPE (GGML_TOP_K_TOP_P_LANGUAGE_MODEL_SAMPLER_STATE_TYPE)))
+    {
+      g_set_error (error,
+                   G_IO_ERROR,
+                   G_IO_ERROR_INVALID_DATA,
+                   "Expected top-k top-p sampler state of type %s",
+                   GGML_TOP_K_TOP_P_LANGUAGE_MODEL_SAMPLER_STATE_TYPE);
+      return FALSE;
+    }
+
+  g_variant_get (state,
+                 GGML_TOP_K_TOP_P_LANGUAGE_MODEL_SAMPLER_STATE_TYPE,
+                 &top_k,
+                 &top_p,
+                 &seed_set,
+                 &seed,
+                 &n_draws);
+
+  if (top_k < 1 || !(top_p > 0.0 && top_p <= 1.0))
+    {
+      g_set_error (error,
+                   G_IO_ERROR,
+                   G_IO_ERROR_INVALID_DATA,
+                   "Invalid top-k top-p sampler state with top_k %u and top_p %f",
+                   top_k,
+                   top_p);
+      return FALSE;
+    }
+
+  if (n_draws > GGML_TOP_K_TOP_P_LANGUAGE_MODEL_SAMPLER_MAX_STATE_DRAWS)
+    {
+      g_set_error (error,
+                   G_IO_ERROR,
+                   G_IO_ERROR_INVALID_DATA,
+                   "Invalid top-k top-p sampler state with %" G_GUINT64_FORMAT " draws, at most %" G_GUINT64_FORMAT " are supported",
+                   n_draws,
+                   GGML_TOP_K_TOP_P_LANGUAGE_MODEL_SAMPLER_MAX_STATE_DRAWS);
+      return FALSE;
+    }
+
+  priv->top_k = top_k;
+  priv->top_p = top_p;
+
+  /* GRand has no way to save its state, but with a known seed we can
+   * get back to the same point in the sequence by drawing the same
+   * numbers again. Without one, any point in the sequence will do. */
+  if (seed_set)
+    {
+      g_mutex_lock (&priv->rand_mutex);
+      priv->seed = seed;
+      priv->seed_set = TRUE;
+      g_rand_set_seed (priv->rand, seed);
+
+      for (guint64 i = 0; i < n_draws; ++i)
+        {
+          g_rand_double_range (priv->rand, 0.0, 1.0);
+        }
+
+      priv->n_draws = n_draws;
+      g_mutex_unlock (&priv->rand_mutex);
+    }
+
+  return TRUE;
+}
+
+/* Mixes @seed with the number of the copy, so that copies of the same
+ * sampler get seeds that have nothing to do with each other, see the
+ * splitmix64 finalizer. */
+static unsigned int
+ggml_top_k_top_p_language_model_sampler_copy_seed (size_t  seed,
+                                                   guint64 n_copy)
+{
+  guint64 z = seed + (n_copy + 1) * G_GUINT64_CONSTANT (0x9e3779b97f4a7c15);
+
+  z = (z ^ (z >> 30)) * G_GUINT64_CONSTANT (0xbf58476d1ce4e5b9);
+  z = (z ^ (z >> 27)) * G_GUINT64_CONSTANT (0x94d049bb133111eb);
+
+  return (unsigned int) (z ^ (z >> 31));
+}
+
+/* A fork should not make the same choices as the cursor it was forked
+ * from, so a copy with a known seed gets a seed of its own derived from
+ * that one and the number of copies made so far. Copies made in the same
+ * order from the same seed are the same, so forking stays reproducible.
+ * Without a seed, the copy gets a random sequence of its own. */
+static GGMLLanguageModelSampler *
+ggml_top_k_top_p_language_model_sampler_copy (GGMLLanguageModelSampler *sampler)
+{
+  GGMLTopKTopPLanguageModelSampler *top_k_top_p_sampler = GGML_TOP_K_TOP_P_LANGUAGE_MODEL_SAMPLER (sampler);
+  GGMLTopKTopPLanguageModelSamplerPrivate *priv = ggml_top_k_top_p_language_model_sampler_get_instance_private (top_k_top_p_sampler);
+  unsigned int copy_seed;
+
+  if (!priv->seed_set)
+    {
+      return ggml_top_k_top_p_language_model_sampler_new (priv->top_k, priv->top_p);
+    }
+
+  g_mutex_lock (&priv->rand_mutex);
+  copy_seed = ggml_top_k_top_p_language_model_sampler_copy_seed (priv->seed, priv->n_copies++);
+  g_mutex_unlock (&priv->rand_mutex);
+
+  return ggml_top_k_top_p_language_model_sampler_new_with_seed (priv->top_k, priv->top_p, copy_seed);
 }
 
 static void
 ggml_top_k_top_p_language_model_sampler_interface_init (GGMLLanguageModelSamplerInterface *iface)
 {
   iface->sample_logits_tensor = ggml_top_k_top_p_language_model_sampler_sample_logits_tensor;
+  iface->get_state = ggml_top_k_top_p_language_model_sampler_get_state;
+  iface->set_state = ggml_top_k_top_p_language_model_sampler_set_state;
+  iface->verify_draft_tokens = ggml_top_k_top_p_language_model_sampler_verify_draft_tokens;
+  iface->copy = ggml_top_k_top_p_language_model_sampler_copy;
 }
 
 static void
@@ -250,6 +656,9 @@ ggml_top_k_top_p_language_model_sampler_finalize (GObject *object)
   GGMLTopKTopPLanguageModelSamplerPrivate *priv = ggml_top_k_top_p_language_model_sampler_get_instance_private (sampler);
 
   g_clear_pointer (&priv->rand, g_rand_free);
+  g_mutex_clear (&priv->rand_mutex);
+
+  G_OBJECT_CLASS (ggml_top_k_top_p_language_model_sampler_parent_class)->finalize (object);
 }
 
 static void
@@ -298,6 +707,9 @@ ggml_top_k_top_p_language_model_sampler_class_init (GGMLTopKTopPLanguageModelSam
 static void
 ggml_top_k_top_p_language_model_sampler_init (GGMLTopKTopPLanguageModelSampler *sampler)
 {
+  GGMLTopKTopPLanguageModelSamplerPrivate *priv = ggml_top_k_top_p_language_model_sampler_get_instance_private (sampler);
+
+  g_mutex_init (&priv->rand_mutex);
 }
 
 /**
@@ -317,6 +729,10 @@ ggml_top_k_top_p_language_model_sampler_init (GGMLTopKTopPLanguageModelSampler *
  * just argmax sampling. The limits allow for some diversity in the sampling but prevent
  * situations where extremely unlikely tokens are sampled by chance.
  *
+ * The sampler may be used from several threads at once, for instance by
+ * cursors executing at the same time, though they then share one sequence
+ * of random numbers.
+ *
  * Returns: (transfer full): A new #GGMLLanguageModelSampler with the top-k, top-p
  *          sampling methodology.
  */
@@ -401,13 +817,17 @@ ggml_top_k_top_p_language_model_sampler_set_seed (GGMLTopKTopPLanguageModelSampl
 {
   GGMLTopKTopPLanguageModelSamplerPrivate *priv = ggml_top_k_top_p_language_model_sampler_get_instance_private (sampler);
 
+  g_mutex_lock (&priv->rand_mutex);
   priv->seed = seed;
   priv->seed_set = TRUE;
+  priv->n_draws = 0;
+  priv->n_copies = 0;
 
   if (priv->rand != NULL)
     {
       g_rand_set_seed (priv->rand, priv->seed);
     }
+  g_mutex_unlock (&priv->rand_mutex);
 }
 
 /**
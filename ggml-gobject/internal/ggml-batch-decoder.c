@@ -0,0 +1,432 @@
+/*
+ * ggml-gobject/internal/ggml-batch-decoder.c
+ *
+ * Library code for ggml-batch-decoder
+ *
+ * Copyright (C) 2023 Sam Spilsbury.
+ *
+ * ggml-gobject is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation; either version 2.1 of the License, or
+ * (at your option) any later version.
+ *
+ * ggml-gobject is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with ggml-gobject; if not, write to the Free Software Foundation,
+ * Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+#include <gio/gio.h>
+#include <ggml-gobject/ggml-gpt.h>
+#include <ggml-gobject/internal/ggml-batch-decoder.h>
+#include <string.h>
+
+/* One cursor waiting for the logits of its next token */
+typedef struct _GGMLBatchDecoderRequest
+{
+  size_t n_past;
+  int32_t token;
+  size_t n_threads;
+  int32_t *page_table;
+  size_t n_pages;
+  float *out_logits;
+  GError *error;
+  gboolean done;
+} GGMLBatchDecoderRequest;
+
+/*
+ * GGMLBatchDecoder:
+ *
+ * Runs the next token of several sequences in the same key-value page
+ * pool through the model in one forward pass.
+ *
+ * There is no thread of its own. Each cursor thread queues a request and
+ * waits. If no pass is running, the waiting thread becomes the leader: it
+ * takes everything that is queued, runs the pass and hands the logits
+ * back, then wakes up the others so that one of them can lead the next
+ * pass. Sequences that arrive while a pass is running go into the next
+ * one, so sequences can join and leave between any two steps.
+ */
+struct _GGMLBatchDecoder {
+  GGMLModel *model;
+  GGMLHyperparameters *hyperparameters;
+  GGMLKeyValuePagePool *page_pool;
+  GGMLExecutionMemory *execution_memory;
+  size_t max_sequences;
+
+  GMutex mutex;
+  GCond cond;
+  GQueue pending_requests;
+  gboolean is_running;
+
+  gatomicrefcount ref_count;
+};
+
+static const char n_threads_key[] = "n_threads";
+
+static GVariant *
+ggml_batch_decoder_build_inputs (int32_t                   page_size,
+                                 GGMLBatchDecoderRequest **requests,
+                                 size_t                    n_requests)
+{
+  GVariantBuilder builder;
+
+  g_variant_builder_init (&builder, G_VARIANT_TYPE (GGML_GPT_BATCH_INPUTS_TYPE));
+  g_variant_builder_add (&builder, "i", page_size);
+  g_variant_builder_open (&builder, G_VARIANT_TYPE ("a(iaiai)"));
+
+  for (size_t i = 0; i < n_requests; ++i)
+    {
+      g_variant_builder_add (&builder,
+                             "(i@ai@ai)",
+                             (int32_t) requests[i]->n_past,
+                             g_variant_new_fixed_array (G_VARIANT_TYPE_INT32,
+                                                        &requests[i]->token,
+                                                        1,
+                                                        sizeof (int32_t)),
+                             g_variant_new_fixed_array (G_VARIANT_TYPE_INT32,
+                                                        requests[i]->page_table,
+                                                        requests[i]->n_pages,
+                                                        sizeof (int32_t)));
+    }
+
+  g_variant_builder_close (&builder);
+
+  return g_variant_ref_sink (g_variant_builder_end (&builder));
+}
+
+/* The size of the execution memory is measured with max_sequences
+ * sequences that each attend over the whole context */
+static size_t
+ggml_batch_decoder_measure_execution_memory_size (GGMLModel            *model,
+                                                  GGMLHyperparameters  *hyperparameters,
+                                                  GGMLModelDescNode    *memory_desc_node,
+                                                  size_t                max_sequences,
+                                                  GError              **error)
+{
+  const int32_t n_ctx = ggml_hyperparameters_get_int32 (hyperparameters, "n_ctx");
+  g_autoptr(GGMLExecutionMemory) recorder_execution_memory = ggml_execution_memory_recorder_new (memory_desc_node);
+  g_autofree GGMLBatchDecoderRequest *dummy_requests = g_new0 (GGMLBatchDecoderRequest, max_sequences);
+  g_autofree GGMLBatchDecoderRequest **dummy_request_ptrs = g_new0 (GGMLBatchDecoderRequest *, max_sequences);
+  int32_t dummy_page_table[] = { 0 };
+
+  /* The recorder memory is not paged, so it is a single page */
+  for (size_t i = 0; i < max_sequences; ++i)
+    {
+      dummy_requests[i].n_past = n_ctx - 1;
+      dummy_requests[i].page_table = dummy_page_table;
+      dummy_requests[i].n_pages = G_N_ELEMENTS (dummy_page_table);
+      dummy_request_ptrs[i] = &dummy_requests[i];
+    }
+
+  g_autoptr(GVariant) dummy_inputs = ggml_batch_decoder_build_inputs (n_ctx, dummy_request_ptrs, max_sequences);
+  g_autoptr(GHashTable) forward_parameters = g_hash_table_new (g_str_hash, g_str_equal);
+  g_autoptr(GGMLTensor) output_tensor = NULL;
+  g_autoptr(GGMLComputeGraph) compute_graph = ggml_model_build_graph (model,
+                                                                      hyperparameters,
+                                                                      dummy_inputs,
+                                                                      forward_parameters,
+                                                                      recorder_execution_memory,
+                                                                      &output_tensor,
+                                                                      error);
+
+  if (compute_graph == NULL)
+    {
+      return 0;
+    }
+
+  return ggml_compute_graph_get_computation_size (compute_graph, output_tensor);
+}
+
+/**
+ * ggml_batch_decoder_new:
+ * @model: A #GGMLModel
+ * @hyperparameters: The #GGMLHyperparameters of @model
+ * @memory_desc_node: The description of the key-value memory of @model
+ * @page_pool: The #GGMLKeyValuePagePool that the sequences are in
+ * @max_sequences: The most sequences to run in one pass
+ * @error: A #GError
+ *
+ * Returns: (transfer full): A new #GGMLBatchDecoder or %NULL with @error set on failure.
+ */
+GGMLBatchDecoder *
+ggml_batch_decoder_new (GGMLModel             *model,
+                        GGMLHyperparameters   *hyperparameters,
+                        GGMLModelDescNode     *memory_desc_node,
+                        GGMLKeyValuePagePool  *page_pool,
+                        size_t                 max_sequences,
+                        GError               **error)
+{
+  g_return_val_if_fail (max_sequences > 0, NULL);
+
+  size_t execution_memory_size = ggml_batch_decoder_measure_execution_memory_size (model,
+                                                                                   hyperparameters,
+                                                                                   memory_desc_node,
+                                                                                   max_sequences,
+                                                                                   error);
+
+  if (execution_memory_size == 0)
+    {
+      return NULL;
+    }
+
+  GGMLBatchDecoder *batch_decoder = g_new0 (GGMLBatchDecoder, 1);
+  batch_decoder->model = ggml_model_ref (model);
+  batch_decoder->hyperparameters = ggml_hyperparameters_ref (hyperparameters);
+  batch_decoder->page_pool = ggml_key_value_page_pool_ref (page_pool);
+  batch_decoder->execution_memory = ggml_execution_memory_new_paged (execution_memory_size, page_pool);
+  batch_decoder->max_sequences = max_sequences;
+  g_mutex_init (&batch_decoder->mutex);
+  g_cond_init (&batch_decoder->cond);
+  g_queue_init (&batch_decoder->pending_requests);
+  g_atomic_ref_count_init (&batch_decoder->ref_count);
+
+  return batch_decoder;
+}
+
+/**
+ * ggml_batch_decoder_ref: (skip)
+ * @batch_decoder: A #GGMLBatchDecoder
+ *
+ * Returns: (transfer full): The @batch_decoder with its ref count increased.
+ */
+GGMLBatchDecoder *
+ggml_batch_decoder_ref (GGMLBatchDecoder *batch_decoder)
+{
+  g_atomic_ref_count_inc (&batch_decoder->ref_count);
+  return batch_decoder;
+}
+
+/**
+ * ggml_batch_decoder_unref: (skip)
+ * @batch_decoder: A #GGMLBatchDecoder
+ *
+ * Decreases the ref count on @batch_decoder, freeing it once it drops to zero.
+ * Nothing can be waiting on @batch_decoder at that point, since each
+ * waiting thread holds a reference through its cursor.
+ */
+void
+ggml_batch_decoder_unref (GGMLBatchDecoder *batch_decoder)
+{
+  if (g_atomic_ref_count_dec (&batch_decoder->ref_count))
+    {
+      g_assert (g_queue_is_empty (&batch_decoder->pending_requests));
+
+      g_clear_pointer (&batch_decoder->model, ggml_model_unref);
+      g_clear_pointer (&batch_decoder->hyperparameters, ggml_hyperparameters_unref);
+      g_clear_pointer (&batch_decoder->page_pool, ggml_key_value_page_pool_unref);
+      g_clear_pointer (&batch_decoder->execution_memory, ggml_execution_memory_unref);
+      g_mutex_clear (&batch_decoder->mutex);
+      g_cond_clear (&batch_decoder->cond);
+      g_clear_pointer (&batch_decoder, g_free);
+    }
+}
+
+/**
+ * ggml_batch_decoder_get_key_value_page_pool:
+ * @batch_decoder: A #GGMLBatchDecoder
+ *
+ * Returns: (transfer none): The #GGMLKeyValuePagePool that sequences
+ *          decoded with @batch_decoder must have their memory in.
+ */
+GGMLKeyValuePagePool *
+ggml_batch_decoder_get_key_value_page_pool (GGMLBatchDecoder *batch_decoder)
+{
+  return batch_decoder->page_pool;
+}
+
+/* Wakes up the waiting threads, so that a cancelled
+ * one can take its request back out of the queue */
+static void
+ggml_batch_decoder_on_cancelled (GCancellable *cancellable,
+                                 gpointer      user_data)
+{
+  GGMLBatchDecoder *batch_decoder = user_data;
+
+  g_mutex_lock (&batch_decoder->mutex);
+  g_cond_broadcast (&batch_decoder->cond);
+  g_mutex_unlock (&batch_decoder->mutex);
+}
+
+/* Called by the leader without the lock held. Only one pass
+ * runs at a time, so the execution memory is not shared. */
+static void
+ggml_batch_decoder_run (GGMLBatchDecoder         *batch_decoder,
+                        GGMLBatchDecoderRequest **requests,
+                        size_t                    n_requests,
+                        size_t                    n_threads)
+{
+  const int32_t n_vocab = ggml_hyperparameters_get_int32 (batch_decoder->hyperparameters, "n_vocab");
+  const int32_t page_size = ggml_key_value_page_pool_get_page_size (batch_decoder->page_pool);
+  g_autoptr(GVariant) inputs = ggml_batch_decoder_build_inputs (page_size, requests, n_requests);
+  g_autoptr(GHashTable) forward_parameters = g_hash_table_new (g_str_hash, g_str_equal);
+  g_autoptr(GError) error = NULL;
+
+  if (n_threads > 0)
+    {
+      g_hash_table_insert (forward_parameters, (gpointer) n_threads_key, GSIZE_TO_POINTER (n_threads));
+    }
+
+  /* Cancelling one cursor should not fail the others, so the
+   * pass itself is not cancellable */
+  g_autoptr(GGMLTensor) logits_tensor = ggml_model_forward (batch_decoder->model,
+                                                            batch_decoder->hyperparameters,
+                                                            inputs,
+                                                            forward_parameters,
+                                                            batch_decoder->execution_memory,
+                                                            NULL,
+                                                            &error);
+
+  if (logits_tensor == NULL)
+    {
+      for (size_t i = 0; i < n_requests; ++i)
+        {
+          requests[i]->error = g_error_copy (error);
+        }
+
+      return;
+    }
+
+  /* There is one row of logits for each sequence, in order */
+  float *logits_tensor_data = (float *) ggml_tensor_get_data (logits_tensor, NULL);
+
+  for (size_t i = 0; i < n_requests; ++i)
+    {
+      memcpy (requests[i]->out_logits, logits_tensor_data + i * n_vocab, n_vocab * sizeof (float));
+    }
+}
+
+/**
+ * ggml_batch_decoder_decode:
+ * @batch_decoder: A #GGMLBatchDecoder
+ * @sequence_memory: The paged #GGMLExecutionMemory of the sequence
+ * @n_past: The number of positions of the sequence already in @sequence_memory
+ * @token: The token to run through the model at position @n_past
+ * @n_threads: The number of threads to use if this call runs the pass, or 0
+ * @out_logits: (out caller-allocates): Space for n_vocab logits for the next token
+ * @cancellable: (nullable): A #GCancellable
+ * @error: A #GError
+ *
+ * Writes the keys and values for @token into the pages of @sequence_memory
+ * and computes the logits for the token after it, in the same forward pass
+ * as the other sequences that are being decoded at the same time. Blocks
+ * until the logits are ready, or until @cancellable is cancelled while the
+ * request is still waiting for a pass. Once a pass with the request has
+ * started, it is waited for, since the other sequences in it still need it.
+ *
+ * Returns: %TRUE on success, %FALSE with @error set on failure.
+ */
+gboolean
+ggml_batch_decoder_decode (GGMLBatchDecoder     *batch_decoder,
+                           GGMLExecutionMemory  *sequence_memory,
+                           size_t                n_past,
+                           int32_t               token,
+                           size_t                n_threads,
+                           float                *out_logits,
+                           GCancellable         *cancellable,
+                           GError              **error)
+{
+  g_return_val_if_fail (ggml_execution_memory_get_key_value_page_pool (sequence_memory) == batch_decoder->page_pool, FALSE);
+
+  /* Copying pages that are shared with other sequences is
+   * done here, so that the leader only has to run the pass */
+  if (!ggml_execution_memory_reserve_key_value_positions (sequence_memory, n_past, 1, error))
+    {
+      return FALSE;
+    }
+
+  size_t n_pages;
+  const int32_t *page_table = ggml_execution_memory_get_key_value_page_table (sequence_memory, &n_pages);
+  g_autofree int32_t *page_table_copy = g_memdup2 (page_table, n_pages * sizeof (int32_t));
+  GGMLBatchDecoderRequest request = {
+    .n_past = n_past,
+    .token = token,
+    .n_threads = n_threads,
+    .page_table = page_table_copy,
+    .n_pages = n_pages,
+    .out_logits = out_logits,
+    .error = NULL,
+    .done = FALSE
+  };
+
+  gboolean is_cancelled = FALSE;
+
+  /* Connect before taking the lock, since the handler runs
+   * straight away if @cancellable is already cancelled */
+  gulong cancelled_handler_id = (
+    cancellable != NULL ?
+    g_cancellable_connect (cancellable,
+                           G_CALLBACK (ggml_batch_decoder_on_cancelled),
+                           batch_decoder,
+                           NULL) :
+    0
+  );
+
+  g_mutex_lock (&batch_decoder->mutex);
+  g_queue_push_tail (&batch_decoder->pending_requests, &request);
+
+  while (!request.done)
+    {
+      /* The request can only be taken back while no leader has it */
+      if (g_cancellable_is_cancelled (cancellable) &&
+          g_queue_remove (&batch_decoder->pending_requests, &request))
+        {
+          is_cancelled = TRUE;
+          break;
+        }
+
+      if (batch_decoder->is_running)
+        {
+          g_cond_wait (&batch_decoder->cond, &batch_decoder->mutex);
+          continue;
+        }
+
+      /* Nobody is running a pass, so this thread runs the next one
+       * with the oldest requests. Its own request may not be among
+       * them, in which case it goes around again. */
+      size_t n_requests = MIN (batch_decoder->max_sequences,
+                               g_queue_get_length (&batch_decoder->pending_requests));
+      g_autofree GGMLBatchDecoderRequest **requests = g_new0 (GGMLBatchDecoderRequest *, n_requests);
+
+      for (size_t i = 0; i < n_requests; ++i)
+        {
+          requests[i] = g_queue_pop_head (&batch_decoder->pending_requests);
+        }
+
+      batch_decoder->is_running = TRUE;
+      g_mutex_unlock (&batch_decoder->mutex);
+
+      ggml_batch_decoder_run (batch_decoder, requests, n_requests, n_threads);
+
+      g_mutex_lock (&batch_decoder->mutex);
+
+      for (size_t i = 0; i < n_requests; ++i)
+        {
+          requests[i]->done = TRUE;
+        }
+
+      batch_decoder->is_running = FALSE;
+      g_cond_broadcast (&batch_decoder->cond);
+    }
+
+  g_mutex_unlock (&batch_decoder->mutex);
+  g_cancellable_disconnect (cancellable, cancelled_handler_id);
+
+  if (is_cancelled)
+    {
+      g_cancellable_set_error_if_cancelled (cancellable, error);
+      return FALSE;
+    }
+
+  if (request.error != NULL)
+    {
+      g_propagate_error (error, request.error);
+      return FALSE;
+    }
+
+  return TRUE;
+}
@@ -0,0 +1,57 @@
+/*
+ * ggml-gobject/internal/ggml-batch-decoder.h
+ *
+ * Header file for ggml-batch-decoder
+ *
+ * Copyright (C) 2023 Sam Spilsbury.
+ *
+ * ggml-gobject is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation; either version 2.1 of the License, or
+ * (at your option) any later version.
+ *
+ * ggml-gobject is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with ggml-gobject; if not, write to the Free Software Foundation,
+ * Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+#pragma once
+
+#include <glib-object.h>
+#include <ggml-gobject/ggml-execution-memory.h>
+#include <ggml-gobject/ggml-hyperparameters.h>
+#include <ggml-gobject/ggml-key-value-page-pool.h>
+#include <ggml-gobject/ggml-model-desc.h>
+#include <ggml-gobject/ggml-model.h>
+
+G_BEGIN_DECLS
+
+typedef struct _GGMLBatchDecoder GGMLBatchDecoder;
+
+GGMLBatchDecoder * ggml_batch_decoder_new (GGMLModel             *model,
+                                           GGMLHyperparameters   *hyperparameters,
+                                           GGMLModelDescNode     *memory_desc_node,
+                                           GGMLKeyValuePagePool  *page_pool,
+                                           size_t                 max_sequences,
+                                           GError               **error);
+GGMLBatchDecoder * ggml_batch_decoder_ref (GGMLBatchDecoder *batch_decoder);
+void ggml_batch_decoder_unref (GGMLBatchDecoder *batch_decoder);
+
+GGMLKeyValuePagePool * ggml_batch_decoder_get_key_value_page_pool (GGMLBatchDecoder *batch_decoder);
+gboolean ggml_batch_decoder_decode (GGMLBatchDecoder     *batch_decoder,
+                                    GGMLExecutionMemory  *sequence_memory,
+                                    size_t                n_past,
+                                    int32_t               token,
+                                    size_t                n_threads,
+                                    float                *out_logits,
+                                    GCancellable         *cancellable,
+                                    GError              **error);
+
+G_DEFINE_AUTOPTR_CLEANUP_FUNC (GGMLBatchDecoder, ggml_batch_decoder_unref)
+
+G_END_DECLS
@@ -31,7 +31,7 @@ G_BEGIN_DECLS
 
 struct _GGMLComputePlan {
   struct ggml_cplan cplan;
-  GGMLTensor *cplan_work_tensor;
+  GBytes *cplan_work_buffer;
   size_t ref_count;
 };
 
@@ -30,9 +30,13 @@ G_BEGIN_DECLS
 
 struct _GGMLContext {
   GBytes *mem_buffer;
+  GBytes *external_data;
   struct ggml_context *ctx;
   struct ggml_allocr *alloc;
   size_t ref_count;
 };
 
+GGMLContext *ggml_context_new_for_external_data (GBytes *external_data,
+                                                 size_t  n_tensors);
+
 G_END_DECLS
\ No newline at end of file
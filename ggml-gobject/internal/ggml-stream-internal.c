@@ -20,6 +20,7 @@
  * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
  */
 
+#include <gio/gfiledescriptorbased.h>
 #include <ggml-gobject/internal/ggml-stream-internal.h>
 
 gboolean
@@ -54,3 +55,50 @@ ggml_input_stream_read_exactly (GInputStream  *istream,
 
   return TRUE;
 }
+
+/**
+ * ggml_input_stream_try_map:
+ * @istream: A #GInputStream
+ * @out_offset: (out): The current read position of @istream within the mapping
+ *
+ * If @istream is backed by a local file, memory-map the whole file and
+ * return its contents, along with the position that @istream is currently
+ * at. The stream position is not changed. The mapping is read-only.
+ *
+ * Returns: (transfer full) (nullable): A #GBytes with the mapped file contents, or
+ *          %NULL if @istream cannot be mapped, in which case the caller should fall
+ *          back to reading from the stream.
+ */
+GBytes *
+ggml_input_stream_try_map (GInputStream *istream,
+                           size_t       *out_offset)
+{
+  if (!G_IS_FILE_DESCRIPTOR_BASED (istream) || !G_IS_SEEKABLE (istream))
+    {
+      return NULL;
+    }
+
+  int fd = g_file_descriptor_based_get_fd (G_FILE_DESCRIPTOR_BASED (istream));
+
+  if (fd < 0)
+    {
+      return NULL;
+    }
+
+  goffset offset = g_seekable_tell (G_SEEKABLE (istream));
+
+  if (offset < 0)
+    {
+      return NULL;
+    }
+
+  g_autoptr(GMappedFile) mapped_file = g_mapped_file_new_from_fd (fd, FALSE, NULL);
+
+  if (mapped_file == NULL || g_mapped_file_get_length (mapped_file) < (size_t) offset)
+    {
+      return NULL;
+    }
+
+  *out_offset = offset;
+  return g_mapped_file_get_bytes (mapped_file);
+}
@@ -31,4 +31,7 @@ gboolean ggml_input_stream_read_exactly (GInputStream  *istream,
                                          GCancellable  *cancellable,
                                          GError       **error);
 
+GBytes * ggml_input_stream_try_map (GInputStream *istream,
+                                    size_t       *out_offset);
+
 G_END_DECLS
\ No newline at end of file
@@ -54,4 +54,13 @@ ggml_tensor_new_3d (GGMLContext *context, GGMLDataType data_type, size_t width,
 GGMLTensor * ggml_tensor_new_scalar_f32 (GGMLContext *context,
                                          float        value);
 
+size_t ggml_tensor_internal_offset_bytes (struct ggml_tensor *tensor,
+                                          size_t              offset);
+
+void ggml_tensor_set_view_offset (GGMLTensor *tensor,
+                                  size_t      offset);
+void ggml_tensor_set_op_param_int32 (GGMLTensor *tensor,
+                                     size_t      index,
+                                     int32_t     value);
+
 G_END_DECLS
\ No newline at end of file
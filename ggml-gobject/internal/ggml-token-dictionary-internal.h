@@ -0,0 +1,41 @@
+/*
+ * ggml-gobject/internal/ggml-token-dictionary-internal.h
+ *
+ * Library code for ggml-token-dictionary-internal
+ *
+ * Copyright (C) 2023 Sam Spilsbury.
+ *
+ * ggml-gobject is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation; either version 2.1 of the License, or
+ * (at your option) any later version.
+ *
+ * ggml-gobject is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License along
+ * with ggml-gobject; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+#pragma once
+
+#include <glib-object.h>
+#include <ggml-gobject/ggml-token-dictionary.h>
+
+G_BEGIN_DECLS
+
+gboolean ggml_token_dictionary_lookup_word_cache (GGMLTokenDictionary *token_dictionary,
+                                                  const char          *word,
+                                                  size_t               length,
+                                                  int32_t             *out_tokens,
+                                                  size_t              *out_n_tokens);
+void ggml_token_dictionary_insert_word_cache (GGMLTokenDictionary *token_dictionary,
+                                              const char          *word,
+                                              size_t               length,
+                                              const int32_t       *tokens,
+                                              size_t               n_tokens);
+
+G_END_DECLS
@@ -214,7 +214,9 @@ G_DEFINE_AUTOPTR_CLEANUP_FUNC (GGMLServiceConnection, ggml_service_connection_un
 
 static const char *language_model_keys[] = {
   "n_params",
-  "quantization"
+  "quantization",
+  "key_value_cache_capacity",
+  "batch_decoding_max_sequences"
 };
 
 static GVariant *
@@ -503,6 +505,9 @@ ggml_service_ref_model_async (GGMLServiceState      *service,
   /* We have to load the model first */
   g_autofree char *model_num_params = NULL;
   g_autofree char *model_quantization = NULL;
+  uint32_t key_value_cache_capacity = 0;
+  uint32_t batch_decoding_max_sequences = 0;
+  g_autofree char *invalid_property = NULL;
 
   GVariantIter iter;
   char *key;
@@ -520,6 +525,36 @@ ggml_service_ref_model_async (GGMLServiceState      *service,
         {
           model_quantization = g_variant_dup_string (value, NULL);
         }
+
+      if ((g_strcmp0 (key, "key_value_cache_capacity") == 0 ||
+           g_strcmp0 (key, "batch_decoding_max_sequences") == 0) &&
+          !g_variant_is_of_type (value, G_VARIANT_TYPE_UINT32))
+        {
+          g_clear_pointer (&invalid_property, g_free);
+          invalid_property = g_strdup (key);
+          continue;
+        }
+
+      if (g_strcmp0 (key, "key_value_cache_capacity") == 0)
+        {
+          key_value_cache_capacity = g_variant_get_uint32 (value);
+        }
+
+      if (g_strcmp0 (key, "batch_decoding_max_sequences") == 0)
+        {
+          batch_decoding_max_sequences = g_variant_get_uint32 (value);
+        }
+    }
+
+  if (invalid_property != NULL)
+    {
+      g_set_error (&error,
+                   G_IO_ERROR,
+                   G_IO_ERROR_INVALID_ARGUMENT,
+                   "Model property %s must be an unsigned 32-bit integer",
+                   invalid_property);
+      (*callback) (NULL, error, user_data);
+      return;
     }
 
   GGMLDefinedLanguageModel defined_model;
@@ -544,6 +579,10 @@ ggml_service_ref_model_async (GGMLServiceState      *service,
                                              ggml_gpt_model_quantization_regexes (),
                                              NULL);
 
+  /* Batch decoding needs the cursors to share a key-value cache */
+  ggml_model_config_set_key_value_cache_capacity (config, key_value_cache_capacity);
+  ggml_model_config_set_batch_decoding_max_sequences (config, batch_decoding_max_sequences);
+
   g_autoptr(GGMLCachedModelIstream) istream = ggml_language_model_stream_from_cache (defined_model, &error);
 
   if (istream == NULL)
@@ -668,7 +707,7 @@ G_DEFINE_AUTOPTR_CLEANUP_FUNC (GGMLSessionCompletion, ggml_session_completion_un
 typedef struct {
   GGMLLanguageModelCompletion *completion_skeleton;
   GDBusMethodInvocation       *invocation;
-  GPtrArray                   *stream_chunks;
+  GString                     *completion_text;
   GGMLSessionCompletion       *completion;
 } HandleCompletionExecClosure;
 
@@ -682,7 +721,7 @@ handle_completion_exec_closure_new (GGMLLanguageModelCompletion *completion_skel
 
   closure->completion_skeleton = g_object_ref (completion_skeleton);
   closure->invocation = g_object_ref (invocation);
-  closure->stream_chunks = g_ptr_array_new_full (num_tokens, g_free);
+  closure->completion_text = g_string_new (NULL);
   closure->completion = ggml_session_completion_ref (completion);
 
   return closure;
@@ -693,7 +732,10 @@ handle_completion_exec_closure_free (HandleCompletionExecClosure *closure)
 {
   g_clear_object (&closure->completion_skeleton);
   g_clear_object (&closure->invocation);
-  g_clear_pointer (&closure->stream_chunks, g_ptr_array_unref);
+  if (closure->completion_text != NULL)
+    {
+      g_string_free (g_steal_pointer (&closure->completion_text), TRUE);
+    }
   g_clear_pointer (&closure->completion, ggml_session_completion_unref);
   g_clear_pointer (&closure, g_free);
 }
@@ -711,8 +753,8 @@ on_new_tokens_for_cursor (const char *decoded,
   ggml_language_model_completion_emit_new_chunk (closure->completion_skeleton,
                                                  decoded);
 
-  /* We also store the chunk in our closure */
-  g_ptr_array_add (closure->stream_chunks, g_strdup (decoded));
+  /* We also collect the chunks in our closure for the Exec reply */
+  g_string_append (closure->completion_text, decoded);
 }
 
 void
@@ -735,9 +777,7 @@ on_done_exec_stream_for_cursor (GObject      *source_object,
 
   g_message ("Done with streaming");
 
-  g_ptr_array_add (closure->stream_chunks, NULL);
-
-  g_autofree char *completion = g_strjoinv ("", (char **) closure->stream_chunks->pdata);
+  g_autofree char *completion = g_string_free (g_steal_pointer (&closure->completion_text), FALSE);
 
   ggml_language_model_completion_complete_exec (closure->completion_skeleton,
                                                 closure->invocation,
@@ -18,13 +18,22 @@
  * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
  */
 
+#include <algorithm>
+#include <cinttypes>
+#include <cmath>
+#include <cstdlib>
+#include <cstring>
 #include <vector>
 #include <tuple>
 #include <memory>
+#include <thread>
+#include <string>
 
 #include "gtest/gtest.h"
 #include "gmock/gmock.h"
 
+#include <glib/gstdio.h>
+#include <ggml-gobject/ggml-argmax-language-model-sampler.h>
 #include <ggml-gobject/ggml-gobject.h>
 
 TEST(Tokenize, simple_string)
@@ -51,6 +60,230 @@ TEST(Tokenize, simple_string)
   EXPECT_EQ (tokens_vector, expected_tokens);
 }
 
+TEST(Tokenize, word_cache_hits)
+{
+  const char *dictionary_strings[] = {
+    "ab",
+    "bc",
+    "abbcd",
+    " ab",
+    NULL
+  };
+  g_autoptr(GGMLTokenDictionary) token_dictionary = ggml_token_dictionary_new (dictionary_strings);
+  g_autofree int32_t *tokens_array = NULL;
+  g_autofree int32_t *cached_tokens_array = NULL;
+  g_autofree int32_t *uncached_tokens_array = NULL;
+  size_t tokens_array_len;
+  size_t cached_tokens_array_len;
+  size_t uncached_tokens_array_len;
+
+  /* The cache is off unless asked for */
+  EXPECT_EQ (ggml_token_dictionary_get_word_cache_max_entries (token_dictionary), 0);
+  EXPECT_TRUE (ggml_gpt_tokenize (token_dictionary,
+                                  "abbcdabbc ab de bc",
+                                  &uncached_tokens_array,
+                                  &uncached_tokens_array_len,
+                                  nullptr));
+  EXPECT_EQ (ggml_token_dictionary_get_word_cache_n_entries (token_dictionary), 0);
+  EXPECT_EQ (ggml_token_dictionary_get_word_cache_n_misses (token_dictionary), 0);
+
+  ggml_token_dictionary_set_word_cache_max_entries (token_dictionary, 1024);
+
+  EXPECT_TRUE (ggml_gpt_tokenize (token_dictionary,
+                                  "abbcdabbc ab de bc",
+                                  &tokens_array,
+                                  &tokens_array_len,
+                                  nullptr));
+  EXPECT_EQ (ggml_token_dictionary_get_word_cache_n_hits (token_dictionary), 0);
+  EXPECT_EQ (ggml_token_dictionary_get_word_cache_n_misses (token_dictionary), 4);
+  EXPECT_EQ (ggml_token_dictionary_get_word_cache_n_entries (token_dictionary), 4);
+
+  /* All the words are cache hits the second time around */
+  EXPECT_TRUE (ggml_gpt_tokenize (token_dictionary,
+                                  "abbcdabbc ab de bc",
+                                  &cached_tokens_array,
+                                  &cached_tokens_array_len,
+                                  nullptr));
+  EXPECT_EQ (ggml_token_dictionary_get_word_cache_n_hits (token_dictionary), 4);
+  EXPECT_EQ (ggml_token_dictionary_get_word_cache_n_misses (token_dictionary), 4);
+
+  std::vector<int32_t> tokens_vector (tokens_array, tokens_array + tokens_array_len);
+  std::vector<int32_t> cached_tokens_vector (cached_tokens_array, cached_tokens_array + cached_tokens_array_len);
+  std::vector<int32_t> uncached_tokens_vector (uncached_tokens_array, uncached_tokens_array + uncached_tokens_array_len);
+  EXPECT_EQ (cached_tokens_vector, tokens_vector);
+  EXPECT_EQ (uncached_tokens_vector, tokens_vector);
+
+  ggml_token_dictionary_set_word_cache_max_entries (token_dictionary, 0);
+  EXPECT_EQ (ggml_token_dictionary_get_word_cache_n_entries (token_dictionary), 0);
+}
+
+TEST(Tokenize, batch_matches_single)
+{
+  const char *dictionary_strings[] = {
+    "ab",
+    "bc",
+    "abbcd",
+    " ab",
+    NULL
+  };
+  g_autoptr(GGMLTokenDictionary) token_dictionary = ggml_token_dictionary_new (dictionary_strings);
+  std::vector<std::string> strings_storage;
+  std::vector<const char *> strings;
+  g_autofree int32_t *batch_tokens = NULL;
+  g_autofree size_t *batch_offsets = NULL;
+  size_t batch_n_tokens;
+
+  for (size_t i = 0; i < 1000; ++i)
+    {
+      std::string string;
+
+      for (size_t j = 0; j < i % 13; ++j)
+        {
+          string += (j % 3 == 0) ? "abbcd bc" : " ab de";
+        }
+
+      strings_storage.push_back (string);
+    }
+
+  for (auto const &string : strings_storage)
+    {
+      strings.push_back (string.c_str ());
+    }
+
+  EXPECT_TRUE (ggml_gpt_tokenize_batch (token_dictionary,
+                                        strings.data (),
+                                        strings.size (),
+                                        4,
+                                        &batch_tokens,
+                                        &batch_offsets,
+                                        &batch_n_tokens,
+                                        nullptr));
+  EXPECT_EQ (batch_offsets[0], 0);
+  EXPECT_EQ (batch_offsets[strings.size ()], batch_n_tokens);
+
+  for (size_t i = 0; i < strings.size (); ++i)
+    {
+      g_autofree int32_t *tokens_array = NULL;
+      size_t tokens_array_len;
+
+      EXPECT_TRUE (ggml_gpt_tokenize (token_dictionary,
+                                      strings[i],
+                                      &tokens_array,
+                                      &tokens_array_len,
+                                      nullptr));
+
+      std::vector<int32_t> tokens_vector (tokens_array, tokens_array + tokens_array_len);
+      std::vector<int32_t> batch_tokens_vector (batch_tokens + batch_offsets[i], batch_tokens + batch_offsets[i + 1]);
+      EXPECT_EQ (batch_tokens_vector, tokens_vector);
+    }
+}
+
+TEST(Tokenize, pre_tokenize_matches_regex)
+{
+  const char *text = "Hello world, it's 2023!  I'm   here\n\nwe'll see's 'tis \t x\xc3\xa9t\xc3\xa9 \xe2\x80\x83na\xc3\xafve  ";
+  size_t length = strlen (text);
+  g_autoptr(GRegex) regex = g_regex_new ("('s|'t|'re|'ve|'m|'ll|'d| ?[[:alpha:]]+| ?[[:digit:]]+| ?[^\\s[:alpha:][:digit:]]+|\\s+(?!\\S)|\\s+)",
+                                         (GRegexCompileFlags) 0,
+                                         (GRegexMatchFlags) 0,
+                                         nullptr);
+  g_autoptr(GMatchInfo) match_info = NULL;
+  std::vector<std::tuple<size_t, size_t>> expected_spans;
+  std::vector<std::tuple<size_t, size_t>> spans;
+
+  g_regex_match (regex, text, (GRegexMatchFlags) 0, &match_info);
+
+  while (g_match_info_matches (match_info))
+    {
+      int start, end;
+
+      g_match_info_fetch_pos (match_info, 0, &start, &end);
+      expected_spans.push_back (std::make_tuple (start, end - start));
+      g_match_info_next (match_info, NULL);
+    }
+
+  for (size_t offset = 0, word_len = 0; offset < length; offset += word_len)
+    {
+      word_len = ggml_gpt_pre_tokenize_next_word (text, length, offset);
+      spans.push_back (std::make_tuple (offset, word_len));
+    }
+
+  EXPECT_EQ (spans, expected_spans);
+}
+
+TEST(Tokenize, longest_prefix_match)
+{
+  const char *dictionary_strings[] = {
+    "a",
+    "abc",
+    "\xc3\xa9",
+    "abcd",
+    "a",
+    NULL
+  };
+  g_autoptr(GGMLTokenDictionary) token_dictionary = ggml_token_dictionary_new (dictionary_strings);
+  int32_t token;
+  size_t length;
+
+  /* The match is limited to the given length */
+  EXPECT_TRUE (ggml_token_dictionary_lookup_longest_prefix (token_dictionary, "abcde", 5, &token, &length));
+  EXPECT_EQ (token, 3);
+  EXPECT_EQ (length, 4);
+
+  EXPECT_TRUE (ggml_token_dictionary_lookup_longest_prefix (token_dictionary, "abcde", 3, &token, &length));
+  EXPECT_EQ (token, 1);
+  EXPECT_EQ (length, 3);
+
+  /* Falls back to a shorter word and duplicate words take the last token */
+  EXPECT_TRUE (ggml_token_dictionary_lookup_longest_prefix (token_dictionary, "abx", 3, &token, &length));
+  EXPECT_EQ (token, 4);
+  EXPECT_EQ (length, 1);
+
+  EXPECT_TRUE (ggml_token_dictionary_lookup_longest_prefix (token_dictionary, "\xc3\xa9t\xc3\xa9", 5, &token, &length));
+  EXPECT_EQ (token, 2);
+  EXPECT_EQ (length, 2);
+
+  EXPECT_FALSE (ggml_token_dictionary_lookup_longest_prefix (token_dictionary, "bcd", 3, &token, &length));
+  EXPECT_FALSE (ggml_token_dictionary_lookup_longest_prefix (token_dictionary, "abc", 0, &token, &length));
+}
+
+TEST(Detokenize, holds_back_incomplete_utf8)
+{
+  const char *dictionary_strings[] = {
+    "h",
+    "\xc3",
+    "\xa9",
+    "\xe2\x82",
+    "\xac",
+    NULL
+  };
+  g_autoptr(GGMLTokenDictionary) token_dictionary = ggml_token_dictionary_new (dictionary_strings);
+  g_autoptr(GGMLDetokenizer) detokenizer = ggml_detokenizer_new (token_dictionary);
+  const int32_t tokens[] = { 0, 1, 2, 3 };
+
+  ggml_detokenizer_push_token (detokenizer, 0);
+  ggml_detokenizer_push_token (detokenizer, 1);
+
+  /* The first half of "é" is held back */
+  g_autofree char *first = ggml_detokenizer_take (detokenizer);
+  EXPECT_STREQ (first, "h");
+  EXPECT_EQ (ggml_detokenizer_get_n_pending_bytes (detokenizer), 1);
+
+  ggml_detokenizer_push_token (detokenizer, 2);
+  g_autofree char *second = ggml_detokenizer_take (detokenizer);
+  EXPECT_STREQ (second, "\xc3\xa9");
+  EXPECT_EQ (ggml_detokenizer_get_n_pending_bytes (detokenizer), 0);
+
+  /* The end of "€" is still missing */
+  ggml_detokenizer_push_tokens (detokenizer, tokens, G_N_ELEMENTS (tokens));
+  g_autofree char *third = ggml_detokenizer_take (detokenizer);
+  EXPECT_STREQ (third, "h\xc3\xa9");
+  EXPECT_EQ (ggml_detokenizer_get_n_pending_bytes (detokenizer), 2);
+
+  ggml_detokenizer_push_token (detokenizer, 4);
+  g_autofree char *fourth = ggml_detokenizer_take (detokenizer);
+  EXPECT_STREQ (fourth, "\xe2\x82\xac");
+}
+
 TEST(ModelDesc, create_gpt2_model_desc)
 {
   int32_t n_inp = 1024;
@@ -65,7 +298,2507 @@ TEST(ModelDesc, create_gpt2_model_desc)
                                                                         n_ctx);
 }
 
-TEST(LanguageModel, load_defined_gpt2_weights)
+TEST(Model, index_layer_weights)
+{
+  g_autoptr(GError) error = nullptr;
+  g_autoptr(GGMLModelDescNode) model_desc = ggml_create_gpt2_model_desc (8, 4, 16, 2, 4);
+  g_autoptr(GHashTable) flattened_desc = ggml_model_desc_node_flatten (model_desc);
+  g_autoptr(GGMLContext) context = ggml_context_new (1024 * 1024);
+  g_autoptr(GGMLModel) model = ggml_model_new_from_flattened_desc (context,
+                                                                   flattened_desc,
+                                                                   nullptr,
+                                                                   nullptr,
+                                                                   nullptr);
+  const char *slot_names[] = { "ln_1/g", "mlp/c_proj/w" };
+
+  ASSERT_TRUE (ggml_model_index_layer_weights (model, "model/h", 2, slot_names, 2, &error));
+  ASSERT_EQ (error, nullptr);
+
+  EXPECT_EQ (ggml_model_get_layer_weight (model, 0, 0), ggml_model_get (model, "model/h0/ln_1/g"));
+  EXPECT_EQ (ggml_model_get_layer_weight (model, 1, 1), ggml_model_get (model, "model/h1/mlp/c_proj/w"));
+
+  /* Indexing again with the same prefix and slots is fine, a different
+   * shape, prefix or slot is not */
+  const char *other_slot_names[] = { "ln_1/g", "mlp/c_fc/w" };
+
+  EXPECT_TRUE (ggml_model_index_layer_weights (model, "model/h", 2, slot_names, 2, nullptr));
+  EXPECT_FALSE (ggml_model_index_layer_weights (model, "model/h", 3, slot_names, 2, nullptr));
+  EXPECT_FALSE (ggml_model_index_layer_weights (model, "model/g", 2, slot_names, 2, nullptr));
+  EXPECT_FALSE (ggml_model_index_layer_weights (model, "model/h", 2, other_slot_names, 2, nullptr));
+}
+
+/* A model of @n_weights weights named w0, w1, ..., each with
+ * @n_rows rows of @n_cols elements of type @data_type */
+static GGMLModelDescNode *
+create_weights_desc (size_t n_weights, int64_t n_cols, int64_t n_rows, GGMLDataType data_type)
+{
+  int64_t weight_size[] = { n_cols, n_rows };
+  g_autoptr(GHashTable) weights = g_hash_table_new_full (g_str_hash,
+                                                         g_str_equal,
+                                                         g_free,
+                                                         (GDestroyNotify) ggml_model_desc_node_unref);
+
+  for (size_t i = 0; i < n_weights; ++i)
+    {
+      g_hash_table_insert (weights,
+                           g_strdup_printf ("w%zu", i),
+                           ggml_model_desc_node_new_leaf (weight_size, 2, data_type));
+    }
+
+  return ggml_model_desc_node_new (NULL, weights);
+}
+
+/* Appends a F32 weight to @buffer the way that it is laid out in a model file */
+static void
+append_f32_weight (std::string &buffer, const char *name, int32_t n_cols, int32_t n_rows, const std::vector<float> &data)
+{
+  const int32_t header[] = { 2, (int32_t) strlen (name), GGML_DATA_TYPE_F32, n_cols, n_rows };
+
+  buffer.append ((const char *) header, sizeof (header));
+  buffer.append (name);
+  buffer.append ((const char *) data.data (), data.size () * sizeof (float));
+}
+
+TEST(Model, convert_weights_on_worker_pool)
+{
+  const size_t n_weights = 16;
+  const int32_t n_cols = 64;
+  const int32_t n_rows = 16;
+  const GGMLDataType data_types[] = { GGML_DATA_TYPE_Q8_0, GGML_DATA_TYPE_F16 };
+  std::vector<std::string> weight_buffers;
+  std::string all_weights_buffer;
+
+  for (size_t i = 0; i < n_weights; ++i)
+    {
+      g_autofree char *name = g_strdup_printf ("w%zu", i);
+      std::vector<float> data (n_cols * n_rows);
+      std::string weight_buffer;
+
+      for (size_t j = 0; j < data.size (); ++j)
+        {
+          data[j] = sinf (j * 0.37f + i);
+        }
+
+      /* The single weight is always called w0 in its own model */
+      append_f32_weight (all_weights_buffer, name, n_cols, n_rows, data);
+      append_f32_weight (weight_buffer, "w0", n_cols, n_rows, data);
+      weight_buffers.push_back (weight_buffer);
+    }
+
+  for (GGMLDataType data_type : data_types)
+    {
+      g_autoptr(GError) error = nullptr;
+
+      /* All the weights are converted at the same time on the worker pool */
+      g_autoptr(GGMLModelDescNode) all_weights_desc = create_weights_desc (n_weights, n_cols, n_rows, data_type);
+      g_autoptr(GInputStream) all_weights_istream = g_memory_input_stream_new_from_data (all_weights_buffer.data (),
+                                                                                          all_weights_buffer.size (),
+                                                                                          nullptr);
+      g_autoptr(GGMLModel) model = ggml_model_load_from_istream (all_weights_istream,
+                                                                 all_weights_desc,
+                                                                 nullptr,
+                                                                 nullptr,
+                                                                 nullptr,
+                                                                 nullptr,
+                                                                 nullptr,
+                                                                 nullptr,
+                                                                 &error);
+
+      ASSERT_NE (model, nullptr);
+      ASSERT_EQ (error, nullptr);
+
+      /* Loading the weights one at a time converts them one after the
+       * other, which must give exactly the same bytes */
+      for (size_t i = 0; i < n_weights; ++i)
+        {
+          g_autofree char *name = g_strdup_printf ("w%zu", i);
+          g_autoptr(GGMLModelDescNode) weight_desc = create_weights_desc (1, n_cols, n_rows, data_type);
+          g_autoptr(GInputStream) weight_istream = g_memory_input_stream_new_from_data (weight_buffers[i].data (),
+                                                                                        weight_buffers[i].size (),
+                                                                                        nullptr);
+          g_autoptr(GGMLModel) weight_model = ggml_model_load_from_istream (weight_istream,
+                                                                            weight_desc,
+                                                                            nullptr,
+                                                                            nullptr,
+                                                                            nullptr,
+                                                                            nullptr,
+                                                                            nullptr,
+                                                                            nullptr,
+                                                                            &error);
+
+          ASSERT_NE (weight_model, nullptr);
+          ASSERT_EQ (error, nullptr);
+
+          GGMLTensor *tensor = ggml_model_get (model, name);
+          GGMLTensor *weight_tensor = ggml_model_get (weight_model, "w0");
+          size_t n_bytes, weight_n_bytes;
+          const char *data = ggml_tensor_get_data (tensor, &n_bytes);
+          const char *weight_data = ggml_tensor_get_data (weight_tensor, &weight_n_bytes);
+
+          ASSERT_EQ (ggml_tensor_get_data_type (tensor), data_type);
+          ASSERT_EQ (n_bytes, weight_n_bytes);
+          EXPECT_EQ (memcmp (data, weight_data, n_bytes), 0) << "for weight " << name;
+        }
+    }
+}
+
+TEST(ModelConfig, set_quantization_config_replaces_previous)
+{
+  g_autoptr(GGMLModelConfig) config = ggml_model_config_new ();
+  const char *first_regexes[] = { "model/h.*", nullptr };
+  const char *second_regexes[] = { "model/lm_head", nullptr };
+  const char *second_skip_regexes[] = { "model/wte", nullptr };
+  GGMLDataType quantization_type;
+  const char **quantization_regexes;
+  const char **skip_quantization_regexes;
+
+  ggml_model_config_set_quantization_config (config, GGML_DATA_TYPE_F16, first_regexes, first_regexes);
+  ggml_model_config_set_quantization_config (config, GGML_DATA_TYPE_Q8_0, second_regexes, second_skip_regexes);
+
+  ASSERT_TRUE (ggml_model_config_get_quantization_config (config,
+                                                          &quantization_type,
+                                                          &quantization_regexes,
+                                                          &skip_quantization_regexes));
+  EXPECT_EQ (quantization_type, GGML_DATA_TYPE_Q8_0);
+  EXPECT_TRUE (g_strv_equal (quantization_regexes, second_regexes));
+  EXPECT_TRUE (g_strv_equal (skip_quantization_regexes, second_skip_regexes));
+}
+
+/* Whether @ptr lies inside a mapping of the file at @path,
+ * according to /proc/self/maps */
+static bool
+is_in_file_mapping (const void *ptr, const char *path)
+{
+  g_autofree char *real_path = realpath (path, nullptr);
+  g_autofree char *maps = nullptr;
+
+  if (real_path == nullptr || !g_file_get_contents ("/proc/self/maps", &maps, nullptr, nullptr))
+    {
+      return false;
+    }
+
+  g_auto(GStrv) lines = g_strsplit (maps, "\n", -1);
+
+  for (char **lines_it = lines; *lines_it != nullptr; ++lines_it)
+    {
+      uintptr_t start, end;
+      int path_offset = -1;
+
+      if (sscanf (*lines_it, "%" SCNxPTR "-%" SCNxPTR " %*s %*s %*s %*s %n", &start, &end, &path_offset) < 2 ||
+          path_offset < 0)
+        {
+          continue;
+        }
+
+      if (strcmp (*lines_it + path_offset, real_path) == 0 &&
+          start <= (uintptr_t) ptr && (uintptr_t) ptr < end)
+        {
+          return true;
+        }
+    }
+
+  return false;
+}
+
+/* A model file of @n_weights F32 weights named w0, w1, ... The headers
+ * are 22 bytes long, so none of the weights after the first one are even
+ * 4-byte aligned in the file */
+static std::string
+create_packed_weights_buffer (size_t n_weights, int32_t n_cols, int32_t n_rows)
+{
+  std::string weights_buffer;
+
+  for (size_t i = 0; i < n_weights; ++i)
+    {
+      g_autofree char *name = g_strdup_printf ("w%zu", i);
+      std::vector<float> data (n_cols * n_rows);
+
+      for (size_t j = 0; j < data.size (); ++j)
+        {
+          data[j] = cosf (j * 0.11f + i);
+        }
+
+      append_f32_weight (weights_buffer, name, n_cols, n_rows, data);
+    }
+
+  return weights_buffer;
+}
+
+/* Writes @contents to a new temporary file, returning its path */
+static char *
+write_temporary_file (const char *tmpl, const std::string &contents, GError **error)
+{
+  g_autofree char *path = nullptr;
+  int fd = g_file_open_tmp (tmpl, &path, error);
+
+  if (fd == -1)
+    {
+      return nullptr;
+    }
+
+  g_close (fd, nullptr);
+
+  if (!g_file_set_contents (path, contents.data (), contents.size (), error))
+    {
+      g_unlink (path);
+      return nullptr;
+    }
+
+  return g_steal_pointer (&path);
+}
+
+TEST(Model, load_mapped_weights_aliases_file)
+{
+  if (!g_file_test ("/proc/self/maps", G_FILE_TEST_EXISTS))
+    {
+      GTEST_SKIP () << "Mappings of the process are not available";
+    }
+
+  const size_t n_weights = 4;
+  const int32_t n_cols = 64;
+  const int32_t n_rows = 4;
+  g_autoptr(GError) error = nullptr;
+  std::string weights_buffer (create_packed_weights_buffer (n_weights, n_cols, n_rows));
+  g_autofree char *path = write_temporary_file ("ggml-gobject-mapped-XXXXXX.bin", weights_buffer, &error);
+
+  ASSERT_NE (path, nullptr);
+
+  g_autoptr(GFile) file = g_file_new_for_path (path);
+  const GGMLDataType data_types[] = { GGML_DATA_TYPE_F32, GGML_DATA_TYPE_Q8_0 };
+
+  for (GGMLDataType data_type : data_types)
+    {
+      g_autoptr(GGMLModelDescNode) desc = create_weights_desc (n_weights, n_cols, n_rows, data_type);
+      g_autoptr(GFileInputStream) file_istream = g_file_read (file, nullptr, &error);
+
+      ASSERT_NE (file_istream, nullptr);
+
+      g_autoptr(GGMLModel) mapped_model = ggml_model_load_from_istream (G_INPUT_STREAM (file_istream),
+                                                                        desc,
+                                                                        nullptr,
+                                                                        nullptr,
+                                                                        nullptr,
+                                                                        nullptr,
+                                                                        nullptr,
+                                                                        nullptr,
+                                                                        &error);
+
+      ASSERT_NE (mapped_model, nullptr);
+      ASSERT_EQ (error, nullptr);
+
+      g_autoptr(GInputStream) memory_istream = g_memory_input_stream_new_from_data (weights_buffer.data (),
+                                                                                    weights_buffer.size (),
+                                                                                    nullptr);
+      g_autoptr(GGMLModel) stream_model = ggml_model_load_from_istream (memory_istream,
+                                                                        desc,
+                                                                        nullptr,
+                                                                        nullptr,
+                                                                        nullptr,
+                                                                        nullptr,
+                                                                        nullptr,
+                                                                        nullptr,
+                                                                        &error);
+
+      ASSERT_NE (stream_model, nullptr);
+      ASSERT_EQ (error, nullptr);
+
+      for (size_t i = 0; i < n_weights; ++i)
+        {
+          g_autofree char *name = g_strdup_printf ("w%zu", i);
+          size_t mapped_n_bytes, stream_n_bytes;
+          const char *mapped_data = ggml_tensor_get_data (ggml_model_get (mapped_model, name), &mapped_n_bytes);
+          const char *stream_data = ggml_tensor_get_data (ggml_model_get (stream_model, name), &stream_n_bytes);
+
+          /* F32 weights point into the file whatever their alignment,
+           * converted weights get their own memory */
+          EXPECT_EQ (is_in_file_mapping (mapped_data, path), data_type == GGML_DATA_TYPE_F32) << "for weight " << name;
+          ASSERT_EQ (mapped_n_bytes, stream_n_bytes);
+          EXPECT_EQ (memcmp (mapped_data, stream_data, mapped_n_bytes), 0) << "for weight " << name;
+        }
+    }
+
+  g_unlink (path);
+}
+
+TEST(Model, load_weights_cache_aliases_file)
+{
+  if (!g_file_test ("/proc/self/maps", G_FILE_TEST_EXISTS))
+    {
+      GTEST_SKIP () << "Mappings of the process are not available";
+    }
+
+  const size_t n_weights = 4;
+  const int32_t n_cols = 64;
+  const int32_t n_rows = 4;
+  g_autoptr(GError) error = nullptr;
+  std::string weights_buffer (create_packed_weights_buffer (n_weights, n_cols, n_rows));
+  g_autofree char *cache_path = write_temporary_file ("ggml-gobject-weights-cache-XXXXXX.bin", "", &error);
+
+  ASSERT_NE (cache_path, nullptr);
+  g_unlink (cache_path);
+
+  g_autoptr(GFile) cache_file = g_file_new_for_path (cache_path);
+  g_autoptr(GGMLModelDescNode) desc = create_weights_desc (n_weights, n_cols, n_rows, GGML_DATA_TYPE_Q8_0);
+  g_autoptr(GInputStream) first_istream = g_memory_input_stream_new_from_data (weights_buffer.data (),
+                                                                               weights_buffer.size (),
+                                                                               nullptr);
+
+  /* The first load quantizes the weights and writes the cache */
+  g_autoptr(GGMLModel) first_model = ggml_model_load_from_istream_with_weights_cache (first_istream,
+                                                                                      cache_file,
+                                                                                      desc,
+                                                                                      nullptr,
+                                                                                      nullptr,
+                                                                                      nullptr,
+                                                                                      nullptr,
+                                                                                      nullptr,
+                                                                                      nullptr,
+                                                                                      &error);
+
+  ASSERT_NE (first_model, nullptr);
+  ASSERT_EQ (error, nullptr);
+  ASSERT_TRUE (g_file_test (cache_path, G_FILE_TEST_EXISTS));
+
+  /* The second load gets the quantized weights from the cache, where
+   * they are aligned, so all of them point into the mapping */
+  g_autoptr(GInputStream) second_istream = g_memory_input_stream_new_from_data (weights_buffer.data (),
+                                                                                weights_buffer.size (),
+                                                                                nullptr);
+  g_autoptr(GGMLModel) second_model = ggml_model_load_from_istream_with_weights_cache (second_istream,
+                                                                                       cache_file,
+                                                                                       desc,
+                                                                                       nullptr,
+                                                                                       nullptr,
+                                                                                       nullptr,
+                                                                                       nullptr,
+                                                                                       nullptr,
+                                                                                       nullptr,
+                                                                                       &error);
+
+  ASSERT_NE (second_model, nullptr);
+  ASSERT_EQ (error, nullptr);
+
+  for (size_t i = 0; i < n_weights; ++i)
+    {
+      g_autofree char *name = g_strdup_printf ("w%zu", i);
+      size_t first_n_bytes, second_n_bytes;
+      const char *first_data = ggml_tensor_get_data (ggml_model_get (first_model, name), &first_n_bytes);
+      const char *second_data = ggml_tensor_get_data (ggml_model_get (second_model, name), &second_n_bytes);
+
+      EXPECT_EQ (ggml_tensor_get_data_type (ggml_model_get (second_model, name)), GGML_DATA_TYPE_Q8_0);
+      EXPECT_TRUE (is_in_file_mapping (second_data, cache_path)) << "for weight " << name;
+      ASSERT_EQ (first_n_bytes, second_n_bytes);
+      EXPECT_EQ (memcmp (first_data, second_data, first_n_bytes), 0) << "for weight " << name;
+    }
+
+  g_unlink (cache_path);
+}
+
+/* A model with a weight called wte and a weight called lm_head, which
+ * is tied to wte, each with @n_rows rows of @n_cols elements */
+static GGMLModelDescNode *
+create_tied_weights_desc (int64_t n_cols, int64_t n_rows, GGMLDataType wte_type, GGMLDataType lm_head_type)
+{
+  int64_t weight_size[] = { n_cols, n_rows };
+  g_autoptr(GHashTable) weights = g_hash_table_new_full (g_str_hash,
+                                                         g_str_equal,
+                                                         g_free,
+                                                         (GDestroyNotify) ggml_model_desc_node_unref);
+
+  g_hash_table_insert (weights, g_strdup ("wte"), ggml_model_desc_node_new_leaf (weight_size, 2, wte_type));
+  g_hash_table_insert (weights, g_strdup ("lm_head"), ggml_model_desc_node_new_tied_leaf (weight_size, 2, lm_head_type, "wte"));
+
+  return ggml_model_desc_node_new (NULL, weights);
+}
+
+/* Only wte is in the file, so lm_head has to come from wte */
+static GGMLModel *
+load_tied_weights (gboolean            from_file,
+                   GGMLModelDescNode  *desc,
+                   const std::string  &weights_buffer,
+                   GError            **error)
+{
+  if (!from_file)
+    {
+      g_autoptr(GInputStream) istream = g_memory_input_stream_new_from_data (weights_buffer.data (),
+                                                                             weights_buffer.size (),
+                                                                             nullptr);
+
+      return ggml_model_load_from_istream (istream, desc, nullptr, nullptr, nullptr, nullptr, nullptr, nullptr, error);
+    }
+
+  g_autofree char *path = write_temporary_file ("ggml-gobject-tied-XXXXXX.bin", weights_buffer, error);
+
+  if (path == nullptr)
+    {
+      return nullptr;
+    }
+
+  g_autoptr(GFile) file = g_file_new_for_path (path);
+  g_autoptr(GFileInputStream) istream = g_file_read (file, nullptr, error);
+  GGMLModel *model = nullptr;
+
+  if (istream != nullptr)
+    {
+      model = ggml_model_load_from_istream (G_INPUT_STREAM (istream), desc, nullptr, nullptr, nullptr, nullptr, nullptr, nullptr, error);
+    }
+
+  g_unlink (path);
+  return model;
+}
+
+TEST(Model, tied_weight_quantized_on_one_side)
+{
+  const int32_t n_cols = 64;
+  const int32_t n_rows = 4;
+  std::vector<float> data (n_cols * n_rows);
+  std::string wte_buffer;
+  std::string lm_head_buffer;
+
+  for (size_t j = 0; j < data.size (); ++j)
+    {
+      data[j] = sinf (j * 0.23f);
+    }
+
+  append_f32_weight (wte_buffer, "wte", n_cols, n_rows, data);
+  append_f32_weight (lm_head_buffer, "lm_head", n_cols, n_rows, data);
+
+  for (gboolean from_file : { FALSE, TRUE })
+    {
+      g_autoptr(GError) error = nullptr;
+
+      /* With the same type, the weights share a tensor */
+      g_autoptr(GGMLModelDescNode) same_desc = create_tied_weights_desc (n_cols, n_rows, GGML_DATA_TYPE_F32, GGML_DATA_TYPE_F32);
+      g_autoptr(GGMLModel) same_model = load_tied_weights (from_file, same_desc, wte_buffer, &error);
+
+      ASSERT_NE (same_model, nullptr);
+      ASSERT_EQ (error, nullptr);
+      EXPECT_EQ (ggml_model_get (same_model, "lm_head"), ggml_model_get (same_model, "wte"));
+
+      /* Quantizing only lm_head breaks the tie, so that wte stays
+       * F32 and lm_head is quantized from it */
+      g_autoptr(GGMLModelDescNode) quantized_desc = create_tied_weights_desc (n_cols, n_rows, GGML_DATA_TYPE_F32, GGML_DATA_TYPE_Q8_0);
+      g_autoptr(GGMLModel) quantized_model = load_tied_weights (from_file, quantized_desc, wte_buffer, &error);
+
+      ASSERT_NE (quantized_model, nullptr);
+      ASSERT_EQ (error, nullptr);
+
+      GGMLTensor *wte = ggml_model_get (quantized_model, "wte");
+      GGMLTensor *lm_head = ggml_model_get (quantized_model, "lm_head");
+
+      ASSERT_NE (wte, lm_head);
+      EXPECT_EQ (ggml_tensor_get_data_type (wte), GGML_DATA_TYPE_F32);
+      EXPECT_EQ (ggml_tensor_get_data_type (lm_head), GGML_DATA_TYPE_Q8_0);
+
+      size_t wte_n_bytes;
+      const char *wte_data = ggml_tensor_get_data (wte, &wte_n_bytes);
+
+      ASSERT_EQ (wte_n_bytes, data.size () * sizeof (float));
+      EXPECT_EQ (memcmp (wte_data, data.data (), wte_n_bytes), 0);
+
+      /* lm_head is the same as if it had been quantized from the file */
+      int64_t weight_size[] = { n_cols, n_rows };
+      g_autoptr(GHashTable) lm_head_weights = g_hash_table_new_full (g_str_hash,
+                                                                     g_str_equal,
+                                                                     g_free,
+                                                                     (GDestroyNotify) ggml_model_desc_node_unref);
+      g_hash_table_insert (lm_head_weights,
+                           g_strdup ("lm_head"),
+                           ggml_model_desc_node_new_leaf (weight_size, 2, GGML_DATA_TYPE_Q8_0));
+      g_autoptr(GGMLModelDescNode) reference_desc = ggml_model_desc_node_new (NULL, lm_head_weights);
+      g_autoptr(GGMLModel) reference_model = load_tied_weights (FALSE, reference_desc, lm_head_buffer, &error);
+
+      ASSERT_NE (reference_model, nullptr);
+      ASSERT_EQ (error, nullptr);
+
+      size_t lm_head_n_bytes, reference_n_bytes;
+      const char *lm_head_data = ggml_tensor_get_data (lm_head, &lm_head_n_bytes);
+      const char *reference_data = ggml_tensor_get_data (ggml_model_get (reference_model, "lm_head"), &reference_n_bytes);
+
+      ASSERT_EQ (lm_head_n_bytes, reference_n_bytes);
+      EXPECT_EQ (memcmp (lm_head_data, reference_data, lm_head_n_bytes), 0);
+
+      /* The other way around, lm_head cannot be made from a quantized wte */
+      g_autoptr(GGMLModelDescNode) dequantized_desc = create_tied_weights_desc (n_cols, n_rows, GGML_DATA_TYPE_Q8_0, GGML_DATA_TYPE_F32);
+      g_autoptr(GGMLModel) dequantized_model = load_tied_weights (from_file, dequantized_desc, wte_buffer, &error);
+
+      EXPECT_EQ (dequantized_model, nullptr);
+      EXPECT_NE (error, nullptr);
+    }
+}
+
+TEST(ExecutionMemory, create_context_reuses_buffer)
+{
+  g_autoptr(GGMLExecutionMemory) memory = ggml_execution_memory_new (1024, nullptr);
+
+  g_autoptr(GGMLContext) first_context = ggml_execution_memory_create_context (memory);
+  g_autoptr(GGMLTensor) first_tensor = ggml_context_new_tensor_1d (first_context, GGML_DATA_TYPE_F32, 16);
+  size_t first_n_bytes;
+  float *first_data = reinterpret_cast<float *> (ggml_tensor_get_data (first_tensor, &first_n_bytes));
+
+  std::fill (first_data, first_data + 16, 1.0f);
+
+  /* The next pass is laid out over the same buffer instead of a new one,
+   * so the tensors from the pass before are overwritten by it */
+  g_autoptr(GGMLContext) second_context = ggml_execution_memory_create_context (memory);
+  g_autoptr(GGMLTensor) second_tensor = ggml_context_new_tensor_1d (second_context, GGML_DATA_TYPE_F32, 16);
+  size_t second_n_bytes;
+  float *second_data = reinterpret_cast<float *> (ggml_tensor_get_data (second_tensor, &second_n_bytes));
+
+  EXPECT_EQ (second_data, first_data);
+  EXPECT_EQ (second_n_bytes, first_n_bytes);
+
+  std::fill (second_data, second_data + 16, 2.0f);
+  EXPECT_EQ (first_data[0], 2.0f);
+
+  /* The earlier context can still be released after the
+   * next one was created, even though its tensors are stale */
+  g_clear_pointer (&first_tensor, ggml_tensor_unref);
+  g_clear_pointer (&first_context, ggml_context_unref);
+
+  EXPECT_EQ (second_data[15], 2.0f);
+}
+
+/* Multiplies @n_inputs inputs of @n_cols elements by F16 weights of ones,
+ * which needs scratch memory to convert the inputs to F16 first, so the
+ * scratch memory grows with @n_inputs. Each output is the sum of its input. */
+static GGMLTensor *
+create_ones_mul_mat (GGMLContext *context, int64_t n_cols, int64_t n_rows, int64_t n_inputs)
+{
+  g_autoptr(GGMLTensor) weights = ggml_context_new_tensor_2d (context, GGML_DATA_TYPE_F16, n_cols, n_rows);
+  g_autoptr(GGMLTensor) inputs = ggml_context_new_tensor_2d (context, GGML_DATA_TYPE_F32, n_cols, n_inputs);
+  std::vector<uint16_t> weights_data (n_cols * n_rows, 0x3c00);
+  std::vector<float> inputs_data (n_cols * n_inputs);
+
+  for (size_t i = 0; i < inputs_data.size (); ++i)
+    {
+      inputs_data[i] = i % 7;
+    }
+
+  ggml_tensor_set_data (weights, reinterpret_cast<char *> (weights_data.data ()), weights_data.size () * sizeof (uint16_t));
+  ggml_tensor_set_data (inputs, reinterpret_cast<char *> (inputs_data.data ()), inputs_data.size () * sizeof (float));
+
+  return ggml_op_mul_mat (context, weights, inputs);
+}
+
+static std::vector<float>
+compute_with_plan (GGMLComputeGraph *compute_graph,
+                   GGMLComputePlan  *compute_plan,
+                   GGMLContext      *context,
+                   GGMLTensor       *output)
+{
+  g_autoptr(GError) error = nullptr;
+
+  EXPECT_TRUE (ggml_compute_graph_compute (compute_graph, compute_plan, context, nullptr, &error));
+  EXPECT_EQ (error, nullptr);
+
+  size_t n_bytes;
+  float *data = reinterpret_cast<float *> (ggml_tensor_get_data (output, &n_bytes));
+
+  return std::vector<float> (data, data + n_bytes / sizeof (float));
+}
+
+TEST(ExecutionMemory, plan_with_growing_work_buffer)
+{
+  g_autoptr(GGMLExecutionMemory) memory = ggml_execution_memory_new (1024, nullptr);
+  g_autoptr(GGMLContext) context = ggml_context_new (1024 * 1024);
+
+  g_autoptr(GGMLTensor) small_output = create_ones_mul_mat (context, 32, 4, 2);
+  g_autoptr(GGMLComputeGraph) small_graph = ggml_compute_graph_new ();
+  ggml_compute_graph_build_forward_expand (small_graph, small_output);
+
+  g_autoptr(GGMLTensor) large_output = create_ones_mul_mat (context, 32, 4, 16);
+  g_autoptr(GGMLComputeGraph) large_graph = ggml_compute_graph_new ();
+  ggml_compute_graph_build_forward_expand (large_graph, large_output);
+
+  g_autoptr(GGMLComputePlan) small_plan = ggml_compute_graph_plan_with_execution_memory (small_graph, 2, memory);
+  std::vector<float> small_result = compute_with_plan (small_graph, small_plan, context, small_output);
+
+  /* The larger plan needs more scratch memory than the execution
+   * memory has so far, so the work buffer gets allocated again */
+  g_autoptr(GGMLComputePlan) large_plan = ggml_compute_graph_plan_with_execution_memory (large_graph, 2, memory);
+  std::vector<float> large_result = compute_with_plan (large_graph, large_plan, context, large_output);
+
+  /* Both give the same results as plans with scratch memory of their own */
+  g_autoptr(GGMLComputePlan) small_fresh_plan = ggml_compute_graph_plan (small_graph, 2);
+  g_autoptr(GGMLComputePlan) large_fresh_plan = ggml_compute_graph_plan (large_graph, 2);
+
+  EXPECT_EQ (small_result, compute_with_plan (small_graph, small_fresh_plan, context, small_output));
+  EXPECT_EQ (large_result, compute_with_plan (large_graph, large_fresh_plan, context, large_output));
+
+  ASSERT_EQ (large_result.size (), 4u * 16u);
+  for (size_t i = 0; i < 16; ++i)
+    {
+      float expected = 0.0f;
+
+      for (size_t j = 0; j < 32; ++j)
+        {
+          expected += (i * 32 + j) % 7;
+        }
+
+      EXPECT_EQ (large_result[i * 4], expected);
+    }
+
+  /* The smaller plan still holds on to the work buffer it was made
+   * with, so it can be used again after the work buffer grew */
+  EXPECT_EQ (compute_with_plan (small_graph, small_plan, context, small_output), small_result);
+}
+
+static GGMLModelDescNode *
+create_key_value_memory_desc (int64_t d_model, int64_t n_ctx, int64_t n_layer)
+{
+  int64_t memory_size[] = { d_model, n_ctx, n_layer };
+  g_autoptr(GGMLModelDescNode) memory_k_node = ggml_model_desc_node_new_leaf (memory_size, 3, GGML_DATA_TYPE_F32);
+  g_autoptr(GHashTable) memory_parameters = g_hash_table_new_full (g_str_hash,
+                                                                   g_str_equal,
+                                                                   g_free,
+                                                                   (GDestroyNotify) ggml_model_desc_node_unref);
+  g_hash_table_insert (memory_parameters, g_strdup ("k"), g_steal_pointer (&memory_k_node));
+
+  return ggml_model_desc_node_new (NULL, memory_parameters);
+}
+
+TEST(KeyValuePagePool, allocate_and_share_pages)
+{
+  g_autoptr(GError) error = nullptr;
+  g_autoptr(GGMLModelDescNode) memory_desc = create_key_value_memory_desc (4, 8, 2);
+  g_autoptr(GGMLKeyValuePagePool) page_pool = ggml_key_value_page_pool_new (memory_desc, 8, 4, &error);
+
+  ASSERT_NE (page_pool, nullptr);
+  ASSERT_EQ (error, nullptr);
+  EXPECT_EQ (ggml_key_value_page_pool_get_n_pages (page_pool), 2);
+
+  GGMLTensor *memory_k = (GGMLTensor *) g_hash_table_lookup (ggml_key_value_page_pool_get_memory (page_pool), "k");
+  ASSERT_NE (memory_k, nullptr);
+
+  int32_t first_page, second_page, third_page;
+  ASSERT_TRUE (ggml_key_value_page_pool_allocate_page (page_pool, &first_page, &error));
+  ASSERT_TRUE (ggml_key_value_page_pool_allocate_page (page_pool, &second_page, &error));
+  EXPECT_NE (first_page, second_page);
+  EXPECT_EQ (ggml_key_value_page_pool_get_n_free_pages (page_pool), 0);
+
+  /* No more pages left */
+  EXPECT_FALSE (ggml_key_value_page_pool_allocate_page (page_pool, &third_page, &error));
+  EXPECT_TRUE (g_error_matches (error, G_IO_ERROR, G_IO_ERROR_NO_SPACE));
+  g_clear_error (&error);
+
+  ggml_key_value_page_pool_ref_page (page_pool, first_page);
+  EXPECT_TRUE (ggml_key_value_page_pool_page_is_shared (page_pool, first_page));
+
+  /* Copying a page copies it for every layer */
+  float *data = (float *) ggml_tensor_get_data (memory_k, nullptr);
+  data[first_page * 4 * 4] = 1.0f;
+  data[(8 + first_page * 4) * 4] = 2.0f;
+  ggml_key_value_page_pool_copy_page (page_pool, first_page, second_page);
+  EXPECT_EQ (data[second_page * 4 * 4], 1.0f);
+  EXPECT_EQ (data[(8 + second_page * 4) * 4], 2.0f);
+
+  /* The page only goes back to the pool once nobody is using it */
+  ggml_key_value_page_pool_unref_page (page_pool, first_page);
+  EXPECT_FALSE (ggml_key_value_page_pool_page_is_shared (page_pool, first_page));
+  EXPECT_EQ (ggml_key_value_page_pool_get_n_free_pages (page_pool), 0);
+
+  ggml_key_value_page_pool_unref_page (page_pool, first_page);
+  ggml_key_value_page_pool_unref_page (page_pool, second_page);
+  EXPECT_EQ (ggml_key_value_page_pool_get_n_free_pages (page_pool), 2);
+}
+
+TEST(KeyValuePagePool, reserve_execution_memory_positions)
+{
+  g_autoptr(GError) error = nullptr;
+  g_autoptr(GGMLModelDescNode) memory_desc = create_key_value_memory_desc (4, 8, 2);
+  g_autoptr(GGMLKeyValuePagePool) page_pool = ggml_key_value_page_pool_new (memory_desc, 16, 4, &error);
+
+  ASSERT_NE (page_pool, nullptr);
+
+  {
+    g_autoptr(GGMLExecutionMemory) memory = ggml_execution_memory_new_paged (1024, page_pool);
+    size_t n_pages = 0;
+
+    EXPECT_EQ (ggml_execution_memory_get_key_value_page_pool (memory), page_pool);
+
+    /* Pages are only allocated as they are needed */
+    ASSERT_TRUE (ggml_execution_memory_reserve_key_value_positions (memory, 0, 5, &error));
+    ggml_execution_memory_get_key_value_page_table (memory, &n_pages);
+    EXPECT_EQ (n_pages, 2);
+
+    ASSERT_TRUE (ggml_execution_memory_reserve_key_value_positions (memory, 5, 1, &error));
+    ggml_execution_memory_get_key_value_page_table (memory, &n_pages);
+    EXPECT_EQ (n_pages, 2);
+
+    ASSERT_TRUE (ggml_execution_memory_reserve_key_value_positions (memory, 6, 3, &error));
+    ggml_execution_memory_get_key_value_page_table (memory, &n_pages);
+    EXPECT_EQ (n_pages, 3);
+    EXPECT_EQ (ggml_key_value_page_pool_get_n_free_pages (page_pool), 1);
+  }
+
+  /* Releasing the memory gives the pages back */
+  EXPECT_EQ (ggml_key_value_page_pool_get_n_free_pages (page_pool), 4);
+}
+
+TEST(KeyValuePagePool, save_and_restore_positions)
+{
+  g_autoptr(GError) error = nullptr;
+  g_autoptr(GGMLModelDescNode) memory_desc = create_key_value_memory_desc (4, 8, 2);
+  g_autoptr(GGMLKeyValuePagePool) page_pool = ggml_key_value_page_pool_new (memory_desc, 16, 4, &error);
+  g_autoptr(GGMLExecutionMemory) memory = ggml_execution_memory_new_paged (1024, page_pool);
+  g_autoptr(GGMLExecutionMemory) other_memory = ggml_execution_memory_new_paged (1024, page_pool);
+
+  ASSERT_TRUE (ggml_execution_memory_reserve_key_value_positions (memory, 0, 6, &error));
+
+  GGMLTensor *memory_k = (GGMLTensor *) g_hash_table_lookup (ggml_execution_memory_get_key_value_memory (memory), "k");
+  float *data = (float *) ggml_tensor_get_data (memory_k, nullptr);
+  size_t n_pages = 0;
+  const int32_t *page_table = ggml_execution_memory_get_key_value_page_table (memory, &n_pages);
+
+  /* Position 5 of the second layer */
+  data[(16 + page_table[1] * 4 + 1) * 4] = 5.0f;
+
+  g_autoptr(GBytes) saved = ggml_execution_memory_save_key_value_positions (memory, 6, &error);
+  ASSERT_NE (saved, nullptr);
+  EXPECT_EQ (g_bytes_get_size (saved), 2 * 6 * 4 * sizeof (float));
+  EXPECT_EQ (ggml_execution_memory_get_key_value_positions_n_bytes (memory, 6), g_bytes_get_size (saved));
+
+  /* Can't save positions that don't have pages yet */
+  EXPECT_EQ (ggml_execution_memory_save_key_value_positions (memory, 9, nullptr), nullptr);
+
+  ASSERT_TRUE (ggml_execution_memory_restore_key_value_positions (other_memory, saved, 6, 6, &error));
+
+  const int32_t *other_page_table = ggml_execution_memory_get_key_value_page_table (other_memory, &n_pages);
+  EXPECT_EQ (n_pages, 2);
+  EXPECT_EQ (data[(16 + other_page_table[1] * 4 + 1) * 4], 5.0f);
+}
+
+TEST(KeyValuePagePool, fork_execution_memory)
+{
+  g_autoptr(GError) error = nullptr;
+  g_autoptr(GGMLModelDescNode) memory_desc = create_key_value_memory_desc (4, 8, 2);
+  g_autoptr(GGMLKeyValuePagePool) page_pool = ggml_key_value_page_pool_new (memory_desc, 16, 4, &error);
+  g_autoptr(GGMLExecutionMemory) memory = ggml_execution_memory_new_paged (1024, page_pool);
+
+  ASSERT_TRUE (ggml_execution_memory_reserve_key_value_positions (memory, 0, 6, &error));
+
+  GGMLTensor *memory_k = (GGMLTensor *) g_hash_table_lookup (ggml_execution_memory_get_key_value_memory (memory), "k");
+  float *data = (float *) ggml_tensor_get_data (memory_k, nullptr);
+  size_t n_pages = 0;
+  const int32_t *page_table = ggml_execution_memory_get_key_value_page_table (memory, &n_pages);
+  int32_t first_page = page_table[0];
+  int32_t second_page = page_table[1];
+
+  /* Position 5 of the first layer */
+  data[(second_page * 4 + 1) * 4] = 5.0f;
+
+  /* The fork shares the pages instead of taking new ones */
+  g_autoptr(GGMLExecutionMemory) fork = ggml_execution_memory_fork (memory, 6, &error);
+  ASSERT_NE (fork, nullptr);
+  EXPECT_EQ (ggml_key_value_page_pool_get_n_free_pages (page_pool), 2);
+  EXPECT_TRUE (ggml_key_value_page_pool_page_is_shared (page_pool, first_page));
+  EXPECT_TRUE (ggml_key_value_page_pool_page_is_shared (page_pool, second_page));
+
+  /* Writing position 6 copies the second page but not the first */
+  ASSERT_TRUE (ggml_execution_memory_reserve_key_value_positions (fork, 6, 1, &error));
+  EXPECT_EQ (ggml_key_value_page_pool_get_n_free_pages (page_pool), 1);
+
+  const int32_t *fork_page_table = ggml_execution_memory_get_key_value_page_table (fork, &n_pages);
+  EXPECT_EQ (n_pages, 2);
+  EXPECT_EQ (fork_page_table[0], first_page);
+  EXPECT_NE (fork_page_table[1], second_page);
+  EXPECT_EQ (data[(fork_page_table[1] * 4 + 1) * 4], 5.0f);
+  EXPECT_FALSE (ggml_key_value_page_pool_page_is_shared (page_pool, second_page));
+
+  /* Can't fork positions that don't have pages yet */
+  EXPECT_EQ (ggml_execution_memory_fork (memory, 9, nullptr), nullptr);
+}
+
+TEST(PrefixCache, lookup_longest_prefix)
+{
+  g_autoptr(GGMLPrefixCache) prefix_cache = ggml_prefix_cache_new (1024);
+  g_autoptr(GGMLModelDescNode) memory_desc_node = create_key_value_memory_desc (4, 8, 2);
+  g_autoptr(GVariant) memory_desc = ggml_model_desc_node_serialize (memory_desc_node);
+  g_autoptr(GBytes) first_snapshot = g_bytes_new_static ("first", 5);
+  g_autoptr(GBytes) second_snapshot = g_bytes_new_static ("second", 6);
+  const int32_t first_tokens[] = { 1, 2, 3, 4 };
+  const int32_t second_tokens[] = { 1, 2, 5 };
+  const int32_t lookup_tokens[] = { 1, 2, 3, 6 };
+  const int32_t other_tokens[] = { 7, 8 };
+
+  ggml_prefix_cache_insert (prefix_cache, memory_desc, first_tokens, G_N_ELEMENTS (first_tokens), first_snapshot);
+  ggml_prefix_cache_insert (prefix_cache, memory_desc, second_tokens, G_N_ELEMENTS (second_tokens), second_snapshot);
+  EXPECT_EQ (ggml_prefix_cache_get_n_bytes (prefix_cache), 11);
+
+  g_autoptr(GBytes) snapshot = nullptr;
+  size_t n_snapshot_tokens = 0;
+
+  /* The snapshot for { 1, 2, 3, 4 } can be used for the first three tokens */
+  EXPECT_EQ (ggml_prefix_cache_lookup (prefix_cache, memory_desc, lookup_tokens, G_N_ELEMENTS (lookup_tokens), &snapshot, &n_snapshot_tokens), 3);
+  EXPECT_EQ (snapshot, first_snapshot);
+  EXPECT_EQ (n_snapshot_tokens, 4);
+
+  EXPECT_EQ (ggml_prefix_cache_lookup (prefix_cache, memory_desc, other_tokens, G_N_ELEMENTS (other_tokens), nullptr, nullptr), 0);
+
+  EXPECT_EQ (ggml_prefix_cache_get_n_hits (prefix_cache), 1);
+  EXPECT_EQ (ggml_prefix_cache_get_n_misses (prefix_cache), 1);
+}
+
+TEST(PrefixCache, evict_least_recently_used)
+{
+  g_autoptr(GGMLPrefixCache) prefix_cache = ggml_prefix_cache_new (10);
+  g_autoptr(GGMLModelDescNode) memory_desc_node = create_key_value_memory_desc (4, 8, 2);
+  g_autoptr(GVariant) memory_desc = ggml_model_desc_node_serialize (memory_desc_node);
+  g_autoptr(GBytes) snapshot = g_bytes_new_static ("snap", 4);
+  const int32_t first_tokens[] = { 1, 2 };
+  const int32_t second_tokens[] = { 1, 3 };
+  const int32_t third_tokens[] = { 4 };
+
+  ggml_prefix_cache_insert (prefix_cache, memory_desc, first_tokens, G_N_ELEMENTS (first_tokens), snapshot);
+  ggml_prefix_cache_insert (prefix_cache, memory_desc, second_tokens, G_N_ELEMENTS (second_tokens), snapshot);
+
+  /* Using the first one makes the second one the least recently used */
+  EXPECT_EQ (ggml_prefix_cache_lookup (prefix_cache, memory_desc, first_tokens, G_N_ELEMENTS (first_tokens), nullptr, nullptr), 2);
+
+  ggml_prefix_cache_insert (prefix_cache, memory_desc, third_tokens, G_N_ELEMENTS (third_tokens), snapshot);
+  EXPECT_EQ (ggml_prefix_cache_get_n_bytes (prefix_cache), 8);
+
+  EXPECT_EQ (ggml_prefix_cache_lookup (prefix_cache, memory_desc, first_tokens, G_N_ELEMENTS (first_tokens), nullptr, nullptr), 2);
+  EXPECT_EQ (ggml_prefix_cache_lookup (prefix_cache, memory_desc, third_tokens, G_N_ELEMENTS (third_tokens), nullptr, nullptr), 1);
+
+  /* Only the shared first token is left of the second one */
+  EXPECT_EQ (ggml_prefix_cache_lookup (prefix_cache, memory_desc, second_tokens, G_N_ELEMENTS (second_tokens), nullptr, nullptr), 1);
+}
+
+TEST(PrefixCache, lookup_same_memory_desc_only)
+{
+  g_autoptr(GGMLPrefixCache) prefix_cache = ggml_prefix_cache_new (1024);
+  g_autoptr(GGMLModelDescNode) memory_desc_node = create_key_value_memory_desc (4, 8, 2);
+  g_autoptr(GGMLModelDescNode) equal_memory_desc_node = create_key_value_memory_desc (4, 8, 2);
+  g_autoptr(GGMLModelDescNode) other_memory_desc_node = create_key_value_memory_desc (4, 8, 3);
+  g_autoptr(GVariant) memory_desc = ggml_model_desc_node_serialize (memory_desc_node);
+  g_autoptr(GVariant) equal_memory_desc = ggml_model_desc_node_serialize (equal_memory_desc_node);
+  g_autoptr(GVariant) other_memory_desc = ggml_model_desc_node_serialize (other_memory_desc_node);
+  g_autoptr(GBytes) snapshot = g_bytes_new_static ("snap", 4);
+  g_autoptr(GBytes) other_snapshot = g_bytes_new_static ("other", 5);
+  const int32_t tokens[] = { 1, 2, 3 };
+
+  ggml_prefix_cache_insert (prefix_cache, memory_desc, tokens, G_N_ELEMENTS (tokens), snapshot);
+
+  /* A snapshot for another memory layout can't be restored */
+  EXPECT_EQ (ggml_prefix_cache_lookup (prefix_cache, other_memory_desc, tokens, G_N_ELEMENTS (tokens), nullptr, nullptr), 0);
+
+  g_autoptr(GBytes) found_snapshot = nullptr;
+  EXPECT_EQ (ggml_prefix_cache_lookup (prefix_cache, equal_memory_desc, tokens, G_N_ELEMENTS (tokens), &found_snapshot, nullptr), 3);
+  EXPECT_EQ (found_snapshot, snapshot);
+
+  /* The same tokens for the other layout get a snapshot of their own */
+  ggml_prefix_cache_insert (prefix_cache, other_memory_desc, tokens, G_N_ELEMENTS (tokens), other_snapshot);
+  EXPECT_EQ (ggml_prefix_cache_get_n_bytes (prefix_cache), 9);
+
+  g_autoptr(GBytes) found_other_snapshot = nullptr;
+  EXPECT_EQ (ggml_prefix_cache_lookup (prefix_cache, other_memory_desc, tokens, G_N_ELEMENTS (tokens), &found_other_snapshot, nullptr), 3);
+  EXPECT_EQ (found_other_snapshot, other_snapshot);
+}
+
+TEST(ComputeContext, acquire_and_release_threads)
+{
+  g_autoptr(GGMLComputeContext) compute_context = ggml_compute_context_new (4, 2);
+  g_autoptr(GError) error = nullptr;
+
+  EXPECT_EQ (ggml_compute_context_get_n_threads (compute_context), 4u);
+  EXPECT_EQ (ggml_compute_context_get_n_threads_per_request (compute_context), 2u);
+  EXPECT_EQ (ggml_compute_context_get_n_available_threads (compute_context), 4u);
+
+  /* The default is the number of threads per request */
+  size_t first_n_threads = ggml_compute_context_acquire_threads (compute_context, 0, nullptr, &error);
+  EXPECT_EQ (first_n_threads, 2u);
+  EXPECT_EQ (ggml_compute_context_get_n_available_threads (compute_context), 2u);
+
+  /* Only what is left of the budget is handed out */
+  size_t second_n_threads = ggml_compute_context_acquire_threads (compute_context, 3, nullptr, &error);
+  EXPECT_EQ (second_n_threads, 2u);
+  EXPECT_EQ (ggml_compute_context_get_n_available_threads (compute_context), 0u);
+
+  ggml_compute_context_release_threads (compute_context, first_n_threads);
+  ggml_compute_context_release_threads (compute_context, second_n_threads);
+  EXPECT_EQ (ggml_compute_context_get_n_available_threads (compute_context), 4u);
+
+  /* Requests are capped to the whole budget */
+  size_t all_n_threads = ggml_compute_context_acquire_threads (compute_context, 10, nullptr, &error);
+  EXPECT_EQ (all_n_threads, 4u);
+
+  ggml_compute_context_release_threads (compute_context, all_n_threads);
+  EXPECT_EQ (ggml_compute_context_get_n_available_threads (compute_context), 4u);
+  EXPECT_EQ (error, nullptr);
+}
+
+TEST(ComputeContext, acquire_waits_for_release)
+{
+  g_autoptr(GGMLComputeContext) compute_context = ggml_compute_context_new (2, 0);
+  size_t n_threads = ggml_compute_context_acquire_threads (compute_context, 0, nullptr, nullptr);
+  gint acquired = 0;
+
+  ASSERT_EQ (n_threads, 2u);
+
+  std::thread waiting_thread ([&compute_context, &acquired]() -> void {
+    size_t waiting_n_threads = ggml_compute_context_acquire_threads (compute_context, 1, nullptr, nullptr);
+
+    g_atomic_int_set (&acquired, (gint) waiting_n_threads);
+    ggml_compute_context_release_threads (compute_context, waiting_n_threads);
+  });
+
+  /* Nothing is free, so the other thread is still waiting */
+  g_usleep (G_USEC_PER_SEC / 10);
+  EXPECT_EQ (g_atomic_int_get (&acquired), 0);
+
+  ggml_compute_context_release_threads (compute_context, n_threads);
+  waiting_thread.join ();
+
+  EXPECT_EQ (g_atomic_int_get (&acquired), 1);
+  EXPECT_EQ (ggml_compute_context_get_n_available_threads (compute_context), 2u);
+}
+
+TEST(ComputeContext, acquire_cancelled_while_waiting)
+{
+  g_autoptr(GGMLComputeContext) compute_context = ggml_compute_context_new (1, 0);
+  g_autoptr(GCancellable) cancellable = g_cancellable_new ();
+  size_t n_threads = ggml_compute_context_acquire_threads (compute_context, 0, nullptr, nullptr);
+  size_t cancelled_n_threads = 1;
+  g_autoptr(GError) cancelled_error = nullptr;
+
+  ASSERT_EQ (n_threads, 1u);
+
+  std::thread waiting_thread ([&compute_context, &cancellable, &cancelled_n_threads, &cancelled_error]() -> void {
+    cancelled_n_threads = ggml_compute_context_acquire_threads (compute_context,
+                                                                0,
+                                                                cancellable,
+                                                                &cancelled_error);
+  });
+
+  g_usleep (G_USEC_PER_SEC / 10);
+  g_cancellable_cancel (cancellable);
+  waiting_thread.join ();
+
+  EXPECT_EQ (cancelled_n_threads, 0u);
+  EXPECT_TRUE (g_error_matches (cancelled_error, G_IO_ERROR, G_IO_ERROR_CANCELLED));
+
+  /* Nothing was taken out of the budget by the cancelled request */
+  ggml_compute_context_release_threads (compute_context, n_threads);
+  EXPECT_EQ (ggml_compute_context_get_n_available_threads (compute_context), 1u);
+}
+
+TEST(ComputeContext, concurrent_requests_stay_within_budget)
+{
+  g_autoptr(GGMLComputeContext) compute_context = ggml_compute_context_new (3, 2);
+  std::vector<std::thread> threads;
+  gint n_threads_in_use = 0;
+  gint max_n_threads_in_use = 0;
+
+  for (size_t i = 0; i < 8; ++i)
+    {
+      threads.emplace_back ([&compute_context, &n_threads_in_use, &max_n_threads_in_use]() -> void {
+        for (size_t j = 0; j < 200; ++j)
+          {
+            size_t n_threads = ggml_compute_context_acquire_threads (compute_context, 0, nullptr, nullptr);
+            gint now_in_use = g_atomic_int_add (&n_threads_in_use, (gint) n_threads) + (gint) n_threads;
+            gint seen_max = g_atomic_int_get (&max_n_threads_in_use);
+
+            while (now_in_use > seen_max &&
+                   !g_atomic_int_compare_and_exchange (&max_n_threads_in_use, seen_max, now_in_use))
+              {
+                seen_max = g_atomic_int_get (&max_n_threads_in_use);
+              }
+
+            g_thread_yield ();
+
+            g_atomic_int_add (&n_threads_in_use, -(gint) n_threads);
+            ggml_compute_context_release_threads (compute_context, n_threads);
+          }
+      });
+    }
+
+  for (auto &thread : threads)
+    {
+      thread.join ();
+    }
+
+  EXPECT_GE (g_atomic_int_get (&max_n_threads_in_use), 1);
+  EXPECT_LE (g_atomic_int_get (&max_n_threads_in_use), 3);
+  EXPECT_EQ (ggml_compute_context_get_n_available_threads (compute_context), 3u);
+}
+
+TEST(LanguageModelSampler, save_and_restore_top_k_top_p_state)
+{
+  g_autoptr(GError) error = nullptr;
+  g_autoptr(GGMLLanguageModelSampler) sampler = ggml_top_k_top_p_language_model_sampler_new_with_seed (4, 1.0f, 42);
+  g_autoptr(GGMLLanguageModelSampler) other_sampler = ggml_top_k_top_p_language_model_sampler_new (1, 1.0f);
+  float logits[] = { 1.0f, 1.0f, 1.0f, 1.0f };
+  size_t shape[] = { 1, 4 };
+  size_t n_samples;
+
+  g_free (ggml_language_model_sampler_sample_logits_tensor (sampler, logits, 4, shape, 2, &n_samples));
+
+  g_autoptr(GVariant) state = ggml_language_model_sampler_get_state (sampler);
+  ASSERT_NE (state, nullptr);
+  ASSERT_TRUE (ggml_language_model_sampler_set_state (other_sampler, state, &error));
+  EXPECT_EQ (ggml_top_k_top_p_language_model_sampler_get_top_k (GGML_TOP_K_TOP_P_LANGUAGE_MODEL_SAMPLER (other_sampler)), 4);
+
+  /* Both samplers carry on from the same point in the random sequence */
+  for (size_t i = 0; i < 8; ++i)
+    {
+      g_autofree size_t *samples = ggml_language_model_sampler_sample_logits_tensor (sampler, logits, 4, shape, 2, &n_samples);
+      g_autofree size_t *other_samples = ggml_language_model_sampler_sample_logits_tensor (other_sampler, logits, 4, shape, 2, &n_samples);
+
+      EXPECT_EQ (samples[0], other_samples[0]);
+    }
+
+  /* Argmax sampling has no state to set */
+  g_autoptr(GGMLLanguageModelSampler) argmax_sampler = ggml_argmax_language_model_sampler_new ();
+  EXPECT_FALSE (ggml_language_model_sampler_set_state (argmax_sampler, state, nullptr));
+}
+
+TEST(LanguageModelSampler, top_k_top_p_rejects_invalid_state)
+{
+  g_autoptr(GGMLLanguageModelSampler) sampler = ggml_top_k_top_p_language_model_sampler_new (4, 1.0f);
+  struct {
+    guint32 top_k;
+    double top_p;
+    guint64 n_draws;
+  } invalid_states[] = {
+    { 0, 1.0, 0 },
+    { 4, 0.0, 0 },
+    { 4, 1.5, 0 },
+    { 4, NAN, 0 },
+    { 4, 1.0, G_MAXUINT64 },
+  };
+
+  for (auto const &invalid_state : invalid_states)
+    {
+      g_autoptr(GError) error = nullptr;
+      g_autoptr(GVariant) state = g_variant_ref_sink (g_variant_new ("(udbut)",
+                                                                     invalid_state.top_k,
+                                                                     invalid_state.top_p,
+                                                                     TRUE,
+                                                                     42,
+                                                                     invalid_state.n_draws));
+
+      EXPECT_FALSE (ggml_language_model_sampler_set_state (sampler, state, &error));
+      EXPECT_TRUE (g_error_matches (error, G_IO_ERROR, G_IO_ERROR_INVALID_DATA));
+    }
+
+  /* The sampler is left as it was */
+  EXPECT_EQ (ggml_top_k_top_p_language_model_sampler_get_top_k (GGML_TOP_K_TOP_P_LANGUAGE_MODEL_SAMPLER (sampler)), 4);
+}
+
+TEST(LanguageModelSampler, top_k_top_p_samples_from_top_k)
+{
+  g_autoptr(GGMLLanguageModelSampler) sampler = ggml_top_k_top_p_language_model_sampler_new_with_seed (3, 1.0f, 42);
+  g_autoptr(GGMLLanguageModelSampler) greedy_sampler = ggml_top_k_top_p_language_model_sampler_new (1, 1.0f);
+  std::vector<float> logits (1024, -10.0f);
+  size_t shape[] = { 1, logits.size () };
+  size_t n_samples;
+
+  /* The largest logits are spread out, so that they do
+   * not just come in order */
+  logits[700] = 5.0f;
+  logits[3] = 4.0f;
+  logits[1000] = 3.0f;
+  logits[512] = 2.0f;
+
+  g_autofree size_t *greedy_samples = ggml_language_model_sampler_sample_logits_tensor (greedy_sampler, logits.data (), logits.size (), shape, 2, &n_samples);
+  EXPECT_EQ (greedy_samples[0], 700);
+
+  for (size_t i = 0; i < 64; ++i)
+    {
+      g_autofree size_t *samples = ggml_language_model_sampler_sample_logits_tensor (sampler, logits.data (), logits.size (), shape, 2, &n_samples);
+
+      EXPECT_THAT (samples[0], ::testing::AnyOf (700, 3, 1000));
+    }
+}
+
+TEST(LanguageModelSampler, top_k_top_p_copy_has_its_own_sequence)
+{
+  g_autoptr(GGMLLanguageModelSampler) sampler = ggml_top_k_top_p_language_model_sampler_new_with_seed (8, 1.0f, 42);
+  g_autoptr(GGMLLanguageModelSampler) same_seed_sampler = ggml_top_k_top_p_language_model_sampler_new_with_seed (8, 1.0f, 42);
+  std::vector<float> logits (8, 1.0f);
+  size_t shape[] = { 1, logits.size () };
+
+  g_autoptr(GGMLLanguageModelSampler) first_copy = ggml_language_model_sampler_copy (sampler);
+  g_autoptr(GGMLLanguageModelSampler) second_copy = ggml_language_model_sampler_copy (sampler);
+  g_autoptr(GGMLLanguageModelSampler) same_seed_copy = ggml_language_model_sampler_copy (same_seed_sampler);
+
+  auto sample_sequence = [&logits, &shape] (GGMLLanguageModelSampler *s) {
+    std::vector<size_t> sequence;
+
+    for (size_t i = 0; i < 64; ++i)
+      {
+        size_t n_samples;
+        g_autofree size_t *samples = ggml_language_model_sampler_sample_logits_tensor (s, logits.data (), logits.size (), shape, 2, &n_samples);
+
+        sequence.push_back (samples[0]);
+      }
+
+    return sequence;
+  };
+
+  std::vector<size_t> sequence = sample_sequence (sampler);
+  std::vector<size_t> first_copy_sequence = sample_sequence (first_copy);
+  std::vector<size_t> second_copy_sequence = sample_sequence (second_copy);
+  std::vector<size_t> same_seed_copy_sequence = sample_sequence (same_seed_copy);
+
+  /* Each copy makes its own choices, but the first copy of a
+   * sampler with the same seed makes the same ones */
+  EXPECT_NE (first_copy_sequence, sequence);
+  EXPECT_NE (second_copy_sequence, sequence);
+  EXPECT_NE (first_copy_sequence, second_copy_sequence);
+  EXPECT_EQ (first_copy_sequence, same_seed_copy_sequence);
+}
+
+TEST(LanguageModelSampler, top_k_top_p_verify_draft_tokens)
+{
+  g_autoptr(GGMLLanguageModelSampler) sampler = ggml_top_k_top_p_language_model_sampler_new_with_seed (3, 1.0f, 42);
+  const size_t n_vocab = 8;
+  const size_t n_draft_tokens = 3;
+  std::vector<float> target_logits ((n_draft_tokens + 1) * n_vocab, -10.0f);
+  std::vector<float> draft_logits (n_draft_tokens * n_vocab, -10.0f);
+
+  for (size_t i = 0; i < n_draft_tokens + 1; ++i)
+    {
+      target_logits[i * n_vocab + 0] = 3.0f;
+      target_logits[i * n_vocab + 1] = 2.0f;
+      target_logits[i * n_vocab + 2] = 1.0f;
+    }
+
+  /* The draft model agrees with the target exactly, so
+   * every draft token in the support is always kept */
+  std::copy (target_logits.begin (), target_logits.begin () + draft_logits.size (), draft_logits.begin ());
+
+  const size_t agreeing_draft_tokens[] = { 0, 2, 1 };
+
+  for (size_t i = 0; i < 64; ++i)
+    {
+      size_t next_token;
+      size_t n_accepted = ggml_language_model_sampler_verify_draft_tokens (sampler,
+                                                                           draft_logits.data (),
+                                                                           target_logits.data (),
+                                                                           n_vocab,
+                                                                           agreeing_draft_tokens,
+                                                                           n_draft_tokens,
+                                                                           &next_token);
+
+      EXPECT_EQ (n_accepted, n_draft_tokens);
+      EXPECT_THAT (next_token, ::testing::AnyOf (0, 1, 2));
+    }
+
+  /* The draft model only puts weight on tokens the target never
+   * picks, so the first draft token is always rejected and the
+   * next token is sampled from the target distribution */
+  std::fill (draft_logits.begin (), draft_logits.end (), -10.0f);
+
+  for (size_t i = 0; i < n_draft_tokens; ++i)
+    {
+      draft_logits[i * n_vocab + 5] = 3.0f;
+      draft_logits[i * n_vocab + 6] = 2.0f;
+      draft_logits[i * n_vocab + 7] = 1.0f;
+    }
+
+  const size_t disjoint_draft_tokens[] = { 5, 6, 7 };
+
+  for (size_t i = 0; i < 64; ++i)
+    {
+      size_t next_token;
+      size_t n_accepted = ggml_language_model_sampler_verify_draft_tokens (sampler,
+                                                                           draft_logits.data (),
+                                                                           target_logits.data (),
+                                                                           n_vocab,
+                                                                           disjoint_draft_tokens,
+                                                                           n_draft_tokens,
+                                                                           &next_token);
+
+      EXPECT_EQ (n_accepted, 0);
+      EXPECT_THAT (next_token, ::testing::AnyOf (0, 1, 2));
+    }
+}
+
+TEST(LanguageModelSampler, top_k_top_p_shared_between_threads)
+{
+  g_autoptr(GGMLLanguageModelSampler) sampler = ggml_top_k_top_p_language_model_sampler_new_with_seed (3, 1.0f, 42);
+  std::vector<std::thread> threads;
+  std::vector<size_t> n_out_of_top_k (4, 0);
+
+  for (size_t t = 0; t < n_out_of_top_k.size (); ++t)
+    {
+      threads.push_back (std::thread ([&sampler, &n_out_of_top_k, t] {
+        /* A different vocabulary size on each thread, so that
+         * the scratch buffers would be resized if they were shared */
+        std::vector<float> logits (256 * (t + 1), -10.0f);
+        size_t shape[] = { 1, logits.size () };
+        size_t n_samples;
+
+        logits[logits.size () - 1] = 5.0f;
+        logits[t] = 4.0f;
+        logits[logits.size () / 2] = 3.0f;
+
+        for (size_t i = 0; i < 256; ++i)
+          {
+            g_autofree size_t *samples = ggml_language_model_sampler_sample_logits_tensor (sampler, logits.data (), logits.size (), shape, 2, &n_samples);
+
+            if (samples[0] != logits.size () - 1 && samples[0] != t && samples[0] != logits.size () / 2)
+              {
+                ++n_out_of_top_k[t];
+              }
+          }
+      }));
+    }
+
+  for (auto &thread : threads)
+    {
+      thread.join ();
+    }
+
+  EXPECT_THAT (n_out_of_top_k, ::testing::Each (0));
+}
+
+TEST(LanguageModel, load_defined_gpt2_weights)
+{
+  g_autoptr(GError) error = nullptr;
+  g_autoptr(GGMLCachedModelIstream) istream = ggml_language_model_stream_from_cache (
+    GGML_DEFINED_LANGUAGE_MODEL_GPT2P117M,
+    &error
+  );
+
+  ASSERT_NE (istream, nullptr);
+  ASSERT_EQ (error, nullptr);
+
+  g_autoptr(GGMLLanguageModel) language_model = ggml_language_model_load_defined_from_istream (
+    GGML_DEFINED_LANGUAGE_MODEL_GPT2P117M,
+    G_INPUT_STREAM (istream),
+    nullptr,
+    nullptr,
+    &error
+  );
+
+  ASSERT_NE (language_model, nullptr);
+  ASSERT_EQ (error, nullptr);
+}
+
+static GGMLLanguageModel *
+load_quantized_gpt2_model (GGMLDataType quantization_type, GError **error)
+{
+  g_autoptr(GGMLCachedModelIstream) istream = ggml_language_model_stream_from_cache (
+    GGML_DEFINED_LANGUAGE_MODEL_GPT2P117M,
+    error
+  );
+
+  if (istream == nullptr)
+    {
+      return nullptr;
+    }
+
+  g_autoptr(GGMLModelConfig) config = ggml_model_config_new ();
+  ggml_model_config_set_quantization_config (config,
+                                             quantization_type,
+                                             ggml_gpt_model_quantization_regexes (),
+                                             nullptr);
+
+  return ggml_language_model_load_defined_from_istream (
+    GGML_DEFINED_LANGUAGE_MODEL_GPT2P117M,
+    G_INPUT_STREAM (istream),
+    config,
+    nullptr,
+    error
+  );
+}
+
+/* The downloaded model is opened as a plain file, rather than through
+ * the cached model stream, so that quantized weights are not loaded
+ * from the cache. A file stream gets its weights loaded from a mapping
+ * of the file. Wrapping it in a buffered stream hides the file descriptor,
+ * so the weights are read from the stream instead. */
+static std::string
+complete_with_gpt2_model_from_stream (gboolean       read_from_stream,
+                                      GGMLDataType   quantization_type,
+                                      GError       **error)
+{
+  g_autoptr(GGMLCachedModelIstream) cached_istream = ggml_language_model_stream_from_cache (
+    GGML_DEFINED_LANGUAGE_MODEL_GPT2P117M,
+    error
+  );
+
+  if (cached_istream == nullptr)
+    {
+      return "";
+    }
+
+  /* Reading from the cached model stream makes sure that the model is downloaded */
+  char first_byte;
+
+  if (g_input_stream_read (G_INPUT_STREAM (cached_istream), &first_byte, 1, nullptr, error) == -1)
+    {
+      return "";
+    }
+
+  g_autofree char *local_path = nullptr;
+  g_object_get (cached_istream, "local-path", &local_path, nullptr);
+
+  g_autoptr(GFile) local_file = g_file_new_for_path (local_path);
+  g_autoptr(GFileInputStream) file_istream = g_file_read (local_file, nullptr, error);
+
+  if (file_istream == nullptr)
+    {
+      return "";
+    }
+
+  g_autoptr(GInputStream) istream = (
+    read_from_stream ?
+    g_buffered_input_stream_new (G_INPUT_STREAM (file_istream)) :
+    G_INPUT_STREAM (g_object_ref (file_istream))
+  );
+  g_autoptr(GGMLModelConfig) config = ggml_model_config_new ();
+
+  if (quantization_type != GGML_DATA_TYPE_F32)
+    {
+      ggml_model_config_set_quantization_config (config,
+                                                 quantization_type,
+                                                 ggml_gpt_model_quantization_regexes (),
+                                                 nullptr);
+    }
+
+  g_autoptr(GGMLLanguageModel) language_model = ggml_language_model_load_defined_from_istream (
+    GGML_DEFINED_LANGUAGE_MODEL_GPT2P117M,
+    istream,
+    config,
+    nullptr,
+    error
+  );
+
+  if (language_model == nullptr)
+    {
+      return "";
+    }
+
+  g_autoptr(GGMLLanguageModelCompletionCursor) cursor = ggml_language_model_create_completion (
+    language_model,
+    "The meaning of life is:",
+    32
+  );
+
+  gboolean is_complete_eos;
+  g_autofree char *completion = ggml_language_model_completion_cursor_exec (cursor, 7, nullptr, &is_complete_eos, error);
+
+  return completion != nullptr ? completion : "";
+}
+
+TEST(LanguageModel, load_mapped_gpt2_weights_matches_stream)
+{
+  const GGMLDataType quantization_types[] = { GGML_DATA_TYPE_F32, GGML_DATA_TYPE_Q8_0 };
+
+  for (GGMLDataType quantization_type : quantization_types)
+    {
+      g_autoptr(GError) error = nullptr;
+      std::string mapped_completion (complete_with_gpt2_model_from_stream (FALSE, quantization_type, &error));
+
+      ASSERT_EQ (error, nullptr);
+
+      std::string stream_completion (complete_with_gpt2_model_from_stream (TRUE, quantization_type, &error));
+
+      ASSERT_EQ (error, nullptr);
+      EXPECT_EQ (mapped_completion, stream_completion);
+
+      if (quantization_type == GGML_DATA_TYPE_F32)
+        {
+          EXPECT_EQ (mapped_completion, "The meaning of life is: to live in a world of abundance");
+        }
+    }
+}
+
+/* The quantized weights cache files for @quantization_nick
+ * next to the downloaded model, whatever their cache key */
+static std::vector<std::string>
+list_quantized_gpt2_weights_cache_files (const char *quantization_nick)
+{
+  std::vector<std::string> cache_files;
+  g_autoptr(GError) error = nullptr;
+  g_autoptr(GGMLCachedModelIstream) istream = ggml_language_model_stream_from_cache (
+    GGML_DEFINED_LANGUAGE_MODEL_GPT2P117M,
+    &error
+  );
+
+  if (istream == nullptr)
+    {
+      return cache_files;
+    }
+
+  g_autofree char *local_path = nullptr;
+  g_object_get (istream, "local-path", &local_path, nullptr);
+
+  g_autofree char *dirname = g_path_get_dirname (local_path);
+  g_autofree char *basename = g_path_get_basename (local_path);
+  g_autofree char *cache_dirname = g_build_filename (dirname, "quantized", nullptr);
+
+  if (g_str_has_suffix (basename, ".bin"))
+    {
+      basename[strlen (basename) - strlen (".bin")] = '\0';
+    }
+
+  g_autofree char *cache_prefix = g_strdup_printf ("%s-%s-", basename, quantization_nick);
+  g_autoptr(GDir) cache_dir = g_dir_open (cache_dirname, 0, nullptr);
+  const char *name;
+
+  while (cache_dir != nullptr && (name = g_dir_read_name (cache_dir)) != nullptr)
+    {
+      if (g_str_has_prefix (name, cache_prefix))
+        {
+          g_autofree char *path = g_build_filename (cache_dirname, name, nullptr);
+          cache_files.push_back (path);
+        }
+    }
+
+  return cache_files;
+}
+
+TEST(LanguageModel, load_quantized_gpt2_weights_from_cache)
+{
+  g_autoptr(GError) error = nullptr;
+
+  /* Start without a cache, so that the first load has to write it */
+  for (auto const &path : list_quantized_gpt2_weights_cache_files ("q8_0"))
+    {
+      g_unlink (path.c_str ());
+    }
+
+  g_autoptr(GGMLLanguageModel) first_language_model = load_quantized_gpt2_model (GGML_DATA_TYPE_Q8_0, &error);
+
+  ASSERT_NE (first_language_model, nullptr);
+  ASSERT_EQ (error, nullptr);
+
+  std::vector<std::string> cache_files (list_quantized_gpt2_weights_cache_files ("q8_0"));
+  ASSERT_EQ (cache_files.size (), 1u);
+
+  /* A cache left over from an older download of the model
+   * gets removed once the current cache is in place */
+  std::string stale_cache_file (cache_files[0]);
+  stale_cache_file.replace (stale_cache_file.size () - strlen ("0000000000000000.bin"),
+                            strlen ("0000000000000000.bin"),
+                            "0000000000000000.bin");
+  ASSERT_NE (stale_cache_file, cache_files[0]);
+  ASSERT_TRUE (g_file_set_contents (stale_cache_file.c_str (), "stale", -1, &error));
+
+  /* Backdate the cache file. A load that misses the cache
+   * writes it again, which would update the time. */
+  g_autoptr(GFile) cache_file = g_file_new_for_path (cache_files[0].c_str ());
+  ASSERT_TRUE (g_file_set_attribute_uint64 (cache_file,
+                                            G_FILE_ATTRIBUTE_TIME_MODIFIED,
+                                            1,
+                                            G_FILE_QUERY_INFO_NONE,
+                                            nullptr,
+                                            &error));
+
+  g_autoptr(GGMLLanguageModel) second_language_model = load_quantized_gpt2_model (GGML_DATA_TYPE_Q8_0, &error);
+
+  ASSERT_NE (second_language_model, nullptr);
+  ASSERT_EQ (error, nullptr);
+
+  g_autoptr(GFileInfo) cache_file_info = g_file_query_info (cache_file,
+                                                            G_FILE_ATTRIBUTE_TIME_MODIFIED,
+                                                            G_FILE_QUERY_INFO_NONE,
+                                                            nullptr,
+                                                            &error);
+
+  ASSERT_NE (cache_file_info, nullptr);
+  EXPECT_EQ (g_file_info_get_attribute_uint64 (cache_file_info, G_FILE_ATTRIBUTE_TIME_MODIFIED), 1u);
+  EXPECT_FALSE (g_file_test (stale_cache_file.c_str (), G_FILE_TEST_EXISTS));
+  EXPECT_EQ (list_quantized_gpt2_weights_cache_files ("q8_0"), cache_files);
+
+  g_autoptr(GGMLLanguageModelCompletionCursor) first_cursor = ggml_language_model_create_completion (
+    first_language_model,
+    "The meaning of life is:",
+    32
+  );
+  g_autoptr(GGMLLanguageModelCompletionCursor) second_cursor = ggml_language_model_create_completion (
+    second_language_model,
+    "The meaning of life is:",
+    32
+  );
+
+  gboolean is_complete_eos;
+  g_autofree char *first_completion = ggml_language_model_completion_cursor_exec (first_cursor, 7, nullptr, &is_complete_eos, &error);
+
+  ASSERT_EQ (error, nullptr);
+
+  g_autofree char *second_completion = ggml_language_model_completion_cursor_exec (second_cursor, 7, nullptr, &is_complete_eos, &error);
+
+  ASSERT_EQ (error, nullptr);
+  EXPECT_STREQ (first_completion, second_completion);
+}
+
+typedef void (*MainLoopCallback) (GMainLoop *loop);
+
+typedef struct {
+  GMainLoop *loop;
+  MainLoopCallback callback;
+} WithinMainLoopData;
+
+static WithinMainLoopData *
+within_main_loop_data_new (GMainLoop *loop,
+                           MainLoopCallback callback)
+{
+  WithinMainLoopData *data = g_new0 (WithinMainLoopData, 1);
+  data->loop = g_main_loop_ref (loop);
+  data->callback = callback;
+
+  return data;
+}
+
+static void
+within_main_loop_data_free (WithinMainLoopData *data)
+{
+  g_clear_pointer (&data->loop, g_main_loop_unref);
+  g_clear_pointer (&data, g_free);
+}
+
+static void
+within_main_loop (MainLoopCallback initial_callback)
+{
+  g_autoptr(GMainLoop) loop = g_main_loop_new (NULL, TRUE);
+  WithinMainLoopData *data = within_main_loop_data_new (loop, initial_callback);
+  g_idle_add ([](gpointer data) -> gboolean {
+    WithinMainLoopData *within_data = (WithinMainLoopData *) data;
+    within_data->callback (g_steal_pointer (&within_data->loop));
+    within_main_loop_data_free (within_data);
+    return G_SOURCE_REMOVE;
+  }, data);
+  g_main_loop_run (loop);
+}
+
+TEST(LanguageModel, load_defined_gpt2_weights_async)
+{
+  within_main_loop ([](GMainLoop *loop) -> void {
+    g_autoptr(GError) error = nullptr;
+    g_autoptr(GGMLCachedModelIstream) istream = ggml_language_model_stream_from_cache (
+      GGML_DEFINED_LANGUAGE_MODEL_GPT2P117M,
+      &error
+    );
+
+    ASSERT_NE (istream, nullptr);
+    ASSERT_EQ (error, nullptr);
+
+    ggml_language_model_load_defined_from_istream_async (
+      GGML_DEFINED_LANGUAGE_MODEL_GPT2P117M,
+      G_INPUT_STREAM (istream),
+      nullptr,
+      nullptr,
+      [](GObject *src, GAsyncResult *result, gpointer data) -> void {
+        g_autoptr(GError) error = NULL;
+        g_autoptr(GMainLoop) loop = (GMainLoop *) data;
+        g_autoptr(GGMLLanguageModel) language_model = ggml_language_model_load_defined_from_istream_finish (
+          result,
+          &error
+        );
+
+        EXPECT_EQ (error, nullptr);
+        EXPECT_NE (language_model, nullptr);
+
+        g_main_loop_quit (loop);
+      },
+      loop
+    );
+  });
+}
+
+TEST(LanguageModel, run_inference_gpt2_sync)
+{
+  g_autoptr(GError) error = nullptr;
+  g_autoptr(GGMLCachedModelIstream) istream = ggml_language_model_stream_from_cache (
+    GGML_DEFINED_LANGUAGE_MODEL_GPT2P117M,
+    &error
+  );
+
+  ASSERT_NE (istream, nullptr);
+  ASSERT_EQ (error, nullptr);
+
+  g_autoptr(GGMLLanguageModel) language_model = ggml_language_model_load_defined_from_istream (
+    GGML_DEFINED_LANGUAGE_MODEL_GPT2P117M,
+    G_INPUT_STREAM (istream),
+    nullptr,
+    nullptr,
+    &error
+  );
+
+  ASSERT_NE (language_model, nullptr);
+  ASSERT_EQ (error, nullptr);
+
+  g_autoptr(GGMLLanguageModelCompletionCursor) cursor = ggml_language_model_create_completion (
+    language_model,
+    "The meaning of life is:",
+    32
+  );
+
+  gboolean is_complete_eos;
+  std::string completion (ggml_language_model_completion_cursor_exec (cursor, 7, nullptr, &is_complete_eos, &error));
+
+  ASSERT_EQ (error, nullptr);
+  EXPECT_EQ (completion, "The meaning of life is: to live in a world of abundance");
+}
+
+TEST(LanguageModel, run_inference_gpt2_async)
+{
+  within_main_loop ([](GMainLoop *loop) -> void {
+    g_autoptr(GError) error = nullptr;
+    g_autoptr(GGMLCachedModelIstream) istream = ggml_language_model_stream_from_cache (
+      GGML_DEFINED_LANGUAGE_MODEL_GPT2P117M,
+      &error
+    );
+
+    ASSERT_NE (istream, nullptr);
+    ASSERT_EQ (error, nullptr);
+
+    g_autoptr(GGMLLanguageModel) language_model = ggml_language_model_load_defined_from_istream (
+      GGML_DEFINED_LANGUAGE_MODEL_GPT2P117M,
+      G_INPUT_STREAM (istream),
+      nullptr,
+      nullptr,
+      &error
+    );
+
+    ASSERT_NE (language_model, nullptr);
+    ASSERT_EQ (error, nullptr);
+
+    g_autoptr(GGMLLanguageModelCompletionCursor) cursor = ggml_language_model_create_completion (
+      language_model,
+      "The meaning of life is:",
+      32
+    );
+
+    typedef std::tuple <GMainLoop *, GGMLLanguageModelCompletionCursor *> ClosureData;
+
+    ggml_language_model_completion_cursor_exec_async (
+      cursor,
+      7,
+      nullptr,
+      [](GObject *src, GAsyncResult *res, gpointer data) -> void {
+        g_autoptr(GError) error = NULL;
+        g_autoptr(GMainLoop) loop = NULL;
+        g_autoptr(GGMLLanguageModelCompletionCursor) cursor = NULL;
+
+        std::unique_ptr<ClosureData> closure_data ((ClosureData *) data);
+        std::tie (loop, cursor) = *closure_data;
+
+        gboolean is_complete_eos;
+        std::string completion (ggml_language_model_completion_cursor_exec_finish (cursor,
+                                                                                   res,
+                                                                                   &is_complete_eos,
+                                                                                   &error));
+        EXPECT_EQ (error, nullptr);
+        EXPECT_EQ (completion, "The meaning of life is: to live in a world of abundance");
+
+        g_main_loop_quit (loop);
+      },
+      new ClosureData (
+        g_steal_pointer (&loop),
+        ggml_language_model_completion_cursor_ref (cursor)
+      )
+    );
+  });
+}
+
+TEST(LanguageModel, run_inference_gpt2_sync_parts)
+{
+  g_autoptr(GError) error = nullptr;
+  g_autoptr(GGMLCachedModelIstream) istream = ggml_language_model_stream_from_cache (
+    GGML_DEFINED_LANGUAGE_MODEL_GPT2P117M,
+    &error
+  );
+
+  ASSERT_NE (istream, nullptr);
+  ASSERT_EQ (error, nullptr);
+
+  g_autoptr(GGMLLanguageModel) language_model = ggml_language_model_load_defined_from_istream (
+    GGML_DEFINED_LANGUAGE_MODEL_GPT2P117M,
+    G_INPUT_STREAM (istream),
+    nullptr,
+    nullptr,
+    &error
+  );
+
+  ASSERT_NE (language_model, nullptr);
+  ASSERT_EQ (error, nullptr);
+
+  g_autoptr(GGMLLanguageModelCompletionCursor) cursor = ggml_language_model_create_completion (
+    language_model,
+    "The meaning of life is:",
+    32
+  );
+
+  gboolean is_complete_eos;
+  std::string first_completion (ggml_language_model_completion_cursor_exec (cursor, 4, nullptr, &is_complete_eos, &error));
+
+  ASSERT_EQ (error, nullptr);
+  EXPECT_EQ (first_completion, "The meaning of life is: to live in a");
+
+  std::string second_completion (ggml_language_model_completion_cursor_exec (cursor, 3, nullptr, &is_complete_eos, &error));
+
+  ASSERT_EQ (error, nullptr);
+  EXPECT_EQ (second_completion, " world of abundance");
+}
+
+TEST(LanguageModel, run_inference_gpt2_sync_cached_graph_reuse)
+{
+  g_autoptr(GError) error = nullptr;
+  g_autoptr(GGMLCachedModelIstream) istream = ggml_language_model_stream_from_cache (
+    GGML_DEFINED_LANGUAGE_MODEL_GPT2P117M,
+    &error
+  );
+
+  ASSERT_NE (istream, nullptr);
+  ASSERT_EQ (error, nullptr);
+
+  g_autoptr(GGMLLanguageModel) language_model = ggml_language_model_load_defined_from_istream (
+    GGML_DEFINED_LANGUAGE_MODEL_GPT2P117M,
+    G_INPUT_STREAM (istream),
+    nullptr,
+    nullptr,
+    &error
+  );
+
+  ASSERT_NE (language_model, nullptr);
+  ASSERT_EQ (error, nullptr);
+
+  g_autoptr(GGMLLanguageModelCompletionCursor) cursor = ggml_language_model_create_completion (
+    language_model,
+    "The meaning of life is:",
+    64
+  );
+
+  gboolean is_complete_eos;
+  g_autofree char *prompt_completion = ggml_language_model_completion_cursor_exec (cursor, 1, nullptr, &is_complete_eos, &error);
+
+  ASSERT_EQ (error, nullptr);
+
+  /* The cursor keeps re-using its graph for each decoding step, until
+   * the keys outgrow the 32 positions that the graph was built for and
+   * a new one is built. A fork has new execution memory, so it always
+   * builds a fresh graph for the same position. Both have to agree at
+   * every step, before, at and after the boundary. */
+  for (size_t i = 0; i < 40; ++i)
+    {
+      g_autoptr(GGMLLanguageModelCompletionCursor) fork = ggml_language_model_completion_cursor_fork (cursor, &error);
+
+      ASSERT_NE (fork, nullptr);
+      ASSERT_EQ (error, nullptr);
+
+      g_autofree char *fork_completion = ggml_language_model_completion_cursor_exec (fork, 1, nullptr, &is_complete_eos, &error);
+
+      ASSERT_EQ (error, nullptr);
+
+      g_autofree char *completion = ggml_language_model_completion_cursor_exec (cursor, 1, nullptr, &is_complete_eos, &error);
+
+      ASSERT_EQ (error, nullptr);
+      EXPECT_STREQ (completion, fork_completion) << "at decoding step " << i;
+    }
+}
+
+TEST(LanguageModel, run_inference_gpt2_sync_paged_key_value_cache)
+{
+  g_autoptr(GError) error = nullptr;
+  g_autoptr(GGMLCachedModelIstream) istream = ggml_language_model_stream_from_cache (
+    GGML_DEFINED_LANGUAGE_MODEL_GPT2P117M,
+    &error
+  );
+
+  ASSERT_NE (istream, nullptr);
+  ASSERT_EQ (error, nullptr);
+
+  /* Both cursors take their key-value memory from the same pool */
+  g_autoptr(GGMLModelConfig) config = ggml_model_config_new ();
+  ggml_model_config_set_key_value_cache_capacity (config, 256);
+
+  g_autoptr(GGMLLanguageModel) language_model = ggml_language_model_load_defined_from_istream (
+    GGML_DEFINED_LANGUAGE_MODEL_GPT2P117M,
+    G_INPUT_STREAM (istream),
+    config,
+    nullptr,
+    &error
+  );
+
+  ASSERT_NE (language_model, nullptr);
+  ASSERT_EQ (error, nullptr);
+  ASSERT_NE (ggml_language_model_get_key_value_page_pool (language_model), nullptr);
+
+  g_autoptr(GGMLLanguageModelCompletionCursor) cursor = ggml_language_model_create_completion (
+    language_model,
+    "The meaning of life is:",
+    32
+  );
+  g_autoptr(GGMLLanguageModelCompletionCursor) other_cursor = ggml_language_model_create_completion (
+    language_model,
+    "The meaning of life is:",
+    32
+  );
+
+  gboolean is_complete_eos;
+  std::string first_completion (ggml_language_model_completion_cursor_exec (cursor, 4, nullptr, &is_complete_eos, &error));
+
+  ASSERT_EQ (error, nullptr);
+  EXPECT_EQ (first_completion, "The meaning of life is: to live in a");
+
+  std::string other_completion (ggml_language_model_completion_cursor_exec (other_cursor, 4, nullptr, &is_complete_eos, &error));
+
+  ASSERT_EQ (error, nullptr);
+  EXPECT_EQ (other_completion, "The meaning of life is: to live in a");
+
+  std::string second_completion (ggml_language_model_completion_cursor_exec (cursor, 3, nullptr, &is_complete_eos, &error));
+
+  ASSERT_EQ (error, nullptr);
+  EXPECT_EQ (second_completion, " world of abundance");
+}
+
+TEST(LanguageModel, run_inference_gpt2_sync_batch_decoding)
+{
+  g_autoptr(GError) error = nullptr;
+  g_autoptr(GGMLCachedModelIstream) istream = ggml_language_model_stream_from_cache (
+    GGML_DEFINED_LANGUAGE_MODEL_GPT2P117M,
+    &error
+  );
+
+  ASSERT_NE (istream, nullptr);
+  ASSERT_EQ (error, nullptr);
+
+  /* Cursors that decode at the same time share their forward passes */
+  g_autoptr(GGMLModelConfig) config = ggml_model_config_new ();
+  ggml_model_config_set_key_value_cache_capacity (config, 256);
+  ggml_model_config_set_batch_decoding_max_sequences (config, 4);
+
+  g_autoptr(GGMLLanguageModel) language_model = ggml_language_model_load_defined_from_istream (
+    GGML_DEFINED_LANGUAGE_MODEL_GPT2P117M,
+    G_INPUT_STREAM (istream),
+    config,
+    nullptr,
+    &error
+  );
+
+  ASSERT_NE (language_model, nullptr);
+  ASSERT_EQ (error, nullptr);
+
+  /* The cursors are created up front, since only
+   * running them is safe from several threads */
+  std::vector<GGMLLanguageModelCompletionCursor *> cursors;
+  std::vector<std::string> completions (3);
+  std::vector<std::thread> threads;
+
+  for (size_t i = 0; i < completions.size (); ++i)
+    {
+      cursors.push_back (ggml_language_model_create_completion (language_model,
+                                                                "The meaning of life is:",
+                                                                32));
+    }
+
+  for (size_t i = 0; i < completions.size (); ++i)
+    {
+      threads.emplace_back ([&cursors, &completions, i]() -> void {
+        g_autoptr(GError) thread_error = nullptr;
+        gboolean is_complete_eos;
+        g_autofree char *completion = ggml_language_model_completion_cursor_exec (cursors[i],
+                                                                                  7,
+                                                                                  nullptr,
+                                                                                  &is_complete_eos,
+                                                                                  &thread_error);
+
+        if (completion != nullptr)
+          {
+            completions[i] = completion;
+          }
+      });
+    }
+
+  for (auto &thread : threads)
+    {
+      thread.join ();
+    }
+
+  for (auto cursor : cursors)
+    {
+      ggml_language_model_completion_cursor_unref (cursor);
+    }
+
+  for (auto const &completion : completions)
+    {
+      EXPECT_EQ (completion, "The meaning of life is: to live in a world of abundance");
+    }
+}
+
+TEST(LanguageModel, batch_decoding_needs_shared_key_value_cache)
+{
+  g_autoptr(GError) error = nullptr;
+  g_autoptr(GGMLCachedModelIstream) istream = ggml_language_model_stream_from_cache (
+    GGML_DEFINED_LANGUAGE_MODEL_GPT2P117M,
+    &error
+  );
+
+  ASSERT_NE (istream, nullptr);
+  ASSERT_EQ (error, nullptr);
+
+  g_autoptr(GGMLModelConfig) config = ggml_model_config_new ();
+  ggml_model_config_set_batch_decoding_max_sequences (config, 4);
+
+  g_autoptr(GGMLLanguageModel) language_model = ggml_language_model_load_defined_from_istream (
+    GGML_DEFINED_LANGUAGE_MODEL_GPT2P117M,
+    G_INPUT_STREAM (istream),
+    config,
+    nullptr,
+    &error
+  );
+
+  EXPECT_EQ (language_model, nullptr);
+  EXPECT_TRUE (g_error_matches (error, G_IO_ERROR, G_IO_ERROR_NOT_SUPPORTED));
+}
+
+TEST(LanguageModel, run_inference_gpt2_sync_f16_key_value_cache)
+{
+  g_autoptr(GError) error = nullptr;
+  g_autoptr(GGMLCachedModelIstream) istream = ggml_language_model_stream_from_cache (
+    GGML_DEFINED_LANGUAGE_MODEL_GPT2P117M,
+    &error
+  );
+
+  ASSERT_NE (istream, nullptr);
+  ASSERT_EQ (error, nullptr);
+
+  g_autoptr(GGMLModelConfig) config = ggml_model_config_new ();
+  ggml_model_config_set_key_value_cache_type (config, GGML_DATA_TYPE_F16);
+
+  g_autoptr(GGMLLanguageModel) language_model = ggml_language_model_load_defined_from_istream (
+    GGML_DEFINED_LANGUAGE_MODEL_GPT2P117M,
+    G_INPUT_STREAM (istream),
+    config,
+    nullptr,
+    &error
+  );
+
+  ASSERT_NE (language_model, nullptr);
+  ASSERT_EQ (error, nullptr);
+
+  g_autoptr(GGMLLanguageModelCompletionCursor) cursor = ggml_language_model_create_completion (
+    language_model,
+    "The meaning of life is:",
+    32
+  );
+
+  gboolean is_complete_eos;
+  std::string completion (ggml_language_model_completion_cursor_exec (cursor, 4, nullptr, &is_complete_eos, &error));
+
+  ASSERT_EQ (error, nullptr);
+  EXPECT_EQ (completion, "The meaning of life is: to live in a");
+}
+
+TEST(LanguageModel, run_inference_gpt2_sync_q8_0_key_value_cache)
+{
+  /* Quantized keys and values are read back by gathering whole
+   * blocks of rows, both from the memory of a single cursor and
+   * from the pages of a shared key-value cache */
+  const size_t key_value_cache_capacities[] = { 0, 256 };
+
+  for (size_t key_value_cache_capacity : key_value_cache_capacities)
+    {
+      g_autoptr(GError) error = nullptr;
+      g_autoptr(GGMLCachedModelIstream) istream = ggml_language_model_stream_from_cache (
+        GGML_DEFINED_LANGUAGE_MODEL_GPT2P117M,
+        &error
+      );
+
+      ASSERT_NE (istream, nullptr);
+      ASSERT_EQ (error, nullptr);
+
+      g_autoptr(GGMLModelConfig) config = ggml_model_config_new ();
+      ggml_model_config_set_key_value_cache_type (config, GGML_DATA_TYPE_Q8_0);
+      ggml_model_config_set_key_value_cache_capacity (config, key_value_cache_capacity);
+
+      g_autoptr(GGMLLanguageModel) language_model = ggml_language_model_load_defined_from_istream (
+        GGML_DEFINED_LANGUAGE_MODEL_GPT2P117M,
+        G_INPUT_STREAM (istream),
+        config,
+        nullptr,
+        &error
+      );
+
+      ASSERT_NE (language_model, nullptr);
+      ASSERT_EQ (error, nullptr);
+
+      g_autoptr(GGMLLanguageModelCompletionCursor) cursor = ggml_language_model_create_completion (
+        language_model,
+        "The meaning of life is:",
+        32
+      );
+
+      /* The prompt fills the memory in one pass, the later
+       * tokens each add a row to a partially filled block */
+      gboolean is_complete_eos;
+      std::string first_completion (ggml_language_model_completion_cursor_exec (cursor, 4, nullptr, &is_complete_eos, &error));
+
+      ASSERT_EQ (error, nullptr);
+      EXPECT_EQ (first_completion, "The meaning of life is: to live in a");
+
+      std::string second_completion (ggml_language_model_completion_cursor_exec (cursor, 3, nullptr, &is_complete_eos, &error));
+
+      ASSERT_EQ (error, nullptr);
+      EXPECT_EQ (second_completion, " world of abundance");
+    }
+}
+
+TEST(LanguageModel, q8_0_key_value_cache_cannot_be_transposed)
+{
+  g_autoptr(GError) error = nullptr;
+  g_autoptr(GGMLCachedModelIstream) istream = ggml_language_model_stream_from_cache (
+    GGML_DEFINED_LANGUAGE_MODEL_GPT2P117M,
+    &error
+  );
+
+  ASSERT_NE (istream, nullptr);
+  ASSERT_EQ (error, nullptr);
+
+  g_autoptr(GGMLModelConfig) config = ggml_model_config_new ();
+  ggml_model_config_set_key_value_cache_type (config, GGML_DATA_TYPE_Q8_0);
+  ggml_model_config_set_key_value_cache_transposed_values (config, TRUE);
+
+  g_autoptr(GGMLLanguageModel) language_model = ggml_language_model_load_defined_from_istream (
+    GGML_DEFINED_LANGUAGE_MODEL_GPT2P117M,
+    G_INPUT_STREAM (istream),
+    config,
+    nullptr,
+    &error
+  );
+
+  EXPECT_EQ (language_model, nullptr);
+  EXPECT_TRUE (g_error_matches (error, G_IO_ERROR, G_IO_ERROR_NOT_SUPPORTED));
+}
+
+TEST(LanguageModel, run_inference_gpt2_sync_transposed_key_value_cache)
+{
+  g_autoptr(GError) error = nullptr;
+  g_autoptr(GGMLCachedModelIstream) istream = ggml_language_model_stream_from_cache (
+    GGML_DEFINED_LANGUAGE_MODEL_GPT2P117M,
+    &error
+  );
+
+  ASSERT_NE (istream, nullptr);
+  ASSERT_EQ (error, nullptr);
+
+  g_autoptr(GGMLModelConfig) config = ggml_model_config_new ();
+  ggml_model_config_set_key_value_cache_transposed_values (config, TRUE);
+
+  g_autoptr(GGMLLanguageModel) language_model = ggml_language_model_load_defined_from_istream (
+    GGML_DEFINED_LANGUAGE_MODEL_GPT2P117M,
+    G_INPUT_STREAM (istream),
+    config,
+    nullptr,
+    &error
+  );
+
+  ASSERT_NE (language_model, nullptr);
+  ASSERT_EQ (error, nullptr);
+
+  g_autoptr(GGMLLanguageModelCompletionCursor) cursor = ggml_language_model_create_completion (
+    language_model,
+    "The meaning of life is:",
+    32
+  );
+
+  gboolean is_complete_eos;
+  std::string first_completion (ggml_language_model_completion_cursor_exec (cursor, 4, nullptr, &is_complete_eos, &error));
+
+  ASSERT_EQ (error, nullptr);
+  EXPECT_EQ (first_completion, "The meaning of life is: to live in a");
+
+  std::string second_completion (ggml_language_model_completion_cursor_exec (cursor, 3, nullptr, &is_complete_eos, &error));
+
+  ASSERT_EQ (error, nullptr);
+  EXPECT_EQ (second_completion, " world of abundance");
+}
+
+TEST(LanguageModel, run_inference_gpt2_sync_prefix_cache)
+{
+  g_autoptr(GError) error = nullptr;
+  g_autoptr(GGMLCachedModelIstream) istream = ggml_language_model_stream_from_cache (
+    GGML_DEFINED_LANGUAGE_MODEL_GPT2P117M,
+    &error
+  );
+
+  ASSERT_NE (istream, nullptr);
+  ASSERT_EQ (error, nullptr);
+
+  g_autoptr(GGMLModelConfig) config = ggml_model_config_new ();
+  ggml_model_config_set_prefix_cache_max_bytes (config, 64 * 1024 * 1024);
+
+  g_autoptr(GGMLLanguageModel) language_model = ggml_language_model_load_defined_from_istream (
+    GGML_DEFINED_LANGUAGE_MODEL_GPT2P117M,
+    G_INPUT_STREAM (istream),
+    config,
+    nullptr,
+    &error
+  );
+
+  ASSERT_NE (language_model, nullptr);
+  ASSERT_EQ (error, nullptr);
+
+  GGMLPrefixCache *prefix_cache = ggml_language_model_get_prefix_cache (language_model);
+  ASSERT_NE (prefix_cache, nullptr);
+
+  for (size_t i = 0; i < 2; ++i)
+    {
+      g_autoptr(GGMLLanguageModelCompletionCursor) cursor = ggml_language_model_create_completion (
+        language_model,
+        "The meaning of life is:",
+        32
+      );
+
+      gboolean is_complete_eos;
+      std::string completion (ggml_language_model_completion_cursor_exec (cursor, 4, nullptr, &is_complete_eos, &error));
+
+      ASSERT_EQ (error, nullptr);
+      EXPECT_EQ (completion, "The meaning of life is: to live in a");
+    }
+
+  /* The second cursor starts from the prompt of the first one */
+  EXPECT_EQ (ggml_prefix_cache_get_n_misses (prefix_cache), 1);
+  EXPECT_EQ (ggml_prefix_cache_get_n_hits (prefix_cache), 1);
+  EXPECT_GT (ggml_prefix_cache_get_n_bytes (prefix_cache), 0);
+}
+
+TEST(LanguageModel, run_inference_gpt2_sync_fork_cursor)
+{
+  g_autoptr(GError) error = nullptr;
+  g_autoptr(GGMLCachedModelIstream) istream = ggml_language_model_stream_from_cache (
+    GGML_DEFINED_LANGUAGE_MODEL_GPT2P117M,
+    &error
+  );
+
+  ASSERT_NE (istream, nullptr);
+  ASSERT_EQ (error, nullptr);
+
+  g_autoptr(GGMLModelConfig) config = ggml_model_config_new ();
+  ggml_model_config_set_key_value_cache_capacity (config, 256);
+
+  g_autoptr(GGMLLanguageModel) language_model = ggml_language_model_load_defined_from_istream (
+    GGML_DEFINED_LANGUAGE_MODEL_GPT2P117M,
+    G_INPUT_STREAM (istream),
+    config,
+    nullptr,
+    &error
+  );
+
+  ASSERT_NE (language_model, nullptr);
+  ASSERT_EQ (error, nullptr);
+
+  g_autoptr(GGMLLanguageModelCompletionCursor) cursor = ggml_language_model_create_completion (
+    language_model,
+    "The meaning of life is:",
+    32
+  );
+
+  gboolean is_complete_eos;
+  std::string first_completion (ggml_language_model_completion_cursor_exec (cursor, 4, nullptr, &is_complete_eos, &error));
+
+  ASSERT_EQ (error, nullptr);
+  EXPECT_EQ (first_completion, "The meaning of life is: to live in a");
+
+  /* The fork picks up from the same point without running the prompt again */
+  g_autoptr(GGMLLanguageModelCompletionCursor) fork = ggml_language_model_completion_cursor_fork (cursor, &error);
+
+  ASSERT_NE (fork, nullptr);
+  ASSERT_EQ (error, nullptr);
+
+  std::string fork_completion (ggml_language_model_completion_cursor_exec (fork, 3, nullptr, &is_complete_eos, &error));
+
+  ASSERT_EQ (error, nullptr);
+  EXPECT_EQ (fork_completion, " world of abundance");
+
+  std::string second_completion (ggml_language_model_completion_cursor_exec (cursor, 3, nullptr, &is_complete_eos, &error));
+
+  ASSERT_EQ (error, nullptr);
+  EXPECT_EQ (second_completion, " world of abundance");
+}
+
+TEST(LanguageModel, run_inference_gpt2_sync_fork_cursor_concurrent_top_k)
+{
+  g_autoptr(GError) error = nullptr;
+  g_autoptr(GGMLCachedModelIstream) istream = ggml_language_model_stream_from_cache (
+    GGML_DEFINED_LANGUAGE_MODEL_GPT2P117M,
+    &error
+  );
+
+  ASSERT_NE (istream, nullptr);
+  ASSERT_EQ (error, nullptr);
+
+  g_autoptr(GGMLModelConfig) config = ggml_model_config_new ();
+  ggml_model_config_set_key_value_cache_capacity (config, 256);
+
+  g_autoptr(GGMLLanguageModel) language_model = ggml_language_model_load_defined_from_istream (
+    GGML_DEFINED_LANGUAGE_MODEL_GPT2P117M,
+    G_INPUT_STREAM (istream),
+    config,
+    nullptr,
+    &error
+  );
+
+  ASSERT_NE (language_model, nullptr);
+  ASSERT_EQ (error, nullptr);
+
+  g_autoptr(GGMLLanguageModelCompletionCursor) cursor = ggml_language_model_create_completion (
+    language_model,
+    "The meaning of life is:",
+    32
+  );
+  g_autoptr(GGMLLanguageModelSampler) sampler = ggml_top_k_top_p_language_model_sampler_new_with_seed (8, 1.0f, 42);
+
+  ggml_language_model_completion_cursor_set_sampler (cursor, sampler);
+
+  gboolean is_complete_eos;
+  g_autofree char *first_completion = ggml_language_model_completion_cursor_exec (cursor, 4, nullptr, &is_complete_eos, &error);
+
+  ASSERT_EQ (error, nullptr);
+
+  g_autoptr(GGMLLanguageModelCompletionCursor) fork = ggml_language_model_completion_cursor_fork (cursor, &error);
+
+  ASSERT_NE (fork, nullptr);
+  ASSERT_EQ (error, nullptr);
+
+  /* The fork has its own copy of the sampler with a seed derived from
+   * the seed of the original, so that the two run at the same time without
+   * getting in each other's way */
+  std::string completions[2];
+  GError *errors[2] = { nullptr, nullptr };
+  GGMLLanguageModelCompletionCursor *cursors[2] = { cursor, fork };
+  std::vector<std::thread> threads;
+
+  for (size_t i = 0; i < 2; ++i)
+    {
+      threads.push_back (std::thread ([&completions, &errors, &cursors, i] {
+        gboolean thread_is_complete_eos;
+        g_autofree char *completion = ggml_language_model_completion_cursor_exec (cursors[i], 8, nullptr, &thread_is_complete_eos, &errors[i]);
+
+        if (completion != nullptr)
+          {
+            completions[i] = completion;
+          }
+      }));
+    }
+
+  for (auto &thread : threads)
+    {
+      thread.join ();
+    }
+
+  ASSERT_EQ (errors[0], nullptr);
+  ASSERT_EQ (errors[1], nullptr);
+
+  /* Doing the same thing one after the other from the same seed makes
+   * the same choices, no matter how the threads were scheduled */
+  g_autoptr(GGMLLanguageModelCompletionCursor) sequential_cursor = ggml_language_model_create_completion (
+    language_model,
+    "The meaning of life is:",
+    32
+  );
+  g_autoptr(GGMLLanguageModelSampler) sequential_sampler = ggml_top_k_top_p_language_model_sampler_new_with_seed (8, 1.0f, 42);
+
+  ggml_language_model_completion_cursor_set_sampler (sequential_cursor, sequential_sampler);
+
+  g_autofree char *sequential_first_completion = ggml_language_model_completion_cursor_exec (sequential_cursor, 4, nullptr, &is_complete_eos, &error);
+
+  ASSERT_EQ (error, nullptr);
+  EXPECT_STREQ (sequential_first_completion, first_completion);
+
+  g_autoptr(GGMLLanguageModelCompletionCursor) sequential_fork = ggml_language_model_completion_cursor_fork (sequential_cursor, &error);
+
+  ASSERT_NE (sequential_fork, nullptr);
+  ASSERT_EQ (error, nullptr);
+
+  g_autofree char *sequential_completion = ggml_language_model_completion_cursor_exec (sequential_cursor, 8, nullptr, &is_complete_eos, &error);
+
+  ASSERT_EQ (error, nullptr);
+
+  g_autofree char *sequential_fork_completion = ggml_language_model_completion_cursor_exec (sequential_fork, 8, nullptr, &is_complete_eos, &error);
+
+  ASSERT_EQ (error, nullptr);
+  EXPECT_EQ (completions[0], sequential_completion);
+  EXPECT_EQ (completions[1], sequential_fork_completion);
+}
+
+TEST(LanguageModel, run_inference_gpt2_sync_save_and_load_cursor_state)
+{
+  g_autoptr(GError) error = nullptr;
+  g_autoptr(GGMLCachedModelIstream) istream = ggml_language_model_stream_from_cache (
+    GGML_DEFINED_LANGUAGE_MODEL_GPT2P117M,
+    &error
+  );
+
+  ASSERT_NE (istream, nullptr);
+  ASSERT_EQ (error, nullptr);
+
+  g_autoptr(GGMLLanguageModel) language_model = ggml_language_model_load_defined_from_istream (
+    GGML_DEFINED_LANGUAGE_MODEL_GPT2P117M,
+    G_INPUT_STREAM (istream),
+    nullptr,
+    nullptr,
+    &error
+  );
+
+  ASSERT_NE (language_model, nullptr);
+  ASSERT_EQ (error, nullptr);
+
+  g_autoptr(GGMLLanguageModelCompletionCursor) cursor = ggml_language_model_create_completion (
+    language_model,
+    "The meaning of life is:",
+    32
+  );
+
+  gboolean is_complete_eos;
+  std::string first_completion (ggml_language_model_completion_cursor_exec (cursor, 4, nullptr, &is_complete_eos, &error));
+
+  ASSERT_EQ (error, nullptr);
+  EXPECT_EQ (first_completion, "The meaning of life is: to live in a");
+
+  g_autoptr(GOutputStream) ostream = g_memory_output_stream_new_resizable ();
+  ASSERT_TRUE (ggml_language_model_completion_cursor_save_state (cursor, ostream, nullptr, &error));
+  ASSERT_TRUE (g_output_stream_close (ostream, nullptr, &error));
+
+  g_autoptr(GBytes) state = g_memory_output_stream_steal_as_bytes (G_MEMORY_OUTPUT_STREAM (ostream));
+  g_autoptr(GInputStream) state_istream = g_memory_input_stream_new_from_bytes (state);
+
+  /* A fresh cursor picks up where the saved one left off */
+  g_autoptr(GGMLLanguageModelCompletionCursor) loaded_cursor = ggml_language_model_create_completion (
+    language_model,
+    "",
+    32
+  );
+
+  ASSERT_TRUE (ggml_language_model_completion_cursor_load_state (loaded_cursor, state_istream, nullptr, &error));
+  ASSERT_EQ (error, nullptr);
+
+  std::string second_completion (ggml_language_model_completion_cursor_exec (loaded_cursor, 3, nullptr, &is_complete_eos, &error));
+
+  ASSERT_EQ (error, nullptr);
+  EXPECT_EQ (second_completion, " world of abundance");
+}
+
+TEST(LanguageModel, run_inference_gpt2_sync_load_cursor_state_rejects_other_key_value_layout)
+{
+  g_autoptr(GError) error = nullptr;
+  g_autoptr(GGMLCachedModelIstream) istream = ggml_language_model_stream_from_cache (
+    GGML_DEFINED_LANGUAGE_MODEL_GPT2P117M,
+    &error
+  );
+
+  ASSERT_NE (istream, nullptr);
+  ASSERT_EQ (error, nullptr);
+
+  g_autoptr(GGMLLanguageModel) language_model = ggml_language_model_load_defined_from_istream (
+    GGML_DEFINED_LANGUAGE_MODEL_GPT2P117M,
+    G_INPUT_STREAM (istream),
+    nullptr,
+    nullptr,
+    &error
+  );
+
+  ASSERT_NE (language_model, nullptr);
+  ASSERT_EQ (error, nullptr);
+
+  g_autoptr(GGMLCachedModelIstream) transposed_istream = ggml_language_model_stream_from_cache (
+    GGML_DEFINED_LANGUAGE_MODEL_GPT2P117M,
+    &error
+  );
+
+  ASSERT_NE (transposed_istream, nullptr);
+  ASSERT_EQ (error, nullptr);
+
+  g_autoptr(GGMLModelConfig) config = ggml_model_config_new ();
+  ggml_model_config_set_key_value_cache_transposed_values (config, TRUE);
+
+  g_autoptr(GGMLLanguageModel) transposed_language_model = ggml_language_model_load_defined_from_istream (
+    GGML_DEFINED_LANGUAGE_MODEL_GPT2P117M,
+    G_INPUT_STREAM (transposed_istream),
+    config,
+    nullptr,
+    &error
+  );
+
+  ASSERT_NE (transposed_language_model, nullptr);
+  ASSERT_EQ (error, nullptr);
+
+  g_autoptr(GGMLLanguageModelCompletionCursor) cursor = ggml_language_model_create_completion (
+    language_model,
+    "The meaning of life is:",
+    32
+  );
+
+  gboolean is_complete_eos;
+  std::string first_completion (ggml_language_model_completion_cursor_exec (cursor, 4, nullptr, &is_complete_eos, &error));
+
+  ASSERT_EQ (error, nullptr);
+
+  g_autoptr(GOutputStream) ostream = g_memory_output_stream_new_resizable ();
+  ASSERT_TRUE (ggml_language_model_completion_cursor_save_state (cursor, ostream, nullptr, &error));
+  ASSERT_TRUE (g_output_stream_close (ostream, nullptr, &error));
+
+  g_autoptr(GBytes) state = g_memory_output_stream_steal_as_bytes (G_MEMORY_OUTPUT_STREAM (ostream));
+  g_autoptr(GInputStream) state_istream = g_memory_input_stream_new_from_bytes (state);
+
+  /* The key-value memory takes up the same number of bytes either way,
+   * but the values are laid out differently, so the state cannot be used */
+  g_autoptr(GGMLLanguageModelCompletionCursor) loaded_cursor = ggml_language_model_create_completion (
+    transposed_language_model,
+    "",
+    32
+  );
+
+  EXPECT_FALSE (ggml_language_model_completion_cursor_load_state (loaded_cursor, state_istream, nullptr, &error));
+  EXPECT_TRUE (g_error_matches (error, G_IO_ERROR, G_IO_ERROR_INVALID_DATA));
+}
+
+TEST(LanguageModel, run_inference_gpt2_sync_append_text)
+{
+  g_autoptr(GError) error = nullptr;
+  g_autoptr(GGMLCachedModelIstream) istream = ggml_language_model_stream_from_cache (
+    GGML_DEFINED_LANGUAGE_MODEL_GPT2P117M,
+    &error
+  );
+
+  ASSERT_NE (istream, nullptr);
+  ASSERT_EQ (error, nullptr);
+
+  g_autoptr(GGMLLanguageModel) language_model = ggml_language_model_load_defined_from_istream (
+    GGML_DEFINED_LANGUAGE_MODEL_GPT2P117M,
+    G_INPUT_STREAM (istream),
+    nullptr,
+    nullptr,
+    &error
+  );
+
+  ASSERT_NE (language_model, nullptr);
+  ASSERT_EQ (error, nullptr);
+
+  g_autoptr(GGMLLanguageModelCompletionCursor) cursor = ggml_language_model_create_completion (
+    language_model,
+    "The meaning of life is:",
+    32
+  );
+
+  gboolean is_complete_eos;
+  std::string first_completion (ggml_language_model_completion_cursor_exec (cursor, 1, nullptr, &is_complete_eos, &error));
+
+  ASSERT_EQ (error, nullptr);
+  EXPECT_EQ (first_completion, "The meaning of life is: to");
+
+  /* The appended text is what the model would have generated anyway,
+   * so the completion carries on the same way from there */
+  ASSERT_TRUE (ggml_language_model_completion_cursor_append_text (cursor, " live in a", &error));
+
+  std::string second_completion (ggml_language_model_completion_cursor_exec (cursor, 3, nullptr, &is_complete_eos, &error));
+
+  ASSERT_EQ (error, nullptr);
+  EXPECT_EQ (second_completion, " live in a world of abundance");
+
+  const int32_t out_of_vocabulary_tokens[] = { -1 };
+  EXPECT_FALSE (ggml_language_model_completion_cursor_append_tokens (cursor, out_of_vocabulary_tokens, 1, nullptr));
+}
+
+TEST(LanguageModel, run_inference_gpt2_sync_append_too_many_tokens)
 {
   g_autoptr(GError) error = nullptr;
   g_autoptr(GGMLCachedModelIstream) istream = ggml_language_model_stream_from_cache (
@@ -86,83 +2819,50 @@ TEST(LanguageModel, load_defined_gpt2_weights)
 
   ASSERT_NE (language_model, nullptr);
   ASSERT_EQ (error, nullptr);
-}
-
-typedef void (*MainLoopCallback) (GMainLoop *loop);
-
-typedef struct {
-  GMainLoop *loop;
-  MainLoopCallback callback;
-} WithinMainLoopData;
 
-static WithinMainLoopData *
-within_main_loop_data_new (GMainLoop *loop,
-                           MainLoopCallback callback)
-{
-  WithinMainLoopData *data = g_new0 (WithinMainLoopData, 1);
-  data->loop = g_main_loop_ref (loop);
-  data->callback = callback;
+  g_autoptr(GGMLLanguageModelCompletionCursor) cursor = ggml_language_model_create_completion (
+    language_model,
+    "The meaning of life is:",
+    8
+  );
 
-  return data;
-}
+  /* The prompt and the appended text have to go through in one pass,
+   * which is longer than the cursor was created for */
+  EXPECT_FALSE (ggml_language_model_completion_cursor_append_text (cursor, " to live in a world of", &error));
+  EXPECT_TRUE (g_error_matches (error, G_IO_ERROR, G_IO_ERROR_INVALID_ARGUMENT));
+  g_clear_error (&error);
 
-static void
-within_main_loop_data_free (WithinMainLoopData *data)
-{
-  g_clear_pointer (&data->loop, g_main_loop_unref);
-  g_clear_pointer (&data, g_free);
-}
+  gboolean is_complete_eos;
+  std::string first_completion (ggml_language_model_completion_cursor_exec (cursor, 1, nullptr, &is_complete_eos, &error));
 
-static void
-within_main_loop (MainLoopCallback initial_callback)
-{
-  g_autoptr(GMainLoop) loop = g_main_loop_new (NULL, TRUE);
-  WithinMainLoopData *data = within_main_loop_data_new (loop, initial_callback);
-  g_idle_add ([](gpointer data) -> gboolean {
-    WithinMainLoopData *within_data = (WithinMainLoopData *) data;
-    within_data->callback (g_steal_pointer (&within_data->loop));
-    within_main_loop_data_free (within_data);
-    return G_SOURCE_REMOVE;
-  }, data);
-  g_main_loop_run (loop);
-}
+  ASSERT_EQ (error, nullptr);
+  EXPECT_EQ (first_completion, "The meaning of life is: to");
 
-TEST(LanguageModel, load_defined_gpt2_weights_async)
-{
-  within_main_loop ([](GMainLoop *loop) -> void {
-    g_autoptr(GError) error = nullptr;
-    g_autoptr(GGMLCachedModelIstream) istream = ggml_language_model_stream_from_cache (
-      GGML_DEFINED_LANGUAGE_MODEL_GPT2P117M,
-      &error
-    );
+  /* The most recent token goes in along with the appended ones */
+  std::vector<int32_t> tokens (8, 0);
 
-    ASSERT_NE (istream, nullptr);
-    ASSERT_EQ (error, nullptr);
+  EXPECT_FALSE (ggml_language_model_completion_cursor_append_tokens (cursor, tokens.data (), 8, &error));
+  EXPECT_TRUE (g_error_matches (error, G_IO_ERROR, G_IO_ERROR_INVALID_ARGUMENT));
+  g_clear_error (&error);
 
-    ggml_language_model_load_defined_from_istream_async (
-      GGML_DEFINED_LANGUAGE_MODEL_GPT2P117M,
-      G_INPUT_STREAM (istream),
-      nullptr,
-      nullptr,
-      [](GObject *src, GAsyncResult *result, gpointer data) -> void {
-        g_autoptr(GError) error = NULL;
-        g_autoptr(GMainLoop) loop = (GMainLoop *) data;
-        g_autoptr(GGMLLanguageModel) language_model = ggml_language_model_load_defined_from_istream_finish (
-          result,
-          &error
-        );
+  EXPECT_TRUE (ggml_language_model_completion_cursor_append_tokens (cursor, tokens.data (), 7, &error));
+  EXPECT_FALSE (ggml_language_model_completion_cursor_append_tokens (cursor, tokens.data (), 1, &error));
+  EXPECT_TRUE (g_error_matches (error, G_IO_ERROR, G_IO_ERROR_INVALID_ARGUMENT));
+  g_clear_error (&error);
 
-        EXPECT_EQ (error, nullptr);
-        EXPECT_NE (language_model, nullptr);
+  /* Even a cursor created for long passes cannot go past the context */
+  g_autoptr(GGMLLanguageModelCompletionCursor) long_cursor = ggml_language_model_create_completion (
+    language_model,
+    "The meaning of life is:",
+    2048
+  );
+  std::vector<int32_t> context_tokens (1024, 0);
 
-        g_main_loop_quit (loop);
-      },
-      loop
-    );
-  });
+  EXPECT_FALSE (ggml_language_model_completion_cursor_append_tokens (long_cursor, context_tokens.data (), context_tokens.size (), &error));
+  EXPECT_TRUE (g_error_matches (error, G_IO_ERROR, G_IO_ERROR_INVALID_ARGUMENT));
 }
 
-TEST(LanguageModel, run_inference_gpt2_sync)
+TEST(LanguageModel, run_inference_gpt2_sync_append_text_after_incomplete_utf8)
 {
   g_autoptr(GError) error = nullptr;
   g_autoptr(GGMLCachedModelIstream) istream = ggml_language_model_stream_from_cache (
@@ -184,6 +2884,16 @@ TEST(LanguageModel, run_inference_gpt2_sync)
   ASSERT_NE (language_model, nullptr);
   ASSERT_EQ (error, nullptr);
 
+  /* A single four byte character which the byte-level tokens split up,
+   * so its first token leaves the detokenizer holding back bytes */
+  const char *strings[] = { "\xf0\x9d\x95\x8f" };
+  g_autofree int32_t *tokens = nullptr;
+  g_autofree size_t *offsets = nullptr;
+  size_t n_tokens;
+
+  ASSERT_TRUE (ggml_language_model_tokenize_batch (language_model, strings, 1, 1, &tokens, &offsets, &n_tokens, &error));
+  ASSERT_GT (n_tokens, 1);
+
   g_autoptr(GGMLLanguageModelCompletionCursor) cursor = ggml_language_model_create_completion (
     language_model,
     "The meaning of life is:",
@@ -191,74 +2901,93 @@ TEST(LanguageModel, run_inference_gpt2_sync)
   );
 
   gboolean is_complete_eos;
-  std::string completion (ggml_language_model_completion_cursor_exec (cursor, 7, nullptr, &is_complete_eos, &error));
+  std::string first_completion (ggml_language_model_completion_cursor_exec (cursor, 1, nullptr, &is_complete_eos, &error));
 
   ASSERT_EQ (error, nullptr);
-  EXPECT_EQ (completion, "The meaning of life is: to live in a world of abundance");
+  EXPECT_EQ (first_completion, "The meaning of life is: to");
+
+  ASSERT_TRUE (ggml_language_model_completion_cursor_append_tokens (cursor, tokens, 1, &error));
+
+  std::string second_completion (ggml_language_model_completion_cursor_exec (cursor, 1, nullptr, &is_complete_eos, &error));
+
+  ASSERT_EQ (error, nullptr);
+
+  /* Whatever bytes were still held back at the end of the last execution
+   * come out before the appended text, not after it */
+  ASSERT_TRUE (ggml_language_model_completion_cursor_append_text (cursor, " live in a", &error));
+
+  std::string third_completion (ggml_language_model_completion_cursor_exec (cursor, 1, nullptr, &is_complete_eos, &error));
+  std::string streamed = second_completion + third_completion;
+
+  ASSERT_EQ (error, nullptr);
+  EXPECT_EQ (streamed.rfind ("\xf0", 0), 0);
+  EXPECT_NE (streamed.find (" live in a"), std::string::npos);
+  EXPECT_LT (streamed.find ("\xf0"), streamed.find (" live in a"));
 }
 
-TEST(LanguageModel, run_inference_gpt2_async)
+TEST(LanguageModel, run_inference_gpt2_sync_save_and_load_cursor_state_with_appended_text)
 {
-  within_main_loop ([](GMainLoop *loop) -> void {
-    g_autoptr(GError) error = nullptr;
-    g_autoptr(GGMLCachedModelIstream) istream = ggml_language_model_stream_from_cache (
-      GGML_DEFINED_LANGUAGE_MODEL_GPT2P117M,
-      &error
-    );
+  g_autoptr(GError) error = nullptr;
+  g_autoptr(GGMLCachedModelIstream) istream = ggml_language_model_stream_from_cache (
+    GGML_DEFINED_LANGUAGE_MODEL_GPT2P117M,
+    &error
+  );
 
-    ASSERT_NE (istream, nullptr);
-    ASSERT_EQ (error, nullptr);
+  ASSERT_NE (istream, nullptr);
+  ASSERT_EQ (error, nullptr);
 
-    g_autoptr(GGMLLanguageModel) language_model = ggml_language_model_load_defined_from_istream (
-      GGML_DEFINED_LANGUAGE_MODEL_GPT2P117M,
-      G_INPUT_STREAM (istream),
-      nullptr,
-      nullptr,
-      &error
-    );
+  g_autoptr(GGMLLanguageModel) language_model = ggml_language_model_load_defined_from_istream (
+    GGML_DEFINED_LANGUAGE_MODEL_GPT2P117M,
+    G_INPUT_STREAM (istream),
+    nullptr,
+    nullptr,
+    &error
+  );
 
-    ASSERT_NE (language_model, nullptr);
-    ASSERT_EQ (error, nullptr);
+  ASSERT_NE (language_model, nullptr);
+  ASSERT_EQ (error, nullptr);
 
-    g_autoptr(GGMLLanguageModelCompletionCursor) cursor = ggml_language_model_create_completion (
-      language_model,
-      "The meaning of life is:",
-      32
-    );
+  g_autoptr(GGMLLanguageModelCompletionCursor) cursor = ggml_language_model_create_completion (
+    language_model,
+    "The meaning of life is:",
+    32
+  );
 
-    typedef std::tuple <GMainLoop *, GGMLLanguageModelCompletionCursor *> ClosureData;
+  gboolean is_complete_eos;
+  std::string first_completion (ggml_language_model_completion_cursor_exec (cursor, 1, nullptr, &is_complete_eos, &error));
 
-    ggml_language_model_completion_cursor_exec_async (
-      cursor,
-      7,
-      nullptr,
-      [](GObject *src, GAsyncResult *res, gpointer data) -> void {
-        g_autoptr(GError) error = NULL;
-        g_autoptr(GMainLoop) loop = NULL;
-        g_autoptr(GGMLLanguageModelCompletionCursor) cursor = NULL;
+  ASSERT_EQ (error, nullptr);
+  EXPECT_EQ (first_completion, "The meaning of life is: to");
 
-        std::unique_ptr<ClosureData> closure_data ((ClosureData *) data);
-        std::tie (loop, cursor) = *closure_data;
+  /* The appended text has not been run through the model yet,
+   * so it has to be saved along with the key-value memory */
+  ASSERT_TRUE (ggml_language_model_completion_cursor_append_text (cursor, " live in a", &error));
 
-        gboolean is_complete_eos;
-        std::string completion (ggml_language_model_completion_cursor_exec_finish (cursor,
-                                                                                   res,
-                                                                                   &is_complete_eos,
-                                                                                   &error));
-        EXPECT_EQ (error, nullptr);
-        EXPECT_EQ (completion, "The meaning of life is: to live in a world of abundance");
+  g_autoptr(GOutputStream) ostream = g_memory_output_stream_new_resizable ();
+  ASSERT_TRUE (ggml_language_model_completion_cursor_save_state (cursor, ostream, nullptr, &error));
+  ASSERT_TRUE (g_output_stream_close (ostream, nullptr, &error));
 
-        g_main_loop_quit (loop);
-      },
-      new ClosureData (
-        g_steal_pointer (&loop),
-        ggml_language_model_completion_cursor_ref (cursor)
-      )
-    );
-  });
+  g_autoptr(GBytes) state = g_memory_output_stream_steal_as_bytes (G_MEMORY_OUTPUT_STREAM (ostream));
+  g_autoptr(GInputStream) state_istream = g_memory_input_stream_new_from_bytes (state);
+
+  g_autoptr(GGMLLanguageModelCompletionCursor) loaded_cursor = ggml_language_model_create_completion (
+    language_model,
+    "",
+    32
+  );
+
+  /* Input appended before loading belongs to the old state and is dropped */
+  ASSERT_TRUE (ggml_language_model_completion_cursor_append_text (loaded_cursor, " to die", &error));
+  ASSERT_TRUE (ggml_language_model_completion_cursor_load_state (loaded_cursor, state_istream, nullptr, &error));
+  ASSERT_EQ (error, nullptr);
+
+  std::string second_completion (ggml_language_model_completion_cursor_exec (loaded_cursor, 3, nullptr, &is_complete_eos, &error));
+
+  ASSERT_EQ (error, nullptr);
+  EXPECT_EQ (second_completion, " live in a world of abundance");
 }
 
-TEST(LanguageModel, run_inference_gpt2_sync_parts)
+TEST(LanguageModel, run_inference_gpt2_sync_speculative_decoding)
 {
   g_autoptr(GError) error = nullptr;
   g_autoptr(GGMLCachedModelIstream) istream = ggml_language_model_stream_from_cache (
@@ -286,6 +3015,11 @@ TEST(LanguageModel, run_inference_gpt2_sync_parts)
     32
   );
 
+  /* A model always agrees with itself, so every draft token
+   * gets kept, but the output must be the same either way */
+  ASSERT_TRUE (ggml_language_model_completion_cursor_set_draft_model (cursor, language_model, 4, &error));
+  ASSERT_EQ (error, nullptr);
+
   gboolean is_complete_eos;
   std::string first_completion (ggml_language_model_completion_cursor_exec (cursor, 4, nullptr, &is_complete_eos, &error));
 
@@ -296,4 +3030,115 @@ TEST(LanguageModel, run_inference_gpt2_sync_parts)
 
   ASSERT_EQ (error, nullptr);
   EXPECT_EQ (second_completion, " world of abundance");
+
+  /* The draft model would miss everything that came before */
+  EXPECT_FALSE (ggml_language_model_completion_cursor_set_draft_model (cursor, language_model, 4, &error));
+  EXPECT_TRUE (g_error_matches (error, G_IO_ERROR, G_IO_ERROR_NOT_SUPPORTED));
+}
+
+/* Runs GPT-2 as if every input token was token 0, so that
+ * the model proposes tokens that have nothing to do with the
+ * actual text */
+static GGMLTensor *
+garbled_gpt_model_forward_pass (GGMLModel            *model,
+                                GGMLHyperparameters  *hyperparameters,
+                                GVariant             *inputs,
+                                GHashTable           *input_parameters,
+                                GGMLComputeGraph     *cgraph,
+                                GGMLExecutionMemory  *execution_memory,
+                                gpointer              user_data,
+                                GError              **error)
+{
+  std::vector<int32_t> garbled_tokens (g_variant_n_children (inputs), 0);
+  g_autoptr(GVariant) garbled_inputs = g_variant_ref_sink (g_variant_new_fixed_array (G_VARIANT_TYPE_INT32,
+                                                                                      garbled_tokens.data (),
+                                                                                      garbled_tokens.size (),
+                                                                                      sizeof (int32_t)));
+
+  return ggml_gpt_model_forward_pass (model,
+                                      hyperparameters,
+                                      garbled_inputs,
+                                      input_parameters,
+                                      cgraph,
+                                      execution_memory,
+                                      user_data,
+                                      error);
+}
+
+TEST(LanguageModel, run_inference_gpt2_sync_speculative_decoding_wrong_draft)
+{
+  g_autoptr(GError) error = nullptr;
+  g_autoptr(GGMLCachedModelIstream) istream = ggml_language_model_stream_from_cache (
+    GGML_DEFINED_LANGUAGE_MODEL_GPT2P117M,
+    &error
+  );
+
+  ASSERT_NE (istream, nullptr);
+  ASSERT_EQ (error, nullptr);
+
+  g_autoptr(GGMLLanguageModel) language_model = ggml_language_model_load_defined_from_istream (
+    GGML_DEFINED_LANGUAGE_MODEL_GPT2P117M,
+    G_INPUT_STREAM (istream),
+    nullptr,
+    nullptr,
+    &error
+  );
+
+  ASSERT_NE (language_model, nullptr);
+  ASSERT_EQ (error, nullptr);
+
+  g_autoptr(GGMLCachedModelIstream) draft_istream = ggml_language_model_stream_from_cache (
+    GGML_DEFINED_LANGUAGE_MODEL_GPT2P117M,
+    &error
+  );
+
+  ASSERT_NE (draft_istream, nullptr);
+  ASSERT_EQ (error, nullptr);
+
+  g_autoptr(GGMLLanguageModel) draft_language_model = ggml_language_model_load_from_istream (
+    G_INPUT_STREAM (draft_istream),
+    nullptr,
+    (GGMLModelDescFromHyperparametersFunc) ggml_create_gpt2_model_desc_from_hyperparameters,
+    nullptr,
+    garbled_gpt_model_forward_pass,
+    nullptr,
+    nullptr,
+    nullptr,
+    &error
+  );
+
+  ASSERT_NE (draft_language_model, nullptr);
+  ASSERT_EQ (error, nullptr);
+
+  g_autoptr(GGMLLanguageModelCompletionCursor) cursor = ggml_language_model_create_completion (
+    language_model,
+    "The meaning of life is:",
+    32
+  );
+  g_autoptr(GGMLLanguageModelCompletionCursor) speculative_cursor = ggml_language_model_create_completion (
+    language_model,
+    "The meaning of life is:",
+    32
+  );
+
+  /* The draft model gets the tokens wrong, so most of its tokens
+   * are thrown away, but the output must still be exactly the same
+   * as without a draft model */
+  ASSERT_TRUE (ggml_language_model_completion_cursor_set_draft_model (speculative_cursor, draft_language_model, 3, &error));
+  ASSERT_EQ (error, nullptr);
+
+  const size_t n_tokens_per_exec[] = { 4, 3 };
+
+  for (size_t n_tokens : n_tokens_per_exec)
+    {
+      gboolean is_complete_eos;
+      g_autofree char *completion = ggml_language_model_completion_cursor_exec (cursor, n_tokens, nullptr, &is_complete_eos, &error);
+
+      ASSERT_EQ (error, nullptr);
+
+      g_autofree char *speculative_completion = ggml_language_model_completion_cursor_exec (speculative_cursor, n_tokens, nullptr, &is_complete_eos, &error);
+
+      ASSERT_EQ (error, nullptr);
+      EXPECT_STREQ (speculative_completion, completion);
+    }
 }